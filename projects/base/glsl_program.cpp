@@ -77,6 +77,20 @@ void GLSLProgram::attachFragmentShaderFromFile(const std::string& filePath) {
     attachFragmentShader(code);
 }
 
+void GLSLProgram::attachFragmentShaderFromFile(
+    const std::string& filePath, const std::vector<std::string>& defines) {
+    std::string code = readFile(filePath);
+    std::string defineLines;
+    for (const auto& define : defines) {
+        defineLines += "#define " + define + "\n";
+    }
+
+    // #version has to stay the first statement
+    const size_t versionEnd = code.compare(0, 8, "#version") == 0 ? code.find('\n') : std::string::npos;
+    code.insert(versionEnd == std::string::npos ? 0 : versionEnd + 1, defineLines);
+    attachFragmentShader(code);
+}
+
 void GLSLProgram::setTransformFeedbackVaryings(
     const std::vector<const char*>& varyings, GLenum bufferMode) {
     glTransformFeedbackVaryings(_handle, static_cast<GLsizei>(varyings.size()), 
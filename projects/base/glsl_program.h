@@ -26,6 +26,9 @@ public:
 
     void attachFragmentShaderFromFile(const std::string& filePath);
 
+    /* the macros are defined right after the #version line, e.g. to pick a code path */
+    void attachFragmentShaderFromFile(const std::string& filePath, const std::vector<std::string>& defines);
+
     void setTransformFeedbackVaryings(
         const std::vector<const char*>& varyings, GLenum bufferMode);
 
@@ -77,14 +77,14 @@ const std::vector<glm::mat4>& InstancedModel::getModelMatrices() const {
 void InstancedModel::draw() const {
 	glBindVertexArray(_vao);
 	glDrawElementsInstanced(GL_TRIANGLES, static_cast<GLsizei>(_indices.size()), 
-							GL_UNSIGNED_INT, 0, static_cast<GLsizei>(_modelMatrices.size()));
+							_indexType, 0, static_cast<GLsizei>(_modelMatrices.size()));
 	glBindVertexArray(0);
 }
 
 void InstancedModel::draw(int amount) const {
 	glBindVertexArray(_vao);
 	glDrawElementsInstanced(GL_TRIANGLES, static_cast<GLsizei>(_indices.size()), 
-							GL_UNSIGNED_INT, 0, amount);
+							_indexType, 0, amount);
 	glBindVertexArray(0);
 }
 
@@ -0,0 +1,103 @@
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mapped_file.h"
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& filepath) {
+    _file = CreateFileA(filepath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (_file == INVALID_HANDLE_VALUE) {
+        _file = nullptr;
+        throw std::runtime_error("open " + filepath + " failure");
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(_file, &size)) {
+        CloseHandle(_file);
+        throw std::runtime_error("stat " + filepath + " failure");
+    }
+
+    _size = static_cast<size_t>(size.QuadPart);
+    if (_size == 0) {
+        return;
+    }
+
+    _mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (_mapping != nullptr) {
+        _data = static_cast<const uint8_t*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+    }
+
+    if (_data == nullptr) {
+        if (_mapping != nullptr) {
+            CloseHandle(_mapping);
+        }
+        CloseHandle(_file);
+        throw std::runtime_error("map " + filepath + " failure");
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (_data != nullptr) {
+        UnmapViewOfFile(_data);
+    }
+
+    if (_mapping != nullptr) {
+        CloseHandle(_mapping);
+    }
+
+    if (_file != nullptr) {
+        CloseHandle(_file);
+    }
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& filepath) {
+    _fd = open(filepath.c_str(), O_RDONLY);
+    if (_fd < 0) {
+        throw std::runtime_error("open " + filepath + " failure");
+    }
+
+    struct stat st;
+    if (fstat(_fd, &st) != 0) {
+        close(_fd);
+        throw std::runtime_error("stat " + filepath + " failure");
+    }
+
+    _size = static_cast<size_t>(st.st_size);
+    if (_size == 0) {
+        return;
+    }
+
+    void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+    if (data == MAP_FAILED) {
+        close(_fd);
+        throw std::runtime_error("map " + filepath + " failure");
+    }
+
+    _data = static_cast<const uint8_t*>(data);
+}
+
+MappedFile::~MappedFile() {
+    if (_data != nullptr) {
+        munmap(const_cast<uint8_t*>(_data), _size);
+    }
+
+    if (_fd >= 0) {
+        close(_fd);
+    }
+}
+
+#endif
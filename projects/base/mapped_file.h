@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * read only memory map of a whole file, pages are loaded on first access
+ * so opening a large file costs almost nothing until its data is read
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filepath);
+
+    MappedFile(const MappedFile& rhs) = delete;
+
+    ~MappedFile();
+
+    const uint8_t* getData() const {
+        return _data;
+    }
+
+    size_t getSize() const {
+        return _size;
+    }
+
+private:
+    const uint8_t* _data = nullptr;
+    size_t _size = 0;
+
+#ifdef _WIN32
+    void* _file = nullptr;
+    void* _mapping = nullptr;
+#else
+    int _fd = -1;
+#endif
+};
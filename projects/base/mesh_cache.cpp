@@ -0,0 +1,169 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "mesh_cache.h"
+
+// bump when the file layout or the obj loader changes, old files then stop matching
+static constexpr uint32_t MeshCacheVersion = 1;
+
+struct MeshCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceSize;    // size and modification time of the obj file the mesh came from
+    int64_t sourceTime;
+    uint32_t vertexSize;
+    uint32_t indexSize;
+    uint32_t nVertices;
+    uint32_t nIndices;
+    uint32_t nMeshlets;     // reserved for meshlets, none are written yet
+    uint32_t pad0;
+    float boundsMin[3];
+    float boundsMax[3];
+    uint8_t pad[8];         // keeps the vertices after the header 16 byte aligned
+};
+
+static_assert(sizeof(MeshCacheHeader) == 80, "MeshCacheHeader must stay 80 bytes");
+
+/* size and modification time of a file, false if it cannot be read */
+static bool getFileStamp(const std::string& filepath, uint64_t& size, int64_t& time) {
+#ifdef _WIN32
+    struct _stat64 status;
+    if (_stat64(filepath.c_str(), &status) != 0) {
+        return false;
+    }
+#else
+    struct stat status;
+    if (stat(filepath.c_str(), &status) != 0) {
+        return false;
+    }
+#endif
+
+    size = static_cast<uint64_t>(status.st_size);
+    time = static_cast<int64_t>(status.st_mtime);
+    return true;
+}
+
+std::unique_ptr<MeshCache> MeshCache::load(const std::string& cachePath, const std::string& sourcePath) {
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    if (!getFileStamp(sourcePath, sourceSize, sourceTime)) {
+        return nullptr;
+    }
+
+    std::unique_ptr<MappedFile> file;
+    try {
+        file.reset(new MappedFile(cachePath));
+    } catch (const std::runtime_error&) {
+        // not cached yet
+        return nullptr;
+    }
+
+    if (file->getSize() < sizeof(MeshCacheHeader)) {
+        return nullptr;
+    }
+
+    MeshCacheHeader header;
+    std::memcpy(&header, file->getData(), sizeof(MeshCacheHeader));
+    const size_t vertexBytes = static_cast<size_t>(header.nVertices) * sizeof(Vertex);
+    const size_t indexBytes = static_cast<size_t>(header.nIndices) * header.indexSize;
+    if (std::memcmp(header.magic, "MESH", 4) != 0 ||
+        header.version != MeshCacheVersion ||
+        header.sourceSize != sourceSize ||
+        header.sourceTime != sourceTime ||
+        header.vertexSize != sizeof(Vertex) ||
+        (header.indexSize != sizeof(uint16_t) && header.indexSize != sizeof(uint32_t)) ||
+        header.nMeshlets != 0 ||
+        file->getSize() != sizeof(MeshCacheHeader) + vertexBytes + indexBytes) {
+        return nullptr;
+    }
+
+    std::unique_ptr<MeshCache> cache(new MeshCache);
+    const uint8_t* data = file->getData() + sizeof(MeshCacheHeader);
+    cache->_vertices = reinterpret_cast<const Vertex*>(data);
+    cache->_vertexCount = header.nVertices;
+    cache->_indices = data + vertexBytes;
+    cache->_indexCount = header.nIndices;
+    cache->_indexSize = header.indexSize;
+    cache->_boundingBox.min = glm::vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+    cache->_boundingBox.max = glm::vec3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+    cache->_file = std::move(file);
+
+    return cache;
+}
+
+void MeshCache::save(const std::string& cachePath, const std::string& sourcePath,
+    const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices,
+    const BoundingBox& boundingBox) {
+    MeshCacheHeader header = {};
+    std::memcpy(header.magic, "MESH", 4);
+    header.version = MeshCacheVersion;
+    if (!getFileStamp(sourcePath, header.sourceSize, header.sourceTime) ||
+        vertices.size() > std::numeric_limits<uint32_t>::max() ||
+        indices.size() > std::numeric_limits<uint32_t>::max()) {
+        return;
+    }
+
+    // the indices of meshes up to 65536 vertices take half the space and bandwidth
+    const bool shortIndices = vertices.size() <= static_cast<size_t>(std::numeric_limits<uint16_t>::max()) + 1;
+    header.vertexSize = sizeof(Vertex);
+    header.indexSize = shortIndices ? sizeof(uint16_t) : sizeof(uint32_t);
+    header.nVertices = static_cast<uint32_t>(vertices.size());
+    header.nIndices = static_cast<uint32_t>(indices.size());
+    for (int i = 0; i < 3; ++i) {
+        header.boundsMin[i] = boundingBox.min[i];
+        header.boundsMax[i] = boundingBox.max[i];
+    }
+
+    // write next to the final file and rename, a crash never leaves a half written cache
+    const std::string tempPath = cachePath + ".tmp";
+    std::ofstream out(tempPath, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(vertices.data()), vertices.size() * sizeof(Vertex));
+    if (shortIndices) {
+        std::vector<uint16_t> shorts(indices.begin(), indices.end());
+        out.write(reinterpret_cast<const char*>(shorts.data()), shorts.size() * sizeof(uint16_t));
+    } else {
+        out.write(reinterpret_cast<const char*>(indices.data()), indices.size() * sizeof(uint32_t));
+    }
+    out.close();
+
+    if (!out) {
+        std::cerr << "MeshCache: write " << tempPath << " failure" << std::endl;
+        std::remove(tempPath.c_str());
+        return;
+    }
+
+    std::remove(cachePath.c_str());
+    if (std::rename(tempPath.c_str(), cachePath.c_str()) != 0) {
+        std::cerr << "MeshCache: rename " << tempPath << " failure" << std::endl;
+        std::remove(tempPath.c_str());
+    }
+}
+
+std::string MeshCache::getCachePath(const std::string& sourcePath, const std::string& directory) {
+    if (directory.empty()) {
+        return sourcePath + ".mesh";
+    }
+
+    // files of the same name in different directories must not share a cache
+    const std::string::size_type slash = sourcePath.find_last_of("/\\");
+    const std::string name = slash == std::string::npos ? sourcePath : sourcePath.substr(slash + 1);
+    std::ostringstream path;
+    path << directory;
+    if (directory.back() != '/' && directory.back() != '\\') {
+        path << '/';
+    }
+    path << name << '.' << std::hex << std::setw(16) << std::setfill('0')
+        << static_cast<uint64_t>(std::hash<std::string>()(sourcePath)) << ".mesh";
+    return path.str();
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bounding_box.h"
+#include "mapped_file.h"
+#include "vertex.h"
+
+/*
+ * binary copy of a mesh loaded from an obj file: a header with the bounding box,
+ * the vertices, then the indices as uint16_t when every vertex fits, else uint32_t.
+ * Loading it is a memory map, the arrays are used where they are in the file
+ */
+class MeshCache {
+public:
+    MeshCache(const MeshCache& rhs) = delete;
+
+    /*
+    *Summary: open the cache of an obj file
+    *Parameters:
+    *     cachePath : the cache file
+    *     sourcePath: the obj file, a cache written before it last changed is stale
+    *Return: the cache, nullptr if it is missing, stale or damaged
+    */
+    static std::unique_ptr<MeshCache> load(const std::string& cachePath, const std::string& sourcePath);
+
+    /*
+    *Summary: write the cache of an obj file, failures are reported but not fatal
+    *Parameters:
+    *     cachePath  : the cache file
+    *     sourcePath : the obj file the mesh was loaded from
+    *     vertices   : vertices of the mesh
+    *     indices    : triangle indices of the mesh
+    *     boundingBox: bounding box of the vertices
+    */
+    static void save(const std::string& cachePath, const std::string& sourcePath,
+        const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices,
+        const BoundingBox& boundingBox);
+
+    /* path of the cache of an obj file, next to it if directory is empty */
+    static std::string getCachePath(const std::string& sourcePath, const std::string& directory);
+
+    const Vertex* getVertices() const {
+        return _vertices;
+    }
+
+    size_t getVertexCount() const {
+        return _vertexCount;
+    }
+
+    /* uint16_t or uint32_t indices, see getIndexSize */
+    const void* getIndices() const {
+        return _indices;
+    }
+
+    size_t getIndexCount() const {
+        return _indexCount;
+    }
+
+    /* 2 or 4 bytes */
+    size_t getIndexSize() const {
+        return _indexSize;
+    }
+
+    const BoundingBox& getBoundingBox() const {
+        return _boundingBox;
+    }
+
+private:
+    std::unique_ptr<MappedFile> _file;
+
+    const Vertex* _vertices = nullptr;
+    size_t _vertexCount = 0;
+    const void* _indices = nullptr;
+    size_t _indexCount = 0;
+    size_t _indexSize = 0;
+    BoundingBox _boundingBox;
+
+    MeshCache() = default;
+};
@@ -1,70 +1,53 @@
 #include <iostream>
 #include <limits>
-#include <unordered_map>
 #include <algorithm>
+#include <stdexcept>
 
-#include <tiny_obj_loader.h>
-
+#include "mapped_file.h"
+#include "mesh_cache.h"
 #include "model.h"
+#include "obj_loader.h"
 
-Model::Model(const std::string& filepath) {
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
-
-    std::string err;
-
-    std::string::size_type index = filepath.find_last_of("/");
-    std::string mtlBaseDir = filepath.substr(0, index + 1);
+std::string Model::_meshCacheDirectory;
 
-    if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &err, filepath.c_str(), mtlBaseDir.c_str())) {
-        throw std::runtime_error("load " + filepath + " failure: " + err);
+static void parseObjFile(const std::string& filepath,
+    std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+    try {
+        MappedFile file(filepath);
+        parseObj(reinterpret_cast<const char*>(file.getData()), file.getSize(), vertices, indices);
+    } catch (const std::runtime_error& e) {
+        throw std::runtime_error("load " + filepath + " failure: " + e.what());
     }
+}
 
-    if (!err.empty()) {
-        std::cerr << err << std::endl;
+static void copyMesh(const MeshCache& cache, 
+    std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+    vertices.assign(cache.getVertices(), cache.getVertices() + cache.getVertexCount());
+    if (cache.getIndexSize() == sizeof(uint16_t)) {
+        const uint16_t* shorts = static_cast<const uint16_t*>(cache.getIndices());
+        indices.assign(shorts, shorts + cache.getIndexCount());
+    } else {
+        const uint32_t* ints = static_cast<const uint32_t*>(cache.getIndices());
+        indices.assign(ints, ints + cache.getIndexCount());
     }
+}
 
-    std::vector<Vertex> vertices;
-    std::vector<uint32_t> indices;
-    std::unordered_map<Vertex, uint32_t> uniqueVertices;
-
-    for (const auto& shape : shapes) {
-        for (const auto& index : shape.mesh.indices) {
-            Vertex vertex{};
-
-            vertex.position.x = attrib.vertices[3 * index.vertex_index + 0];
-            vertex.position.y = attrib.vertices[3 * index.vertex_index + 1];
-            vertex.position.z = attrib.vertices[3 * index.vertex_index + 2];
-
-            if (index.normal_index >= 0) {
-                vertex.normal.x = attrib.normals[3 * index.normal_index + 0];
-                vertex.normal.y = attrib.normals[3 * index.normal_index + 1];
-                vertex.normal.z = attrib.normals[3 * index.normal_index + 2];
-            }
-
-            if (index.texcoord_index >= 0) {
-                vertex.texCoord.x = attrib.texcoords[2 * index.texcoord_index + 0];
-                vertex.texCoord.y = attrib.texcoords[2 * index.texcoord_index + 1];
-            }
-
-            // check if the vertex appeared before to reduce redundant data
-            if (uniqueVertices.count(vertex) == 0) {
-                uniqueVertices[vertex] = static_cast<uint32_t>(vertices.size());
-                vertices.push_back(vertex);
-            }
-
-            indices.push_back(uniqueVertices[vertex]);
-        }
+Model::Model(const std::string& filepath) {
+    const std::string cachePath = MeshCache::getCachePath(filepath, _meshCacheDirectory);
+    std::unique_ptr<MeshCache> cache = MeshCache::load(cachePath, filepath);
+    if (cache) {
+        // the buffers are filled straight from the mapped cache, the copies are only 
+        // kept for getVertices and getIndices
+        copyMesh(*cache, _vertices, _indices);
+        _boundingBox = cache->getBoundingBox();
+        initGLResources(cache->getVertices(), cache->getIndices(), cache->getIndexSize());
+    } else {
+        parseObjFile(filepath, _vertices, _indices);
+        computeBoundingBox();
+        MeshCache::save(cachePath, filepath, _vertices, _indices, _boundingBox);
+        initGLResources();
     }
 
-    _vertices = vertices;
-    _indices = indices;
-    
-    computeBoundingBox();
-
-    initGLResources();
-
     initBoxGLResources();
 
     GLenum error = glGetError();
@@ -74,6 +57,23 @@ Model::Model(const std::string& filepath) {
     }
 }
 
+void Model::loadObj(const std::string& filepath, 
+    std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+    const std::string cachePath = MeshCache::getCachePath(filepath, _meshCacheDirectory);
+    std::unique_ptr<MeshCache> cache = MeshCache::load(cachePath, filepath);
+    if (cache) {
+        copyMesh(*cache, vertices, indices);
+        return;
+    }
+
+    parseObjFile(filepath, vertices, indices);
+    MeshCache::save(cachePath, filepath, vertices, indices, computeBoundingBox(vertices));
+}
+
+void Model::setMeshCacheDirectory(const std::string& directory) {
+    _meshCacheDirectory = directory;
+}
+
 Model::Model(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices)
     : _vertices(vertices), _indices(indices) {
 
@@ -94,7 +94,7 @@ Model::Model(Model&& rhs) noexcept
     : _vertices(std::move(rhs._vertices)),
       _indices(std::move(rhs._indices)),
       _boundingBox(std::move(rhs._boundingBox)),
-      _vao(rhs._vao), _vbo(rhs._vbo), _ebo(rhs._ebo), 
+      _vao(rhs._vao), _vbo(rhs._vbo), _ebo(rhs._ebo), _indexType(rhs._indexType),
       _boxVao(rhs._boxVao), _boxVbo(rhs._boxVbo), _boxEbo(rhs._boxEbo) {
     _vao = 0;
     _vbo = 0;
@@ -114,7 +114,7 @@ BoundingBox Model::getBoundingBox() const {
 
 void Model::draw() const {
     glBindVertexArray(_vao);
-    glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(_indices.size()), GL_UNSIGNED_INT, 0);
+    glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(_indices.size()), _indexType, 0);
     glBindVertexArray(0);
 }
 
@@ -130,6 +130,10 @@ GLuint Model::getVao() const {
     return _vao;
 }
 
+GLenum Model::getIndexType() const {
+    return _indexType;
+}
+
 GLuint Model::getBoundingBoxVao() const {
     return _boxVao;
 }
@@ -143,6 +147,12 @@ size_t Model::getFaceCount() const {
 }
 
 void Model::initGLResources() {
+    initGLResources(_vertices.data(), _indices.data(), sizeof(uint32_t));
+}
+
+void Model::initGLResources(const Vertex* vertices, const void* indices, size_t indexSize) {
+    _indexType = indexSize == sizeof(uint16_t) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+
     // create a vertex array object
     glGenVertexArrays(1, &_vao);
     // create a vertex buffer object
@@ -153,11 +163,11 @@ void Model::initGLResources() {
     glBindVertexArray(_vao);
     glBindBuffer(GL_ARRAY_BUFFER, _vbo);
     glBufferData(GL_ARRAY_BUFFER, 
-        sizeof(Vertex) * _vertices.size(), _vertices.data(), GL_STATIC_DRAW);
+        sizeof(Vertex) * _vertices.size(), vertices, GL_STATIC_DRAW);
 
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _ebo);
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, 
-        _indices.size() * sizeof(uint32_t), _indices.data(), GL_STATIC_DRAW);
+        _indices.size() * indexSize, indices, GL_STATIC_DRAW);
 
     // specify layout, size of a vertex, data type, normalize, sizeof vertex array, offset of the attribute
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, position));
@@ -170,7 +180,7 @@ void Model::initGLResources() {
     glBindVertexArray(0);
 }
 
-void Model::computeBoundingBox() {
+BoundingBox Model::computeBoundingBox(const std::vector<Vertex>& vertices) {
     float minX = std::numeric_limits<float>::max();
     float minY = std::numeric_limits<float>::max();
     float minZ = std::numeric_limits<float>::max();
@@ -178,7 +188,7 @@ void Model::computeBoundingBox() {
     float maxY = -std::numeric_limits<float>::max();
     float maxZ = -std::numeric_limits<float>::max();
 
-    for (const auto& v : _vertices) {
+    for (const auto& v : vertices) {
         minX = std::min(v.position.x, minX);
         minY = std::min(v.position.y, minY);
         minZ = std::min(v.position.z, minZ);
@@ -187,8 +197,14 @@ void Model::computeBoundingBox() {
         maxZ = std::max(v.position.z, maxZ);
     }
 
-    _boundingBox.min = glm::vec3(minX, minY, minZ);
-    _boundingBox.max = glm::vec3(maxX, maxY, maxZ);
+    BoundingBox boundingBox;
+    boundingBox.min = glm::vec3(minX, minY, minZ);
+    boundingBox.max = glm::vec3(maxX, maxY, maxZ);
+    return boundingBox;
+}
+
+void Model::computeBoundingBox() {
+    _boundingBox = computeBoundingBox(_vertices);
 }
 
 void Model::initBoxGLResources() {
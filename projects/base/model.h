@@ -23,6 +23,9 @@ public:
 
     GLuint getBoundingBoxVao() const;
 
+    // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT, the type of the indices in the element buffer
+    GLenum getIndexType() const;
+
     size_t getVertexCount() const;
 
     size_t getFaceCount() const;
@@ -36,6 +39,14 @@ public:
     const std::vector<uint32_t>& getIndices() const { return _indices; }
     const std::vector<Vertex>& getVertices() const { return _vertices; }
     const Vertex& getVertex(int i) const { return _vertices[i]; }
+
+    // load the deduplicated vertices and indices of an obj file, needs no OpenGL context.
+    // A mesh cache of the file is read instead of the text when it is up to date, else written
+    static void loadObj(const std::string& filepath, 
+        std::vector<Vertex>& vertices, std::vector<uint32_t>& indices);
+
+    // directory of the mesh caches of obj files, next to each obj file if empty
+    static void setMeshCacheDirectory(const std::string& directory);
 public:
     Transform transform;
 
@@ -51,6 +62,7 @@ protected:
     GLuint _vao = 0;
     GLuint _vbo = 0;
     GLuint _ebo = 0;
+    GLenum _indexType = GL_UNSIGNED_INT;
 
     GLuint _boxVao = 0;
     GLuint _boxVbo = 0;
@@ -58,9 +70,16 @@ protected:
 
     void computeBoundingBox();
 
+    static BoundingBox computeBoundingBox(const std::vector<Vertex>& vertices);
+
     void initGLResources();
 
+    void initGLResources(const Vertex* vertices, const void* indices, size_t indexSize);
+
     void initBoxGLResources();
 
     void cleanup();
+
+private:
+    static std::string _meshCacheDirectory;
 };
\ No newline at end of file
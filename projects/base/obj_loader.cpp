@@ -0,0 +1,545 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "obj_loader.h"
+
+// texts below this size are parsed on one thread, starting threads would take longer
+static constexpr size_t MinParallelSize = 1 << 20;
+
+// chunks per thread, v lines parse faster than f lines and small chunks keep the threads busy
+static constexpr int ChunksPerThread = 4;
+
+/* a corner of a triangle, indices into the attribute arrays, -1 if absent */
+struct ObjCorner {
+    int v;
+    int vt;
+    int vn;
+};
+
+/* a corner with indices relative to the attributes before its line, they are made global on merging */
+struct RelativeCorner {
+    size_t corner;
+    uint8_t mask;       // 1: v, 2: vt, 4: vn
+};
+
+/* the lines of a chunk and what they hold */
+struct ObjChunk {
+    const char* begin = nullptr;
+    const char* end = nullptr;
+
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::vec2> texCoords;
+    std::vector<ObjCorner> corners;
+    std::vector<RelativeCorner> relativeCorners;
+};
+
+/* run func(thread) on nThreads threads, the calling thread is one of them; rethrows the first exception */
+template <typename Func>
+static void runThreads(int nThreads, const Func& func) {
+    std::exception_ptr exception;
+    std::mutex exceptionMutex;
+    auto run = [&](int thread) {
+        try {
+            func(thread);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(exceptionMutex);
+            if (!exception) {
+                exception = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < nThreads; ++t) {
+        threads.emplace_back(run, t);
+    }
+    run(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    if (exception) {
+        std::rethrow_exception(exception);
+    }
+}
+
+/* split [0, count) into nThreads even ranges and run func(thread, begin, end) on each */
+template <typename Func>
+static void parallelFor(int nThreads, size_t count, const Func& func) {
+    runThreads(nThreads, [&](int thread) {
+        func(thread, count * thread / nThreads, count * (thread + 1) / nThreads);
+    });
+}
+
+static inline bool isDigit(char c) {
+    return static_cast<unsigned int>(c - '0') < 10u;
+}
+
+static inline bool isSpace(char c) {
+    return c == ' ' || c == '\t';
+}
+
+static inline const char* skipSpaces(const char* p, const char* end) {
+    while (p < end && isSpace(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+/* end of the token at p, a token ends at a space, a tab, '\r' or one of the extra delimiters */
+static inline const char* findTokenEnd(const char* p, const char* end, bool slash) {
+    while (p < end && !isSpace(*p) && *p != '\r' && !(slash && *p == '/')) {
+        ++p;
+    }
+    return p;
+}
+
+/*
+ * the number parser of tinyobjloader on [s, end). The arithmetic is kept as it is,
+ * it is not correctly rounded and other parsers would give other last bits
+ */
+static bool parseDouble(const char* s, const char* end, double* result) {
+    static const double powLut[] = { 1.0, 0.1, 0.01, 0.001, 0.0001, 0.00001, 0.000001, 0.0000001 };
+    static const int lutEntries = sizeof(powLut) / sizeof(powLut[0]);
+
+    if (s >= end) {
+        return false;
+    }
+
+    double mantissa = 0.0;
+    int exponent = 0;
+    bool negative = false;
+    const char* p = s;
+    if (*p == '+' || *p == '-') {
+        negative = *p == '-';
+        ++p;
+    } else if (!isDigit(*p)) {
+        return false;
+    }
+
+    int read = 0;
+    while (p < end && isDigit(*p)) {
+        mantissa *= 10;
+        mantissa += static_cast<int>(*p - '0');
+        ++p;
+        ++read;
+    }
+
+    if (read == 0) {
+        return false;
+    }
+
+    if (p < end && *p == '.') {
+        ++p;
+        read = 1;
+        while (p < end && isDigit(*p)) {
+            mantissa += static_cast<int>(*p - '0') * (read < lutEntries ? powLut[read] : std::pow(10.0, -read));
+            ++read;
+            ++p;
+        }
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        bool negativeExponent = false;
+        if (p < end && (*p == '+' || *p == '-')) {
+            negativeExponent = *p == '-';
+            ++p;
+        } else if (p >= end || !isDigit(*p)) {
+            return false;
+        }
+
+        read = 0;
+        while (p < end && isDigit(*p)) {
+            exponent *= 10;
+            exponent += static_cast<int>(*p - '0');
+            ++p;
+            ++read;
+        }
+
+        if (read == 0) {
+            return false;
+        }
+        exponent *= negativeExponent ? -1 : 1;
+    }
+
+    *result = (negative ? -1 : 1) *
+        (exponent ? std::ldexp(mantissa * std::pow(5.0, exponent), exponent) : mantissa);
+    return true;
+}
+
+/* the next number of a line, 0 if it is missing or not a number */
+static inline float parseFloat(const char*& p, const char* end) {
+    p = skipSpaces(p, end);
+    const char* tokenEnd = findTokenEnd(p, end, false);
+    double value = 0.0;
+    parseDouble(p, tokenEnd, &value);
+    p = tokenEnd;
+    return static_cast<float>(value);
+}
+
+/* atoi on [p, end) */
+static inline int parseInt(const char* p, const char* end) {
+    while (p < end && (isSpace(*p) || *p == '\r' || *p == '\v' || *p == '\f')) {
+        ++p;
+    }
+
+    bool negative = false;
+    if (p < end && (*p == '+' || *p == '-')) {
+        negative = *p == '-';
+        ++p;
+    }
+
+    int value = 0;
+    while (p < end && isDigit(*p)) {
+        value = value * 10 + (*p - '0');
+        ++p;
+    }
+
+    return negative ? -value : value;
+}
+
+/* one based and relative obj indices to zero based ones, the relative ones count back from n */
+static inline int fixIndex(int idx, int n) {
+    if (idx > 0) {
+        return idx - 1;
+    }
+    if (idx == 0) {
+        return 0;
+    }
+    return n + idx;
+}
+
+/*
+ * parse a corner of a face, v, v/vt, v//vn or v/vt/vn. Relative indices are
+ * resolved against the attributes of the chunk, mask gets a bit for each of them
+ */
+static ObjCorner parseCorner(const char*& p, const char* end, const ObjChunk& chunk, uint8_t& mask) {
+    ObjCorner corner = { -1, -1, -1 };
+    mask = 0;
+
+    int idx = parseInt(p, end);
+    corner.v = fixIndex(idx, static_cast<int>(chunk.positions.size()));
+    mask |= idx < 0 ? 1 : 0;
+    p = findTokenEnd(p, end, true);
+    if (p >= end || *p != '/') {
+        return corner;
+    }
+    ++p;
+
+    // v//vn
+    if (p < end && *p == '/') {
+        ++p;
+        idx = parseInt(p, end);
+        corner.vn = fixIndex(idx, static_cast<int>(chunk.normals.size()));
+        mask |= idx < 0 ? 4 : 0;
+        p = findTokenEnd(p, end, true);
+        return corner;
+    }
+
+    // v/vt or v/vt/vn
+    idx = parseInt(p, end);
+    corner.vt = fixIndex(idx, static_cast<int>(chunk.texCoords.size()));
+    mask |= idx < 0 ? 2 : 0;
+    p = findTokenEnd(p, end, true);
+    if (p >= end || *p != '/') {
+        return corner;
+    }
+    ++p;
+
+    idx = parseInt(p, end);
+    corner.vn = fixIndex(idx, static_cast<int>(chunk.normals.size()));
+    mask |= idx < 0 ? 4 : 0;
+    p = findTokenEnd(p, end, true);
+    return corner;
+}
+
+/* parse the lines of a chunk, faces are fanned into triangles */
+static void parseChunk(ObjChunk& chunk) {
+    std::vector<ObjCorner> face;
+    std::vector<uint8_t> faceMasks;
+
+    const char* p = chunk.begin;
+    while (p < chunk.end) {
+        // lines end at '\n', '\r' or both
+        const char* lineEnd = p;
+        while (lineEnd < chunk.end && *lineEnd != '\n' && *lineEnd != '\r') {
+            ++lineEnd;
+        }
+
+        const char* token = skipSpaces(p, lineEnd);
+        p = lineEnd + 1;
+
+        const size_t length = lineEnd - token;
+        if (length < 2 || token[0] == '#') {
+            continue;
+        }
+
+        if (token[0] == 'v' && isSpace(token[1])) {
+            token += 2;
+            glm::vec3 position;
+            position.x = parseFloat(token, lineEnd);
+            position.y = parseFloat(token, lineEnd);
+            position.z = parseFloat(token, lineEnd);
+            chunk.positions.push_back(position);
+        } else if (length >= 3 && token[0] == 'v' && token[1] == 'n' && isSpace(token[2])) {
+            token += 3;
+            glm::vec3 normal;
+            normal.x = parseFloat(token, lineEnd);
+            normal.y = parseFloat(token, lineEnd);
+            normal.z = parseFloat(token, lineEnd);
+            chunk.normals.push_back(normal);
+        } else if (length >= 3 && token[0] == 'v' && token[1] == 't' && isSpace(token[2])) {
+            token += 3;
+            glm::vec2 texCoord;
+            texCoord.x = parseFloat(token, lineEnd);
+            texCoord.y = parseFloat(token, lineEnd);
+            chunk.texCoords.push_back(texCoord);
+        } else if (token[0] == 'f' && isSpace(token[1])) {
+            token = skipSpaces(token + 2, lineEnd);
+            face.clear();
+            faceMasks.clear();
+            while (token < lineEnd) {
+                uint8_t mask;
+                face.push_back(parseCorner(token, lineEnd, chunk, mask));
+                faceMasks.push_back(mask);
+                while (token < lineEnd && (isSpace(*token) || *token == '\r')) {
+                    ++token;
+                }
+            }
+
+            for (size_t k = 2; k < face.size(); ++k) {
+                const size_t fan[3] = { 0, k - 1, k };
+                for (size_t corner : fan) {
+                    if (faceMasks[corner] != 0) {
+                        chunk.relativeCorners.push_back({ chunk.corners.size(), faceMasks[corner] });
+                    }
+                    chunk.corners.push_back(face[corner]);
+                }
+            }
+        }
+    }
+}
+
+/* hash of the values of a vertex, +0 and -0 compare equal and hash the same */
+static inline uint32_t hashVertex(const Vertex& vertex) {
+    const float values[8] = {
+        vertex.position.x + 0.0f, vertex.position.y + 0.0f, vertex.position.z + 0.0f,
+        vertex.normal.x + 0.0f, vertex.normal.y + 0.0f, vertex.normal.z + 0.0f,
+        vertex.texCoord.x + 0.0f, vertex.texCoord.y + 0.0f
+    };
+
+    uint64_t h = 0x9e3779b97f4a7c15ull;
+    for (float value : values) {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        h = (h ^ bits) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+
+    return static_cast<uint32_t>(h);
+}
+
+void parseObj(const char* data, size_t size,
+    std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, int nThreads) {
+    vertices.clear();
+    indices.clear();
+
+    if (nThreads <= 0) {
+        nThreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+    if (size < MinParallelSize) {
+        nThreads = 1;
+    }
+
+    // chunks start after a line break, so no line is split
+    const int nChunks = nThreads == 1 ? 1 : nThreads * ChunksPerThread;
+    std::vector<ObjChunk> chunks(nChunks);
+    const char* const end = data + size;
+    const char* begin = data;
+    for (int c = 0; c < nChunks; ++c) {
+        const char* chunkEnd = c + 1 == nChunks ? end : std::max(begin, data + size * (c + 1) / nChunks);
+        while (chunkEnd < end && *chunkEnd != '\n' && *chunkEnd != '\r') {
+            ++chunkEnd;
+        }
+        chunkEnd = std::min(chunkEnd + 1, end);
+
+        chunks[c].begin = begin;
+        chunks[c].end = chunkEnd;
+        begin = chunkEnd;
+    }
+
+    std::atomic<int> nextChunk{ 0 };
+    runThreads(nThreads, [&](int) {
+        for (int c = nextChunk++; c < nChunks; c = nextChunk++) {
+            parseChunk(chunks[c]);
+        }
+    });
+
+    // where the attributes and corners of every chunk go in the merged arrays
+    std::vector<size_t> positionOffsets(nChunks + 1, 0);
+    std::vector<size_t> normalOffsets(nChunks + 1, 0);
+    std::vector<size_t> texCoordOffsets(nChunks + 1, 0);
+    std::vector<size_t> cornerOffsets(nChunks + 1, 0);
+    for (int c = 0; c < nChunks; ++c) {
+        positionOffsets[c + 1] = positionOffsets[c] + chunks[c].positions.size();
+        normalOffsets[c + 1] = normalOffsets[c] + chunks[c].normals.size();
+        texCoordOffsets[c + 1] = texCoordOffsets[c] + chunks[c].texCoords.size();
+        cornerOffsets[c + 1] = cornerOffsets[c] + chunks[c].corners.size();
+    }
+
+    const size_t nCorners = cornerOffsets[nChunks];
+    if (nCorners >= std::numeric_limits<uint32_t>::max() ||
+        positionOffsets[nChunks] > static_cast<size_t>(std::numeric_limits<int>::max()) ||
+        normalOffsets[nChunks] > static_cast<size_t>(std::numeric_limits<int>::max()) ||
+        texCoordOffsets[nChunks] > static_cast<size_t>(std::numeric_limits<int>::max())) {
+        throw std::runtime_error("too many vertices or faces");
+    }
+
+    std::vector<glm::vec3> positions(positionOffsets[nChunks]);
+    std::vector<glm::vec3> normals(normalOffsets[nChunks]);
+    std::vector<glm::vec2> texCoords(texCoordOffsets[nChunks]);
+    std::vector<ObjCorner> corners(nCorners);
+
+    std::atomic<bool> invalidIndex{ false };
+    nextChunk = 0;
+    runThreads(nThreads, [&](int) {
+        for (int c = nextChunk++; c < nChunks; c = nextChunk++) {
+            ObjChunk& chunk = chunks[c];
+            std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + positionOffsets[c]);
+            std::copy(chunk.normals.begin(), chunk.normals.end(), normals.begin() + normalOffsets[c]);
+            std::copy(chunk.texCoords.begin(), chunk.texCoords.end(), texCoords.begin() + texCoordOffsets[c]);
+
+            ObjCorner* chunkCorners = corners.data() + cornerOffsets[c];
+            std::copy(chunk.corners.begin(), chunk.corners.end(), chunkCorners);
+            for (const auto& relative : chunk.relativeCorners) {
+                ObjCorner& corner = chunkCorners[relative.corner];
+                corner.v += (relative.mask & 1) ? static_cast<int>(positionOffsets[c]) : 0;
+                corner.vt += (relative.mask & 2) ? static_cast<int>(texCoordOffsets[c]) : 0;
+                corner.vn += (relative.mask & 4) ? static_cast<int>(normalOffsets[c]) : 0;
+            }
+
+            for (size_t i = 0; i < chunk.corners.size(); ++i) {
+                const ObjCorner& corner = chunkCorners[i];
+                if (corner.v < 0 || corner.v >= static_cast<int>(positions.size()) ||
+                    corner.vt < -1 || corner.vt >= static_cast<int>(texCoords.size()) ||
+                    corner.vn < -1 || corner.vn >= static_cast<int>(normals.size())) {
+                    invalidIndex = true;
+                }
+            }
+
+            chunk = ObjChunk();
+        }
+    });
+
+    if (invalidIndex) {
+        throw std::runtime_error("face index out of range");
+    }
+
+    auto getVertex = [&](const ObjCorner& corner) {
+        Vertex vertex{};
+        vertex.position = positions[corner.v];
+        if (corner.vn >= 0) {
+            vertex.normal = normals[corner.vn];
+        }
+        if (corner.vt >= 0) {
+            vertex.texCoord = texCoords[corner.vt];
+        }
+        return vertex;
+    };
+
+    // the vertices are split by hash among the threads, each merges its own in corner order,
+    // so every corner finds the first corner with the same vertex as the sequential merge would
+    const int nPartitions = nThreads;
+    auto getPartition = [nPartitions](uint32_t hash) {
+        return static_cast<int>((static_cast<uint64_t>(hash) * nPartitions) >> 32);
+    };
+
+    std::vector<uint32_t> hashes(nCorners);
+    std::vector<std::vector<size_t>> partitionSizes(nThreads, std::vector<size_t>(nPartitions, 0));
+    parallelFor(nThreads, nCorners, [&](int thread, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            hashes[i] = hashVertex(getVertex(corners[i]));
+            ++partitionSizes[thread][getPartition(hashes[i])];
+        }
+    });
+
+    std::vector<uint32_t> firstCorners(nCorners);
+    runThreads(nPartitions, [&](int partition) {
+        size_t partitionSize = 0;
+        for (int t = 0; t < nThreads; ++t) {
+            partitionSize += partitionSizes[t][partition];
+        }
+
+        // open addressing on the low bits of the hash, at most half full
+        size_t tableSize = 16;
+        while (tableSize < 2 * partitionSize) {
+            tableSize *= 2;
+        }
+        const uint32_t mask = static_cast<uint32_t>(tableSize - 1);
+        std::vector<uint32_t> table(tableSize, 0);  // corner + 1, 0 is empty
+
+        for (size_t i = 0; i < nCorners; ++i) {
+            const uint32_t hash = hashes[i];
+            if (getPartition(hash) != partition) {
+                continue;
+            }
+
+            const Vertex vertex = getVertex(corners[i]);
+            for (uint32_t slot = hash & mask; ; slot = (slot + 1) & mask) {
+                const uint32_t entry = table[slot];
+                if (entry == 0) {
+                    table[slot] = static_cast<uint32_t>(i + 1);
+                    firstCorners[i] = static_cast<uint32_t>(i);
+                    break;
+                }
+
+                const uint32_t other = entry - 1;
+                if (hashes[other] == hash && getVertex(corners[other]) == vertex) {
+                    firstCorners[i] = other;
+                    break;
+                }
+            }
+        }
+    });
+
+    // vertices are numbered in the order of their first corners
+    std::vector<size_t> rankOffsets(nThreads + 1, 0);
+    parallelFor(nThreads, nCorners, [&](int thread, size_t begin, size_t end) {
+        size_t count = 0;
+        for (size_t i = begin; i < end; ++i) {
+            count += firstCorners[i] == i ? 1 : 0;
+        }
+        rankOffsets[thread + 1] = count;
+    });
+    for (int t = 0; t < nThreads; ++t) {
+        rankOffsets[t + 1] += rankOffsets[t];
+    }
+
+    vertices.resize(rankOffsets[nThreads]);
+    indices.resize(nCorners);
+    parallelFor(nThreads, nCorners, [&](int thread, size_t begin, size_t end) {
+        uint32_t rank = static_cast<uint32_t>(rankOffsets[thread]);
+        for (size_t i = begin; i < end; ++i) {
+            if (firstCorners[i] == i) {
+                vertices[rank] = getVertex(corners[i]);
+                indices[i] = rank++;
+            }
+        }
+    });
+
+    // first corners keep their rank, the others take the rank of theirs
+    parallelFor(nThreads, nCorners, [&](int, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            indices[i] = indices[firstCorners[i]];
+        }
+    });
+}
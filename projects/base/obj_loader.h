@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "vertex.h"
+
+/*
+ * parse the text of an obj file into deduplicated vertices and triangle indices.
+ * The text is split into line aligned chunks parsed on nThreads threads, <= 0 uses
+ * all hardware threads. The result is the same tinyobjloader gave Model::loadObj:
+ * faces are fanned into triangles, numbers are parsed with its rounding and vertices
+ * are merged by value in the order they first appear. Materials, groups and smoothing
+ * groups are ignored. Throws std::runtime_error on an index out of range
+ */
+void parseObj(const char* data, size_t size,
+    std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, int nThreads = 0);
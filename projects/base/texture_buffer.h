@@ -0,0 +1,42 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include "texture.h"
+
+/*
+ * a buffer object read as a 1D array of texels, samplerBuffer in GLSL,
+ * fetched with texelFetch by an integer index without padding to rows
+ */
+class TextureBuffer : public Texture {
+public:
+	TextureBuffer(GLenum internalFormat, size_t size, const void* data = nullptr, GLenum usage = GL_STATIC_DRAW);
+
+	TextureBuffer(TextureBuffer&& rhs) noexcept;
+
+	~TextureBuffer();
+
+	void bind(int slot = 0) const override;
+
+	void unbind() const override;
+
+	// buffer textures have neither mipmaps nor sampler state, both do nothing
+	void generateMipmap() const override;
+
+	void setParamterInt(GLenum name, int value) const override;
+
+	/* overwrite size bytes at offset of the buffer */
+	void update(size_t offset, size_t size, const void* data) const;
+
+	size_t getSize() const;
+
+	/* GL_MAX_TEXTURE_BUFFER_SIZE, at least 65536 texels */
+	static int getMaxTexels();
+
+private:
+	GLuint _buffer = 0;
+
+	size_t _size = 0;
+
+	void cleanup() override;
+};
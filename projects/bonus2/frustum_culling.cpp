@@ -386,7 +386,7 @@ void FrustumCulling::renderAsternoidsIndirect() {
 
 	glBindVertexArray(_instancedAsternoids->getVao());
 
-	glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, 0, 
+	glMultiDrawElementsIndirect(GL_TRIANGLES, _instancedAsternoids->getIndexType(), 0, 
 								static_cast<GLsizei>(_indirectDrawCmds.size()), 0);
 
 	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include <glm/glm.hpp>
+
+// CPU counterpart of the adaptive sampling in raytracing.frag, both use the same test and budget
+
+struct AdaptiveSamplingOptions {
+public:
+    bool enabled = false;
+    float threshold = 0.02f;    // a pixel is converged once the standard error of its mean
+                                // luminance is below this fraction of the mean
+    uint32_t minSamples = 16;   // pixels are never converged before this many samples
+    int maxSamplesPerPass = 8;  // the noisiest pixels take up to this many samples per pass
+};
+
+/* running mean and variance of the luminance of a pixel, Welford's update */
+struct PixelVariance {
+public:
+    uint32_t n = 0;
+    float mean = 0.0f;
+    float m2 = 0.0f;
+
+public:
+    void add(const glm::vec3& color) {
+        const float x = getLuminance(color);
+        ++n;
+        const float delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+    }
+
+    /* standard error of the mean relative to the mean, dark pixels are measured against a floor */
+    float getRelativeError() const {
+        if (n < 2) {
+            return std::numeric_limits<float>::max();
+        }
+
+        const float variance = m2 / (n - 1);
+        return std::sqrt(variance / n) / (mean + 0.01f);
+    }
+
+    bool isConverged(const AdaptiveSamplingOptions& options) const {
+        return options.enabled && n >= options.minSamples && getRelativeError() < options.threshold;
+    }
+
+    static float getLuminance(const glm::vec3& color) {
+        return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+    }
+};
+
+/*
+*Summary: samples a pixel or tile takes in the next pass, the error left decides how many
+*Parameters:
+*     relativeError: PixelVariance::getRelativeError of the pixel, the largest one of a tile
+*     n            : samples the pixel has, the fewest of a tile
+*     options      : the adaptive sampling options
+*Return: 0 when converged, 1 when adaptive sampling is off, else 1 to options.maxSamplesPerPass
+*/
+inline int getSampleBudget(float relativeError, uint32_t n, const AdaptiveSamplingOptions& options) {
+    if (!options.enabled) {
+        return 1;
+    }
+
+    if (n < options.minSamples) {
+        return 1;
+    }
+
+    if (relativeError < options.threshold) {
+        return 0;
+    }
+
+    // the error falls with the square root of the samples
+    const float ratio = relativeError / options.threshold;
+    const float samples = std::min(ratio * ratio, static_cast<float>(options.maxSamplesPerPass));
+    return std::max(1, static_cast<int>(samples));
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+/*
+ * bump allocator with a fixed capacity, objects are released all at once.
+ * the storage is reserved but only the pages of allocated objects are touched,
+ * several threads may allocate concurrently.
+ */
+template <typename T>
+class Arena {
+public:
+    static_assert(std::is_trivially_destructible<T>::value,
+        "Arena never runs destructors of its objects");
+
+    explicit Arena(size_t capacity) :
+        _storage(static_cast<T*>(::operator new(capacity * sizeof(T)))),
+        _capacity(capacity) { }
+
+    Arena(const Arena& rhs) = delete;
+
+    ~Arena() {
+        ::operator delete(_storage);
+    }
+
+    // throws std::length_error when the capacity is used up, the storage never moves
+    T* allocate() {
+        size_t idx = _size.fetch_add(1);
+        if (idx >= _capacity) {
+            throw std::length_error("Arena: capacity of " + std::to_string(_capacity) + " objects exceeded");
+        }
+        return new (_storage + idx) T();
+    }
+
+    size_t size() const {
+        return _size.load();
+    }
+
+    void reset() {
+        _size = 0;
+    }
+
+private:
+    T* _storage;
+    size_t _capacity;
+    std::atomic<size_t> _size{ 0 };
+};
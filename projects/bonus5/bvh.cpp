@@ -1,91 +1,1451 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <unordered_set>
+#include <utility>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define BVH_USE_SSE
+#include <xmmintrin.h>
+#endif
+
 #include "bvh.h"
 
+// subtrees with more primitives are built as separate tasks
+static constexpr int ParallelSubtreeThreshold = 4096;
+// ranges with more primitives are reduced and binned in parallel
+static constexpr int ParallelRangeThreshold = 65536;
+static constexpr int ParallelGrainSize = 16384;
+// HLBVH treelets share the highest bits of their Morton codes
+static constexpr int TreeletBits = 12;
+
+// spread the low 21 bits of v so that two zero bits follow every bit
+static inline uint64_t leftShift3(uint32_t v) {
+    uint64_t x = v & 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+// x takes the highest bit of every triple, so bit i of the code splits axis 2 - i % 3
+uint64_t BVH::encodeMorton3(uint32_t x, uint32_t y, uint32_t z) {
+    return (leftShift3(x) << 2) | (leftShift3(y) << 1) | leftShift3(z);
+}
+
+const char* BVH::getBuildMethodName(BVHBuildMethod method) {
+    switch (method) {
+        case BVHBuildMethod::SAH:   return "SAH";
+        case BVHBuildMethod::LBVH:  return "LBVH";
+        case BVHBuildMethod::HLBVH: return "HLBVH";
+        case BVHBuildMethod::SBVH:  return "SBVH";
+        default:                    return "unknown";
+    }
+}
+
+BVH::BVH(std::vector<BVHNode> nodes, std::vector<Primitive> orderedPrimitives, int height,
+    const BVHBuildOptions& options) :
+    nodes(std::move(nodes)),
+    orderedPrimitives(std::move(orderedPrimitives)),
+    height(height),
+    maxHeight(options.maxHeight),
+    _options(options) {
+    initQuality();
+    initTriangleData();
+}
+
+void TriangleSoA::resize(size_t n) {
+    // zero padding makes degenerate triangles that the test rejects
+    for (int axis = 0; axis < 3; ++axis) {
+        p0[axis].assign(n + 3, 0.0f);
+        e1[axis].assign(n + 3, 0.0f);
+        e2[axis].assign(n + 3, 0.0f);
+    }
+    minDet.assign(n + 3, 0.0f);
+}
+
+void TriangleSoA::clear() {
+    for (int axis = 0; axis < 3; ++axis) {
+        p0[axis].clear();
+        e1[axis].clear();
+        e2[axis].clear();
+    }
+    minDet.clear();
+}
+
+void TriangleSoA::set(size_t i, const Triangle& triangle) {
+    const glm::vec3& p1 = triangle.vertices[triangle.v[0]].position;
+    const glm::vec3& p2 = triangle.vertices[triangle.v[1]].position;
+    const glm::vec3& p3 = triangle.vertices[triangle.v[2]].position;
+    for (int axis = 0; axis < 3; ++axis) {
+        p0[axis][i] = p1[axis];
+        e1[axis][i] = p2[axis] - p1[axis];
+        e2[axis][i] = p3[axis] - p1[axis];
+    }
+
+    // det = dir . (e2 x e1), so |det| is the cosine Triangle::intersect tests scaled by |e1 x e2|
+    minDet[i] = Triangle::MinHitCosine * glm::length(glm::cross(p2 - p1, p3 - p1));
+}
+
+void BVH::initQuality() {
+    sahCost = computeSAHCost();
+
+    _builtAreas.resize(nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        _builtAreas[i] = nodes[i].box.surfaceArea();
+    }
+    degradation = 1.0f;
+}
+
 void BVH::constructBVH(std::vector<Primitive>& primitives) {
-    std::vector<PrimitiveInfo> primInfo;
-    for (int i = 0; i < primitives.size(); ++i) {
-        primInfo.push_back({ i, getAABB(primitives[i]) });
+    if (primitives.empty()) {
+        return;
     }
 
-    int totalNode = 0;
-    BVHBuildNode* root = recursiveBuild(
-        primitives, primInfo, 0, static_cast<int>(primInfo.size()), &totalNode);
+    auto buildStart = std::chrono::high_resolution_clock::now();
+
+    std::unique_ptr<ThreadPool> pool;
+    if (_options.nThreads != 1) {
+        pool.reset(new ThreadPool(_options.nThreads));
+        _pool = pool.get();
+    }
+
+    const int nPrimitives = static_cast<int>(primitives.size());
+    std::vector<PrimitiveInfo> primInfo(nPrimitives);
+    parallelFor(0, nPrimitives, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            primInfo[i] = { i, getAABB(primitives[i]) };
+        }
+    });
+
+    // spatial splits may add references up to the budget
+    SpatialBuildState state;
+    state.primitives = &primitives;
+    state.nReferences = nPrimitives;
+    state.maxReferences = _options.method != BVHBuildMethod::SBVH ? nPrimitives :
+        nPrimitives + static_cast<size_t>(nPrimitives * std::max(_options.spatialSplitBudget, 0.0f));
 
-    nodes.resize(totalNode);
+    // every leaf holds at least one reference, so there are at most 2n - 1 nodes
+    Arena<BVHBuildNode> arena(2 * state.maxReferences - 1);
+    _arena = &arena;
+    BVHBuildNode* root = nullptr;
+    if (_options.method == BVHBuildMethod::SAH) {
+        root = recursiveBuild(primInfo, 0, nPrimitives, 1);
+    } else if (_options.method == BVHBuildMethod::SBVH) {
+        AABB bound, centroidBox;
+        computeBounds(primInfo, 0, nPrimitives, &bound, &centroidBox);
+        state.rootArea = bound.surfaceArea();
+        root = spatialBuild(state, primInfo, 1);
+        primInfo.swap(state.leafRefs);
+    } else {
+        root = linearBuild(primInfo);
+    }
+
+    // leaves reference their range of primInfo, which is final after the build
+    const int nReferences = static_cast<int>(primInfo.size());
+    orderedPrimitives.resize(nReferences);
+    parallelFor(0, nReferences, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            orderedPrimitives[i] = primitives[primInfo[i].pid];
+        }
+    });
+
+    nodes.resize(arena.size());
     int offset = 0;
-    toLinearTree(root, &offset);
+    toLinearTree(root, 1, &offset);
+
+    initQuality();
+    initTriangleData();
+
+    // the build tree dies with the arena
+    _arena = nullptr;
+    _pool = nullptr;
+
+    auto buildEnd = std::chrono::high_resolution_clock::now();
+    buildTime = std::chrono::duration<float, std::milli>(buildEnd - buildStart).count();
 }
 
 BVHBuildNode* BVH::recursiveBuild(
-    const std::vector<Primitive>& primitives,
     std::vector<PrimitiveInfo>& primInfo, 
-    int start, int end, int* totalNodes
+    int start, int end, int depth
 ) {
-    BVHBuildNode* node = new BVHBuildNode;
-    *totalNodes += 1;
+    BVHBuildNode* node = _arena->allocate();
+
+    AABB bound, centroidBox;
+    computeBounds(primInfo, start, end, &bound, &centroidBox);
+
     int nPrimitives = end - start;
-    if (nPrimitives == 1) {
-        AABB box;
-        int startId = static_cast<int>(orderedPrimitives.size());
-        for (int i = start; i < end; ++i) {
-            box = unionAABB(box, primInfo[i].box);
-            orderedPrimitives.push_back(primitives[primInfo[i].pid]);
+    int dim = maximumDim(centroidBox);
+    int mid = (start + end) / 2;
+    const bool fitsInLeaf = nPrimitives <= BVHNode::getMaxLeafPrimitives();
+    if (fitsInLeaf && (nPrimitives == 1 || depth >= _options.maxHeight)) {
+        node->initLeafNode(bound, start, nPrimitives);
+        return node;
+    }
+
+    if (centroidBox.pMax[dim] == centroidBox.pMin[dim] || (!fitsInLeaf && depth >= _options.maxHeight)) {
+        // no split plane can separate the centroids, only halve ranges too large for a leaf
+        if (fitsInLeaf) {
+            node->initLeafNode(bound, start, nPrimitives);
+            return node;
+        }
+    } else if (nPrimitives <= 2) {
+        std::nth_element(&primInfo[start], &primInfo[mid], &primInfo[end - 1] + 1,
+            [dim](const PrimitiveInfo& a, const PrimitiveInfo& b) {
+                return a.centroid[dim] < b.centroid[dim];
+            });
+    } else {
+        float minCost = 0.0f;
+        int splitBucket = findSAHSplit(primInfo, start, end, bound, centroidBox, dim, &minCost);
+        float leafCost = _options.intersectCost * nPrimitives;
+        if (nPrimitives > _options.maxPrimsInNode || minCost < leafCost || !fitsInLeaf) {
+            const int nBuckets = _options.nBuckets;
+            PrimitiveInfo* pmid = std::partition(&primInfo[start], &primInfo[end - 1] + 1,
+                [=](const PrimitiveInfo& pi) {
+                    return getBucketIndex(pi.centroid, centroidBox, dim, nBuckets) <= splitBucket;
+                });
+            mid = static_cast<int>(pmid - &primInfo[0]);
+        } else {
+            node->initLeafNode(bound, start, nPrimitives);
+            return node;
+        }
+    }
+
+    BVHBuildNode* leftChild = nullptr;
+    BVHBuildNode* rightChild = nullptr;
+    if (_pool != nullptr && nPrimitives > ParallelSubtreeThreshold) {
+        // the two halves touch disjoint ranges of primInfo
+        TaskGroup group;
+        _pool->run(group, [&]() {
+            leftChild = recursiveBuild(primInfo, start, mid, depth + 1);
+        });
+        rightChild = recursiveBuild(primInfo, mid, end, depth + 1);
+        _pool->wait(group);
+    } else {
+        leftChild = recursiveBuild(primInfo, start, mid, depth + 1);
+        rightChild = recursiveBuild(primInfo, mid, end, depth + 1);
+    }
+
+    node->initInteriorNode(leftChild, rightChild, dim);
+
+    return node;
+}
+
+BVHBuildNode* BVH::linearBuild(std::vector<PrimitiveInfo>& primInfo) {
+    const int nPrimitives = static_cast<int>(primInfo.size());
+    AABB bound, centroidBox;
+    computeBounds(primInfo, 0, nPrimitives, &bound, &centroidBox);
+
+    // 30 bit codes sort in 4 passes, larger scenes need 63 bits to keep the cells small
+    const int bitsPerAxis = nPrimitives <= (1 << 20) ? 10 : 21;
+    const int nBits = 3 * bitsPerAxis;
+    const float mortonScale = static_cast<float>(1 << bitsPerAxis);
+    const uint32_t maxCell = (1u << bitsPerAxis) - 1u;
+
+    std::vector<MortonPrimitive> mortonPrims(nPrimitives);
+    parallelFor(0, nPrimitives, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            uint32_t cell[3];
+            for (int axis = 0; axis < 3; ++axis) {
+                const float extent = centroidBox.pMax[axis] - centroidBox.pMin[axis];
+                const float offset = extent > 0.0f ?
+                    (primInfo[i].centroid[axis] - centroidBox.pMin[axis]) / extent : 0.0f;
+                cell[axis] = std::min(static_cast<uint32_t>(offset * mortonScale), maxCell);
+            }
+            mortonPrims[i] = { encodeMorton3(cell[0], cell[1], cell[2]), i };
         }
-        node->initLeafNode(box, startId, nPrimitives);
+    });
+
+    radixSort(mortonPrims, nBits);
+
+    // leaves index primInfo, so it follows the curve order
+    std::vector<PrimitiveInfo> sortedInfo(nPrimitives);
+    parallelFor(0, nPrimitives, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            sortedInfo[i] = primInfo[mortonPrims[i].primIdx];
+        }
+    });
+    primInfo.swap(sortedInfo);
+
+    if (_options.method == BVHBuildMethod::LBVH) {
+        return emitLBVH(primInfo, mortonPrims, 0, nPrimitives, nBits - 1, 1);
+    }
+
+    // primitives in the same cell of the coarse grid form a treelet
+    const int treeletShift = nBits - TreeletBits;
+    std::vector<Treelet> treelets;
+    for (int start = 0, end = 1; end <= nPrimitives; ++end) {
+        if (end == nPrimitives ||
+            (mortonPrims[start].mortonCode >> treeletShift) != (mortonPrims[end].mortonCode >> treeletShift)) {
+            treelets.push_back({ start, end, AABB() });
+            start = end;
+        }
+    }
+
+    parallelFor(0, static_cast<int>(treelets.size()), [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            for (int j = treelets[i].start; j < treelets[i].end; ++j) {
+                treelets[i].bound = unionAABB(treelets[i].bound, primInfo[j].box);
+            }
+        }
+    });
+
+    return buildUpperSAH(primInfo, mortonPrims, treelets, 0, static_cast<int>(treelets.size()), treeletShift - 1, 1);
+}
+
+void BVH::radixSort(std::vector<MortonPrimitive>& mortonPrims, int nBits) {
+    constexpr int BitsPerPass = 8;
+    constexpr int nBuckets = 1 << BitsPerPass;
+    const int nPrimitives = static_cast<int>(mortonPrims.size());
+
+    // every chunk counts and scatters its own range, the ranges are fixed for the whole sort
+    const int nChunks = _pool == nullptr ? 1 :
+        std::max(1, std::min((nPrimitives + ParallelGrainSize - 1) / ParallelGrainSize, 4 * _pool->getThreadCount()));
+    const int chunkSize = (nPrimitives + nChunks - 1) / nChunks;
+    auto forEachChunk = [&](const std::function<void(int, int, int)>& func) {
+        auto runChunks = [&](int begin, int end) {
+            for (int c = begin; c < end; ++c) {
+                func(c, c * chunkSize, std::min((c + 1) * chunkSize, nPrimitives));
+            }
+        };
+
+        if (_pool == nullptr) {
+            runChunks(0, nChunks);
+        } else {
+            _pool->parallelFor(0, nChunks, 1, runChunks);
+        }
+    };
+
+    std::vector<MortonPrimitive> temp(nPrimitives);
+    std::vector<int> offsets(nChunks * nBuckets);
+    for (int lowBit = 0; lowBit < nBits; lowBit += BitsPerPass) {
+        std::vector<MortonPrimitive>& in = mortonPrims;
+        std::vector<MortonPrimitive>& out = temp;
+
+        std::fill(offsets.begin(), offsets.end(), 0);
+        forEachChunk([&](int c, int begin, int end) {
+            int* counts = &offsets[c * nBuckets];
+            for (int i = begin; i < end; ++i) {
+                counts[(in[i].mortonCode >> lowBit) & (nBuckets - 1)]++;
+            }
+        });
+
+        // bucket major prefix sum keeps equal codes in their input order
+        int sum = 0;
+        for (int b = 0; b < nBuckets; ++b) {
+            for (int c = 0; c < nChunks; ++c) {
+                int count = offsets[c * nBuckets + b];
+                offsets[c * nBuckets + b] = sum;
+                sum += count;
+            }
+        }
+
+        forEachChunk([&](int c, int begin, int end) {
+            int* next = &offsets[c * nBuckets];
+            for (int i = begin; i < end; ++i) {
+                out[next[(in[i].mortonCode >> lowBit) & (nBuckets - 1)]++] = in[i];
+            }
+        });
+
+        mortonPrims.swap(temp);
+    }
+}
+
+BVHBuildNode* BVH::emitLBVH(
+    std::vector<PrimitiveInfo>& primInfo,
+    const std::vector<MortonPrimitive>& mortonPrims,
+    int start, int end, int bitIndex, int depth
+) {
+    const int nPrimitives = end - start;
+    const bool fitsInLeaf = nPrimitives <= BVHNode::getMaxLeafPrimitives();
+    if (fitsInLeaf && (bitIndex < 0 || nPrimitives <= _options.maxPrimsInNode || depth >= _options.maxHeight)) {
+        BVHBuildNode* node = _arena->allocate();
+        AABB bound, centroidBox;
+        computeBounds(primInfo, start, end, &bound, &centroidBox);
+        node->initLeafNode(bound, start, nPrimitives);
         return node;
+    }
+
+    // skip the bits shared by the whole range, they do not split it
+    const uint64_t mask = bitIndex >= 0 ? 1ull << bitIndex : 0ull;
+    if (bitIndex >= 0 && depth < _options.maxHeight &&
+        (mortonPrims[start].mortonCode & mask) == (mortonPrims[end - 1].mortonCode & mask)) {
+        return emitLBVH(primInfo, mortonPrims, start, end, bitIndex - 1, depth);
+    }
+
+    int mid = (start + end) / 2;
+    int axis = 0;
+    if (bitIndex >= 0 && depth < _options.maxHeight) {
+        // the codes are sorted, so the range splits at the first code with the bit set
+        mid = static_cast<int>(std::partition_point(&mortonPrims[start], &mortonPrims[end - 1] + 1,
+            [mask](const MortonPrimitive& mp) {
+                return (mp.mortonCode & mask) == 0;
+            }) - &mortonPrims[0]);
+        axis = 2 - bitIndex % 3;
+    }
+
+    BVHBuildNode* node = _arena->allocate();
+    BVHBuildNode* leftChild = nullptr;
+    BVHBuildNode* rightChild = nullptr;
+    if (_pool != nullptr && nPrimitives > ParallelSubtreeThreshold) {
+        TaskGroup group;
+        _pool->run(group, [&]() {
+            leftChild = emitLBVH(primInfo, mortonPrims, start, mid, bitIndex - 1, depth + 1);
+        });
+        rightChild = emitLBVH(primInfo, mortonPrims, mid, end, bitIndex - 1, depth + 1);
+        _pool->wait(group);
+    } else {
+        leftChild = emitLBVH(primInfo, mortonPrims, start, mid, bitIndex - 1, depth + 1);
+        rightChild = emitLBVH(primInfo, mortonPrims, mid, end, bitIndex - 1, depth + 1);
+    }
+
+    node->initInteriorNode(leftChild, rightChild, axis);
+
+    return node;
+}
+
+BVHBuildNode* BVH::buildUpperSAH(
+    std::vector<PrimitiveInfo>& primInfo,
+    const std::vector<MortonPrimitive>& mortonPrims,
+    std::vector<Treelet>& treelets,
+    int start, int end, int bitIndex, int depth
+) {
+    if (end - start == 1) {
+        return emitLBVH(primInfo, mortonPrims, treelets[start].start, treelets[start].end, bitIndex, depth);
+    }
+
+    AABB bound, centroidBox;
+    for (int i = start; i < end; ++i) {
+        bound = unionAABB(bound, treelets[i].bound);
+        centroidBox = unionAABB(centroidBox, 0.5f * (treelets[i].bound.pMin + treelets[i].bound.pMax));
+    }
+
+    const int dim = maximumDim(centroidBox);
+    const int nBuckets = _options.nBuckets;
+    auto getCentroid = [](const Treelet& t) {
+        return 0.5f * (t.bound.pMin + t.bound.pMax);
+    };
+
+    // treelets are cells of a grid, so their centroids differ unless the cells overlap
+    int mid = (start + end) / 2;
+    if (centroidBox.pMax[dim] > centroidBox.pMin[dim]) {
+        struct Bucket {
+            int count = 0;
+            AABB box;
+        };
+
+        std::vector<Bucket> buckets(nBuckets);
+        for (int i = start; i < end; ++i) {
+            int b = getBucketIndex(getCentroid(treelets[i]), centroidBox, dim, nBuckets);
+            buckets[b].count++;
+            buckets[b].box = unionAABB(buckets[b].box, treelets[i].bound);
+        }
+
+        int splitBucket = 0;
+        float minCost = std::numeric_limits<float>::max();
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            AABB b0, b1;
+            int count0 = 0, count1 = 0;
+            for (int j = 0; j <= i; ++j) {
+                b0 = unionAABB(b0, buckets[j].box);
+                count0 += buckets[j].count;
+            }
+            for (int j = i + 1; j < nBuckets; ++j) {
+                b1 = unionAABB(b1, buckets[j].box);
+                count1 += buckets[j].count;
+            }
+            if (count0 == 0 || count1 == 0) {
+                continue;
+            }
+
+            float cost = _options.traversalCost +
+                (count0 * b0.surfaceArea() + count1 * b1.surfaceArea()) / bound.surfaceArea();
+            if (cost < minCost) {
+                minCost = cost;
+                splitBucket = i;
+            }
+        }
+
+        Treelet* pmid = std::partition(&treelets[start], &treelets[end - 1] + 1,
+            [&](const Treelet& t) {
+                return getBucketIndex(getCentroid(t), centroidBox, dim, nBuckets) <= splitBucket;
+            });
+        mid = static_cast<int>(pmid - &treelets[0]);
+    }
+
+    BVHBuildNode* node = _arena->allocate();
+    BVHBuildNode* leftChild = nullptr;
+    BVHBuildNode* rightChild = nullptr;
+    if (_pool != nullptr) {
+        // the treelets below the node cover disjoint ranges of primInfo
+        TaskGroup group;
+        _pool->run(group, [&]() {
+            leftChild = buildUpperSAH(primInfo, mortonPrims, treelets, start, mid, bitIndex, depth + 1);
+        });
+        rightChild = buildUpperSAH(primInfo, mortonPrims, treelets, mid, end, bitIndex, depth + 1);
+        _pool->wait(group);
     } else {
-        // TODO: recursive build BVH 
+        leftChild = buildUpperSAH(primInfo, mortonPrims, treelets, start, mid, bitIndex, depth + 1);
+        rightChild = buildUpperSAH(primInfo, mortonPrims, treelets, mid, end, bitIndex, depth + 1);
+    }
+
+    node->initInteriorNode(leftChild, rightChild, dim);
+
+    return node;
+}
+
+BVHBuildNode* BVH::spatialBuild(SpatialBuildState& state, std::vector<PrimitiveInfo>& refs, int depth) {
+    BVHBuildNode* node = _arena->allocate();
+
+    const int nRefs = static_cast<int>(refs.size());
+    AABB bound, centroidBox;
+    computeBounds(refs, 0, nRefs, &bound, &centroidBox);
+
+    auto initLeaf = [&]() {
+        node->initLeafNode(bound, static_cast<int>(state.leafRefs.size()), nRefs);
+        state.leafRefs.insert(state.leafRefs.end(), refs.begin(), refs.end());
         return node;
+    };
+
+    const bool fitsInLeaf = nRefs <= BVHNode::getMaxLeafPrimitives();
+    if (fitsInLeaf && (nRefs == 1 || depth >= _options.maxHeight)) {
+        return initLeaf();
+    }
+
+    // the object split, and how much its children overlap
+    const int dim = maximumDim(centroidBox);
+    float objectCost = std::numeric_limits<float>::max();
+    int splitBucket = -1;
+    AABB objectLeft, objectRight;
+    if (centroidBox.pMax[dim] > centroidBox.pMin[dim]) {
+        splitBucket = findSAHSplit(refs, 0, nRefs, bound, centroidBox, dim, &objectCost);
+        for (const auto& ref : refs) {
+            if (getBucketIndex(ref.centroid, centroidBox, dim, _options.nBuckets) <= splitBucket) {
+                objectLeft = unionAABB(objectLeft, ref.box);
+            } else {
+                objectRight = unionAABB(objectRight, ref.box);
+            }
+        }
     }
+
+    // a spatial split only pays off where long primitives make the object split children overlap
+    SpatialSplit spatial;
+    const AABB overlap(glm::max(objectLeft.pMin, objectRight.pMin), glm::min(objectLeft.pMax, objectRight.pMax));
+    const bool overlapping = splitBucket < 0 || (glm::all(glm::lessThan(objectRight.pMin, objectLeft.pMax)) &&
+        glm::all(glm::lessThan(objectLeft.pMin, objectRight.pMax)) &&
+        overlap.surfaceArea() > _options.spatialSplitAlpha * state.rootArea);
+    if (_options.method == BVHBuildMethod::SBVH && overlapping && state.nReferences < state.maxReferences) {
+        spatial = findSpatialSplit(state, refs, bound);
+    }
+
+    const float minCost = std::min(objectCost, spatial.cost);
+    const float leafCost = _options.intersectCost * nRefs;
+    if (fitsInLeaf && (minCost == std::numeric_limits<float>::max() ||
+        (nRefs <= _options.maxPrimsInNode && minCost >= leafCost))) {
+        return initLeaf();
+    }
+
+    std::vector<PrimitiveInfo> left, right;
+    int axis = dim;
+    if (spatial.cost < objectCost) {
+        splitReferences(state, refs, spatial, left, right);
+        axis = spatial.dim;
+    } else if (splitBucket >= 0) {
+        for (const auto& ref : refs) {
+            if (getBucketIndex(ref.centroid, centroidBox, dim, _options.nBuckets) <= splitBucket) {
+                left.push_back(ref);
+            } else {
+                right.push_back(ref);
+            }
+        }
+    } else {
+        // no plane separates the references, only halve ranges too large for a leaf
+        left.assign(refs.begin(), refs.begin() + nRefs / 2);
+        right.assign(refs.begin() + nRefs / 2, refs.end());
+    }
+
+    // the references of this node are not needed while the children are built
+    std::vector<PrimitiveInfo>().swap(refs);
+
+    BVHBuildNode* leftChild = spatialBuild(state, left, depth + 1);
+    BVHBuildNode* rightChild = spatialBuild(state, right, depth + 1);
+    node->initInteriorNode(leftChild, rightChild, axis);
+
+    return node;
 }
 
-int BVH::toLinearTree(BVHBuildNode* root, int* offset) {
+BVH::SpatialSplit BVH::findSpatialSplit(
+    const SpatialBuildState& state, const std::vector<PrimitiveInfo>& refs, const AABB& bound
+) {
+    struct SpatialBin {
+        AABB box;
+        int entries = 0;
+        int exits = 0;
+    };
+
+    SpatialSplit split;
+    const int dim = maximumDim(bound);
+    const float origin = bound.pMin[dim];
+    const float binWidth = (bound.pMax[dim] - origin) / _options.nBuckets;
+    if (!(binWidth > 0.0f)) {
+        return split;
+    }
+
+    // chop every reference at the bin planes it crosses, a reference enters one bin and exits one
+    const int nBins = _options.nBuckets;
+    std::vector<SpatialBin> bins(nBins);
+    auto getBin = [&](float x) {
+        return std::min(std::max(static_cast<int>((x - origin) / binWidth), 0), nBins - 1);
+    };
+
+    for (const auto& ref : refs) {
+        const int firstBin = getBin(ref.box.pMin[dim]);
+        const int lastBin = std::max(getBin(ref.box.pMax[dim]), firstBin);
+        AABB rest = ref.box;
+        for (int b = firstBin; b < lastBin; ++b) {
+            AABB leftPart, rightPart;
+            splitReference(*state.primitives, ref.pid, rest, dim, origin + (b + 1) * binWidth, &leftPart, &rightPart);
+            bins[b].box = unionAABB(bins[b].box, leftPart);
+            rest = rightPart;
+        }
+        bins[lastBin].box = unionAABB(bins[lastBin].box, rest);
+        bins[firstBin].entries++;
+        bins[lastBin].exits++;
+    }
+
+    // sweep from the right to get the bound and count above every plane, like findSAHSplit
+    std::vector<AABB> boxAbove(nBins - 1);
+    std::vector<int> countAbove(nBins - 1);
+    AABB box;
+    int count = 0;
+    for (int i = nBins - 1; i > 0; --i) {
+        box = unionAABB(box, bins[i].box);
+        count += bins[i].exits;
+        boxAbove[i - 1] = box;
+        countAbove[i - 1] = count;
+    }
+
+    box = AABB();
+    count = 0;
+    const int nRefs = static_cast<int>(refs.size());
+    const float invArea = 1.0f / bound.surfaceArea();
+    for (int i = 0; i < nBins - 1; ++i) {
+        box = unionAABB(box, bins[i].box);
+        count += bins[i].entries;
+        const size_t duplicates = static_cast<size_t>(std::max(count + countAbove[i] - nRefs, 0));
+        if (count == 0 || countAbove[i] == 0 || state.nReferences + duplicates > state.maxReferences) {
+            continue;
+        }
+
+        float cost = _options.traversalCost + _options.intersectCost *
+            (count * box.surfaceArea() + countAbove[i] * boxAbove[i].surfaceArea()) * invArea;
+        if (cost < split.cost) {
+            split.cost = cost;
+            split.dim = dim;
+            split.position = origin + (i + 1) * binWidth;
+            split.leftBound = box;
+            split.rightBound = boxAbove[i];
+            split.nLeft = count;
+            split.nRight = countAbove[i];
+        }
+    }
+
+    return split;
+}
+
+void BVH::splitReferences(
+    SpatialBuildState& state, const std::vector<PrimitiveInfo>& refs, const SpatialSplit& split,
+    std::vector<PrimitiveInfo>& left, std::vector<PrimitiveInfo>& right
+) {
+    const int dim = split.dim;
+    AABB leftBound = split.leftBound;
+    AABB rightBound = split.rightBound;
+    int nLeft = split.nLeft;
+    int nRight = split.nRight;
+    for (const auto& ref : refs) {
+        if (ref.box.pMax[dim] <= split.position) {
+            left.push_back(ref);
+            continue;
+        }
+        if (ref.box.pMin[dim] >= split.position) {
+            right.push_back(ref);
+            continue;
+        }
+
+        // keep the whole reference on one side when that is cheaper than duplicating it, or when the
+        // budget is used up: the binned prediction of findSpatialSplit may miss references on the plane
+        const AABB leftUnion = unionAABB(leftBound, ref.box);
+        const AABB rightUnion = unionAABB(rightBound, ref.box);
+        const float splitCost = leftBound.surfaceArea() * nLeft + rightBound.surfaceArea() * nRight;
+        const float leftCost = leftUnion.surfaceArea() * nLeft + rightBound.surfaceArea() * (nRight - 1);
+        const float rightCost = leftBound.surfaceArea() * (nLeft - 1) + rightUnion.surfaceArea() * nRight;
+        const bool overBudget = state.nReferences >= state.maxReferences;
+        if ((overBudget || leftCost < splitCost) && leftCost <= rightCost) {
+            left.push_back(ref);
+            leftBound = leftUnion;
+            --nRight;
+        } else if (overBudget || rightCost < splitCost) {
+            right.push_back(ref);
+            rightBound = rightUnion;
+            --nLeft;
+        } else {
+            AABB leftPart, rightPart;
+            splitReference(*state.primitives, ref.pid, ref.box, dim, split.position, &leftPart, &rightPart);
+            left.push_back(PrimitiveInfo(ref.pid, leftPart));
+            right.push_back(PrimitiveInfo(ref.pid, rightPart));
+            ++state.nReferences;
+        }
+    }
+
+    // references on the plane may all fall on one side, keep both children non empty
+    if (left.empty() || right.empty()) {
+        std::vector<PrimitiveInfo>& all = left.empty() ? right : left;
+        std::vector<PrimitiveInfo>& none = left.empty() ? left : right;
+        none.assign(all.begin() + all.size() / 2, all.end());
+        all.resize(all.size() / 2);
+    }
+
+    // the node arena is sized for maxReferences leaves
+    assert(state.nReferences <= state.maxReferences);
+}
+
+void BVH::splitReference(
+    const std::vector<Primitive>& primitives, int pid, const AABB& box, int dim, float position,
+    AABB* left, AABB* right
+) {
+    *left = AABB();
+    *right = AABB();
+    const Primitive& prim = primitives[pid];
+    if (prim.type == Primitive::Type::Triangle) {
+        // the parts of the triangle on both sides of the plane, edges crossing it add the crossing point
+        const Triangle& triangle = *prim.triangle;
+        for (int i = 0; i < 3; ++i) {
+            const glm::vec3& v0 = triangle.vertices[triangle.v[i]].position;
+            const glm::vec3& v1 = triangle.vertices[triangle.v[(i + 1) % 3]].position;
+            if (v0[dim] <= position) {
+                *left = unionAABB(*left, v0);
+            }
+            if (v0[dim] >= position) {
+                *right = unionAABB(*right, v0);
+            }
+            if ((v0[dim] < position && v1[dim] > position) || (v0[dim] > position && v1[dim] < position)) {
+                const float t = (position - v0[dim]) / (v1[dim] - v0[dim]);
+                glm::vec3 p = glm::mix(v0, v1, t);
+                p[dim] = position;
+                *left = unionAABB(*left, p);
+                *right = unionAABB(*right, p);
+            }
+        }
+    } else {
+        // other primitives are only clipped by their bound
+        *left = box;
+        *right = box;
+    }
+
+    // the reference may already be a clipped part of the primitive
+    left->pMax[dim] = position;
+    right->pMin[dim] = position;
+    left->pMin = glm::max(left->pMin, box.pMin);
+    left->pMax = glm::min(left->pMax, box.pMax);
+    right->pMin = glm::max(right->pMin, box.pMin);
+    right->pMax = glm::min(right->pMax, box.pMax);
+}
+
+void BVH::computeBounds(
+    const std::vector<PrimitiveInfo>& primInfo,
+    int start, int end, AABB* bound, AABB* centroidBox
+) {
+    if (_pool == nullptr || end - start <= ParallelRangeThreshold) {
+        for (int i = start; i < end; ++i) {
+            *bound = unionAABB(*bound, primInfo[i].box);
+            *centroidBox = unionAABB(*centroidBox, primInfo[i].centroid);
+        }
+        return;
+    }
+
+    // min/max reductions are exact, so the chunking does not change the result
+    std::mutex mutex;
+    parallelFor(start, end, [&](int begin, int end) {
+        AABB localBound, localCentroidBox;
+        for (int i = begin; i < end; ++i) {
+            localBound = unionAABB(localBound, primInfo[i].box);
+            localCentroidBox = unionAABB(localCentroidBox, primInfo[i].centroid);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        *bound = unionAABB(*bound, localBound);
+        *centroidBox = unionAABB(*centroidBox, localCentroidBox);
+    });
+}
+
+int BVH::findSAHSplit(
+    const std::vector<PrimitiveInfo>& primInfo,
+    int start, int end, const AABB& bound, const AABB& centroidBox, 
+    int dim, float* minCost
+) {
+    struct Bucket {
+        int count = 0;
+        AABB box;
+    };
+
+    const int nBuckets = _options.nBuckets;
+    std::vector<Bucket> buckets(nBuckets);
+    auto binRange = [&](std::vector<Bucket>& bins, int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            int b = getBucketIndex(primInfo[i].centroid, centroidBox, dim, nBuckets);
+            bins[b].count++;
+            bins[b].box = unionAABB(bins[b].box, primInfo[i].box);
+        }
+    };
+
+    if (_pool == nullptr || end - start <= ParallelRangeThreshold) {
+        binRange(buckets, start, end);
+    } else {
+        std::mutex mutex;
+        parallelFor(start, end, [&](int begin, int end) {
+            std::vector<Bucket> localBuckets(nBuckets);
+            binRange(localBuckets, begin, end);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int b = 0; b < nBuckets; ++b) {
+                buckets[b].count += localBuckets[b].count;
+                buckets[b].box = unionAABB(buckets[b].box, localBuckets[b].box);
+            }
+        });
+    }
+
+    // sweep from the right to get the bound and count above every split plane
+    std::vector<float> areaAbove(nBuckets - 1);
+    std::vector<int> countAbove(nBuckets - 1);
+    AABB box;
+    int count = 0;
+    for (int i = nBuckets - 1; i > 0; --i) {
+        box = unionAABB(box, buckets[i].box);
+        count += buckets[i].count;
+        areaAbove[i - 1] = box.surfaceArea();
+        countAbove[i - 1] = count;
+    }
+
+    int splitBucket = 0;
+    *minCost = std::numeric_limits<float>::max();
+    box = AABB();
+    count = 0;
+    const float invArea = 1.0f / bound.surfaceArea();
+    for (int i = 0; i < nBuckets - 1; ++i) {
+        box = unionAABB(box, buckets[i].box);
+        count += buckets[i].count;
+        if (count == 0 || countAbove[i] == 0) {
+            continue;
+        }
+
+        float cost = _options.traversalCost + _options.intersectCost * 
+            (count * box.surfaceArea() + countAbove[i] * areaAbove[i]) * invArea;
+        if (cost < *minCost) {
+            *minCost = cost;
+            splitBucket = i;
+        }
+    }
+
+    return splitBucket;
+}
+
+int BVH::getBucketIndex(const glm::vec3& centroid, const AABB& centroidBox, int dim, int nBuckets) {
+    int b = static_cast<int>(nBuckets * 
+        (centroid[dim] - centroidBox.pMin[dim]) / 
+        (centroidBox.pMax[dim] - centroidBox.pMin[dim]));
+    return std::min(b, nBuckets - 1);
+}
+
+void BVH::parallelFor(int begin, int end, const std::function<void(int, int)>& func) {
+    if (_pool == nullptr) {
+        func(begin, end);
+    } else {
+        _pool->parallelFor(begin, end, ParallelGrainSize, func);
+    }
+}
+
+int BVH::toLinearTree(BVHBuildNode* root, int depth, int* offset) {
     if (root == nullptr) {
         return -1;
     }
 
+    height = std::max(height, depth);
+
     int nodeIdx = *offset;
     *offset += 1;
-    int leftIdx = toLinearTree(root->leftChild, offset);
-    int rightIdx = toLinearTree(root->rightChild, offset);
+    // the left subtree is written right after the node, so its index is implicit
+    toLinearTree(root->leftChild, depth + 1, offset);
+    int rightIdx = toLinearTree(root->rightChild, depth + 1, offset);
     nodes[nodeIdx].box = root->bound;
-    if (leftIdx == -1 && rightIdx == -1) {
-        nodes[nodeIdx].type = BVHNode::Type::Leaf;
+    if (rightIdx == -1) {
         nodes[nodeIdx].startIndex = root->startIdx;
-        nodes[nodeIdx].nPrimitives = root->nPrimitives;
+        nodes[nodeIdx].nPrimitives = static_cast<uint16_t>(root->nPrimitives);
     } else {
-        nodes[nodeIdx].type = BVHNode::Type::NonLeaf;
-        nodes[nodeIdx].leftChild = leftIdx;
         nodes[nodeIdx].rightChild = rightIdx;
+        nodes[nodeIdx].nPrimitives = 0;
+        nodes[nodeIdx].axis = static_cast<uint8_t>(root->splitAxis);
     }
 
     return nodeIdx;
 }
 
-bool BVH::intersect(const Ray& ray, Interaction& isect) {
+float BVH::computeSAHCost() const {
+    if (nodes.empty()) {
+        return 0.0f;
+    }
+
+    float invRootArea = 1.0f / nodes[0].box.surfaceArea();
+    float cost = 0.0f;
+    for (const auto& node : nodes) {
+        float area = node.box.surfaceArea() * invRootArea;
+        if (node.isLeaf()) {
+            cost += _options.intersectCost * node.nPrimitives * area;
+        } else {
+            cost += _options.traversalCost * area;
+        }
+    }
+
+    return cost;
+}
+
+void BVH::refit(int* dirtyBegin, int* dirtyEnd) {
+    int first = 0;
+    int last = -1;
+    double growth = 0.0;
+
+    // the vertices may have moved too
+    initTriangleData();
+
+    // children are stored after their parent, so a reverse sweep sees them first
+    for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; --i) {
+        BVHNode& node = nodes[i];
+        AABB box;
+        if (node.isLeaf()) {
+            for (int j = 0; j < node.nPrimitives; ++j) {
+                box = unionAABB(box, getAABB(orderedPrimitives[node.startIndex + j]));
+            }
+        } else {
+            box = unionAABB(nodes[i + 1].box, nodes[node.rightChild].box);
+        }
+
+        if (box.pMin != node.box.pMin || box.pMax != node.box.pMax) {
+            node.box = box;
+            first = i;
+            last = last < 0 ? i : last;
+        }
+
+        if (_builtAreas[i] > 0.0f) {
+            growth += node.box.surfaceArea() / _builtAreas[i];
+        } else {
+            growth += 1.0;
+        }
+    }
+
+    if (dirtyBegin != nullptr && dirtyEnd != nullptr) {
+        *dirtyBegin = first;
+        *dirtyEnd = last + 1;
+    }
+
+    // the SAH cost is relative to the root, so a large primitive like the ground hides
+    // subtrees that spread out, every node's own growth shows them
+    degradation = nodes.empty() ? 1.0f : static_cast<float>(growth / nodes.size());
+    sahCost = computeSAHCost();
+}
+
+bool BVH::isDegraded() const {
+    return degradation > _options.rebuildThreshold;
+}
+
+void BVH::initTriangleData() {
+    for (const auto& prim : orderedPrimitives) {
+        if (prim.type != Primitive::Type::Triangle) {
+            _triangles.clear();
+            return;
+        }
+    }
+
+    _triangles.resize(orderedPrimitives.size());
+    for (size_t i = 0; i < orderedPrimitives.size(); ++i) {
+        _triangles.set(i, *orderedPrimitives[i].triangle);
+    }
+}
+
+void BVH::rebuild() {
+    std::vector<Primitive> primitives;
+    primitives.swap(orderedPrimitives);
+
+    // spatial splits reference a primitive in several leaves
+    std::unordered_set<uint64_t> seen;
+    primitives.erase(std::remove_if(primitives.begin(), primitives.end(), [&seen](const Primitive& prim) {
+        const uint64_t shape = (static_cast<uint64_t>(prim.type) << 32) | static_cast<uint32_t>(prim.shapeIdx);
+        return !seen.insert(shape).second;
+    }), primitives.end());
+    nodes.clear();
+    height = 0;
+    constructBVH(primitives);
+}
+
+bool BVH::intersect(const Ray& ray, Interaction& isect) const {
+    if (nodes.empty()) {
+        return false;
+    }
+
+    return intersectSubtree(ray, 0, isect);
+}
+
+bool BVH::intersectSubtree(const Ray& ray, int root, Interaction& isect) const {
     bool hit = false;
     glm::vec3 invDir = glm::vec3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
     int isDirNeg[3];
     isDirNeg[0] = ray.dir.x < 0 ? 1 : 0;
     isDirNeg[1] = ray.dir.y < 0 ? 1 : 0;
     isDirNeg[2] = ray.dir.z < 0 ? 1 : 0;
-    int currentNodeIndex = 0;
+    int currentNodeIndex = root;
     int toVisitOffset = 0;
     int nodesToVisit[128];
-    BVHNode node;
     while (true) {
-        node = nodes[currentNodeIndex];
+        const BVHNode& node = nodes[currentNodeIndex];
         if (node.box.intersect(ray, invDir, isDirNeg)) {
-            if (node.type == BVHNode::Type::Leaf) {
+            if (node.isLeaf()) {
+                if (intersectLeaf(ray, node.startIndex, node.nPrimitives, isect)) {
+                    hit = true;
+                }
+
+                if (toVisitOffset == 0) {
+                    break;
+                }
+
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            } else {
+                // visit the child on the near side of the split first
+                if (isDirNeg[node.axis]) {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node.rightChild;
+                } else {
+                    nodesToVisit[toVisitOffset++] = node.rightChild;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            }
+        } else {
+            if (toVisitOffset == 0) {
+                break;
+            }
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+
+    return hit;
+}
+
+bool BVH::intersectLeaf(const Ray& ray, int first, int count, Interaction& isect) const {
+    if (!_triangles.p0[0].empty()) {
+        return intersectTriangles(ray, first, count, isect);
+    }
+
+    bool hit = false;
+    for (int i = 0; i < count; ++i) {
+        if (intersectPrimitive(ray, orderedPrimitives[first + i], isect)) {
+            hit = true;
+        }
+    }
+
+    return hit;
+}
+
+AABB BVH::getAABB(const Primitive& prim) {
+    if (prim.type == Primitive::Type::Sphere) {
+        return getSphereAABB(*prim.sphere);
+    } else if (prim.type == Primitive::Type::Instance) {
+        return prim.instance->bound;
+    } else {
+        return getTriangleAABB(*prim.triangle);
+    }
+}
+
+void BVH::intersectPacket(const Ray* rays, int count, Interaction* isects, bool* hits) const {
+    for (int i = 0; i < count; ++i) {
+        hits[i] = false;
+    }
+
+    if (nodes.empty() || count <= 0) {
+        return;
+    }
+
+    // rays as structure of arrays, the unused lanes stay zero and are masked out
+    PacketData packet = {};
+    int octant = -1;
+    bool useFrustum = true;
+    glm::vec3 oLo(std::numeric_limits<float>::max()), oHi(-std::numeric_limits<float>::max());
+    glm::vec3 invLo(std::numeric_limits<float>::max()), invHi(-std::numeric_limits<float>::max());
+    for (int i = 0; i < count; ++i) {
+        const glm::vec3 invDir = glm::vec3(1.0f / rays[i].dir.x, 1.0f / rays[i].dir.y, 1.0f / rays[i].dir.z);
+        for (int axis = 0; axis < 3; ++axis) {
+            packet.o[axis][i] = rays[i].o[axis];
+            packet.invDir[axis][i] = invDir[axis];
+            useFrustum = useFrustum && std::isfinite(invDir[axis]);
+        }
+        packet.tMax[i] = rays[i].tMax;
+
+        const int rayOctant = (rays[i].dir.x < 0 ? 1 : 0) | (rays[i].dir.y < 0 ? 2 : 0) | (rays[i].dir.z < 0 ? 4 : 0);
+        useFrustum = useFrustum && (octant == -1 || octant == rayOctant);
+        octant = rayOctant;
+        oLo = glm::min(oLo, rays[i].o);
+        oHi = glm::max(oHi, rays[i].o);
+        invLo = glm::min(invLo, invDir);
+        invHi = glm::max(invHi, invDir);
+    }
+
+    struct StackEntry {
+        int node;
+        uint32_t mask;
+    };
+
+    StackEntry nodesToVisit[128];
+    int toVisitOffset = 0;
+    int currentNodeIndex = 0;
+    uint32_t mask = (1u << count) - 1;
+    while (true) {
+        const BVHNode& node = nodes[currentNodeIndex];
+        uint32_t hitMask = 0;
+        if (!useFrustum || !missFrustum(node.box, oLo, oHi, invLo, invHi)) {
+            hitMask = intersectPacketBox(node.box, packet, count, mask);
+        }
+
+        if (hitMask != 0 && countBits(hitMask) < MinPacketRays) {
+            // too few rays left for the packet to pay off, finish the subtree one ray at a time
+            for (int i = 0; i < count; ++i) {
+                if ((hitMask & (1u << i)) && intersectSubtree(rays[i], currentNodeIndex, isects[i])) {
+                    hits[i] = true;
+                    packet.tMax[i] = rays[i].tMax;
+                }
+            }
+        } else if (hitMask != 0 && node.isLeaf()) {
+            const int firstIndex = node.startIndex;
+            const int nPrimitives = node.nPrimitives;
+            for (int i = 0; i < count; ++i) {
+                if (!(hitMask & (1u << i))) {
+                    continue;
+                }
+
+                if (!_triangles.p0[0].empty()) {
+                    if (intersectTriangles(rays[i], firstIndex, nPrimitives, isects[i])) {
+                        hits[i] = true;
+                    }
+                    continue;
+                }
+
+                for (int j = 0; j < nPrimitives; ++j) {
+                    const Primitive& primitive = orderedPrimitives[firstIndex + j];
+                    if (primitive.type != Primitive::Type::Instance &&
+                        intersectPrimitive(rays[i], primitive, isects[i])) {
+                        hits[i] = true;
+                    }
+                }
+            }
+
+            if (_triangles.p0[0].empty()) {
+                for (int j = 0; j < nPrimitives; ++j) {
+                    const Primitive& primitive = orderedPrimitives[firstIndex + j];
+                    if (primitive.type == Primitive::Type::Instance) {
+                        intersectInstancePacket(*primitive.instance, rays, count, hitMask, isects, hits);
+                    }
+                }
+            }
+
+            for (int i = 0; i < count; ++i) {
+                packet.tMax[i] = rays[i].tMax;
+            }
+        } else if (hitMask != 0) {
+            // near child first for the octant of the last ray, which every ray shares unless
+            // the packet mixes octants, then the order is only a guess
+            if (octant >= 0 && (octant & (1 << node.axis))) {
+                nodesToVisit[toVisitOffset++] = { currentNodeIndex + 1, hitMask };
+                currentNodeIndex = node.rightChild;
+            } else {
+                nodesToVisit[toVisitOffset++] = { node.rightChild, hitMask };
+                currentNodeIndex = currentNodeIndex + 1;
+            }
+            mask = hitMask;
+            continue;
+        }
+
+        if (toVisitOffset == 0) {
+            break;
+        }
+
+        --toVisitOffset;
+        currentNodeIndex = nodesToVisit[toVisitOffset].node;
+        mask = nodesToVisit[toVisitOffset].mask;
+    }
+}
+
+int BVH::countBits(uint32_t mask) {
+    int n = 0;
+    for (; mask != 0; mask &= mask - 1) {
+        ++n;
+    }
+    return n;
+}
+
+bool BVH::missFrustum(
+    const AABB& box, const glm::vec3& oLo, const glm::vec3& oHi, const glm::vec3& invLo, const glm::vec3& invHi
+) {
+    // interval arithmetic over the origins and inverse directions of the packet: if the largest
+    // possible entry distance of a ray is behind the smallest possible exit distance, no ray hits
+    float tNear = 0.0f;
+    float tFar = std::numeric_limits<float>::max();
+    for (int axis = 0; axis < 3; ++axis) {
+        const bool negative = invLo[axis] < 0.0f;
+        const float nearPlane = negative ? box.pMax[axis] : box.pMin[axis];
+        const float farPlane = negative ? box.pMin[axis] : box.pMax[axis];
+
+        // every ray enters the slab no earlier than the lowest bound of (nearPlane - o) * invDir
+        const float n0 = nearPlane - oHi[axis];
+        const float n1 = nearPlane - oLo[axis];
+        const float nLo = std::min(std::min(n0 * invLo[axis], n0 * invHi[axis]),
+                                   std::min(n1 * invLo[axis], n1 * invHi[axis]));
+        const float f0 = farPlane - oHi[axis];
+        const float f1 = farPlane - oLo[axis];
+        const float fHi = std::max(std::max(f0 * invLo[axis], f0 * invHi[axis]),
+                                   std::max(f1 * invLo[axis], f1 * invHi[axis]));
+        tNear = std::max(tNear, nLo);
+        tFar = std::min(tFar, fHi);
+    }
+
+    return tNear > tFar;
+}
+
+uint32_t BVH::intersectPacketBox(const AABB& box, const PacketData& packet, int count, uint32_t mask) {
+    uint32_t hitMask = 0;
+#ifdef BVH_USE_SSE
+    const __m128 zero = _mm_setzero_ps();
+    for (int i = 0; i < count; i += 4) {
+        if (((mask >> i) & 0xf) == 0) {
+            continue;
+        }
+
+        const __m128 ox = _mm_load_ps(&packet.o[0][i]);
+        const __m128 oy = _mm_load_ps(&packet.o[1][i]);
+        const __m128 oz = _mm_load_ps(&packet.o[2][i]);
+        const __m128 idx = _mm_load_ps(&packet.invDir[0][i]);
+        const __m128 idy = _mm_load_ps(&packet.invDir[1][i]);
+        const __m128 idz = _mm_load_ps(&packet.invDir[2][i]);
+
+        const __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.pMin.x), ox), idx);
+        const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.pMax.x), ox), idx);
+        const __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.pMin.y), oy), idy);
+        const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.pMax.y), oy), idy);
+        const __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.pMin.z), oz), idz);
+        const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.pMax.z), oz), idz);
+
+        __m128 tMin = _mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1));
+        tMin = _mm_max_ps(tMin, _mm_min_ps(tz0, tz1));
+        __m128 tMax = _mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1));
+        tMax = _mm_min_ps(tMax, _mm_max_ps(tz0, tz1));
+
+        // same conditions as AABB::intersect
+        __m128 hit = _mm_cmplt_ps(tMin, tMax);
+        hit = _mm_and_ps(hit, _mm_cmplt_ps(tMin, _mm_load_ps(&packet.tMax[i])));
+        hit = _mm_and_ps(hit, _mm_cmpgt_ps(tMax, zero));
+        hitMask |= static_cast<uint32_t>(_mm_movemask_ps(hit)) << i;
+    }
+#else
+    for (int i = 0; i < count; ++i) {
+        if (!(mask & (1u << i))) {
+            continue;
+        }
+
+        float tMin = 0.0f;
+        float tMax = 0.0f;
+        for (int axis = 0; axis < 3; ++axis) {
+            const float t0 = (box.pMin[axis] - packet.o[axis][i]) * packet.invDir[axis][i];
+            const float t1 = (box.pMax[axis] - packet.o[axis][i]) * packet.invDir[axis][i];
+            tMin = axis == 0 ? std::min(t0, t1) : std::max(tMin, std::min(t0, t1));
+            tMax = axis == 0 ? std::max(t0, t1) : std::min(tMax, std::max(t0, t1));
+        }
+
+        if (tMin < tMax && tMin < packet.tMax[i] && tMax > 0) {
+            hitMask |= 1u << i;
+        }
+    }
+#endif
+
+    return hitMask & mask;
+}
+
+void BVH::intersectInstancePacket(
+    const Instance& instance, const Ray* rays, int count, uint32_t mask, Interaction* isects, bool* hits
+) {
+    Ray objectRays[MaxPacketSize];
+    Interaction objectIsects[MaxPacketSize];
+    bool objectHits[MaxPacketSize];
+    int lanes[MaxPacketSize];
+    int n = 0;
+    for (int i = 0; i < count; ++i) {
+        if (mask & (1u << i)) {
+            // the direction is not normalized, so t is the same in both spaces
+            objectRays[n].o = glm::vec3(instance.worldToObject * glm::vec4(rays[i].o, 1.0f));
+            objectRays[n].dir = glm::vec3(instance.worldToObject * glm::vec4(rays[i].dir, 0.0f));
+            objectRays[n].tMax = rays[i].tMax;
+            lanes[n++] = i;
+        }
+    }
+
+    instance.blas->intersectPacket(objectRays, n, objectIsects, objectHits);
+    for (int j = 0; j < n; ++j) {
+        if (!objectHits[j]) {
+            continue;
+        }
+
+        const int i = lanes[j];
+        const Ray& ray = rays[i];
+        Interaction& isect = isects[i];
+        ray.tMax = objectRays[j].tMax;
+        isect.primitive = objectIsects[j].primitive;
+        isect.hitPoint = objectIsects[j].hitPoint;
+        isect.hitPoint.position = ray(ray.tMax);
+        isect.hitPoint.normal = glm::normalize(instance.normalToWorld * isect.hitPoint.normal);
+        isect.primitive.materialIdx = instance.materialIdx;
+        hits[i] = true;
+    }
+}
+
+bool BVH::occluded(const Ray& ray, float tMax) const {
+    if (nodes.empty()) {
+        return false;
+    }
+
+    Ray shadowRay = ray;
+    shadowRay.tMax = tMax;
+    glm::vec3 invDir = glm::vec3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+    int isDirNeg[3];
+    isDirNeg[0] = ray.dir.x < 0 ? 1 : 0;
+    isDirNeg[1] = ray.dir.y < 0 ? 1 : 0;
+    isDirNeg[2] = ray.dir.z < 0 ? 1 : 0;
+    int currentNodeIndex = 0;
+    int toVisitOffset = 0;
+    int nodesToVisit[128];
+    while (true) {
+        const BVHNode& node = nodes[currentNodeIndex];
+        if (node.box.intersect(shadowRay, invDir, isDirNeg)) {
+            if (node.isLeaf()) {
                 int firstIndex = node.startIndex;
                 int nPrimitives = node.nPrimitives;
 
-                Primitive primitive;
-                for (int i = 0; i < nPrimitives; ++i) {
-                    primitive = orderedPrimitives[firstIndex + i];
-                    if (intersectPrimitive(ray, primitive, isect)) {
-                        hit = true;
+                if (!_triangles.p0[0].empty()) {
+                    glm::vec2 uv;
+                    if (findTriangleHit(shadowRay, firstIndex, nPrimitives, true, &uv) >= 0) {
+                        return true;
+                    }
+                } else {
+                    for (int i = 0; i < nPrimitives; ++i) {
+                        if (occludedPrimitive(shadowRay, orderedPrimitives[firstIndex + i])) {
+                            return true;
+                        }
+                    }
+                }
+
+                if (toVisitOffset == 0) {
+                    break;
+                }
+
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            } else {
+                // any hit ends the query, so the children are visited in memory order
+                nodesToVisit[toVisitOffset++] = node.rightChild;
+                currentNodeIndex = currentNodeIndex + 1;
+            }
+        } else {
+            if (toVisitOffset == 0) {
+                break;
+            }
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+
+    return false;
+}
+
+bool BVH::intersect(const Ray& ray, Interaction& isect, TraversalStatistics& stats) const {
+    ++stats.rays;
+    return traverseCounted(ray, false, isect, stats);
+}
+
+bool BVH::occluded(const Ray& ray, float tMax, TraversalStatistics& stats) const {
+    ++stats.rays;
+    Ray shadowRay = ray;
+    shadowRay.tMax = tMax;
+    Interaction isect;
+    return traverseCounted(shadowRay, true, isect, stats);
+}
+
+bool BVH::traverseCounted(const Ray& ray, bool anyHit, Interaction& isect, TraversalStatistics& stats) const {
+    if (nodes.empty()) {
+        return false;
+    }
+
+    bool hit = false;
+    glm::vec3 invDir = glm::vec3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+    int isDirNeg[3];
+    isDirNeg[0] = ray.dir.x < 0 ? 1 : 0;
+    isDirNeg[1] = ray.dir.y < 0 ? 1 : 0;
+    isDirNeg[2] = ray.dir.z < 0 ? 1 : 0;
+    int currentNodeIndex = 0;
+    int toVisitOffset = 0;
+    int nodesToVisit[128];
+    while (true) {
+        const BVHNode& node = nodes[currentNodeIndex];
+        ++stats.nodes;
+        if (node.box.intersect(ray, invDir, isDirNeg)) {
+            if (node.isLeaf()) {
+                bool leafHit = false;
+                if (!_triangles.p0[0].empty()) {
+                    // the leaf tests of intersectSubtree and occluded, so the hits are the same
+                    stats.primitives += node.nPrimitives;
+                    glm::vec2 uv;
+                    leafHit = anyHit ?
+                        findTriangleHit(ray, node.startIndex, node.nPrimitives, true, &uv) >= 0 :
+                        intersectTriangles(ray, node.startIndex, node.nPrimitives, isect);
+                } else {
+                    for (int i = 0; i < node.nPrimitives && !(anyHit && leafHit); ++i) {
+                        const Primitive& primitive = orderedPrimitives[node.startIndex + i];
+                        if (primitive.type == Primitive::Type::Instance) {
+                            // the same transform as intersectInstance, the BLAS counts into stats
+                            const Instance& instance = *primitive.instance;
+                            glm::vec3 o = glm::vec3(instance.worldToObject * glm::vec4(ray.o, 1.0f));
+                            glm::vec3 dir = glm::vec3(instance.worldToObject * glm::vec4(ray.dir, 0.0f));
+                            Ray objectRay(o, dir, ray.tMax);
+                            ++stats.instances;
+                            if (instance.blas->traverseCounted(objectRay, anyHit, isect, stats)) {
+                                leafHit = true;
+                                if (!anyHit) {
+                                    ray.tMax = objectRay.tMax;
+                                    isect.hitPoint.position = ray(ray.tMax);
+                                    isect.hitPoint.normal =
+                                        glm::normalize(instance.normalToWorld * isect.hitPoint.normal);
+                                    isect.primitive.materialIdx = instance.materialIdx;
+                                }
+                            }
+                        } else {
+                            ++stats.primitives;
+                            if (anyHit ? occludedPrimitive(ray, primitive) : intersectPrimitive(ray, primitive, isect)) {
+                                leafHit = true;
+                            }
+                        }
+                    }
+                }
+
+                if (leafHit) {
+                    if (anyHit) {
+                        return true;
                     }
+                    hit = true;
                 }
 
                 if (toVisitOffset == 0) {
@@ -93,11 +1453,13 @@ bool BVH::intersect(const Ray& ray, Interaction& isect) {
                 }
 
                 currentNodeIndex = nodesToVisit[--toVisitOffset];
+            } else if (anyHit || !isDirNeg[node.axis]) {
+                // the child orders of occluded and intersectSubtree
+                nodesToVisit[toVisitOffset++] = node.rightChild;
+                currentNodeIndex = currentNodeIndex + 1;
             } else {
-                int leftChild = node.leftChild;
-                int rightChild = node.rightChild;
-                nodesToVisit[toVisitOffset++] = rightChild;
-                currentNodeIndex = leftChild;
+                nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                currentNodeIndex = node.rightChild;
             }
         } else {
             if (toVisitOffset == 0) {
@@ -110,17 +1472,33 @@ bool BVH::intersect(const Ray& ray, Interaction& isect) {
     return hit;
 }
 
-AABB BVH::getAABB(const Primitive& prim) {
-    if (prim.type == Primitive::Type::Sphere) {
-        return getSphereAABB(*prim.sphere);
+bool BVH::occludedPrimitive(const Ray& ray, const Primitive& primitive) {
+    switch (primitive.type) {
+    case Primitive::Type::Sphere:
+        return hitSphere(ray, *primitive.sphere);
+    case Primitive::Type::Triangle:
+        return primitive.triangle->intersect(ray);
+    case Primitive::Type::Instance: {
+        const Instance& instance = *primitive.instance;
+        glm::vec3 o = glm::vec3(instance.worldToObject * glm::vec4(ray.o, 1.0f));
+        glm::vec3 dir = glm::vec3(instance.worldToObject * glm::vec4(ray.dir, 0.0f));
+        return instance.blas->occluded(Ray(o, dir), ray.tMax);
     }
-    else {
-        return getTriangleAABB(*prim.triangle);
     }
+
+    return false;
 }
 
 bool BVH::intersectPrimitive(const Ray& ray, const Primitive& primitive, Interaction& isect) {
-    if (intersectSphere(ray, *primitive.sphere, isect)) {
+    if (primitive.type == Primitive::Type::Instance) {
+        // isect.primitive is the triangle hit inside the BLAS
+        return intersectInstance(ray, *primitive.instance, isect);
+    }
+
+    bool hit = primitive.type == Primitive::Type::Sphere ?
+        intersectSphere(ray, *primitive.sphere, isect) :
+        intersectTriangle(ray, *primitive.triangle, isect);
+    if (hit) {
         isect.primitive = primitive;
         return true;
     }
@@ -141,6 +1519,16 @@ AABB BVH::getSphereAABB(const Sphere& sphere) {
 }
 
 bool BVH::intersectSphere(const Ray& ray, const Sphere& sphere, Interaction& isect) {
+    if (!hitSphere(ray, sphere)) {
+        return false;
+    }
+
+    isect.hitPoint.position = ray.o + ray.tMax * ray.dir;
+    isect.hitPoint.normal = glm::normalize(isect.hitPoint.position - sphere.position);
+    return true;
+}
+
+bool BVH::hitSphere(const Ray& ray, const Sphere& sphere) {
     float a = glm::dot(ray.dir, ray.dir);
     float b = glm::dot(ray.dir, ray.o - sphere.position);
     float c = glm::dot(ray.o - sphere.position, ray.o - sphere.position) - sphere.radius * sphere.radius;
@@ -151,13 +1539,187 @@ bool BVH::intersectSphere(const Ray& ray, const Sphere& sphere, Interaction& ise
         float t2 = (-b + std::sqrt(discriminant)) / a;
 
         if ((1e-3f <= t1 && t1 < ray.tMax) || (1e-3f <= t2 && t2 < ray.tMax)) {
-            float t = (1e-3f <= t1 && t1 < ray.tMax) ? t1 : t2;
-            ray.tMax = t;
-            isect.hitPoint.position = ray.o + t * ray.dir;
-            isect.hitPoint.normal = glm::normalize(isect.hitPoint.position - sphere.position);
+            ray.tMax = (1e-3f <= t1 && t1 < ray.tMax) ? t1 : t2;
             return true;
         }
     }
 
     return false;
-}
\ No newline at end of file
+}
+
+bool BVH::intersectTriangles(const Ray& ray, int first, int count, Interaction& isect) const {
+    glm::vec2 uv;
+    const int idx = findTriangleHit(ray, first, count, false, &uv);
+    if (idx < 0) {
+        return false;
+    }
+
+    const Primitive& primitive = orderedPrimitives[idx];
+    setTriangleHitPoint(ray, *primitive.triangle, glm::vec3(1.0f - uv.x - uv.y, uv.x, uv.y), isect);
+    isect.primitive = primitive;
+    return true;
+}
+
+int BVH::findTriangleHit(const Ray& ray, int first, int count, bool anyHit, glm::vec2* uv) const {
+    // Moller-Trumbore on the precomputed edges: 4 triangles per step, the closest lane wins
+    int bestIdx = -1;
+    float bestT = ray.tMax;
+    float bestU = 0.0f;
+    float bestV = 0.0f;
+
+#ifdef BVH_USE_SSE
+    const __m128 ox = _mm_set1_ps(ray.o.x);
+    const __m128 oy = _mm_set1_ps(ray.o.y);
+    const __m128 oz = _mm_set1_ps(ray.o.z);
+    const __m128 dx = _mm_set1_ps(ray.dir.x);
+    const __m128 dy = _mm_set1_ps(ray.dir.y);
+    const __m128 dz = _mm_set1_ps(ray.dir.z);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 lanes = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+
+    for (int i = 0; i < count; i += 4) {
+        const int idx = first + i;
+        const __m128 e1x = _mm_loadu_ps(&_triangles.e1[0][idx]);
+        const __m128 e1y = _mm_loadu_ps(&_triangles.e1[1][idx]);
+        const __m128 e1z = _mm_loadu_ps(&_triangles.e1[2][idx]);
+        const __m128 e2x = _mm_loadu_ps(&_triangles.e2[0][idx]);
+        const __m128 e2y = _mm_loadu_ps(&_triangles.e2[1][idx]);
+        const __m128 e2z = _mm_loadu_ps(&_triangles.e2[2][idx]);
+
+        // pvec = dir x e2, det = e1 . pvec
+        const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        const __m128 invDet = _mm_div_ps(one, det);
+
+        // tvec = o - p0, u = tvec . pvec / det
+        const __m128 tx = _mm_sub_ps(ox, _mm_loadu_ps(&_triangles.p0[0][idx]));
+        const __m128 ty = _mm_sub_ps(oy, _mm_loadu_ps(&_triangles.p0[1][idx]));
+        const __m128 tz = _mm_sub_ps(oz, _mm_loadu_ps(&_triangles.p0[2][idx]));
+        const __m128 u = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+
+        // qvec = tvec x e1, v = dir . qvec / det, t = e2 . qvec / det
+        const __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+        const __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+        const __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+        const __m128 v = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+        const __m128 t = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+        // the comparisons are false for the NaN and inf lanes of degenerate triangles,
+        // rays grazing the plane miss like in Triangle::intersect
+        const __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+        __m128 mask = _mm_cmpneq_ps(det, zero);
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(absDet, _mm_loadu_ps(&_triangles.minDet[idx])));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(t, zero));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_set1_ps(bestT)));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(lanes, _mm_set1_ps(static_cast<float>(count - i))));
+
+        int hitMask = _mm_movemask_ps(mask);
+        if (hitMask == 0) {
+            continue;
+        }
+
+        alignas(16) float tLanes[4], uLanes[4], vLanes[4];
+        _mm_store_ps(tLanes, t);
+        _mm_store_ps(uLanes, u);
+        _mm_store_ps(vLanes, v);
+        for (int lane = 0; lane < 4; ++lane) {
+            if ((hitMask & (1 << lane)) && tLanes[lane] < bestT) {
+                bestIdx = idx + lane;
+                bestT = tLanes[lane];
+                bestU = uLanes[lane];
+                bestV = vLanes[lane];
+            }
+        }
+
+        if (anyHit) {
+            break;
+        }
+    }
+#else
+    for (int idx = first; idx < first + count; ++idx) {
+        const glm::vec3 e1(_triangles.e1[0][idx], _triangles.e1[1][idx], _triangles.e1[2][idx]);
+        const glm::vec3 e2(_triangles.e2[0][idx], _triangles.e2[1][idx], _triangles.e2[2][idx]);
+        const glm::vec3 p0(_triangles.p0[0][idx], _triangles.p0[1][idx], _triangles.p0[2][idx]);
+        const glm::vec3 pvec = glm::cross(ray.dir, e2);
+        const float det = glm::dot(e1, pvec);
+        if (det == 0.0f || std::abs(det) < _triangles.minDet[idx]) {
+            continue;
+        }
+
+        const float invDet = 1.0f / det;
+        const glm::vec3 tvec = ray.o - p0;
+        const float u = glm::dot(tvec, pvec) * invDet;
+        const glm::vec3 qvec = glm::cross(tvec, e1);
+        const float v = glm::dot(ray.dir, qvec) * invDet;
+        const float t = glm::dot(e2, qvec) * invDet;
+        if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t >= 0.0f && t < bestT) {
+            bestIdx = idx;
+            bestT = t;
+            bestU = u;
+            bestV = v;
+            if (anyHit) {
+                break;
+            }
+        }
+    }
+#endif
+
+    if (bestIdx >= 0) {
+        ray.tMax = bestT;
+        *uv = glm::vec2(bestU, bestV);
+    }
+
+    return bestIdx;
+}
+
+bool BVH::intersectTriangle(const Ray& ray, const Triangle& triangle, Interaction& isect) {
+    glm::vec3 barycentric;
+    if (!triangle.intersect(ray, &barycentric)) {
+        return false;
+    }
+
+    setTriangleHitPoint(ray, triangle, barycentric, isect);
+    return true;
+}
+
+void BVH::setTriangleHitPoint(
+    const Ray& ray, const Triangle& triangle, const glm::vec3& barycentric, Interaction& isect
+) {
+    const Vertex& v1 = triangle.vertices[triangle.v[0]];
+    const Vertex& v2 = triangle.vertices[triangle.v[1]];
+    const Vertex& v3 = triangle.vertices[triangle.v[2]];
+    isect.hitPoint.position = ray(ray.tMax);
+    glm::vec3 normal = barycentric.x * v1.normal + barycentric.y * v2.normal + barycentric.z * v3.normal;
+    if (glm::dot(normal, normal) == 0.0f) {
+        // meshes without vertex normals fall back to the face normal
+        normal = glm::cross(v2.position - v1.position, v3.position - v1.position);
+    }
+    isect.hitPoint.normal = glm::normalize(normal);
+    isect.hitPoint.texCoord = 
+        barycentric.x * v1.texCoord + barycentric.y * v2.texCoord + barycentric.z * v3.texCoord;
+}
+
+bool BVH::intersectInstance(const Ray& ray, const Instance& instance, Interaction& isect) {
+    // the direction is not normalized, so t is the same in both spaces
+    glm::vec3 o = glm::vec3(instance.worldToObject * glm::vec4(ray.o, 1.0f));
+    glm::vec3 dir = glm::vec3(instance.worldToObject * glm::vec4(ray.dir, 0.0f));
+    Ray objectRay(o, dir, ray.tMax);
+    if (!instance.blas->intersect(objectRay, isect)) {
+        return false;
+    }
+
+    ray.tMax = objectRay.tMax;
+    isect.hitPoint.position = ray(ray.tMax);
+    isect.hitPoint.normal = glm::normalize(instance.normalToWorld * isect.hitPoint.normal);
+    isect.primitive.materialIdx = instance.materialIdx;
+    return true;
+}
@@ -1,11 +1,16 @@
 #pragma once 
 
+#include <cstdint>
+#include <functional>
+#include <limits>
 #include <vector>
 #include "aabb.h"
+#include "arena.h"
 #include "ray.h"
 #include "triangle.h"
 #include "sphere.h"
 #include "primitive.h"
+#include "thread_pool.h"
 
 struct Interaction {
     Primitive primitive;
@@ -28,6 +33,13 @@ public:
         pid(idx) {}
 };
 
+/* primInfo index keyed by the Morton code of its centroid */
+struct MortonPrimitive {
+public:
+    uint64_t mortonCode;
+    int primIdx;
+};
+
 struct BVHBuildNode {
 public:
     AABB bound;
@@ -55,70 +67,441 @@ public:
     }
 };
 
-struct BVHNode {
+enum class BVHBuildMethod {
+    SAH,        // binned SAH, the fastest to trace
+    LBVH,       // splits at the Morton code bits, linear time build for scenes changing every frame
+    HLBVH,      // LBVH treelets joined by SAH, most of the SAH quality at close to LBVH build time
+    SBVH,       // SAH with spatial splits, long thin triangles are chopped and referenced by several leaves
+};
+
+struct BVHBuildOptions {
 public:
-    enum class Type { NonLeaf, Leaf };
+    BVHBuildMethod method = BVHBuildMethod::SAH;
+    int maxPrimsInNode = 4;     // a node with more primitives is always split
+    int nBuckets = 12;          // number of centroid bins tested by SAH
+    int maxHeight = 64;         // nodes deeper than this become leaves
+    float traversalCost = 0.125f;
+    float intersectCost = 1.0f;
+    int nThreads = 0;           // 0 builds with all cores, 1 builds serially
+    float rebuildThreshold = 1.5f;  // a refitted BVH is degraded once its node areas grow past this factor
+    float spatialSplitAlpha = 1e-5f;    // SBVH: try spatial splits where the object split children overlap
+                                        // by more than this fraction of the root area
+    float spatialSplitBudget = 0.3f;    // SBVH: at most this many extra references per primitive
+};
+
+/*
+ * 32 byte node of the linear BVH. Nodes are stored depth first, so the left
+ * child of an interior node is the next node and only the right one is kept
+ */
+struct alignas(32) BVHNode {
 public:
     AABB box;
-    Type type;
     union {
-        struct {
-            int leftChild;
-            int rightChild;
-        };
-        struct {
-            int startIndex;
-            int nPrimitives;
-        };
+        int startIndex;         // leaf: first primitive in orderedPrimitives
+        int rightChild;         // interior: index of the second child
     };
+    uint16_t nPrimitives;       // 0 for interior nodes
+    uint8_t axis;               // split axis of interior nodes
+    uint8_t pad;
+
+public:
+    BVHNode() : startIndex(-1), nPrimitives(0), axis(0), pad(0) { }
+
+    bool isLeaf() const {
+        return nPrimitives > 0;
+    }
+
+    static constexpr int getMaxLeafPrimitives() noexcept {
+        return 65535;
+    }
+};
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode must stay 32 bytes");
+
+/* work done by traversals, instances add the nodes and primitives of their BLAS */
+struct TraversalStatistics {
+public:
+    uint64_t rays = 0;
+    uint64_t nodes = 0;         // node bounds tested
+    uint64_t primitives = 0;    // spheres and triangles tested
+    uint64_t instances = 0;     // instances entered
 
 public:
-    BVHNode() : type(Type::Leaf), leftChild(-1), rightChild(-1) { }
+    double getNodesPerRay() const {
+        return rays > 0 ? static_cast<double>(nodes) / rays : 0.0;
+    }
+
+    double getPrimitivesPerRay() const {
+        return rays > 0 ? static_cast<double>(primitives) / rays : 0.0;
+    }
+
+    double getInstancesPerRay() const {
+        return rays > 0 ? static_cast<double>(instances) / rays : 0.0;
+    }
+};
+
+/* BVHNode as two RGBA32F texels of the bvh buffer: pMin, pMax.x | pMax.yz, offset, nPrimitives */
+struct ShaderBVHNode {
+    glm::vec4 v[2];
 
     static constexpr int getTexDataComponent() noexcept {
-        return 3;
+        return 4;
     }
 };
 
+/*
+ * positions of the triangles in orderedPrimitives as structure of arrays:
+ * vertex 0 and the edges to vertices 1 and 2, so a leaf tests 4 triangles
+ * per SSE instruction. The arrays are padded so 4 wide loads never overrun
+ */
+struct TriangleSoA {
+public:
+    std::vector<float> p0[3];
+    std::vector<float> e1[3];
+    std::vector<float> e2[3];
+    std::vector<float> minDet;  // |e1 x e2| * Triangle::MinHitCosine, the smallest |det| of a hit
+
+public:
+    void resize(size_t n);
+
+    void clear();
+
+    void set(size_t i, const Triangle& triangle);
+};
+
 class BVH {
+public:
+    static constexpr int MaxPacketSize = 16;
+    static constexpr int MinPacketRays = 4;     // smaller packets continue as single rays
+
 public:
     std::vector<BVHNode> nodes;
     std::vector<Primitive> orderedPrimitives;
-    int height;
-    int maxHeight;
+    int height = 0;
+    int maxHeight = 0;
+    float sahCost = 0.0f;
+    float degradation = 1.0f;   // mean growth of the node areas since the last build
+    float buildTime = 0.0f;     // ms
 
 public:
-    BVH(std::vector<Primitive>& primitives) {
+    BVH(std::vector<Primitive>& primitives, const BVHBuildOptions& options = BVHBuildOptions()) :
+        maxHeight(options.maxHeight), _options(options) {
         constructBVH(primitives);
     }
 
-    bool intersect(const Ray& ray, Interaction& isect);
+    /*
+    *Summary: restore a BVH saved by an earlier build, e.g. from BVHCache
+    *Parameters:
+    *     nodes            : the linear nodes
+    *     orderedPrimitives: primitives in the order the leaves index them
+    *     height           : height of the tree
+    *     options          : the options the tree was built with, used by refit and rebuild
+    */
+    BVH(std::vector<BVHNode> nodes, std::vector<Primitive> orderedPrimitives, int height,
+        const BVHBuildOptions& options = BVHBuildOptions());
+
+    bool intersect(const Ray& ray, Interaction& isect) const;
+
+    /*
+    *Summary: closest hits of up to MaxPacketSize rays traversed together. Every node is tested
+    *         against all rays still in it at once, and rays of the same direction octant skip
+    *         the nodes outside the frustum of the packet with a single test
+    *Parameters:
+    *     rays  : the rays, tMax of every ray is shortened to its hit distance
+    *     count : number of rays
+    *     isects: record the hit of every ray
+    *     hits  : receives whether every ray hit something
+    */
+    void intersectPacket(const Ray* rays, int count, Interaction* isects, bool* hits) const;
+
+    /*
+    *Summary: test whether anything blocks the ray before tMax, for shadow and visibility rays.
+    *         The traversal stops at the first hit found and records nothing about it
+    *Parameters:
+    *     ray : the ray, its tMax is ignored
+    *     tMax: distance to the point being tested
+    *Return: true if a primitive is hit in (0, tMax)
+    */
+    bool occluded(const Ray& ray, float tMax) const;
+
+    /*
+    *Summary: intersect and occluded counting the work into stats, the nodes are visited in the
+    *         same order and give the same hits. The counters cost time, so these are only meant
+    *         for measuring trees, e.g. by a benchmark
+    */
+    bool intersect(const Ray& ray, Interaction& isect, TraversalStatistics& stats) const;
+
+    bool occluded(const Ray& ray, float tMax, TraversalStatistics& stats) const;
+
+    /*
+    *Summary: closest hit among the primitives of a leaf, the leaf test of intersect. Triangles
+    *         are tested 4 at a time, other primitives one by one
+    *Parameters:
+    *     ray  : the ray, tMax is shortened to the hit distance
+    *     first: first primitive of the leaf in orderedPrimitives
+    *     count: number of primitives of the leaf
+    *     isect: record the hit point and primitive
+    *Return: true if a primitive was hit before ray.tMax
+    */
+    bool intersectLeaf(const Ray& ray, int first, int count, Interaction& isect) const;
+
+    /* every primitive is a triangle and the leaves test them from structure of arrays */
+    bool hasTriangleData() const {
+        return !_triangles.p0[0].empty();
+    }
+
+    /*
+    *Summary: the triangle test behind intersectTriangles and occluded, needs hasTriangleData
+    *Parameters:
+    *     ray   : the ray, tMax is shortened to the hit distance
+    *     first : first primitive of the leaf
+    *     count : number of primitives of the leaf
+    *     anyHit: return the first hit found instead of the closest one
+    *     uv    : receives the barycentric weights of v[1] and v[2] at the hit point
+    *Return: index of the hit triangle in orderedPrimitives, -1 if none was hit
+    */
+    int findTriangleHit(const Ray& ray, int first, int count, bool anyHit, glm::vec2* uv) const;
+
+    /*
+    *Summary: recompute the node bounds bottom up after primitives moved, the topology is kept
+    *Parameters:
+    *     dirtyBegin: first node whose bound changed
+    *     dirtyEnd  : one past the last node whose bound changed, equal to dirtyBegin if none did
+    */
+    void refit(int* dirtyBegin = nullptr, int* dirtyEnd = nullptr);
+
+    /* degradation grew past options.rebuildThreshold, tracing the rebuilt tree would be faster */
+    bool isDegraded() const;
+
+    /* build the tree again from orderedPrimitives, node and primitive order change */
+    void rebuild();
+
+    static bool intersectPrimitive(const Ray& ray, const Primitive& primitive, Interaction& isect);
+
+    static const char* getBuildMethodName(BVHBuildMethod method);
+
+    /* interleave the low 21 bits of x, y and z into a Morton code */
+    static uint64_t encodeMorton3(uint32_t x, uint32_t y, uint32_t z);
 
 private:
+    BVHBuildOptions _options;
+
+    ThreadPool* _pool = nullptr;
+
+    Arena<BVHBuildNode>* _arena = nullptr;
+
+    std::vector<float> _builtAreas;     // node areas right after the build, to measure degradation
+
+    TriangleSoA _triangles;             // only filled when every primitive is a triangle, like in a BLAS
+
+    /* traverse the subtree below root with a single ray */
+    bool intersectSubtree(const Ray& ray, int root, Interaction& isect) const;
+
+    /* the traversal behind the counting intersect and occluded, stats.rays is left to the caller */
+    bool traverseCounted(const Ray& ray, bool anyHit, Interaction& isect, TraversalStatistics& stats) const;
+
+    /* the rays of a packet as structure of arrays */
+    struct alignas(16) PacketData {
+        float o[3][MaxPacketSize];
+        float invDir[3][MaxPacketSize];
+        float tMax[MaxPacketSize];
+    };
+
+    /*
+    *Summary: test the packet frustum, bounded by the ranges of the origins and inverse directions
+    *         of rays sharing a direction octant, against a node bound
+    *Return: true if no ray of the packet can hit the box
+    */
+    static bool missFrustum(const AABB& box,
+        const glm::vec3& oLo, const glm::vec3& oHi, const glm::vec3& invLo, const glm::vec3& invHi);
+
+    static int countBits(uint32_t mask);
+
+    /* mask of the rays in mask that hit the box, 4 rays per SSE step */
+    static uint32_t intersectPacketBox(const AABB& box, const PacketData& packet, int count, uint32_t mask);
+
+    /* trace the rays in mask through the BLAS of the instance as one packet in object space */
+    static void intersectInstancePacket(const Instance& instance,
+        const Ray* rays, int count, uint32_t mask, Interaction* isects, bool* hits);
+
+    /* fill _triangles from orderedPrimitives, or clear it if there are other primitives */
+    void initTriangleData();
+
+    /*
+    *Summary: closest hit among the triangles orderedPrimitives[first, first + count), 4 at a time
+    *Parameters:
+    *     ray  : the ray, tMax is shortened to the hit distance
+    *     first: first primitive of the leaf
+    *     count: number of primitives of the leaf
+    *     isect: record the hit point and primitive
+    *Return: true if a triangle was hit before ray.tMax
+    */
+    bool intersectTriangles(const Ray& ray, int first, int count, Interaction& isect) const;
+
     void constructBVH(std::vector<Primitive>& primitives);
 
+    /* compute sahCost and remember the node areas that refit measures degradation against */
+    void initQuality();
+
     /*
-    *Summary: build bvh and store primitives in orderedPrimitives
+    *Summary: build bvh over primInfo[start, end), leaves index the reordered primInfo
     *Parameters:
-    *     primitives: the primitives in scene
     *     primInfo  : PrimitiveInfo of primitives
     *     start     : start index of primitives
     *     end       : end index of primitives
-    *     totalNodes: the number of nodes was crated
-    *Return: the root of BVH
+    *     depth     : depth of the node, the root is at depth 1
+    *Return: the root of BVH, nodes are allocated from _arena
     */
     BVHBuildNode* recursiveBuild(
-        const std::vector<Primitive>& primitives,
         std::vector<PrimitiveInfo>& primInfo, 
-        int start, int end, int* totalNodes);
+        int start, int end, int depth);
+
+    /*
+    *Summary: build bvh over primInfo sorted by the Morton codes of the centroids, for LBVH and HLBVH
+    *Parameters:
+    *     primInfo: PrimitiveInfo of primitives, it is reordered along the Morton curve
+    *Return: the root of BVH, nodes are allocated from _arena
+    */
+    BVHBuildNode* linearBuild(std::vector<PrimitiveInfo>& primInfo);
+
+    /*
+    *Summary: stable LSD radix sort of the Morton codes, 8 bits per pass
+    *Parameters:
+    *     mortonPrims: primitives to sort
+    *     nBits      : number of low bits of the codes that are used
+    */
+    void radixSort(std::vector<MortonPrimitive>& mortonPrims, int nBits);
+
+    /*
+    *Summary: build the subtree of the sorted range by splitting where bit bitIndex flips
+    *Parameters:
+    *     primInfo   : PrimitiveInfo sorted like mortonPrims
+    *     mortonPrims: sorted Morton codes
+    *     start      : start index of primitives
+    *     end        : end index of primitives
+    *     bitIndex   : the highest bit that may still differ in [start, end)
+    *     depth      : depth of the node, the root is at depth 1
+    *Return: root of the subtree
+    */
+    BVHBuildNode* emitLBVH(
+        std::vector<PrimitiveInfo>& primInfo,
+        const std::vector<MortonPrimitive>& mortonPrims,
+        int start, int end, int bitIndex, int depth);
+
+    struct Treelet {
+        int start, end;
+        AABB bound;
+    };
+
+    /*
+    *Summary: join treelets[start, end) by SAH over their bounds, treelets are emitted at the leaves
+    *Parameters:
+    *     treelets   : primitive ranges sharing the high bits of their Morton codes
+    *     start      : start index of treelets
+    *     end        : end index of treelets
+    *     bitIndex   : the first bit that differs inside a treelet
+    *     depth      : depth of the node, the root is at depth 1
+    *Return: root of the subtree
+    */
+    BVHBuildNode* buildUpperSAH(
+        std::vector<PrimitiveInfo>& primInfo,
+        const std::vector<MortonPrimitive>& mortonPrims,
+        std::vector<Treelet>& treelets,
+        int start, int end, int bitIndex, int depth);
+
+    struct SpatialBuildState {
+        const std::vector<Primitive>* primitives = nullptr;
+        std::vector<PrimitiveInfo> leafRefs;    // references in the order the leaves index them
+        float rootArea = 0.0f;
+        size_t nReferences = 0;
+        size_t maxReferences = 0;
+    };
+
+    struct SpatialSplit {
+        float cost = std::numeric_limits<float>::max();
+        int dim = 0;
+        float position = 0.0f;
+        AABB leftBound, rightBound;
+        int nLeft = 0, nRight = 0;
+    };
+
+    /*
+    *Summary: build the SBVH over refs, trying a spatial split next to the object split where the
+    *         object split children overlap. Leaves append their references to state.leafRefs
+    *Parameters:
+    *     state: primitives, output references and the reference budget
+    *     refs : references of the node, possibly clipped parts of primitives, freed after the split
+    *     depth: depth of the node, the root is at depth 1
+    *Return: root of the subtree
+    */
+    BVHBuildNode* spatialBuild(SpatialBuildState& state, std::vector<PrimitiveInfo>& refs, int depth);
+
+    /* the SAH optimal spatial split plane among nBuckets bins of the largest axis of bound */
+    SpatialSplit findSpatialSplit(
+        const SpatialBuildState& state, const std::vector<PrimitiveInfo>& refs, const AABB& bound);
+
+    /* distribute refs to the sides of the split plane, references crossing it are chopped or kept whole */
+    void splitReferences(SpatialBuildState& state, const std::vector<PrimitiveInfo>& refs,
+        const SpatialSplit& split, std::vector<PrimitiveInfo>& left, std::vector<PrimitiveInfo>& right);
+
+    /*
+    *Summary: bound the parts of a reference on both sides of an axis aligned plane
+    *Parameters:
+    *     primitives: the primitives of the build
+    *     pid       : the referenced primitive
+    *     box       : bound of the reference
+    *     dim       : axis of the plane
+    *     position  : position of the plane
+    *     left      : receives the bound of the part below the plane
+    *     right     : receives the bound of the part above the plane
+    */
+    static void splitReference(const std::vector<Primitive>& primitives, int pid, const AABB& box,
+        int dim, float position, AABB* left, AABB* right);
+
+    /*
+    *Summary: compute the bound of primitives and of their centroids in primInfo[start, end)
+    */
+    void computeBounds(
+        const std::vector<PrimitiveInfo>& primInfo,
+        int start, int end, AABB* bound, AABB* centroidBox);
+
+    /*
+    *Summary: find the SAH optimal split of primInfo[start, end) with binned centroids
+    *Parameters:
+    *     primInfo   : PrimitiveInfo of primitives
+    *     start      : start index of primitives
+    *     end        : end index of primitives
+    *     bound      : bound of primitives in [start, end)
+    *     centroidBox: bound of centroids in [start, end)
+    *     dim        : the axis to bin along
+    *     minCost    : the SAH cost of the best split
+    *Return: the bucket index whose upper boundary is the best split plane
+    */
+    int findSAHSplit(
+        const std::vector<PrimitiveInfo>& primInfo,
+        int start, int end, const AABB& bound, const AABB& centroidBox, 
+        int dim, float* minCost);
+
+    static int getBucketIndex(const glm::vec3& centroid, const AABB& centroidBox, int dim, int nBuckets);
+
+    /* run func over [begin, end) on the build pool, or inline for a serial build */
+    void parallelFor(int begin, int end, const std::function<void(int, int)>& func);
+
     /*
     *Summary: convert BVH to array form
     *Parameters:
     *     root: root of bvh
+    *     depth: depth of root, used to fill in height
     *     offset: offset of nodes array
     *Return: node index in nodes array
     */
-    int toLinearTree(BVHBuildNode* root, int* offset);
+    int toLinearTree(BVHBuildNode* root, int depth, int* offset);
+
+    /*
+    *Summary: compute the SAH cost of the linear tree relative to the root bound
+    *Return: the SAH cost
+    */
+    float computeSAHCost() const;
 
     static AABB getAABB(const Primitive& prim);
 
@@ -126,7 +509,20 @@ private:
 
     static AABB getSphereAABB(const Sphere& sphere);
 
-    static bool intersectPrimitive(const Ray& ray, const Primitive& primitive, Interaction& isect);
-
     static bool intersectSphere(const Ray& ray, const Sphere& sphere, Interaction& isect);
+
+    /* sphere test without a hit record, ray.tMax is shortened to the hit distance */
+    static bool hitSphere(const Ray& ray, const Sphere& sphere);
+
+    /* any hit of a single primitive, instances trace their BLAS with occluded */
+    static bool occludedPrimitive(const Ray& ray, const Primitive& primitive);
+
+    static bool intersectTriangle(const Ray& ray, const Triangle& triangle, Interaction& isect);
+
+    /* interpolate the vertex attributes of a triangle hit, ray.tMax is the hit distance */
+    static void setTriangleHitPoint(
+        const Ray& ray, const Triangle& triangle, const glm::vec3& barycentric, Interaction& isect);
+
+    /* trace the ray through the BLAS in object space, the hit is moved back to world space */
+    static bool intersectInstance(const Ray& ray, const Instance& instance, Interaction& isect);
 };
\ No newline at end of file
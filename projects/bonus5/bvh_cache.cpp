@@ -0,0 +1,215 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include "../base/mapped_file.h"
+#include "bvh_cache.h"
+
+// bump when the file layout or the build changes, old files then stop matching
+static constexpr uint32_t CacheVersion = 1;
+
+struct BVHCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t nodeSize;
+    uint32_t nNodes;
+    uint32_t nPrimitives;
+    int32_t height;
+    uint8_t pad[32];        // keeps the nodes after the header 32 byte aligned
+};
+
+static_assert(sizeof(BVHCacheHeader) == 64, "BVHCacheHeader must stay 64 bytes");
+
+static void makeDirectory(const std::string& path) {
+#ifdef _WIN32
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+}
+
+BVHCache::BVHCache(const std::string& directory) : _directory(directory) {
+    if (!_directory.empty() && _directory.back() != '/' && _directory.back() != '\\') {
+        _directory += '/';
+    }
+}
+
+uint64_t BVHCache::getMeshKey(
+    const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices,
+    const BVHBuildOptions& options
+) {
+    uint64_t key = hash(vertices.data(), vertices.size() * sizeof(Vertex), CacheVersion);
+    key = hash(indices.data(), indices.size() * sizeof(uint32_t), key);
+
+    // only the options that change the tree, the thread count does not
+    const int32_t intOptions[] = {
+        static_cast<int32_t>(options.method), options.maxPrimsInNode, options.nBuckets, options.maxHeight
+    };
+    const float floatOptions[] = {
+        options.traversalCost, options.intersectCost, options.spatialSplitAlpha, options.spatialSplitBudget
+    };
+    key = hash(intOptions, sizeof(intOptions), key);
+    key = hash(floatOptions, sizeof(floatOptions), key);
+
+    return key;
+}
+
+std::unique_ptr<BVH> BVHCache::load(
+    uint64_t key, const std::vector<Primitive>& primitives, const BVHBuildOptions& options
+) const {
+    std::unique_ptr<MappedFile> file;
+    try {
+        file.reset(new MappedFile(getFilePath(key)));
+    } catch (const std::runtime_error&) {
+        // not cached yet
+        return nullptr;
+    }
+
+    if (file->getSize() < sizeof(BVHCacheHeader)) {
+        return nullptr;
+    }
+
+    BVHCacheHeader header;
+    std::memcpy(&header, file->getData(), sizeof(BVHCacheHeader));
+    const size_t expectedSize = sizeof(BVHCacheHeader) +
+        static_cast<size_t>(header.nNodes) * sizeof(BVHNode) +
+        static_cast<size_t>(header.nPrimitives) * sizeof(int32_t);
+    if (std::memcmp(header.magic, "BVHC", 4) != 0 ||
+        header.version != CacheVersion ||
+        header.key != key ||
+        header.nodeSize != sizeof(BVHNode) ||
+        header.nPrimitives < primitives.size() ||
+        file->getSize() != expectedSize) {
+        return nullptr;
+    }
+
+    const uint8_t* data = file->getData() + sizeof(BVHCacheHeader);
+    std::vector<BVHNode> nodes(header.nNodes);
+    std::memcpy(nodes.data(), data, header.nNodes * sizeof(BVHNode));
+    data += header.nNodes * sizeof(BVHNode);
+
+    // a damaged file must not send the traversal out of the arrays
+    for (int i = 0; i < static_cast<int>(nodes.size()); ++i) {
+        const BVHNode& node = nodes[i];
+        const bool valid = node.isLeaf() ?
+            node.startIndex >= 0 && node.startIndex + node.nPrimitives <= static_cast<int>(header.nPrimitives) :
+            node.rightChild > i + 1 && node.rightChild < static_cast<int>(nodes.size());
+        if (!valid) {
+            return nullptr;
+        }
+    }
+
+    std::vector<int32_t> order(header.nPrimitives);
+    std::memcpy(order.data(), data, header.nPrimitives * sizeof(int32_t));
+
+    std::vector<Primitive> orderedPrimitives(header.nPrimitives);
+    for (size_t i = 0; i < order.size(); ++i) {
+        if (order[i] < 0 || order[i] >= static_cast<int32_t>(primitives.size())) {
+            return nullptr;
+        }
+        orderedPrimitives[i] = primitives[order[i]];
+    }
+
+    return std::unique_ptr<BVH>(new BVH(std::move(nodes), std::move(orderedPrimitives), header.height, options));
+}
+
+void BVHCache::save(uint64_t key, const BVH& bvh, const std::vector<Primitive>& primitives) const {
+    // orderedPrimitives hold pointers, the file stores where they came from in primitives
+    const int firstShape = primitives.empty() ? 0 : primitives[0].shapeIdx;
+    std::vector<int32_t> order(bvh.orderedPrimitives.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        const Primitive& prim = bvh.orderedPrimitives[i];
+        const int idx = prim.shapeIdx - firstShape;
+        if (idx < 0 || idx >= static_cast<int>(primitives.size()) ||
+            primitives[idx].type != prim.type || primitives[idx].shapeIdx != prim.shapeIdx) {
+            std::cerr << "BVHCache: primitives are not consecutive shapes, not saved" << std::endl;
+            return;
+        }
+        order[i] = idx;
+    }
+
+    BVHCacheHeader header = {};
+    std::memcpy(header.magic, "BVHC", 4);
+    header.version = CacheVersion;
+    header.key = key;
+    header.nodeSize = sizeof(BVHNode);
+    header.nNodes = static_cast<uint32_t>(bvh.nodes.size());
+    header.nPrimitives = static_cast<uint32_t>(order.size());
+    header.height = bvh.height;
+
+    makeDirectory(_directory);
+
+    // write next to the final file and rename, a crash never leaves a half written cache entry
+    const std::string filepath = getFilePath(key);
+    const std::string tempFilepath = filepath + ".tmp";
+    std::ofstream out(tempFilepath, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(bvh.nodes.data()), bvh.nodes.size() * sizeof(BVHNode));
+    out.write(reinterpret_cast<const char*>(order.data()), order.size() * sizeof(int32_t));
+    out.close();
+
+    if (!out) {
+        std::cerr << "BVHCache: write " << tempFilepath << " failure" << std::endl;
+        std::remove(tempFilepath.c_str());
+        return;
+    }
+
+    std::remove(filepath.c_str());
+    if (std::rename(tempFilepath.c_str(), filepath.c_str()) != 0) {
+        std::cerr << "BVHCache: rename " << tempFilepath << " failure" << std::endl;
+        std::remove(tempFilepath.c_str());
+    }
+}
+
+uint64_t BVHCache::hash(const void* data, size_t size, uint64_t seed) {
+    // murmur3 style mixing of 8 byte words, the tail is padded with zeros
+    auto rotl = [](uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    };
+    auto mix = [&](uint64_t k) {
+        k *= 0x87c37b91114253d5ull;
+        k = rotl(k, 31);
+        return k * 0x4cf5ad432745937full;
+    };
+
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint64_t h = seed ^ (size * 0x9e3779b97f4a7c15ull);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t k;
+        std::memcpy(&k, bytes + i, 8);
+        h ^= mix(k);
+        h = rotl(h, 27) * 5 + 0x52dce729;
+    }
+
+    if (i < size) {
+        uint64_t k = 0;
+        std::memcpy(&k, bytes + i, size - i);
+        h ^= mix(k);
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+std::string BVHCache::getFilePath(uint64_t key) const {
+    std::ostringstream name;
+    name << _directory << std::hex << std::setw(16) << std::setfill('0') << key << ".bvh";
+    return name.str();
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../base/vertex.h"
+#include "bvh.h"
+
+/*
+ * directory of BVHs built earlier, one file per key. A file holds the linear
+ * nodes and, for every leaf slot, the index of the primitive in the list the
+ * BVH was built from, so loading it is a memory map and two copies
+ */
+class BVHCache {
+public:
+    /* the directory is created when the first BVH is saved */
+    explicit BVHCache(const std::string& directory);
+
+    /*
+    *Summary: key of the BVH of a mesh, the mesh is hashed by content so a moved or renamed file still hits
+    *Parameters:
+    *     vertices: vertices of the mesh
+    *     indices : triangle indices of the mesh
+    *     options : build options, a different build gives a different key
+    *Return: the key
+    */
+    static uint64_t getMeshKey(
+        const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices,
+        const BVHBuildOptions& options);
+
+    /*
+    *Summary: load the BVH saved with the key
+    *Parameters:
+    *     key       : key of the BVH
+    *     primitives: the primitives the BVH is over, in the order they were in when it was saved
+    *     options   : build options of the restored BVH
+    *Return: the BVH, nullptr if there is no valid file for the key
+    */
+    std::unique_ptr<BVH> load(
+        uint64_t key, const std::vector<Primitive>& primitives, const BVHBuildOptions& options) const;
+
+    /*
+    *Summary: save the BVH under the key, failures are reported but not fatal
+    *Parameters:
+    *     key       : key of the BVH
+    *     bvh       : the BVH
+    *     primitives: the primitives the BVH was built from, their shapeIdx must be consecutive
+    */
+    void save(uint64_t key, const BVH& bvh, const std::vector<Primitive>& primitives) const;
+
+    /* 64 bit hash of a byte range, chained through seed */
+    static uint64_t hash(const void* data, size_t size, uint64_t seed);
+
+private:
+    std::string _directory;
+
+    std::string getFilePath(uint64_t key) const;
+};
@@ -0,0 +1,655 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+
+#include <glm/ext.hpp>
+#include <stb_image_write.h>
+
+#include "../base/mapped_file.h"
+#include "bvh_cache.h"
+#include "cpu_renderer.h"
+#include "sampling.h"
+
+static constexpr float RayOffset = 1e-4f;
+
+// bump when the layout of the checkpoints changes, old files then stop matching
+static constexpr uint32_t CheckpointVersion = 1;
+
+struct CheckpointHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    int32_t width;
+    int32_t height;
+    uint32_t sampleCount;
+    uint32_t pixelSize;     // bytes of the arrays below per pixel
+    uint64_t rays;
+    uint64_t samples;
+    double seconds;
+    uint8_t pad[8];
+};
+
+static_assert(sizeof(CheckpointHeader) == 64, "CheckpointHeader must stay 64 bytes");
+
+// the header is followed by an array of every per pixel state in this order
+static constexpr uint32_t CheckpointPixelSize =
+    sizeof(glm::vec3) + sizeof(PixelVariance) + sizeof(PixelFeatures) + sizeof(uint32_t);
+
+CPURenderer::CPURenderer(int width, int height, int nThreads, TileOrder tileOrder) :
+    _width(width), _height(height), _pool(new ThreadPool(nThreads)) {
+    _tileScheduler.reset(new TileScheduler(*_pool, _width, _height, TileSize, tileOrder));
+
+    const int pixelCount = _width * _height;
+    _accumulation.resize(pixelCount);
+    _variances.resize(pixelCount);
+    _features.resize(pixelCount);
+    _tileVersions.resize(_tileScheduler->getTileCount());
+    _tileBackups.resize(_tileScheduler->getTileCount());
+    reset();
+
+    // same seeds as the rngState textures of the GPU renderer
+    _rngs.reserve(pixelCount);
+    for (int i = 0; i < pixelCount; ++i) {
+        _rngs.push_back(RNG::createPixelStream(static_cast<uint32_t>(i)));
+    }
+}
+
+void CPURenderer::setScene(const Scene* scene, const EnvironmentMap* sky) {
+    _scene = scene;
+    _sky = sky;
+    reset();
+}
+
+void CPURenderer::setCamera(const Camera& camera) {
+    glm::mat4 cameraToScreen = camera.getProjectionMatrix();
+    glm::mat4 screenToRaster = glm::scale(glm::mat4(1.0f),
+        glm::vec3(float(_width) / 2.0f, float(_height) / 2.0f, 1.0f)) *
+        glm::translate(glm::mat4(1.0f), glm::vec3(1.0f, 1.0f, 0.0f));
+
+    _cameraToWorld = glm::inverse(camera.getViewMatrix());
+    _rasterToCamera = glm::inverse(cameraToScreen) * glm::inverse(screenToRaster);
+    reset();
+}
+
+void CPURenderer::setAdaptiveSampling(const AdaptiveSamplingOptions& options) {
+    _adaptiveSampling = options;
+}
+
+void CPURenderer::setLightSampling(bool enabled) {
+    _lightSampling = enabled;
+}
+
+float CPURenderer::getConvergedFraction() const {
+    size_t converged = 0;
+    for (const auto& variance : _variances) {
+        if (variance.isConverged(_adaptiveSampling)) {
+            ++converged;
+        }
+    }
+
+    return _variances.empty() ? 0.0f : static_cast<float>(converged) / _variances.size();
+}
+
+void CPURenderer::reset() {
+    clearAccumulation();
+    _cancelled = false;
+}
+
+void CPURenderer::clearAccumulation() {
+    std::fill(_accumulation.begin(), _accumulation.end(), glm::vec3(0.0f));
+    std::fill(_variances.begin(), _variances.end(), PixelVariance());
+    std::fill(_features.begin(), _features.end(), PixelFeatures());
+    _sampleCount = 0;
+
+    // versions only count up, a tile never takes one it was written with before
+    for (auto& version : _tileVersions) {
+        ++version;
+    }
+}
+
+int CPURenderer::getTileIndex(const Tile& tile) const {
+    const int nTilesX = (_width + TileSize - 1) / TileSize;
+    return tile.y0 / TileSize * nTilesX + tile.x0 / TileSize;
+}
+
+void CPURenderer::backupTile(const Tile& tile) {
+    const int tileWidth = tile.x1 - tile.x0;
+    const size_t tilePixels = static_cast<size_t>(tileWidth) * (tile.y1 - tile.y0);
+    std::unique_ptr<TileBackup>& backup = _tileBackups[getTileIndex(tile)];
+    backup.reset(new TileBackup);
+    backup->accumulation.resize(tilePixels);
+    backup->variances.resize(tilePixels);
+    backup->features.resize(tilePixels);
+    backup->rngs.resize(tilePixels);
+    for (int y = tile.y0; y < tile.y1; ++y) {
+        const int begin = y * _width + tile.x0;
+        const int end = y * _width + tile.x1;
+        const size_t row = static_cast<size_t>(y - tile.y0) * tileWidth;
+        std::copy(_accumulation.begin() + begin, _accumulation.begin() + end, backup->accumulation.begin() + row);
+        std::copy(_variances.begin() + begin, _variances.begin() + end, backup->variances.begin() + row);
+        std::copy(_features.begin() + begin, _features.begin() + end, backup->features.begin() + row);
+        std::copy(_rngs.begin() + begin, _rngs.begin() + end, backup->rngs.begin() + row);
+    }
+}
+
+void CPURenderer::restoreTile(const Tile& tile) {
+    const int tileWidth = tile.x1 - tile.x0;
+    const TileBackup& backup = *_tileBackups[getTileIndex(tile)];
+    for (int y = tile.y0; y < tile.y1; ++y) {
+        const int begin = y * _width + tile.x0;
+        const size_t row = static_cast<size_t>(y - tile.y0) * tileWidth;
+        std::copy(backup.accumulation.begin() + row, backup.accumulation.begin() + row + tileWidth, _accumulation.begin() + begin);
+        std::copy(backup.variances.begin() + row, backup.variances.begin() + row + tileWidth, _variances.begin() + begin);
+        std::copy(backup.features.begin() + row, backup.features.begin() + row + tileWidth, _features.begin() + begin);
+        std::copy(backup.rngs.begin() + row, backup.rngs.begin() + row + tileWidth, _rngs.begin() + begin);
+    }
+}
+
+void CPURenderer::cancel() {
+    _cancelled = true;
+}
+
+bool CPURenderer::renderSample() {
+    if (_scene == nullptr || _sky == nullptr) {
+        throw std::runtime_error("CPURenderer: no scene to render");
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    std::atomic<uint64_t> rays{ 0 };
+    std::atomic<uint64_t> samples{ 0 };
+    const bool completed = _tileScheduler->run([&](const Tile& tile) {
+        // a tile is rendered by one thread per pass, its backup is its own
+        backupTile(tile);
+
+        uint64_t localRays = 0;
+        uint64_t localSamples = 0;
+        renderTile(tile, &localRays, &localSamples);
+        if (localSamples > 0) {
+            ++_tileVersions[getTileIndex(tile)];
+        }
+        rays.fetch_add(localRays);
+        samples.fetch_add(localSamples);
+    }, _cancelled);
+
+    auto end = std::chrono::high_resolution_clock::now();
+    _statistics.rays += rays.load();
+    _statistics.seconds += std::chrono::duration<double>(end - start).count();
+
+    if (!completed) {
+        // part of the tiles got one sample more than the others, put them back as the
+        // previous pass left them. Versions only count up, so restored tiles take new ones
+        for (const Tile& tile : _tileScheduler->getTiles()) {
+            const int tileIndex = getTileIndex(tile);
+            if (_tileBackups[tileIndex]) {
+                restoreTile(tile);
+                ++_tileVersions[tileIndex];
+            }
+        }
+    }
+
+    for (auto& backup : _tileBackups) {
+        backup.reset();
+    }
+
+    if (!completed) {
+        return false;
+    }
+
+    ++_sampleCount;
+    _statistics.samples += samples.load();
+
+    return true;
+}
+
+void CPURenderer::renderTile(const Tile& tile, uint64_t* rays, uint64_t* samples) {
+    // every pixel takes as many samples as its error asks for, converged ones none
+    std::vector<int> pixels;
+    std::vector<int> budgets;
+    int maxBudget = 0;
+    for (int y = tile.y0; y < tile.y1; ++y) {
+        for (int x = tile.x0; x < tile.x1; ++x) {
+            const int idx = y * _width + x;
+            const PixelVariance& variance = _variances[idx];
+            const int budget = variance.isConverged(_adaptiveSampling) ?
+                0 : getSampleBudget(variance.getRelativeError(), variance.n, _adaptiveSampling);
+            if (budget > 0) {
+                pixels.push_back(idx);
+                budgets.push_back(budget);
+                maxBudget = std::max(maxBudget, budget);
+            }
+        }
+    }
+
+    std::vector<Ray> cameraRays(pixels.size());
+    std::vector<Interaction> isects(pixels.size());
+    std::unique_ptr<bool[]> hits(new bool[pixels.size()]);
+    for (int s = 0; s < maxBudget; ++s) {
+        // pixels whose budget is used up drop out, the rest keep their order
+        int count = 0;
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            if (budgets[i] > s) {
+                pixels[count] = pixels[i];
+                budgets[count] = budgets[i];
+                ++count;
+            }
+        }
+
+        // the camera rays of a tile are coherent, they are traced together in packets
+        for (int i = 0; i < count; ++i) {
+            const int idx = pixels[i];
+            cameraRays[i] = generateRay(idx % _width, idx / _width, _rngs[idx].get2D());
+            isects[i] = Interaction();
+        }
+
+        _scene->intersect(cameraRays.data(), count, isects.data(), hits.get());
+        *rays += count;
+        *samples += count;
+
+        for (int i = 0; i < count; ++i) {
+            const int idx = pixels[i];
+            _features[idx].add(getFeatures(cameraRays[i], hits[i], isects[i]));
+            glm::vec3 color = trace(cameraRays[i], hits[i], isects[i], _rngs[idx], rays);
+            if (!std::isfinite(color.x) || !std::isfinite(color.y) || !std::isfinite(color.z)) {
+                color = glm::vec3(0.0f);
+            }
+
+            _accumulation[idx] += color;
+            _variances[idx].add(color);
+        }
+
+        pixels.resize(count);
+        budgets.resize(count);
+    }
+}
+
+Ray CPURenderer::generateRay(int x, int y, const glm::vec2& u) const {
+    glm::vec4 pixelPos = glm::vec4(x + u.x, y + u.y, 0.0f, 1.0f);
+    glm::vec3 o = glm::vec3(_cameraToWorld * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+    glm::vec3 localRayDir = glm::vec3(_rasterToCamera * pixelPos);
+    glm::vec3 dir = glm::normalize(glm::vec3(_cameraToWorld * glm::vec4(localRayDir, 0.0f)));
+    return Ray(o, dir);
+}
+
+glm::vec3 CPURenderer::trace(Ray ray, bool hit, Interaction isect, RNG& rng, uint64_t* rays) const {
+    // light reaching a diffuse hit is sampled there and found again by the bounce,
+    // both are weighted by MIS so it counts once
+    const float lightSelectPdf = getLightSelectPdf();
+    glm::vec3 radiance(0.0f);
+    glm::vec3 throughput(1.0f);
+    glm::vec3 lastPosition(0.0f);
+    float bsdfPdf = 0.0f;   // of the last bounce, 0 for camera rays and specular bounces
+    for (int depth = 0; depth < MaxTraceDepth; ++depth) {
+        if (depth > 0) {
+            *rays += 1;
+            isect = Interaction();
+            hit = _scene->intersect(ray, isect);
+        }
+
+        if (!hit) {
+            float weight = 1.0f;
+            if (bsdfPdf > 0.0f && lightSelectPdf > 0.0f && _sky->hasDistribution()) {
+                weight = powerHeuristic(bsdfPdf, lightSelectPdf * _sky->getPdf(ray.dir));
+            }
+
+            return radiance + weight * throughput * _sky->lookup(ray.dir);
+        }
+
+        if (isect.material.type == Material::Type::Emissive) {
+            // emitters shine from their front side and absorb what hits them
+            if (glm::dot(ray.dir, isect.hitPoint.normal) < 0.0f) {
+                float weight = 1.0f;
+                if (bsdfPdf > 0.0f && lightSelectPdf > 0.0f && isect.primitive.type == Primitive::Type::Sphere) {
+                    weight = powerHeuristic(bsdfPdf,
+                        lightSelectPdf * getSphereLightPdf(*isect.primitive.sphere, lastPosition));
+                }
+
+                radiance += weight * throughput * isect.material.albedo;
+            }
+
+            return radiance;
+        }
+
+        if (isect.material.type == Material::Type::Lambertian && lightSelectPdf > 0.0f) {
+            radiance += throughput * sampleDirectLight(ray, isect, rng, rays);
+        }
+
+        lastPosition = isect.hitPoint.position;
+        bsdfPdf = 0.0f;
+
+        switch (isect.material.type) {
+        case Material::Type::Lambertian:
+            if (!lambertianScatter(ray, isect, rng)) {
+                return radiance;
+            }
+            bsdfPdf = std::abs(glm::dot(ray.dir, isect.hitPoint.normal)) / Pi;
+            break;
+        case Material::Type::Metal:
+            if (!metalScatter(ray, isect, rng)) {
+                return radiance;
+            }
+            break;
+        case Material::Type::Dielectric:
+            dielectricScatter(ray, isect, rng);
+            break;
+        case Material::Type::Emissive:
+            break;
+        }
+
+        throughput *= isect.material.albedo;
+    }
+
+    return radiance;
+}
+
+PixelFeatures CPURenderer::getFeatures(const Ray& ray, bool hit, const Interaction& isect) {
+    PixelFeatures features;
+    if (!hit) {
+        features.albedo = glm::vec3(1.0f);
+        features.normal = -ray.dir;
+        features.depth = PixelFeatures::SkyDepth;
+        return features;
+    }
+
+    const glm::vec3& n = isect.hitPoint.normal;
+    features.albedo = isect.material.type == Material::Type::Emissive ? glm::vec3(1.0f) : isect.material.albedo;
+    features.normal = glm::dot(n, ray.dir) > 0.0f ? -n : n;
+    features.depth = ray.tMax;
+    return features;
+}
+
+glm::vec3 CPURenderer::sampleDirectLight(const Ray& ray, const Interaction& isect, RNG& rng, uint64_t* rays) const {
+    glm::vec3 n = isect.hitPoint.normal;
+    if (glm::dot(n, ray.dir) > 0.0f) {
+        n = -n;
+    }
+
+    const glm::vec3& p = isect.hitPoint.position;
+    const int nLights = static_cast<int>(_scene->lights.size());
+    const int nChoices = nLights + (_sky->hasDistribution() ? 1 : 0);
+    const int choice = std::min(static_cast<int>(rng.getFloat() * nChoices), nChoices - 1);
+    const glm::vec2 u = rng.get2D();
+
+    glm::vec3 dir;
+    glm::vec3 emission;
+    float lightPdf = 0.0f;
+    float tMax = std::numeric_limits<float>::max();
+    if (choice < nLights) {
+        // directions in the cone the sphere covers, seen from p
+        const int sphere = _scene->lights[choice];
+        const Sphere& light = _scene->spheres[sphere];
+        const glm::vec3 toCenter = light.position - p;
+        const float d2 = glm::dot(toCenter, toCenter);
+        const float r2 = light.radius * light.radius;
+        if (d2 <= r2) {
+            return glm::vec3(0.0f);
+        }
+
+        const float sin2Max = r2 / d2;
+        const float oneMinusCosMax = sin2Max / (1.0f + std::sqrt(std::max(0.0f, 1.0f - sin2Max)));
+        dir = glm::normalize(toWorld(createLocalCoord(toCenter), uniformSampleCone(u, oneMinusCosMax)));
+        lightPdf = uniformConePdf(oneMinusCosMax);
+
+        // the near side of the sphere, a grazing direction that misses it stops at the tangent
+        const float b = glm::dot(dir, toCenter);
+        tMax = b - std::sqrt(std::max(0.0f, b * b - (d2 - r2)));
+        emission = _scene->materials[_scene->getSphereMaterial(sphere)].albedo;
+    } else {
+        dir = _sky->sample(u, &lightPdf);
+        emission = _sky->lookup(dir);
+    }
+
+    const float cosTheta = glm::dot(n, dir);
+    if (cosTheta <= 0.0f || lightPdf <= 0.0f) {
+        return glm::vec3(0.0f);
+    }
+
+    // stop short of the light, it would block its own shadow ray
+    *rays += 1;
+    if (_scene->occluded(spawnRay(p, n, dir), tMax * (1.0f - 1e-3f))) {
+        return glm::vec3(0.0f);
+    }
+
+    const float selectPdf = 1.0f / nChoices;
+    const float weight = powerHeuristic(selectPdf * lightPdf, cosTheta / Pi);
+    return isect.material.albedo / Pi * emission * (cosTheta * weight / (selectPdf * lightPdf));
+}
+
+float CPURenderer::getLightSelectPdf() const {
+    const size_t nChoices = _scene->lights.size() + (_sky->hasDistribution() ? 1 : 0);
+    return _lightSampling && nChoices > 0 ? 1.0f / nChoices : 0.0f;
+}
+
+float CPURenderer::getSphereLightPdf(const Sphere& sphere, const glm::vec3& p) {
+    const glm::vec3 toCenter = sphere.position - p;
+    const float d2 = glm::dot(toCenter, toCenter);
+    const float r2 = sphere.radius * sphere.radius;
+    if (d2 <= r2) {
+        return 0.0f;
+    }
+
+    const float sin2Max = r2 / d2;
+    return uniformConePdf(sin2Max / (1.0f + std::sqrt(std::max(0.0f, 1.0f - sin2Max))));
+}
+
+bool CPURenderer::lambertianScatter(Ray& ray, const Interaction& isect, RNG& rng) const {
+    glm::vec3 n = isect.hitPoint.normal;
+    if (glm::dot(n, ray.dir) > 0.0f) {
+        n = -n;
+    }
+
+    glm::vec3 dir = toWorld(createLocalCoord(n), cosineWeightedSampleHemiSphere(rng.get2D()));
+    ray = spawnRay(isect.hitPoint.position, n, dir);
+    return true;
+}
+
+bool CPURenderer::metalScatter(Ray& ray, const Interaction& isect, RNG& rng) const {
+    glm::vec3 n = isect.hitPoint.normal;
+    if (glm::dot(n, ray.dir) > 0.0f) {
+        n = -n;
+    }
+
+    glm::vec3 dir = glm::reflect(ray.dir, n) +
+        isect.material.fuzz * uniformSampleSphere(rng.get2D());
+    if (glm::dot(dir, n) <= 0.0f) {
+        return false;
+    }
+
+    ray = spawnRay(isect.hitPoint.position, n, glm::normalize(dir));
+    return true;
+}
+
+void CPURenderer::dielectricScatter(Ray& ray, const Interaction& isect, RNG& rng) const {
+    const bool frontFace = glm::dot(ray.dir, isect.hitPoint.normal) < 0.0f;
+    const glm::vec3 n = frontFace ? isect.hitPoint.normal : -isect.hitPoint.normal;
+    const float eta = frontFace ? 1.0f / isect.material.ior : isect.material.ior;
+
+    float cosTheta = std::min(glm::dot(-ray.dir, n), 1.0f);
+    float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+
+    glm::vec3 dir;
+    if (eta * sinTheta > 1.0f ||
+        fresnelSchlick(cosTheta, isect.material.ior) > rng.getFloat()) {
+        dir = glm::reflect(ray.dir, n);
+    } else {
+        dir = glm::refract(ray.dir, n, eta);
+    }
+
+    ray = spawnRay(isect.hitPoint.position, n, glm::normalize(dir));
+}
+
+Ray CPURenderer::spawnRay(const glm::vec3& p, const glm::vec3& n, glm::vec3 dir) {
+    glm::vec3 offset = glm::dot(dir, n) > 0.0f ? RayOffset * n : -RayOffset * n;
+    return Ray(p + offset, dir);
+}
+
+void CPURenderer::getImage(std::vector<glm::vec3>& image) const {
+    image.resize(_accumulation.size());
+    for (size_t i = 0; i < _accumulation.size(); ++i) {
+        // pixels have different sample counts with adaptive sampling
+        const uint32_t n = _variances[i].n;
+        image[i] = _accumulation[i] * (n > 0 ? 1.0f / n : 0.0f);
+    }
+}
+
+void CPURenderer::getDenoisedImage(std::vector<glm::vec3>& image, const DenoiseOptions& options) const {
+    getImage(image);
+    denoise(image, _features, _variances, _width, _height, options, *_pool, image);
+}
+
+void CPURenderer::writeImage(const std::string& filepath) const {
+    std::vector<glm::vec3> image;
+    getImage(image);
+    writeImage(filepath, image);
+}
+
+void CPURenderer::writeImage(const std::string& filepath, const std::vector<glm::vec3>& image) const {
+    // png rows go top-down
+    std::vector<unsigned char> pixels(static_cast<size_t>(_width) * _height * 3);
+    for (int y = 0; y < _height; ++y) {
+        for (int x = 0; x < _width; ++x) {
+            glm::vec3 color = glm::clamp(gammaCorrection(image[y * _width + x]), 0.0f, 1.0f);
+            unsigned char* pixel = &pixels[(static_cast<size_t>(_height - 1 - y) * _width + x) * 3];
+            pixel[0] = static_cast<unsigned char>(color.r * 255.0f + 0.5f);
+            pixel[1] = static_cast<unsigned char>(color.g * 255.0f + 0.5f);
+            pixel[2] = static_cast<unsigned char>(color.b * 255.0f + 0.5f);
+        }
+    }
+
+    if (!stbi_write_png(filepath.c_str(), _width, _height, 3, pixels.data(), _width * 3)) {
+        throw std::runtime_error("write " + filepath + " failure");
+    }
+}
+
+int CPURenderer::writeTiles(TiledImageWriter& writer) const {
+    const std::vector<Tile>& tiles = _tileScheduler->getTiles();
+    std::atomic<int> nWritten{ 0 };
+    _pool->parallelFor(0, static_cast<int>(tiles.size()), 1, [&](int begin, int end) {
+        std::vector<glm::vec3> pixels(TileSize * TileSize);
+        for (int i = begin; i < end; ++i) {
+            const Tile& tile = tiles[i];
+            const uint64_t version = _tileVersions[getTileIndex(tile)];
+            if (writer.isTileCurrent(tile, version)) {
+                continue;
+            }
+
+            const int tileWidth = tile.x1 - tile.x0;
+            for (int y = tile.y0; y < tile.y1; ++y) {
+                for (int x = tile.x0; x < tile.x1; ++x) {
+                    const int idx = y * _width + x;
+                    const uint32_t n = _variances[idx].n;
+                    pixels[(y - tile.y0) * tileWidth + x - tile.x0] = _accumulation[idx] * (n > 0 ? 1.0f / n : 0.0f);
+                }
+            }
+
+            writer.writeTile(tile, version, pixels.data(), tileWidth);
+            ++nWritten;
+        }
+    });
+
+    writer.flush();
+    return nWritten.load();
+}
+
+uint64_t CPURenderer::getCheckpointKey(uint64_t key) const {
+    const uint32_t lightSampling = _lightSampling ? 1u : 0u;
+    key = BVHCache::hash(&_cameraToWorld, sizeof(_cameraToWorld), key);
+    key = BVHCache::hash(&_rasterToCamera, sizeof(_rasterToCamera), key);
+    return BVHCache::hash(&lightSampling, sizeof(lightSampling), key);
+}
+
+void CPURenderer::saveCheckpoint(const std::string& filepath, uint64_t key) const {
+    CheckpointHeader header = {};
+    std::memcpy(header.magic, "CKPT", 4);
+    header.version = CheckpointVersion;
+    header.key = getCheckpointKey(key);
+    header.width = _width;
+    header.height = _height;
+    header.sampleCount = _sampleCount;
+    header.pixelSize = CheckpointPixelSize;
+    header.rays = _statistics.rays;
+    header.samples = _statistics.samples;
+    header.seconds = _statistics.seconds;
+
+    std::vector<uint32_t> rngStates(_rngs.size());
+    for (size_t i = 0; i < _rngs.size(); ++i) {
+        rngStates[i] = _rngs[i].getState();
+    }
+
+    // write next to the final file and rename, a crash while saving keeps the last checkpoint
+    const std::string tempFilepath = filepath + ".tmp";
+    std::ofstream out(tempFilepath, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(_accumulation.data()), _accumulation.size() * sizeof(glm::vec3));
+    out.write(reinterpret_cast<const char*>(_variances.data()), _variances.size() * sizeof(PixelVariance));
+    out.write(reinterpret_cast<const char*>(_features.data()), _features.size() * sizeof(PixelFeatures));
+    out.write(reinterpret_cast<const char*>(rngStates.data()), rngStates.size() * sizeof(uint32_t));
+    out.close();
+
+    if (!out) {
+        std::remove(tempFilepath.c_str());
+        throw std::runtime_error("write " + tempFilepath + " failure");
+    }
+
+    std::remove(filepath.c_str());
+    if (std::rename(tempFilepath.c_str(), filepath.c_str()) != 0) {
+        std::remove(tempFilepath.c_str());
+        throw std::runtime_error("rename " + tempFilepath + " failure");
+    }
+}
+
+bool CPURenderer::loadCheckpoint(const std::string& filepath, uint64_t key) {
+    std::unique_ptr<MappedFile> file;
+    try {
+        file.reset(new MappedFile(filepath));
+    } catch (const std::runtime_error&) {
+        // no checkpoint yet
+        return false;
+    }
+
+    if (file->getSize() < sizeof(CheckpointHeader)) {
+        return false;
+    }
+
+    CheckpointHeader header;
+    std::memcpy(&header, file->getData(), sizeof(CheckpointHeader));
+    const size_t pixelCount = _accumulation.size();
+    if (std::memcmp(header.magic, "CKPT", 4) != 0 ||
+        header.version != CheckpointVersion ||
+        header.key != getCheckpointKey(key) ||
+        header.width != _width ||
+        header.height != _height ||
+        header.pixelSize != CheckpointPixelSize ||
+        file->getSize() != sizeof(CheckpointHeader) + pixelCount * CheckpointPixelSize) {
+        return false;
+    }
+
+    const uint8_t* data = file->getData() + sizeof(CheckpointHeader);
+    std::memcpy(_accumulation.data(), data, pixelCount * sizeof(glm::vec3));
+    data += pixelCount * sizeof(glm::vec3);
+    std::memcpy(_variances.data(), data, pixelCount * sizeof(PixelVariance));
+    data += pixelCount * sizeof(PixelVariance);
+    std::memcpy(_features.data(), data, pixelCount * sizeof(PixelFeatures));
+    data += pixelCount * sizeof(PixelFeatures);
+    for (size_t i = 0; i < pixelCount; ++i) {
+        uint32_t state;
+        std::memcpy(&state, data + i * sizeof(uint32_t), sizeof(uint32_t));
+        _rngs[i] = RNG(state);
+    }
+
+    _sampleCount = header.sampleCount;
+    _statistics.rays = header.rays;
+    _statistics.samples = header.samples;
+    _statistics.seconds = header.seconds;
+
+    for (auto& version : _tileVersions) {
+        ++version;
+    }
+
+    return true;
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "../base/camera.h"
+#include "adaptive_sampling.h"
+#include "denoiser.h"
+#include "environment_map.h"
+#include "image_writer.h"
+#include "random.h"
+#include "scene.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
+
+struct RenderStatistics {
+public:
+    uint64_t rays = 0;          // camera rays, bounces and shadow rays
+    uint64_t samples = 0;       // pixel samples
+    double seconds = 0.0;       // time spent in renderSample
+
+public:
+    double getRaysPerSecond() const {
+        return seconds > 0.0 ? rays / seconds : 0.0;
+    }
+
+    double getSamplesPerSecond() const {
+        return seconds > 0.0 ? samples / seconds : 0.0;
+    }
+};
+
+/*
+ * path tracer running on the CPU, it traces the same scenes with the same
+ * scatter model as raytracing.frag and accumulates one sample per pixel per pass
+ */
+class CPURenderer {
+public:
+    static constexpr int TileSize = 16;
+    static constexpr int MaxTraceDepth = 16;
+
+public:
+    /* nThreads <= 0 uses all hardware threads */
+    CPURenderer(int width, int height, int nThreads = 0, TileOrder tileOrder = TileOrder::Hilbert);
+
+    void setScene(const Scene* scene, const EnvironmentMap* sky);
+
+    void setCamera(const Camera& camera);
+
+    /* the accumulated samples are kept, converged pixels are skipped from the next pass on */
+    void setAdaptiveSampling(const AdaptiveSamplingOptions& options);
+
+    const AdaptiveSamplingOptions& getAdaptiveSampling() const {
+        return _adaptiveSampling;
+    }
+
+    /*
+    *Summary: sample the emissive spheres and the sky at diffuse hits and weight them against the
+    *         bounces by MIS, off only follows the bounces. The accumulated samples are kept
+    */
+    void setLightSampling(bool enabled);
+
+    bool getLightSampling() const {
+        return _lightSampling;
+    }
+
+    /* fraction of the pixels adaptive sampling considers converged */
+    float getConvergedFraction() const;
+
+    /* drop the accumulated samples, e.g. after the camera moved, and clear a pending cancel */
+    void reset();
+
+    /*
+    *Summary: trace one sample for every pixel, tiles are rendered in parallel. With adaptive
+    *         sampling converged pixels are skipped and noisy pixels take several samples
+    *Return: false if the pass was cancelled, the tiles it reached are rolled back to the
+    *        previous pass then and the accumulated passes are kept
+    */
+    bool renderSample();
+
+    /*
+    *Summary: make the running and following passes return early until the next reset,
+    *         safe to call from any thread
+    */
+    void cancel();
+
+    uint32_t getSampleCount() const {
+        return _sampleCount;
+    }
+
+    const RenderStatistics& getStatistics() const {
+        return _statistics;
+    }
+
+    /* average of the accumulated samples in linear space, rows are bottom-up like a texture */
+    void getImage(std::vector<glm::vec3>& image) const;
+
+    /*
+    *Summary: getImage filtered by the denoiser, guided by what the camera rays hit first.
+    *         The tiles are filtered on the render threads
+    *Parameters:
+    *     image  : receives the filtered image in linear space
+    *     options: the filter options, options.enabled is ignored
+    */
+    void getDenoisedImage(std::vector<glm::vec3>& image, const DenoiseOptions& options) const;
+
+    /* write the gamma corrected image as png */
+    void writeImage(const std::string& filepath) const;
+
+    /* write an image of getImage or getDenoisedImage as png */
+    void writeImage(const std::string& filepath, const std::vector<glm::vec3>& image) const;
+
+    /*
+    *Summary: write the average of the tiles that took samples since the writer last got them,
+    *         tiles whose pixels all converged are written once. No image of the whole frame is made
+    *Parameters:
+    *     writer: writer of TileSize tiles with the size of the renderer
+    *Return: number of tiles written
+    */
+    int writeTiles(TiledImageWriter& writer) const;
+
+    /*
+    *Summary: save the accumulation, the random streams and the statistics so a killed render can
+    *         resume from them. The file is replaced only once the new one is complete
+    *Parameters:
+    *     filepath: the checkpoint file
+    *     key     : identifies the scene, a checkpoint only resumes a render with the same key
+    */
+    void saveCheckpoint(const std::string& filepath, uint64_t key) const;
+
+    /*
+    *Summary: resume from a checkpoint of saveCheckpoint, after setScene and setCamera
+    *Parameters:
+    *     filepath: the checkpoint file
+    *     key     : the key it was saved with
+    *Return: false if there is no file or it was saved for another scene, camera or image size,
+    *        the accumulation is left as it is then
+    */
+    bool loadCheckpoint(const std::string& filepath, uint64_t key);
+
+private:
+    int _width;
+    int _height;
+
+    std::unique_ptr<ThreadPool> _pool;
+    std::unique_ptr<TileScheduler> _tileScheduler;
+    std::atomic<bool> _cancelled{ false };
+
+    const Scene* _scene = nullptr;
+    const EnvironmentMap* _sky = nullptr;
+
+    glm::mat4 _cameraToWorld = glm::mat4(1.0f);
+    glm::mat4 _rasterToCamera = glm::mat4(1.0f);
+
+    std::vector<glm::vec3> _accumulation;
+    std::vector<PixelVariance> _variances;      // also counts the samples of every pixel
+    std::vector<PixelFeatures> _features;       // sums over the samples, guide the denoiser
+    std::vector<RNG> _rngs;
+    uint32_t _sampleCount = 0;
+
+    // per tile of _tileScheduler, changes whenever the pixels of the tile do, see writeTiles
+    std::vector<uint64_t> _tileVersions;
+
+    // the pixels of a tile as they were before the running pass reached it, row by row
+    struct TileBackup {
+        std::vector<glm::vec3> accumulation;
+        std::vector<PixelVariance> variances;
+        std::vector<PixelFeatures> features;
+        std::vector<RNG> rngs;
+    };
+
+    // per tile of _tileScheduler, allocated when the running pass reaches the tile and released
+    // when the pass ends. A cancelled pass restores the tiles that have one
+    std::vector<std::unique_ptr<TileBackup>> _tileBackups;
+
+    AdaptiveSamplingOptions _adaptiveSampling;
+
+    bool _lightSampling = true;
+
+    RenderStatistics _statistics;
+
+    void renderTile(const Tile& tile, uint64_t* rays, uint64_t* samples);
+
+    void clearAccumulation();
+
+    /* copy the pixels of a tile between the accumulation and _tileBackups */
+    void backupTile(const Tile& tile);
+
+    void restoreTile(const Tile& tile);
+
+    int getTileIndex(const Tile& tile) const;
+
+    /* key of the checkpoints of this camera and these render options, chained through key */
+    uint64_t getCheckpointKey(uint64_t key) const;
+
+    Ray generateRay(int x, int y, const glm::vec2& u) const;
+
+    /*
+    *Summary: follow the path of a camera ray whose closest hit is already known
+    *Parameters:
+    *     ray  : the camera ray
+    *     hit  : whether the camera ray hit something
+    *     isect: the hit of the camera ray
+    *     rng  : random numbers of the pixel
+    *     rays : counts the bounce rays
+    *Return: radiance carried along the path
+    */
+    glm::vec3 trace(Ray ray, bool hit, Interaction isect, RNG& rng, uint64_t* rays) const;
+
+    /* the denoiser features of a camera ray whose closest hit is known */
+    static PixelFeatures getFeatures(const Ray& ray, bool hit, const Interaction& isect);
+
+    /*
+    *Summary: next event estimation at a diffuse hit, one light or the sky is picked uniformly
+    *         and a shadow ray is sent to a point sampled on it
+    *Parameters:
+    *     ray  : the ray that hit
+    *     isect: the diffuse hit
+    *     rng  : random numbers of the pixel
+    *     rays : counts the shadow ray
+    *Return: the light reflected towards the ray, MIS weighted against the bounce
+    */
+    glm::vec3 sampleDirectLight(const Ray& ray, const Interaction& isect, RNG& rng, uint64_t* rays) const;
+
+    /* probability of picking one of the lights or the sky, 0 without light sampling */
+    float getLightSelectPdf() const;
+
+    /* pdf w.r.t. solid angle of sampling the sphere from p, 0 from inside it */
+    static float getSphereLightPdf(const Sphere& sphere, const glm::vec3& p);
+
+    bool lambertianScatter(Ray& ray, const Interaction& isect, RNG& rng) const;
+
+    bool metalScatter(Ray& ray, const Interaction& isect, RNG& rng) const;
+
+    void dielectricScatter(Ray& ray, const Interaction& isect, RNG& rng) const;
+
+    /* start a scattered ray just off the surface, on the side it leaves through */
+    static Ray spawnRay(const glm::vec3& p, const glm::vec3& n, glm::vec3 dir);
+};
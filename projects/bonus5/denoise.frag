@@ -0,0 +1,221 @@
+#version 330 core
+layout (location = 0) out vec4 fragColor;
+
+in vec2 screenTexCoord;
+
+// the a-trous filter of denoiser.cpp as fullscreen passes: a prepare pass, then one pass per
+// iteration, the last one writes the gamma corrected image
+
+const int PREPARE_PASS = 0;    // illumination and its variance from the accumulated frame
+const int FILTER_PASS = 1;     // one a-trous iteration on the illumination
+const int RESOLVE_PASS = 2;    // one a-trous iteration, modulated by the albedo again
+
+const float MinAlbedo = 1e-3f;
+
+uniform int pass;
+uniform int stepWidth;          // distance between the kernel taps of FILTER_PASS and RESOLVE_PASS
+
+uniform sampler2D frame;        // PREPARE_PASS: RTResult, else the illumination and variance of the last pass
+uniform sampler2D variance;     // sample count, mean and m2 of the luminance
+uniform sampler2D albedoDepth;
+uniform sampler2D normal;
+
+uniform float colorSigma;
+uniform float normalSigma;
+uniform float depthSigma;
+uniform float albedoSigma;
+
+/**
+ * Summary: the illumination of a pixel, its color divided by the albedo
+ * Parameters:
+ *     p: the pixel
+ * Return: the illumination in linear space
+ */
+vec3 getIllumination(ivec2 p);
+
+/**
+ * Summary: variance of the illumination luminance over the 3x3 pixels around p, for pixels of one sample
+ * Parameters:
+ *     p: the pixel
+ * Return: the variance
+ */
+float getSpatialVariance(ivec2 p);
+
+/**
+ * Summary: the variance of the last pass blurred by a 3x3 gaussian
+ * Parameters:
+ *     p: the pixel
+ * Return: the variance
+ */
+float getFilteredVariance(ivec2 p);
+
+/**
+ * Summary: the depth change to the closer of the two neighbours along each axis
+ * Parameters:
+ *     p: the pixel
+ * Return: the larger change of both axes
+ */
+float getDepthGradient(ivec2 p);
+
+vec4 filterPixel(ivec2 p);
+
+bool isInside(ivec2 p);
+
+float getLuminance(vec3 color);
+
+vec3 demodulate(vec3 color, vec3 albedo);
+
+vec3 modulate(vec3 illumination, vec3 albedo);
+
+void main() {
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    if (pass == PREPARE_PASS) {
+        vec4 stats = texelFetch(variance, p, 0);
+        vec3 albedo = texelFetch(albedoDepth, p, 0).rgb;
+        float illuminationVariance;
+        if (stats.x >= 2.0f) {
+            float albedoLuminance = max(getLuminance(albedo), MinAlbedo);
+            illuminationVariance = stats.z / (stats.x - 1.0f) / stats.x / (albedoLuminance * albedoLuminance);
+        } else {
+            illuminationVariance = getSpatialVariance(p);
+        }
+
+        fragColor = vec4(getIllumination(p), illuminationVariance);
+    } else if (pass == FILTER_PASS) {
+        fragColor = filterPixel(p);
+    } else {
+        vec3 illumination = filterPixel(p).rgb;
+        vec3 albedo = texelFetch(albedoDepth, p, 0).rgb;
+        fragColor = vec4(pow(modulate(illumination, albedo), vec3(1.0f / 2.2f)), 1.0f);
+    }
+}
+
+vec4 filterPixel(ivec2 p) {
+    // B3 spline, the 5 taps of the kernel from the center out
+    const float kernelWeights[3] = float[3](3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f);
+
+    vec4 center = texelFetch(frame, p, 0);
+    vec4 guide = texelFetch(albedoDepth, p, 0);
+    vec3 n = texelFetch(normal, p, 0).xyz;
+    n = length(n) > 0.0f ? normalize(n) : vec3(0.0f);
+    float luminance = getLuminance(center.rgb);
+    float colorScale = colorSigma * sqrt(getFilteredVariance(p)) + 1e-6f;
+    float depthScale = depthSigma * getDepthGradient(p) * float(stepWidth);
+    float depthEpsilon = 1e-3f * guide.w;
+    float albedoScale = albedoSigma * albedoSigma;
+
+    vec3 sum = vec3(0.0f);
+    float varianceSum = 0.0f;
+    float weightSum = 0.0f;
+    for (int dy = -2; dy <= 2; ++dy) {
+        for (int dx = -2; dx <= 2; ++dx) {
+            ivec2 q = p + ivec2(dx, dy) * stepWidth;
+            if (!isInside(q)) {
+                continue;
+            }
+
+            vec4 value = texelFetch(frame, q, 0);
+            float weight = kernelWeights[0] * kernelWeights[0];
+            if (q != p) {
+                vec4 other = texelFetch(albedoDepth, q, 0);
+                vec3 otherNormal = texelFetch(normal, q, 0).xyz;
+                otherNormal = length(otherNormal) > 0.0f ? normalize(otherNormal) : vec3(0.0f);
+                vec3 albedoDelta = guide.rgb - other.rgb;
+                float normalWeight = pow(max(0.0f, dot(n, otherNormal)), normalSigma);
+                float depthWeight = exp(-abs(guide.w - other.w) / (depthScale * length(vec2(dx, dy)) + depthEpsilon));
+                float colorWeight = exp(-abs(luminance - getLuminance(value.rgb)) / colorScale);
+                float albedoWeight = exp(-dot(albedoDelta, albedoDelta) / albedoScale);
+                weight = kernelWeights[abs(dx)] * kernelWeights[abs(dy)] *
+                    normalWeight * depthWeight * colorWeight * albedoWeight;
+            }
+
+            sum += weight * value.rgb;
+            varianceSum += weight * weight * value.w;
+            weightSum += weight;
+        }
+    }
+
+    // the variance of a weighted mean of independent pixels
+    return vec4(sum / weightSum, varianceSum / (weightSum * weightSum));
+}
+
+vec3 getIllumination(ivec2 p) {
+    vec3 color = pow(texelFetch(frame, p, 0).rgb, vec3(2.2f));
+    return demodulate(color, texelFetch(albedoDepth, p, 0).rgb);
+}
+
+float getSpatialVariance(ivec2 p) {
+    float sum = 0.0f;
+    float sum2 = 0.0f;
+    float n = 0.0f;
+    for (int dy = -1; dy <= 1; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+            ivec2 q = p + ivec2(dx, dy);
+            if (!isInside(q)) {
+                continue;
+            }
+
+            float l = getLuminance(getIllumination(q));
+            sum += l;
+            sum2 += l * l;
+            n += 1.0f;
+        }
+    }
+
+    float mean = sum / n;
+    return max(0.0f, sum2 / n - mean * mean);
+}
+
+float getFilteredVariance(ivec2 p) {
+    const float gaussian[2] = float[2](1.0f / 4.0f, 1.0f / 8.0f);
+    float sum = 0.0f;
+    float weightSum = 0.0f;
+    for (int dy = -1; dy <= 1; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+            ivec2 q = p + ivec2(dx, dy);
+            if (!isInside(q)) {
+                continue;
+            }
+
+            float weight = gaussian[abs(dx)] * gaussian[abs(dy)];
+            sum += weight * texelFetch(frame, q, 0).w;
+            weightSum += weight;
+        }
+    }
+
+    return sum / weightSum;
+}
+
+float getDepthGradient(ivec2 p) {
+    const float SkyDepth = 1e4f;
+    float depth = texelFetch(albedoDepth, p, 0).w;
+    float gradient[2] = float[2](SkyDepth, SkyDepth);
+    for (int axis = 0; axis < 2; ++axis) {
+        for (int side = -1; side <= 1; side += 2) {
+            ivec2 q = p;
+            q[axis] += side;
+            if (isInside(q)) {
+                gradient[axis] = min(gradient[axis], abs(texelFetch(albedoDepth, q, 0).w - depth));
+            }
+        }
+    }
+
+    return max(gradient[0], gradient[1]);
+}
+
+bool isInside(ivec2 p) {
+    ivec2 size = textureSize(albedoDepth, 0);
+    return p.x >= 0 && p.y >= 0 && p.x < size.x && p.y < size.y;
+}
+
+float getLuminance(vec3 color) {
+    return dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+vec3 demodulate(vec3 color, vec3 albedo) {
+    return mix(color, color / max(albedo, vec3(MinAlbedo)), greaterThan(albedo, vec3(MinAlbedo)));
+}
+
+vec3 modulate(vec3 illumination, vec3 albedo) {
+    return mix(illumination, illumination * albedo, greaterThan(albedo, vec3(MinAlbedo)));
+}
@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <cmath>
+
+#include "denoiser.h"
+
+// tiles are filtered in parallel, every pass writes a buffer the next one reads
+static constexpr int DenoiseTileSize = 32;
+
+// B3 spline, the 5 taps of the kernel from the center out
+static const float kernelWeights[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+// the albedo a channel is divided by at least, darker channels are left as they are
+static constexpr float MinAlbedo = 1e-3f;
+
+/* the features of a pixel and the gradient of its depth, ready for the filter */
+struct FilterGuide {
+    glm::vec3 albedo;
+    glm::vec3 normal;
+    float depth;
+    float depthGradient;    // largest depth change to a neighbour on the same surface
+};
+
+static glm::vec3 demodulate(const glm::vec3& color, const glm::vec3& albedo) {
+    return glm::vec3(
+        albedo.r > MinAlbedo ? color.r / albedo.r : color.r,
+        albedo.g > MinAlbedo ? color.g / albedo.g : color.g,
+        albedo.b > MinAlbedo ? color.b / albedo.b : color.b);
+}
+
+static glm::vec3 modulate(const glm::vec3& illumination, const glm::vec3& albedo) {
+    return glm::vec3(
+        albedo.r > MinAlbedo ? illumination.r * albedo.r : illumination.r,
+        albedo.g > MinAlbedo ? illumination.g * albedo.g : illumination.g,
+        albedo.b > MinAlbedo ? illumination.b * albedo.b : illumination.b);
+}
+
+/* run func(x0, y0, x1, y1) on the tiles of the image in parallel */
+template <typename TileFunc>
+static void parallelForTiles(ThreadPool& pool, int width, int height, const TileFunc& func) {
+    const int nTilesX = (width + DenoiseTileSize - 1) / DenoiseTileSize;
+    const int nTilesY = (height + DenoiseTileSize - 1) / DenoiseTileSize;
+    pool.parallelFor(0, nTilesX * nTilesY, 1, [&](int begin, int end) {
+        for (int tile = begin; tile < end; ++tile) {
+            const int x0 = tile % nTilesX * DenoiseTileSize;
+            const int y0 = tile / nTilesX * DenoiseTileSize;
+            func(x0, y0, std::min(x0 + DenoiseTileSize, width), std::min(y0 + DenoiseTileSize, height));
+        }
+    });
+}
+
+/* the depth change to the closer of the two neighbours along each axis, edges do not count */
+static float getDepthGradient(const std::vector<FilterGuide>& guides, int width, int height, int x, int y) {
+    const float depth = guides[y * width + x].depth;
+    auto axisGradient = [&](int x0, int y0, int x1, int y1) {
+        float gradient = PixelFeatures::SkyDepth;
+        if (x0 >= 0 && y0 >= 0) {
+            gradient = std::min(gradient, std::abs(guides[y0 * width + x0].depth - depth));
+        }
+        if (x1 < width && y1 < height) {
+            gradient = std::min(gradient, std::abs(guides[y1 * width + x1].depth - depth));
+        }
+        return gradient;
+    };
+
+    return std::max(axisGradient(x - 1, y, x + 1, y), axisGradient(x, y - 1, x, y + 1));
+}
+
+/* variance of the illumination luminance over the 3x3 pixels around (x, y), for pixels of one sample */
+static float getSpatialVariance(const std::vector<glm::vec4>& illumination, int width, int height, int x, int y) {
+    float sum = 0.0f;
+    float sum2 = 0.0f;
+    int n = 0;
+    for (int dy = -1; dy <= 1; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+            const int qx = x + dx;
+            const int qy = y + dy;
+            if (qx < 0 || qy < 0 || qx >= width || qy >= height) {
+                continue;
+            }
+
+            const float l = PixelVariance::getLuminance(glm::vec3(illumination[qy * width + qx]));
+            sum += l;
+            sum2 += l * l;
+            ++n;
+        }
+    }
+
+    const float mean = sum / n;
+    return std::max(0.0f, sum2 / n - mean * mean);
+}
+
+/* the variance of a pixel blurred by a 3x3 gaussian, a single estimate is too noisy to steer the weights */
+static float getFilteredVariance(const std::vector<glm::vec4>& src, int width, int height, int x, int y) {
+    static const float gaussian[2] = { 1.0f / 4.0f, 1.0f / 8.0f };
+    float sum = 0.0f;
+    float weightSum = 0.0f;
+    for (int dy = -1; dy <= 1; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+            const int qx = x + dx;
+            const int qy = y + dy;
+            if (qx < 0 || qy < 0 || qx >= width || qy >= height) {
+                continue;
+            }
+
+            const float weight = gaussian[std::abs(dx)] * gaussian[std::abs(dy)];
+            sum += weight * src[qy * width + qx].w;
+            weightSum += weight;
+        }
+    }
+
+    return sum / weightSum;
+}
+
+/*
+*Summary: one a-trous pass over the tile [x0, x1) x [y0, y1)
+*Parameters:
+*     src : illumination and the variance of its luminance of every pixel
+*     step: distance between the taps of the kernel
+*     dst : receives the filtered illumination and variance
+*/
+static void filterTile(const std::vector<glm::vec4>& src, const std::vector<FilterGuide>& guides,
+    int width, int height, int step, const DenoiseOptions& options,
+    int x0, int y0, int x1, int y1, std::vector<glm::vec4>& dst) {
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            const int p = y * width + x;
+            const FilterGuide& guide = guides[p];
+            const float luminance = PixelVariance::getLuminance(glm::vec3(src[p]));
+            const float colorScale = options.colorSigma * std::sqrt(getFilteredVariance(src, width, height, x, y)) + 1e-6f;
+            const float depthScale = options.depthSigma * guide.depthGradient * step;
+            const float depthEpsilon = 1e-3f * guide.depth;
+            const float albedoScale = options.albedoSigma * options.albedoSigma;
+
+            glm::vec3 sum(0.0f);
+            float varianceSum = 0.0f;
+            float weightSum = 0.0f;
+            for (int dy = -2; dy <= 2; ++dy) {
+                for (int dx = -2; dx <= 2; ++dx) {
+                    const int qx = x + dx * step;
+                    const int qy = y + dy * step;
+                    if (qx < 0 || qy < 0 || qx >= width || qy >= height) {
+                        continue;
+                    }
+
+                    const int q = qy * width + qx;
+                    const FilterGuide& other = guides[q];
+                    const glm::vec3 albedoDelta = guide.albedo - other.albedo;
+                    const float normalWeight = std::pow(std::max(0.0f, glm::dot(guide.normal, other.normal)), options.normalSigma);
+                    const float depthWeight = std::exp(-std::abs(guide.depth - other.depth) /
+                        (depthScale * std::sqrt(static_cast<float>(dx * dx + dy * dy)) + depthEpsilon));
+                    const float colorWeight = std::exp(-std::abs(luminance -
+                        PixelVariance::getLuminance(glm::vec3(src[q]))) / colorScale);
+                    const float albedoWeight = std::exp(-glm::dot(albedoDelta, albedoDelta) / albedoScale);
+                    const float weight = q == p ? kernelWeights[0] * kernelWeights[0] :
+                        kernelWeights[std::abs(dx)] * kernelWeights[std::abs(dy)] *
+                        normalWeight * depthWeight * colorWeight * albedoWeight;
+
+                    sum += weight * glm::vec3(src[q]);
+                    varianceSum += weight * weight * src[q].w;
+                    weightSum += weight;
+                }
+            }
+
+            // the variance of a weighted mean of independent pixels
+            dst[p] = glm::vec4(sum / weightSum, varianceSum / (weightSum * weightSum));
+        }
+    }
+}
+
+void denoise(const std::vector<glm::vec3>& image, const std::vector<PixelFeatures>& features,
+    const std::vector<PixelVariance>& variances, int width, int height, const DenoiseOptions& options,
+    ThreadPool& pool, std::vector<glm::vec3>& output) {
+    const size_t pixelCount = static_cast<size_t>(width) * height;
+    std::vector<FilterGuide> guides(pixelCount);
+    std::vector<glm::vec4> buffers[2];
+    buffers[0].resize(pixelCount);
+    buffers[1].resize(pixelCount);
+
+    // average features, pixels without samples are kept apart like the sky
+    parallelForTiles(pool, width, height, [&](int x0, int y0, int x1, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) {
+                const int p = y * width + x;
+                const uint32_t n = variances[p].n;
+                FilterGuide& guide = guides[p];
+                guide.albedo = n > 0 ? features[p].albedo / static_cast<float>(n) : glm::vec3(1.0f);
+                guide.normal = glm::length(features[p].normal) > 0.0f ? glm::normalize(features[p].normal) : glm::vec3(0.0f);
+                guide.depth = n > 0 ? features[p].depth / n : PixelFeatures::SkyDepth;
+                buffers[1][p] = glm::vec4(demodulate(image[p], guide.albedo), 0.0f);
+            }
+        }
+    });
+
+    // the variance of the mean illumination of every pixel, from the neighbours if there is one sample
+    parallelForTiles(pool, width, height, [&](int x0, int y0, int x1, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) {
+                const int p = y * width + x;
+                FilterGuide& guide = guides[p];
+                guide.depthGradient = getDepthGradient(guides, width, height, x, y);
+
+                const PixelVariance& variance = variances[p];
+                float illuminationVariance;
+                if (variance.n >= 2) {
+                    const float albedoLuminance = std::max(PixelVariance::getLuminance(guide.albedo), MinAlbedo);
+                    illuminationVariance = variance.m2 / (variance.n - 1) / variance.n /
+                        (albedoLuminance * albedoLuminance);
+                } else {
+                    illuminationVariance = getSpatialVariance(buffers[1], width, height, x, y);
+                }
+
+                buffers[0][p] = glm::vec4(glm::vec3(buffers[1][p]), illuminationVariance);
+            }
+        }
+    });
+
+    int current = 0;
+    for (int i = 0; i < options.iterations; ++i) {
+        const int step = 1 << i;
+        parallelForTiles(pool, width, height, [&](int x0, int y0, int x1, int y1) {
+            filterTile(buffers[current], guides, width, height, step, options, x0, y0, x1, y1, buffers[1 - current]);
+        });
+        current = 1 - current;
+    }
+
+    output.resize(pixelCount);
+    for (size_t p = 0; p < pixelCount; ++p) {
+        output[p] = modulate(glm::vec3(buffers[current][p]), guides[p].albedo);
+    }
+}
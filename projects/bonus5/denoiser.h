@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "adaptive_sampling.h"
+#include "thread_pool.h"
+
+// edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) with the variance guided color
+// weight of SVGF (Schied et al. 2017). denoise.frag runs the same filter as fullscreen passes
+
+struct DenoiseOptions {
+public:
+    bool enabled = false;
+    int iterations = 3;         // passes of the 5x5 kernel, pass i takes every 2^i-th pixel
+    float colorSigma = 4.0f;    // illumination differences in standard deviations of the noise
+    float normalSigma = 4.0f;   // exponent of the cosine between the normals, low enough for small spheres
+    float depthSigma = 2.0f;    // depth differences in steps of the local depth gradient
+    float albedoSigma = 0.5f;   // albedo differences, keeps materials apart
+};
+
+/* what the camera rays of a pixel hit first, the averages guide the filter */
+struct PixelFeatures {
+public:
+    glm::vec3 albedo = glm::vec3(0.0f);     // 1 for the sky and lights, they are not modulated
+    glm::vec3 normal = glm::vec3(0.0f);     // facing the camera, the ray direction for the sky
+    float depth = 0.0f;                     // distance to the hit, SkyDepth for the sky
+
+public:
+    // far beyond the scenes, a sky pixel never takes in a surface
+    static constexpr float SkyDepth = 1e4f;
+
+    void add(const PixelFeatures& rhs) {
+        albedo += rhs.albedo;
+        normal += rhs.normal;
+        depth += rhs.depth;
+    }
+};
+
+/*
+*Summary: filter the noise of a low sample count image. The illumination, the color divided by
+*         the albedo, is blurred between pixels of similar features and similar illumination
+*         w.r.t. its noise, then modulated by the albedo again. The tiles of every pass are
+*         filtered in parallel, the result does not depend on the thread count
+*Parameters:
+*     image    : average color of every pixel in linear space, rows bottom-up
+*     features : sums of the PixelFeatures of the samples of every pixel
+*     variances: luminance statistics of every pixel, the sample counts divide features
+*     width    : image width
+*     height   : image height
+*     options  : the filter options
+*     pool     : threads the tiles are filtered on
+*     output   : receives the filtered image, may be image
+*/
+void denoise(const std::vector<glm::vec3>& image, const std::vector<PixelFeatures>& features,
+    const std::vector<PixelVariance>& variances, int width, int height, const DenoiseOptions& options,
+    ThreadPool& pool, std::vector<glm::vec3>& output);
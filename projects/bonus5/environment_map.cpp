@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+
+#include <stb_image.h>
+
+#include "environment_map.h"
+
+EnvironmentMap::EnvironmentMap(const std::vector<std::string>& facePaths) {
+    assert(facePaths.size() == 6);
+
+    for (int i = 0; i < 6; ++i) {
+        // cubemap faces keep the first row at the top
+        stbi_set_flip_vertically_on_load(false);
+        int width = 0, height = 0, channels = 0;
+        unsigned char* data = stbi_load(facePaths[i].c_str(), &width, &height, &channels, 0);
+        if (data == nullptr) {
+            throw std::runtime_error("load " + facePaths[i] + " failure");
+        }
+
+        if (channels != 1 && channels != 3 && channels != 4) {
+            stbi_image_free(data);
+            throw std::runtime_error("unsupported format");
+        }
+
+        Face& face = _faces[i];
+        face.width = width;
+        face.height = height;
+        face.texels.resize(static_cast<size_t>(width) * height * 3);
+        for (size_t p = 0; p < static_cast<size_t>(width) * height; ++p) {
+            const unsigned char* texel = data + p * channels;
+            face.texels[3 * p + 0] = texel[0];
+            face.texels[3 * p + 1] = channels == 1 ? 0 : texel[1];
+            face.texels[3 * p + 2] = channels == 1 ? 0 : texel[2];
+        }
+
+        stbi_image_free(data);
+    }
+
+    buildDistribution();
+}
+
+glm::vec3 EnvironmentMap::lookup(const glm::vec3& dir) const {
+    float sc, tc;
+    const Face& face = _faces[getFaceCoord(dir, &sc, &tc)];
+    float s = 0.5f * (sc + 1.0f);
+    float t = 0.5f * (tc + 1.0f);
+    int x = std::min(std::max(static_cast<int>(s * face.width), 0), face.width - 1);
+    int y = std::min(std::max(static_cast<int>(t * face.height), 0), face.height - 1);
+
+    const uint8_t* texel = &face.texels[(static_cast<size_t>(y) * face.width + x) * 3];
+    return glm::vec3(texel[0], texel[1], texel[2]) / 255.0f;
+}
+
+glm::vec3 EnvironmentMap::sample(const glm::vec2& u, float* pdf) const {
+    // the cell by the cdf, then a uniform point in the cell on the face
+    const int nCells = static_cast<int>(_cdf.size()) - 1;
+    const float target = u.x * _cdf.back();
+    int cell = static_cast<int>(std::upper_bound(_cdf.begin(), _cdf.end(), target) - _cdf.begin()) - 1;
+    cell = std::min(std::max(cell, 0), nCells - 1);
+
+    const float cellPdf = (_cdf[cell + 1] - _cdf[cell]) / _cdf.back();
+    const float du = cellPdf > 0.0f ? (target - _cdf[cell]) / (_cdf[cell + 1] - _cdf[cell]) : 0.5f;
+
+    const int face = cell / (DistributionSize * DistributionSize);
+    const int x = cell % DistributionSize;
+    const int y = cell / DistributionSize % DistributionSize;
+    const float sc = 2.0f * (x + std::min(du, 0.99999994f)) / DistributionSize - 1.0f;
+    const float tc = 2.0f * (y + u.y) / DistributionSize - 1.0f;
+
+    // uniform on the face is not uniform in solid angle, the corners of the cube take less of it
+    const float r2 = 1.0f + sc * sc + tc * tc;
+    *pdf = cellPdf * DistributionSize * DistributionSize / 4.0f * r2 * std::sqrt(r2);
+
+    return glm::normalize(getDirection(face, sc, tc));
+}
+
+float EnvironmentMap::getPdf(const glm::vec3& dir) const {
+    float sc, tc;
+    const int face = getFaceCoord(dir, &sc, &tc);
+    int x = static_cast<int>(0.5f * (sc + 1.0f) * DistributionSize);
+    int y = static_cast<int>(0.5f * (tc + 1.0f) * DistributionSize);
+    x = std::min(std::max(x, 0), DistributionSize - 1);
+    y = std::min(std::max(y, 0), DistributionSize - 1);
+
+    const int cell = (face * DistributionSize + y) * DistributionSize + x;
+    const float cellPdf = (_cdf[cell + 1] - _cdf[cell]) / _cdf.back();
+    const float r2 = 1.0f + sc * sc + tc * tc;
+
+    return cellPdf * DistributionSize * DistributionSize / 4.0f * r2 * std::sqrt(r2);
+}
+
+void EnvironmentMap::buildDistribution() {
+    // a cell is weighted by its mean luminance and the solid angle it covers
+    auto solidAngle = [](float x, float y) {
+        return std::atan2(x * y, std::sqrt(x * x + y * y + 1.0f));
+    };
+
+    const int nCells = 6 * DistributionSize * DistributionSize;
+    _cdf.assign(nCells + 1, 0.0f);
+    for (int face = 0; face < 6; ++face) {
+        const Face& f = _faces[face];
+        for (int y = 0; y < DistributionSize; ++y) {
+            const int y0 = y * f.height / DistributionSize;
+            const int y1 = std::max((y + 1) * f.height / DistributionSize, y0 + 1);
+            for (int x = 0; x < DistributionSize; ++x) {
+                const int x0 = x * f.width / DistributionSize;
+                const int x1 = std::max((x + 1) * f.width / DistributionSize, x0 + 1);
+
+                double luminance = 0.0;
+                for (int ty = y0; ty < std::min(y1, f.height); ++ty) {
+                    for (int tx = x0; tx < std::min(x1, f.width); ++tx) {
+                        const uint8_t* texel = &f.texels[(static_cast<size_t>(ty) * f.width + tx) * 3];
+                        luminance += 0.2126 * texel[0] + 0.7152 * texel[1] + 0.0722 * texel[2];
+                    }
+                }
+                luminance /= 255.0 * std::max((x1 - x0) * (y1 - y0), 1);
+
+                const float sc0 = 2.0f * x / DistributionSize - 1.0f;
+                const float sc1 = 2.0f * (x + 1) / DistributionSize - 1.0f;
+                const float tc0 = 2.0f * y / DistributionSize - 1.0f;
+                const float tc1 = 2.0f * (y + 1) / DistributionSize - 1.0f;
+                const float omega = solidAngle(sc0, tc0) - solidAngle(sc0, tc1) -
+                    solidAngle(sc1, tc0) + solidAngle(sc1, tc1);
+
+                const int cell = (face * DistributionSize + y) * DistributionSize + x;
+                _cdf[cell + 1] = static_cast<float>(luminance * omega);
+            }
+        }
+    }
+
+    // summed in double, 24k cells would lose the small ones in float
+    double sum = 0.0;
+    for (int i = 1; i <= nCells; ++i) {
+        sum += _cdf[i];
+        _cdf[i] = static_cast<float>(sum);
+    }
+}
+
+int EnvironmentMap::getFaceCoord(const glm::vec3& dir, float* sc, float* tc) {
+    glm::vec3 a = glm::abs(dir);
+    int faceIdx;
+    float ma;
+    if (a.x >= a.y && a.x >= a.z) {
+        faceIdx = dir.x >= 0.0f ? 0 : 1;
+        *sc = dir.x >= 0.0f ? -dir.z : dir.z;
+        *tc = -dir.y;
+        ma = a.x;
+    } else if (a.y >= a.z) {
+        faceIdx = dir.y >= 0.0f ? 2 : 3;
+        *sc = dir.x;
+        *tc = dir.y >= 0.0f ? dir.z : -dir.z;
+        ma = a.y;
+    } else {
+        faceIdx = dir.z >= 0.0f ? 4 : 5;
+        *sc = dir.z >= 0.0f ? dir.x : -dir.x;
+        *tc = -dir.y;
+        ma = a.z;
+    }
+
+    *sc /= ma;
+    *tc /= ma;
+    return faceIdx;
+}
+
+glm::vec3 EnvironmentMap::getDirection(int face, float sc, float tc) {
+    switch (face) {
+    case 0: return glm::vec3(1.0f, -tc, -sc);
+    case 1: return glm::vec3(-1.0f, -tc, sc);
+    case 2: return glm::vec3(sc, 1.0f, tc);
+    case 3: return glm::vec3(sc, -1.0f, -tc);
+    case 4: return glm::vec3(sc, -tc, 1.0f);
+    default: return glm::vec3(-sc, -tc, -1.0f);
+    }
+}
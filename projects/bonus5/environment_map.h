@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+/*
+ * CPU copy of the sky cubemap, looked up the same way as a GL_NEAREST
+ * samplerCube so the CPU and GPU renderers see the same sky. It also holds
+ * a distribution over the sky by luminance, used to sample the directions
+ * the light comes from
+ */
+class EnvironmentMap {
+public:
+    // the faces are split into cells of DistributionSize x DistributionSize for sampling
+    static constexpr int DistributionSize = 64;
+
+public:
+    /* faces in the order +x, -x, +y, -y, +z, -z */
+    EnvironmentMap(const std::vector<std::string>& facePaths);
+
+    glm::vec3 lookup(const glm::vec3& dir) const;
+
+    /* false for a black sky, nothing to sample then */
+    bool hasDistribution() const {
+        return _cdf.back() > 0.0f;
+    }
+
+    /*
+    *Summary: sample a direction, bright and large parts of the sky more often
+    *Parameters:
+    *     u  : random numbers in [0, 1)
+    *     pdf: receives the pdf of the direction w.r.t. solid angle
+    *Return: the direction
+    */
+    glm::vec3 sample(const glm::vec2& u, float* pdf) const;
+
+    /* pdf of sample drawing dir w.r.t. solid angle */
+    float getPdf(const glm::vec3& dir) const;
+
+    /*
+    * cdf over the 6 * DistributionSize^2 cells, face by face and row by row,
+    * with a leading 0. The GPU renderer uploads it to sample the same way
+    */
+    const std::vector<float>& getCdf() const {
+        return _cdf;
+    }
+
+private:
+    struct Face {
+        int width = 0;
+        int height = 0;
+        std::vector<uint8_t> texels;    // rgb, as loaded; a float copy of 2048^2 faces takes 300 MB
+    };
+
+    Face _faces[6];
+
+    std::vector<float> _cdf;
+
+    void buildDistribution();
+
+    /* face and face coordinates in [-1, 1] of a direction, table 8.19 of the OpenGL specification */
+    static int getFaceCoord(const glm::vec3& dir, float* sc, float* tc);
+
+    /* the inverse of getFaceCoord, the direction is not normalized */
+    static glm::vec3 getDirection(int face, float sc, float tc);
+};
@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "image_writer.h"
+
+constexpr uint64_t TiledImageWriter::NoVersion;
+
+static_assert(sizeof(glm::vec3) == 3 * sizeof(float), "pfm pixels are 3 packed floats");
+
+static bool seek(std::FILE* file, long long offset) {
+#ifdef _WIN32
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+static bool isLittleEndian() {
+    const uint32_t one = 1;
+    uint8_t firstByte;
+    std::memcpy(&firstByte, &one, 1);
+    return firstByte == 1;
+}
+
+TiledImageWriter::TiledImageWriter(const std::string& filepath, int width, int height, int tileSize) :
+    _filepath(filepath), _width(width), _height(height), _tileSize(tileSize) {
+    if (width <= 0 || height <= 0 || tileSize <= 0) {
+        throw std::runtime_error("TiledImageWriter: invalid size of " + filepath);
+    }
+
+    _file = std::fopen(filepath.c_str(), "wb");
+    if (_file == nullptr) {
+        throw std::runtime_error("open " + filepath + " failure");
+    }
+
+    // a negative scale marks little endian floats, rows go bottom-up
+    const std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n" +
+        (isLittleEndian() ? "-1.0\n" : "1.0\n");
+    _headerSize = static_cast<long long>(header.size());
+
+    // writing the last byte sizes the file, the pixels in between read as zeros
+    const long long fileSize = _headerSize + static_cast<long long>(width) * height * sizeof(glm::vec3);
+    const char zero = 0;
+    if (std::fwrite(header.data(), 1, header.size(), _file) != header.size() ||
+        !seek(_file, fileSize - 1) || std::fwrite(&zero, 1, 1, _file) != 1) {
+        std::fclose(_file);
+        throw std::runtime_error("write " + filepath + " failure");
+    }
+
+    _nTilesX = (width + tileSize - 1) / tileSize;
+    const int nTilesY = (height + tileSize - 1) / tileSize;
+    _tileVersions.assign(static_cast<size_t>(_nTilesX) * nTilesY, NoVersion);
+}
+
+TiledImageWriter::~TiledImageWriter() {
+    if (_file != nullptr) {
+        std::fclose(_file);
+    }
+}
+
+bool TiledImageWriter::isTileCurrent(const Tile& tile, uint64_t version) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _tileVersions[getTileIndex(tile)] == version;
+}
+
+void TiledImageWriter::writeTile(const Tile& tile, uint64_t version, const glm::vec3* pixels, int stride) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    writeRows(tile.x0, tile.y0, tile.x1, tile.y1, pixels, stride);
+    _tileVersions[getTileIndex(tile)] = version;
+}
+
+void TiledImageWriter::writeImage(const std::vector<glm::vec3>& image) {
+    if (image.size() != static_cast<size_t>(_width) * _height) {
+        throw std::runtime_error("TiledImageWriter: image size does not match " + _filepath);
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    writeRows(0, 0, _width, _height, image.data(), _width);
+    std::fill(_tileVersions.begin(), _tileVersions.end(), NoVersion);
+}
+
+void TiledImageWriter::flush() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (std::fflush(_file) != 0) {
+        _failed = true;
+    }
+
+    if (_failed) {
+        throw std::runtime_error("write " + _filepath + " failure");
+    }
+}
+
+int TiledImageWriter::getTileIndex(const Tile& tile) const {
+    return tile.y0 / _tileSize * _nTilesX + tile.x0 / _tileSize;
+}
+
+void TiledImageWriter::writeRows(int x0, int y0, int x1, int y1, const glm::vec3* pixels, int stride) {
+    if (x0 < 0 || y0 < 0 || x1 > _width || y1 > _height || x0 >= x1 || y0 >= y1) {
+        throw std::runtime_error("TiledImageWriter: tile out of " + _filepath);
+    }
+
+    // every row of the tile is contiguous in the file
+    const size_t rowPixels = static_cast<size_t>(x1 - x0);
+    for (int y = y0; y < y1; ++y) {
+        const long long offset = _headerSize + (static_cast<long long>(y) * _width + x0) * sizeof(glm::vec3);
+        const glm::vec3* row = pixels + static_cast<size_t>(y - y0) * stride;
+        if (!seek(_file, offset) || std::fwrite(row, sizeof(glm::vec3), rowPixels, _file) != rowPixels) {
+            _failed = true;
+            return;
+        }
+    }
+}
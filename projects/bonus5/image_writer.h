@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "tile_scheduler.h"
+
+/*
+ * PFM image written a tile at a time: the file is sized for the whole image
+ * when it is opened and every tile is written in place at the rows it covers,
+ * so a render never holds a float copy of the frame for the output and the
+ * file always holds the latest version of every tile written so far
+ */
+class TiledImageWriter {
+public:
+    // version of the tiles not written by writeTile yet, never pass it to writeTile
+    static constexpr uint64_t NoVersion = ~0ull;
+
+public:
+    /*
+    *Summary: create or truncate the file, unwritten pixels read as black
+    *Parameters:
+    *     filepath: the pfm file
+    *     width   : image width
+    *     height  : image height
+    *     tileSize: edge of the tiles passed to writeTile, they start at multiples of it
+    */
+    TiledImageWriter(const std::string& filepath, int width, int height, int tileSize);
+
+    TiledImageWriter(const TiledImageWriter& rhs) = delete;
+
+    ~TiledImageWriter();
+
+    /* whether the tile was written with the version last, writing it again is not needed */
+    bool isTileCurrent(const Tile& tile, uint64_t version) const;
+
+    /*
+    *Summary: write the pixels of a tile, safe to call from any thread
+    *Parameters:
+    *     tile   : the tile
+    *     version: changes whenever the pixels of the tile do, e.g. a count of the samples taken in it
+    *     pixels : first pixel of the tile in linear space, rows are bottom-up
+    *     stride : pixels from one row of the tile to the next
+    */
+    void writeTile(const Tile& tile, uint64_t version, const glm::vec3* pixels, int stride);
+
+    /* write a whole image, rows are bottom-up like getImage */
+    void writeImage(const std::vector<glm::vec3>& image);
+
+    /* push the written tiles to the file, throws if a write failed */
+    void flush();
+
+    const std::string& getFilepath() const {
+        return _filepath;
+    }
+
+private:
+    std::string _filepath;
+    int _width;
+    int _height;
+    int _tileSize;
+    int _nTilesX;
+
+    std::FILE* _file = nullptr;
+    long long _headerSize = 0;
+    bool _failed = false;
+
+    mutable std::mutex _mutex;
+    std::vector<uint64_t> _tileVersions;
+
+    int getTileIndex(const Tile& tile) const;
+
+    /* write the rows of [x0, x1) x [y0, y1), _mutex must be held */
+    void writeRows(int x0, int y0, int x1, int y1, const glm::vec3* pixels, int stride);
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include "aabb.h"
+
+class BVH;
+
+/*
+ * a placed copy of a mesh: the mesh keeps one BVH in object space (BLAS)
+ * and every instance only stores its transform, so repeated meshes cost
+ * one entry in the top level BVH (TLAS) instead of a copy of their triangles
+ */
+struct Instance {
+public:
+    const BVH* blas = nullptr;
+    int meshIdx = 0;
+    int materialIdx = 0;
+    glm::mat4 objectToWorld = glm::mat4(1.0f);
+    glm::mat4 worldToObject = glm::mat4(1.0f);
+    glm::mat3 normalToWorld = glm::mat3(1.0f);
+    AABB bound;   // world space bound of the transformed BLAS
+
+public:
+    Instance() = default;
+
+    Instance(const BVH* blas, const AABB& objectBound, int meshIdx, int materialIdx, const glm::mat4& transform) :
+        blas(blas),
+        meshIdx(meshIdx),
+        materialIdx(materialIdx),
+        objectToWorld(transform),
+        worldToObject(glm::inverse(transform)),
+        normalToWorld(glm::transpose(glm::inverse(glm::mat3(transform)))) {
+        updateBound(objectBound);
+    }
+
+    /* recompute the world space bound, e.g. after the BLAS was refitted */
+    void updateBound(const AABB& objectBound) {
+        bound = AABB();
+        for (int i = 0; i < 8; ++i) {
+            bound = unionAABB(bound, glm::vec3(objectToWorld * glm::vec4(objectBound.corner(i), 1.0f)));
+        }
+    }
+};
+
+/* instance layout of the instance buffer: rows of worldToObject and objectToWorld, then the BLAS root */
+struct ShaderInstance {
+    glm::vec4 worldToObject[3];
+    glm::vec4 objectToWorld[3];
+    glm::vec4 info;   // x: root node of the BLAS in the bvh buffer, y: material index
+
+    static constexpr int getTexDataComponent() noexcept {
+        return 4;
+    }
+};
@@ -7,7 +7,8 @@ public:
     enum class Type {
         Lambertian,
         Metal,
-        Dielectric
+        Dielectric,
+        Emissive    // albedo is the emitted radiance, emitters do not scatter
     };
 
 public:
@@ -3,20 +3,23 @@
 #include "sphere.h"
 #include "triangle.h"
 #include "material.h"
+#include "instance.h"
 
 struct Primitive {
 public:
     enum class Type {
         Sphere,
-        Triangle
+        Triangle,
+        Instance
     };
 public:
-    Type type = Type::Sphere; // 0: sphere 1: triangle
+    Type type = Type::Sphere; // 0: sphere 1: triangle 2: instance
     int shapeIdx = 0;         // used in shader
     int materialIdx = 0;
     union {
         Sphere* sphere;
         Triangle* triangle;
+        Instance* instance;
     };
 
 public:
@@ -34,6 +37,12 @@ public:
         materialIdx(materialIdx),
         triangle(ptr) {}
 
+    Primitive(Type type, int shapeIdx, int materialIdx, Instance* ptr) :
+        type(type),
+        shapeIdx(shapeIdx),
+        materialIdx(materialIdx),
+        instance(ptr) {}
+
     static constexpr int getTexDataComponent() noexcept {
         return 3;
     }
@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include "quantized_bvh.h"
+
+// 2^e built from the exponent bits, e must stay in the range of normalized floats
+static inline float exp2i(int e) {
+    uint32_t bits = static_cast<uint32_t>(e + 127) << 23;
+    float f;
+    std::memcpy(&f, &bits, sizeof(float));
+    return f;
+}
+
+QuantizedBVHNode::QuantizedBVHNode() : leaf(0), rightChild(-1) {
+    for (int axis = 0; axis < 3; ++axis) {
+        origin[axis] = 0.0f;
+        exponent[axis] = 0;
+        for (int i = 0; i < 2; ++i) {
+            qMin[i][axis] = 0;
+            qMax[i][axis] = 0;
+        }
+    }
+}
+
+AABB QuantizedBVHNode::getChildBound(int i) const {
+    AABB box;
+    for (int axis = 0; axis < 3; ++axis) {
+        const float scale = exp2i(exponent[axis]);
+        box.pMin[axis] = origin[axis] + qMin[i][axis] * scale;
+        box.pMax[axis] = origin[axis] + qMax[i][axis] * scale;
+    }
+    return box;
+}
+
+QuantizedBVH::QuantizedBVH(const BVH& bvh) : _primitives(bvh.orderedPrimitives) {
+    if (!bvh.nodes.empty()) {
+        _rootBound = bvh.nodes[0].box;
+        nodes.reserve(bvh.nodes.size());
+        convert(bvh, 0);
+    }
+}
+
+int QuantizedBVH::convert(const BVH& bvh, int idx) {
+    const int nodeIdx = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+
+    const BVHNode& node = bvh.nodes[idx];
+    if (node.isLeaf()) {
+        nodes[nodeIdx].leaf = 1;
+        nodes[nodeIdx].startIndex = node.startIndex;
+        nodes[nodeIdx].nPrimitives = node.nPrimitives;
+        return nodeIdx;
+    }
+
+    // the first child lands at nodeIdx + 1
+    convert(bvh, idx + 1);
+    const int rightChild = convert(bvh, node.rightChild);
+
+    const AABB children[2] = { bvh.nodes[idx + 1].box, bvh.nodes[node.rightChild].box };
+    nodes[nodeIdx].rightChild = rightChild;
+    quantize(nodes[nodeIdx], node.box, children);
+
+    return nodeIdx;
+}
+
+void QuantizedBVH::quantize(QuantizedBVHNode& node, const AABB& bound, const AABB children[2]) {
+    for (int axis = 0; axis < 3; ++axis) {
+        const float origin = bound.pMin[axis];
+        const float extent = bound.pMax[axis] - origin;
+
+        // smallest power of two step whose 255 steps cover the bound
+        int e = -126;
+        if (extent > 0.0f) {
+            e = std::max(-126, static_cast<int>(std::ceil(std::log2(extent / 255.0f))));
+            while (e < 127 && origin + 255.0f * exp2i(e) < bound.pMax[axis]) {
+                ++e;
+            }
+        }
+
+        const float scale = exp2i(e);
+        node.origin[axis] = origin;
+        node.exponent[axis] = static_cast<int8_t>(e);
+        for (int i = 0; i < 2; ++i) {
+            float lo = std::floor((children[i].pMin[axis] - origin) / scale);
+            float hi = std::ceil((children[i].pMax[axis] - origin) / scale);
+            int qLo = static_cast<int>(std::min(std::max(lo, 0.0f), 255.0f));
+            int qHi = static_cast<int>(std::min(std::max(hi, 0.0f), 255.0f));
+
+            // rounding of origin + q * scale must not cut into the exact bound
+            while (qLo > 0 && origin + qLo * scale > children[i].pMin[axis]) {
+                --qLo;
+            }
+            while (qHi < 255 && origin + qHi * scale < children[i].pMax[axis]) {
+                ++qHi;
+            }
+
+            node.qMin[i][axis] = static_cast<uint8_t>(qLo);
+            node.qMax[i][axis] = static_cast<uint8_t>(qHi);
+        }
+    }
+}
+
+bool QuantizedBVH::intersectBound(const AABB& box, const Ray& ray, const glm::vec3& invDir, float* tNear) {
+    glm::vec3 t0 = (box.pMin - ray.o) * invDir;
+    glm::vec3 t1 = (box.pMax - ray.o) * invDir;
+    glm::vec3 tSmall = glm::min(t0, t1);
+    glm::vec3 tLarge = glm::max(t0, t1);
+    float tMin = std::max(tSmall.x, std::max(tSmall.y, tSmall.z));
+    float tMax = std::min(tLarge.x, std::min(tLarge.y, tLarge.z));
+    *tNear = tMin;
+    return tMin <= tMax && tMin < ray.tMax && tMax > 0.0f;
+}
+
+bool QuantizedBVH::intersect(const Ray& ray, Interaction& isect) const {
+    if (nodes.empty()) {
+        return false;
+    }
+
+    const glm::vec3 invDir = glm::vec3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+    float tRoot;
+    if (!intersectBound(_rootBound, ray, invDir, &tRoot)) {
+        return false;
+    }
+
+    struct StackEntry {
+        int node;
+        float tNear;
+    };
+
+    bool hit = false;
+    StackEntry nodesToVisit[128];
+    int toVisitOffset = 0;
+    int currentNodeIndex = 0;
+    while (true) {
+        const QuantizedBVHNode& node = nodes[currentNodeIndex];
+        if (node.leaf) {
+            for (int i = 0; i < node.nPrimitives; ++i) {
+                if (BVH::intersectPrimitive(ray, _primitives[node.startIndex + i], isect)) {
+                    hit = true;
+                }
+            }
+        } else {
+            float tNear[2];
+            const bool hitLeft = intersectBound(node.getChildBound(0), ray, invDir, &tNear[0]);
+            const bool hitRight = intersectBound(node.getChildBound(1), ray, invDir, &tNear[1]);
+            if (hitLeft && hitRight) {
+                // visit the nearer child first, it may shorten tMax for the other one
+                const bool leftFirst = tNear[0] <= tNear[1];
+                nodesToVisit[toVisitOffset++] = leftFirst ?
+                    StackEntry{ node.rightChild, tNear[1] } : StackEntry{ currentNodeIndex + 1, tNear[0] };
+                currentNodeIndex = leftFirst ? currentNodeIndex + 1 : node.rightChild;
+                continue;
+            } else if (hitLeft) {
+                currentNodeIndex = currentNodeIndex + 1;
+                continue;
+            } else if (hitRight) {
+                currentNodeIndex = node.rightChild;
+                continue;
+            }
+        }
+
+        // skip children that lie behind a hit found since they were pushed
+        while (toVisitOffset > 0 && nodesToVisit[toVisitOffset - 1].tNear >= ray.tMax) {
+            --toVisitOffset;
+        }
+
+        if (toVisitOffset == 0) {
+            break;
+        }
+        currentNodeIndex = nodesToVisit[--toVisitOffset].node;
+    }
+
+    return hit;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "bvh.h"
+
+/*
+ * 32 byte entry of the quantized BVH. An interior entry keeps the bounds of
+ * both children as 8 bit offsets from its own bound, so one fetch is enough
+ * to test the two children. Entries are stored depth first like BVHNode:
+ * the first child is the next entry, only the second one is kept
+ */
+struct alignas(32) QuantizedBVHNode {
+public:
+    union {
+        float origin[3];            // interior: pMin of the node bound
+        struct {
+            int startIndex;         // leaf: first primitive in orderedPrimitives
+            int nPrimitives;
+        };
+    };
+    int8_t exponent[3];             // child bound = origin + q * 2^exponent
+    uint8_t leaf;                   // 1 for leaves
+    uint8_t qMin[2][3];
+    uint8_t qMax[2][3];
+    int rightChild;                 // interior: index of the second child
+
+public:
+    QuantizedBVHNode();
+
+    /* the decoded bound of child i, it contains the exact bound */
+    AABB getChildBound(int i) const;
+};
+
+static_assert(sizeof(QuantizedBVHNode) == 32, "QuantizedBVHNode must stay 32 bytes");
+
+/*
+ * BVH with 8 bit child bounds quantized relative to the parent, converted from
+ * a binary BVH and sharing its orderedPrimitives. The decoded bounds are
+ * conservative, so it finds the same hits with half of the node data per box
+ */
+class QuantizedBVH {
+public:
+    std::vector<QuantizedBVHNode> nodes;
+
+public:
+    QuantizedBVH(const BVH& bvh);
+
+    bool intersect(const Ray& ray, Interaction& isect) const;
+
+private:
+    const std::vector<Primitive>& _primitives;
+
+    AABB _rootBound;
+
+    /*
+    *Summary: convert the binary subtree into quantized entries
+    *Parameters:
+    *     bvh: the binary BVH
+    *     idx: index of the binary node
+    *Return: index of the entry in nodes array
+    */
+    int convert(const BVH& bvh, int idx);
+
+    /*
+    *Summary: quantize the child bounds of an interior entry
+    *Parameters:
+    *     node    : the entry
+    *     bound   : bound of the node, the quantization grid spans it
+    *     children: exact bounds of the two children
+    */
+    static void quantize(QuantizedBVHNode& node, const AABB& bound, const AABB children[2]);
+
+    static bool intersectBound(const AABB& box, const Ray& ray, const glm::vec3& invDir, float* tNear);
+};
@@ -1,28 +1,90 @@
-#pragma once 
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
 
-#include <random>
 #include <glm/glm.hpp>
 
-inline float randomFloat() {
-    // Returns a random real in [0, 1).
-    static std::default_random_engine e;
-    static std::uniform_real_distribution<float> u(0.0f, 1.0f);
+/*
+ * xorshift32 stream, the same generator as rngGetRandom1D in raytracing.frag.
+ * An RNG is a plain value owned by one pixel, ball or task, so code using it
+ * can run in parallel and gives the same numbers for any thread count
+ */
+class RNG {
+public:
+    explicit RNG(uint32_t state = 1013904223u) : _state(state != 0u ? state : 1u) { }
+
+    /* seed of a pixel, the same as the rngState textures of the GPU renderer */
+    static RNG createPixelStream(uint32_t pixelIdx) {
+        return RNG(1664525u * pixelIdx + 1013904223u);
+    }
+
+    /*
+    *Summary: counter based stream, it only depends on its arguments, not on what was drawn before
+    *Parameters:
+    *     index    : pixel or object index
+    *     sample   : sample index
+    *     dimension: which decision of the sample the stream is used for
+    */
+    static RNG createStream(uint32_t index, uint32_t sample = 0u, uint32_t dimension = 0u) {
+        return RNG(hash(index ^ hash(sample ^ hash(dimension))));
+    }
+
+    uint32_t getState() const {
+        return _state;
+    }
+
+    uint32_t getUint() {
+        _state ^= (_state << 13);
+        _state ^= (_state >> 17);
+        _state ^= (_state << 5);
+        return _state;
+    }
 
-    return u(e);
+    /* random real in [0, 1) */
+    float getFloat() {
+        const float floatOneMinusEpsilon = 0.99999994f;
+        return std::min(floatOneMinusEpsilon, static_cast<float>(getUint()) * (1.0f / 4294967296.0f));
+    }
+
+    glm::vec2 get2D() {
+        float x = getFloat();
+        float y = getFloat();
+        return glm::vec2(x, y);
+    }
+
+    /* pcg output permutation, used to decorrelate the seeds of neighbouring streams */
+    static uint32_t hash(uint32_t v) {
+        uint32_t state = v * 747796405u + 2891336453u;
+        uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+        return (word >> 22u) ^ word;
+    }
+
+private:
+    uint32_t _state;
+};
+
+inline float randomFloat(RNG& rng) {
+    // Returns a random real in [0, 1).
+    return rng.getFloat();
 }
 
-inline float randomFloat(float minVal, float maxVal) {
+inline float randomFloat(RNG& rng, float minVal, float maxVal) {
     // Returns a random real in [min,max).
-    return minVal + (maxVal - minVal) * randomFloat();
+    return minVal + (maxVal - minVal) * randomFloat(rng);
 }
 
-inline glm::vec3 randomVec3() {
-    return glm::vec3(randomFloat(), randomFloat(), randomFloat());
+inline glm::vec3 randomVec3(RNG& rng) {
+    // arguments are evaluated in an unspecified order, draw them one by one
+    float x = randomFloat(rng);
+    float y = randomFloat(rng);
+    float z = randomFloat(rng);
+    return glm::vec3(x, y, z);
 }
 
-inline glm::vec3 randomVec3(float minVal, float maxVal) {
-    return glm::vec3(
-        randomFloat(minVal, maxVal),
-        randomFloat(minVal, maxVal),
-        randomFloat(minVal, maxVal));
-}
\ No newline at end of file
+inline glm::vec3 randomVec3(RNG& rng, float minVal, float maxVal) {
+    float x = randomFloat(rng, minVal, maxVal);
+    float y = randomFloat(rng, minVal, maxVal);
+    float z = randomFloat(rng, minVal, maxVal);
+    return glm::vec3(x, y, z);
+}
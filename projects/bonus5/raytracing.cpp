@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <unordered_map>
@@ -12,17 +15,25 @@
 #include "../base/vertex.h"
 #include "random.h"
 #include "raytracing.h"
+#include "sampling.h"
 
 static constexpr int BufferWidth = 2048;
 
+// top level primitives the buffers have room for at least, see createPrimitiveBuffer
+static constexpr size_t MinTopLevelCapacity = 256;
+
 const std::string lucyRelPath = "obj/lucy.obj";
 
+const std::string bvhCacheRelPath = "cache/";
+
 const std::string quadVsRelPath = "shader/bonus5/quad.vert";
 const std::string quadFsRelPath = "shader/bonus5/quad.frag";
 
 const std::string raytracingVsRelPath = "shader/bonus5/quad.vert";
 const std::string raytracingFsRelPath = "shader/bonus5/raytracing.frag";
 
+const std::string denoiseFsRelPath = "shader/bonus5/denoise.frag";
+
 const std::vector<std::string> skyboxTextureRelPaths = {
 	"texture/skyboxrt/right.jpg",
 	"texture/skyboxrt/left.jpg",
@@ -35,18 +46,24 @@ const std::vector<std::string> skyboxTextureRelPaths = {
 RayTracing::RayTracing(const Options& options): Application(options) {
 	_lucy.reset(new Model(getAssetFullPath(lucyRelPath)));
 
+	_bvhCache.reset(new BVHCache(getAssetFullPath(bvhCacheRelPath)));
+
 	std::vector<std::string> skyBoxTexturePaths;
 	for (size_t i = 0; i < skyboxTextureRelPaths.size(); ++i) {
 		skyBoxTexturePaths.push_back(getAssetFullPath(skyboxTextureRelPaths[i]));
 	}
 	_skybox.reset(new ImageTextureCubemap(skyBoxTexturePaths));
+	_environmentMap.reset(new EnvironmentMap(skyBoxTexturePaths));
 
 	_camera.reset(new PerspectiveCamera(
 		glm::radians(60.0f), static_cast<float>(_windowWidth) / _windowHeight, 0.1f, 1000.0f));
 	_camera->transform.position = glm::vec3(15.0f, 3.0f, 4.0f);
 	_camera->transform.lookAt(glm::vec3(0.0f));
 
-	createBalls();
+	createBalls(_balls, _ballMaterials);
+
+	_textureBuffersSupported = supportsTextureBuffers();
+	_useTextureBuffers = _textureBuffersSupported;
 
 	initShaders();
 
@@ -57,13 +74,14 @@ RayTracing::RayTracing(const Options& options): Application(options) {
 	std::vector<unsigned int> rngStateInitVals;
 	rngStateInitVals.reserve(pixelCount);
 	for (int i = 0; i < pixelCount; ++i) {
-		rngStateInitVals.push_back(1664525 * i + 1013904223);
+		rngStateInitVals.push_back(RNG::createPixelStream(i).getState());
 	}
 
 	for (int i = 0; i < 2; ++i) {
 		_sampleFramebuffers[i].reset(new Framebuffer);
 		_sampleFramebuffers[i]->bind();
-		_sampleFramebuffers[i]->drawBuffers({ GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 });
+		_sampleFramebuffers[i]->drawBuffers({ GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2,
+			GL_COLOR_ATTACHMENT3, GL_COLOR_ATTACHMENT4 });
 
 		_outFrames[i].reset(new Texture2D(GL_RGBA32F, _windowWidth, _windowHeight, GL_RGBA, GL_FLOAT));
 		_outFrames[i]->bind();
@@ -84,7 +102,48 @@ RayTracing::RayTracing(const Options& options): Application(options) {
 
 		_sampleFramebuffers[i]->attachTexture(*_rngStates[i], GL_COLOR_ATTACHMENT1);
 
+		_varianceFrames[i].reset(new Texture2D(GL_RGBA32F, _windowWidth, _windowHeight, GL_RGBA, GL_FLOAT));
+		_varianceFrames[i]->bind();
+		_varianceFrames[i]->setParamterInt(GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		_varianceFrames[i]->setParamterInt(GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		_varianceFrames[i]->setParamterInt(GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		_varianceFrames[i]->setParamterInt(GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		_sampleFramebuffers[i]->attachTexture(*_varianceFrames[i], GL_COLOR_ATTACHMENT2);
+
+		_albedoDepthFrames[i].reset(new Texture2D(GL_RGBA32F, _windowWidth, _windowHeight, GL_RGBA, GL_FLOAT));
+		_albedoDepthFrames[i]->bind();
+		_albedoDepthFrames[i]->setParamterInt(GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		_albedoDepthFrames[i]->setParamterInt(GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		_albedoDepthFrames[i]->setParamterInt(GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		_albedoDepthFrames[i]->setParamterInt(GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		_sampleFramebuffers[i]->attachTexture(*_albedoDepthFrames[i], GL_COLOR_ATTACHMENT3);
+
+		_normalFrames[i].reset(new Texture2D(GL_RGBA32F, _windowWidth, _windowHeight, GL_RGBA, GL_FLOAT));
+		_normalFrames[i]->bind();
+		_normalFrames[i]->setParamterInt(GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		_normalFrames[i]->setParamterInt(GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		_normalFrames[i]->setParamterInt(GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		_normalFrames[i]->setParamterInt(GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		_sampleFramebuffers[i]->attachTexture(*_normalFrames[i], GL_COLOR_ATTACHMENT4);
+
 		_sampleFramebuffers[i]->unbind();
+
+		_denoiseFramebuffers[i].reset(new Framebuffer);
+		_denoiseFramebuffers[i]->bind();
+
+		_denoiseFrames[i].reset(new Texture2D(GL_RGBA32F, _windowWidth, _windowHeight, GL_RGBA, GL_FLOAT));
+		_denoiseFrames[i]->bind();
+		_denoiseFrames[i]->setParamterInt(GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		_denoiseFrames[i]->setParamterInt(GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		_denoiseFrames[i]->setParamterInt(GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		_denoiseFrames[i]->setParamterInt(GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		_denoiseFramebuffers[i]->attachTexture(*_denoiseFrames[i], GL_COLOR_ATTACHMENT0);
+
+		_denoiseFramebuffers[i]->unbind();
 	}
 
 	createRenderScene(_renderSceneIndex);
@@ -98,6 +157,8 @@ RayTracing::RayTracing(const Options& options): Application(options) {
 }
 
 RayTracing::~RayTracing() {
+	stopCPURender();
+
 	ImGui_ImplOpenGL3_Shutdown();
 	ImGui_ImplGlfw_Shutdown();
 	ImGui::DestroyContext();
@@ -110,10 +171,80 @@ void RayTracing::handleInput() {
 	}
 
 	static int lastSceneIndex = _renderSceneIndex;
-	if (lastSceneIndex != _renderSceneIndex) {
+	static int lastBVHMethodIndex = _bvhMethodIndex;
+	static int lastRendererIndex = _rendererIndex;
+	static bool lastUseTextureBuffers = _useTextureBuffers;
+	static AdaptiveSamplingOptions lastAdaptiveSampling = _adaptiveSampling;
+	static bool lastLightSampling = _lightSampling;
+	if (lastSceneIndex != _renderSceneIndex || lastBVHMethodIndex != _bvhMethodIndex) {
+		// the render thread reads the scene, it has to leave before the scene is rebuilt
+		stopCPURender();
 		createRenderScene(_renderSceneIndex);
 		lastSceneIndex = _renderSceneIndex;
+		lastBVHMethodIndex = _bvhMethodIndex;
+		_sampleCount = 0;
+		if (_rendererIndex == 1) {
+			startCPURender();
+		}
+
+		// a scene too large for texture buffers falls back to 2D textures
+		lastUseTextureBuffers = _useTextureBuffers;
+	}
+
+	if (lastUseTextureBuffers != _useTextureBuffers) {
+		// the shader declares the buffers as samplerBuffer or sampler2D, both are made again
+		initShaders();
+		createPrimitiveBuffer(*_scene);
+		_sampleCount = 0;
+		lastUseTextureBuffers = _useTextureBuffers;
+	}
+
+	if (lastRendererIndex != _rendererIndex) {
+		if (_rendererIndex == 1) {
+			startCPURender();
+		} else {
+			stopCPURender();
+		}
+		lastRendererIndex = _rendererIndex;
+	}
+
+	if (lastAdaptiveSampling.enabled != _adaptiveSampling.enabled ||
+		lastAdaptiveSampling.threshold != _adaptiveSampling.threshold) {
+		// pixels skipped so far may not be converged under the new options, sample them all again
+		_sampleCount = 0;
+		if (_rendererIndex == 1) {
+			stopCPURender();
+			startCPURender();
+		}
+		lastAdaptiveSampling = _adaptiveSampling;
+	}
+
+	if (lastLightSampling != _lightSampling) {
+		// both estimators converge to the same image, but the samples are not averaged across them
 		_sampleCount = 0;
+		if (_rendererIndex == 1) {
+			stopCPURender();
+			startCPURender();
+		}
+		lastLightSampling = _lightSampling;
+	}
+
+	if (_materialEdited || _addSphere || _removeSphere) {
+		editScene();
+	}
+
+	if (_animateBalls && _useBVH) {
+		// the render thread reads the spheres and the BVH, it restarts with the new frame
+		const bool cpuRendering = _rendererIndex == 1;
+		if (cpuRendering) {
+			stopCPURender();
+		}
+
+		animateBalls();
+
+		if (cpuRendering) {
+			startCPURender();
+		}
 	}
 }
 
@@ -122,61 +253,96 @@ void RayTracing::renderFrame() {
 
 	glDisable(GL_DEPTH_TEST);
 
-	glm::mat4 cameraToWorld = glm::inverse(_camera->getViewMatrix());
-	glm::mat4 cameraToScreen = _camera->getProjectionMatrix();
-	glm::mat4 screenToRaster = glm::scale(glm::mat4(1.0f), glm::vec3(float(_windowWidth) / 2.0f,
-		float(_windowHeight) / 2.0f, 1.0f)) *
-		glm::translate(glm::mat4(1.0f), glm::vec3(1.0f, 1.0f, 0.0f));
+	if (_rendererIndex == 1) {
+		renderCPUFrame();
+	} else {
+		glm::mat4 cameraToWorld = glm::inverse(_camera->getViewMatrix());
+		glm::mat4 cameraToScreen = _camera->getProjectionMatrix();
+		glm::mat4 screenToRaster = glm::scale(glm::mat4(1.0f), glm::vec3(float(_windowWidth) / 2.0f,
+			float(_windowHeight) / 2.0f, 1.0f)) *
+			glm::translate(glm::mat4(1.0f), glm::vec3(1.0f, 1.0f, 0.0f));
 
-	glm::mat4 rasterToScreen = glm::inverse(screenToRaster);
-	glm::mat4 rasterToCamera = glm::inverse(cameraToScreen) * rasterToScreen;
+		glm::mat4 rasterToScreen = glm::inverse(screenToRaster);
+		glm::mat4 rasterToCamera = glm::inverse(cameraToScreen) * rasterToScreen;
 
-	_sampleFramebuffers[_currentWriteBufferID]->bind();
-	_raytracingShader->use();
-	_raytracingShader->setUniformUint("totalSamples", _sampleCount);
-	_raytracingShader->setUniformMat4("camera.cameraToWorld", cameraToWorld);
-	_raytracingShader->setUniformMat4("camera.rasterToCamera", rasterToCamera);
+		_sampleFramebuffers[_currentWriteBufferID]->bind();
+		_raytracingShader->use();
+		_raytracingShader->setUniformUint("totalSamples", _sampleCount);
+		_raytracingShader->setUniformBool("adaptiveSampling", _adaptiveSampling.enabled);
+		_raytracingShader->setUniformFloat("varianceThreshold", _adaptiveSampling.threshold);
+		_raytracingShader->setUniformUint("minSamples", _adaptiveSampling.minSamples);
+		_raytracingShader->setUniformInt("maxSamplesPerPass", _adaptiveSampling.maxSamplesPerPass);
+		_raytracingShader->setUniformBool("useBVH", _useBVH);
+		_raytracingShader->setUniformBool("lightSampling", _lightSampling);
+		_raytracingShader->setUniformInt("nLights", static_cast<int>(_scene->lights.size()));
+		_raytracingShader->setUniformInt("skyDistributionSize",
+			_environmentMap->hasDistribution() ? EnvironmentMap::DistributionSize : 0);
+		_raytracingShader->setUniformMat4("camera.cameraToWorld", cameraToWorld);
+		_raytracingShader->setUniformMat4("camera.rasterToCamera", rasterToCamera);
 
-	_raytracingShader->setUniformInt("sky", 0);
-	_skybox->bind(0);
-	
-	_sphereBuffer->bind(1);
-	_raytracingShader->setUniformInt("sphereBuffer", 1);
+		_raytracingShader->setUniformInt("sky", 0);
+		_skybox->bind(0);
 
-	_raytracingShader->setUniformInt("materialBuffer", 2);
-	_materialBuffer->bind(2);
+		_sphereBuffer->bind(1);
+		_raytracingShader->setUniformInt("sphereBuffer", 1);
 
-	_raytracingShader->setUniformInt("primitiveBuffer", 3);
-	_primitiveBuffer->bind(3);
+		_raytracingShader->setUniformInt("materialBuffer", 2);
+		_materialBuffer->bind(2);
 
-	_raytracingShader->setUniformInt("RTResult", 4);
-	_outFrames[_currentReadBufferID]->bind(4);
+		_raytracingShader->setUniformInt("primitiveBuffer", 3);
+		_primitiveBuffer->bind(3);
 
-	_raytracingShader->setUniformInt("oldRngState", 5);
-	_rngStates[_currentReadBufferID]->bind(5);
+		_raytracingShader->setUniformInt("RTResult", 4);
+		_outFrames[_currentReadBufferID]->bind(4);
 
-	_indexBuffer->bind(6);
-	_raytracingShader->setUniformInt("triangleIndexBuffer", 6);
-	_vertexBuffer->bind(7);
-	_raytracingShader->setUniformInt("vertexBuffer", 7);
+		_raytracingShader->setUniformInt("oldRngState", 5);
+		_rngStates[_currentReadBufferID]->bind(5);
 
-	_bvhBuffer->bind(8);
-	_raytracingShader->setUniformInt("bvh", 8);
+		_indexBuffer->bind(6);
+		_raytracingShader->setUniformInt("triangleIndexBuffer", 6);
+		_vertexBuffer->bind(7);
+		_raytracingShader->setUniformInt("vertexBuffer", 7);
 
-	_screenQuad->draw();
+		_bvhBuffer->bind(8);
+		_raytracingShader->setUniformInt("bvh", 8);
 
-	_sampleFramebuffers[_currentWriteBufferID]->unbind();
-	
-	// render the result to the screen
-	_drawScreenShader->use();
-	_drawScreenShader->setUniformInt("frame", 0);
-	
-	_outFrames[_currentWriteBufferID]->bind(0);
-	_screenQuad->draw();
+		_instanceBuffer->bind(9);
+		_raytracingShader->setUniformInt("instanceBuffer", 9);
+
+		_raytracingShader->setUniformInt("oldVariance", 10);
+		_varianceFrames[_currentReadBufferID]->bind(10);
+
+		_lightBuffer->bind(11);
+		_raytracingShader->setUniformInt("lightBuffer", 11);
+
+		_skyDistribution->bind(12);
+		_raytracingShader->setUniformInt("skyDistribution", 12);
+
+		_raytracingShader->setUniformInt("oldAlbedoDepth", 13);
+		_albedoDepthFrames[_currentReadBufferID]->bind(13);
+
+		_raytracingShader->setUniformInt("oldNormal", 14);
+		_normalFrames[_currentReadBufferID]->bind(14);
+
+		_screenQuad->draw();
 
-	// update
-	++_sampleCount;
-	std::swap(_currentReadBufferID, _currentWriteBufferID);
+		_sampleFramebuffers[_currentWriteBufferID]->unbind();
+
+		// render the result to the screen
+		if (_denoise.enabled) {
+			drawDenoisedFrame();
+		} else {
+			_drawScreenShader->use();
+			_drawScreenShader->setUniformInt("frame", 0);
+
+			_outFrames[_currentWriteBufferID]->bind(0);
+			_screenQuad->draw();
+		}
+
+		// update
+		++_sampleCount;
+		std::swap(_currentReadBufferID, _currentWriteBufferID);
+	}
 
 	// render UI
 	ImGui_ImplOpenGL3_NewFrame();
@@ -195,16 +361,82 @@ void RayTracing::renderFrame() {
 		ImGui::Text("switch scenes");
 		ImGui::Separator();
 		static const char* scenes[] = {
-			"scene 1", "scene 2", "scene 3"
+			"scene 1", "scene 2", "scene 3", "small light"
 		};
 
 		ImGui::Combo("##1", &_renderSceneIndex, scenes, IM_ARRAYSIZE(scenes));
 
 		ImGui::NewLine();
 
+		ImGui::Text("bvh build");
+		ImGui::Separator();
+		static const char* bvhMethods[] = {
+			"SAH", "LBVH", "HLBVH", "SBVH"
+		};
+
+		ImGui::Combo("##3", &_bvhMethodIndex, bvhMethods, IM_ARRAYSIZE(bvhMethods));
+		ImGui::Checkbox("animate balls", &_animateBalls);
+
+		ImGui::NewLine();
+
+		ImGui::Text("edit scene");
+		ImGui::Separator();
+		if (!_scene->spheres.empty()) {
+			ImGui::SliderInt("sphere", &_editSphere, 0, static_cast<int>(_scene->spheres.size()) - 1);
+			if (_scene->hasSphere(_editSphere)) {
+				_editMaterial = _scene->materials[_scene->getSphereMaterial(_editSphere)];
+				// emitted radiance goes past 1
+				const bool emissive = _editMaterial.type == Material::Type::Emissive;
+				_materialEdited = ImGui::ColorEdit3(emissive ? "emission" : "albedo", &_editMaterial.albedo.x,
+					emissive ? ImGuiColorEditFlags_HDR | ImGuiColorEditFlags_Float : 0);
+				_materialEdited |= ImGui::SliderFloat("fuzz", &_editMaterial.fuzz, 0.0f, 1.0f);
+				_removeSphere = ImGui::Button("remove sphere");
+				ImGui::SameLine();
+			} else {
+				ImGui::Text("removed");
+			}
+		}
+		_addSphere = ImGui::Button("add sphere");
+
+		ImGui::NewLine();
+
+		ImGui::Text("renderer");
+		ImGui::Separator();
+		static const char* renderers[] = {
+			"GPU", "CPU"
+		};
+
+		ImGui::Combo("##2", &_rendererIndex, renderers, IM_ARRAYSIZE(renderers));
+		if (_textureBuffersSupported) {
+			ImGui::Checkbox("texture buffers", &_useTextureBuffers);
+		}
+		ImGui::Checkbox("light sampling", &_lightSampling);
+		ImGui::Checkbox("adaptive sampling", &_adaptiveSampling.enabled);
+		if (_adaptiveSampling.enabled) {
+			ImGui::SliderFloat("error", &_adaptiveSampling.threshold, 0.005f, 0.1f, "%.3f");
+		}
+		{
+			std::lock_guard<std::mutex> lock(_cpuImageMutex);
+			ImGui::Checkbox("denoise", &_denoise.enabled);
+			if (_denoise.enabled) {
+				ImGui::SliderInt("passes", &_denoise.iterations, 1, 5);
+			}
+		}
+
+		ImGui::NewLine();
+
 		ImGui::Text("statistics");
 		ImGui::Separator();
-		ImGui::Text("samples: %u", _sampleCount);
+		if (_rendererIndex == 1) {
+			std::lock_guard<std::mutex> lock(_cpuImageMutex);
+			ImGui::Text("samples: %u", _cpuSampleCount);
+			ImGui::Text("Mrays/s: %.2f", _cpuRaysPerSecond * 1e-6);
+			if (_adaptiveSampling.enabled) {
+				ImGui::Text("converged: %.1f%%", _cpuConvergedFraction * 100.0f);
+			}
+		} else {
+			ImGui::Text("samples: %u", _sampleCount);
+		}
 
 		ImGui::End();
 	}
@@ -214,367 +446,554 @@ void RayTracing::renderFrame() {
 }
 
 void RayTracing::initShaders() {
-	// TODO: modify raytracing.frag code to achieve raytracing
 	_raytracingShader.reset(new GLSLProgram);
 	_raytracingShader->attachVertexShaderFromFile(getAssetFullPath(raytracingVsRelPath));
-	_raytracingShader->attachFragmentShaderFromFile(getAssetFullPath(raytracingFsRelPath));
+	std::vector<std::string> defines;
+	if (_useTextureBuffers) {
+		defines.push_back("USE_TEXTURE_BUFFER");
+	}
+	_raytracingShader->attachFragmentShaderFromFile(getAssetFullPath(raytracingFsRelPath), defines);
 	_raytracingShader->link();
 
 	_drawScreenShader.reset(new GLSLProgram);
 	_drawScreenShader->attachVertexShaderFromFile(getAssetFullPath(quadVsRelPath));
 	_drawScreenShader->attachFragmentShaderFromFile(getAssetFullPath(quadFsRelPath));
 	_drawScreenShader->link();
-}
 
-int RayTracing::getBufferHeight(size_t nObjects, size_t objectSize, size_t texComponent) const {
-	size_t componentPerObject = objectSize / (sizeof(float) * texComponent);
-	return static_cast<int>(nObjects * componentPerObject + BufferWidth - 1) / BufferWidth;
+	_denoiseShader.reset(new GLSLProgram);
+	_denoiseShader->attachVertexShaderFromFile(getAssetFullPath(quadVsRelPath));
+	_denoiseShader->attachFragmentShaderFromFile(getAssetFullPath(denoiseFsRelPath));
+	_denoiseShader->link();
 }
 
-void RayTracing::createBalls() {
-    _balls.push_back(Sphere(glm::vec3(0.0f, -1000.0f, 0.0f), 1000.0f));
-	_ballMaterials.push_back(Material(Material::Type::Lambertian, 1.0f, 0.0f, glm::vec3(0.5f, 0.5f, 0.5f)));
-	for (int a = -12; a < 12; ++a) {
-        for (int b = -12; b < 12; ++b) {
-            auto chooseMat = randomFloat();
-            glm::vec3 center(a + 0.9f * randomFloat(), 0.2f, b + 0.9f * randomFloat());
-	
-            if ((glm::length(center - glm::vec3(0.0f, 0.2f, 0.0f)) > 2.0f) &&
-				(glm::length(center - glm::vec3(4.0f, 0.2f, -2.0f)) > 2.0f) &&
-				(glm::length(center - glm::vec3(-4.0f, 0.2f, 2.0f)) > 2.0f) &&
-				(glm::length(center - glm::vec3(4.0f, 0.0f, 5.0f)) > 1.0f)) {
-                Material material;
-                if (chooseMat < 0.8f) {
-					material.type = Material::Type::Lambertian;
-					material.ior = 1.0f;
-					material.fuzz = 0.0f;
-					material.albedo = randomVec3() * randomVec3();
-                } else if (chooseMat < 0.95f) {
-					material.type = Material::Type::Metal;
-					material.ior = 1.0f;
-					material.fuzz = randomFloat(0.0f, 0.5f);
-					material.albedo = randomVec3(0.5f, 1.0f);
-                } else {
-					material.type = Material::Type::Dielectric;
-					material.ior = 1.5f;
-					material.fuzz = 0.0f;
-					material.albedo = glm::vec3(1.0f, 1.0f, 1.0f);
-                }
-
-				_balls.push_back(Sphere(center, randomFloat(0.15f, 0.2f)));
-				_ballMaterials.push_back(material);
-            }
-        }
-    }
-	
-	// init three big sphere
-	_balls.push_back(Sphere(glm::vec3(4.0f, 1.0f, 5.0f), 1.0f));
-	_ballMaterials.push_back(Material(Material::Type::Dielectric, 1.5f, 0.0f, glm::vec3(1.0f, 1.0f, 1.0f)));
-	
-	_balls.push_back(Sphere(glm::vec3(-8.0f, 2.0f, 14.0f), 2.0f));
-	_ballMaterials.push_back(Material(Material::Type::Lambertian, 1.0f, 0.0f, glm::vec3(0.2f, 0.4f, 0.8f)));
-	
-	_balls.push_back(Sphere(glm::vec3(3.0f, 3.0f, -8.0f), 2.0f));
-	_ballMaterials.push_back(Material(Material::Type::Metal, 1.0f, 0.0f, glm::vec3(0.7f, 0.6f, 0.5f)));
+void RayTracing::startCPURender() {
+	if (_cpuRenderer == nullptr) {
+		_cpuRenderer.reset(new CPURenderer(_windowWidth, _windowHeight));
+
+		_cpuFrame.reset(new Texture2D(GL_RGBA32F, _windowWidth, _windowHeight, GL_RGB, GL_FLOAT));
+		_cpuFrame->bind();
+		_cpuFrame->setParamterInt(GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		_cpuFrame->setParamterInt(GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		_cpuFrame->setParamterInt(GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		_cpuFrame->setParamterInt(GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+
+	_cpuRenderer->setScene(_scene.get(), _environmentMap.get());
+	_cpuRenderer->setCamera(*_camera);
+	_cpuRenderer->setAdaptiveSampling(_adaptiveSampling);
+	_cpuRenderer->setLightSampling(_lightSampling);
+	_cpuSampleCount = 0;
+	_cpuConvergedFraction = 0.0f;
+	_cpuImageUpdated = false;
+
+	_cpuRenderStop = false;
+	_cpuRenderThread = std::thread([this]() {
+		std::vector<glm::vec3> image;
+		while (!_cpuRenderStop) {
+			if (!_cpuRenderer->renderSample()) {
+				continue;
+			}
+
+			DenoiseOptions denoise;
+			{
+				std::lock_guard<std::mutex> lock(_cpuImageMutex);
+				denoise = _denoise;
+			}
+
+			if (denoise.enabled) {
+				_cpuRenderer->getDenoisedImage(image, denoise);
+			} else {
+				_cpuRenderer->getImage(image);
+			}
+			for (auto& color : image) {
+				color = gammaCorrection(color);
+			}
+
+			std::lock_guard<std::mutex> lock(_cpuImageMutex);
+			_cpuImage.swap(image);
+			_cpuImageUpdated = true;
+			_cpuSampleCount = _cpuRenderer->getSampleCount();
+			_cpuRaysPerSecond = _cpuRenderer->getStatistics().getRaysPerSecond();
+			_cpuConvergedFraction = _cpuRenderer->getConvergedFraction();
+		}
+	});
 }
 
-void RayTracing::createRenderScene(int index) {
-	switch (index) {
-		case 0: createScene1(); break;
-		case 1: createScene2(); break;
-		case 2: createScene3(); break;
-		default: createScene3(); break;
+void RayTracing::stopCPURender() {
+	if (!_cpuRenderThread.joinable()) {
+		return;
 	}
+
+	// the running pass stops after the tiles in flight instead of finishing the frame
+	_cpuRenderStop = true;
+	_cpuRenderer->cancel();
+	_cpuRenderThread.join();
 }
 
-void RayTracing::createPrimitiveBuffer(const std::vector<Sphere>& spheres, 
-                                       const std::vector<Model*> models, 
-	                          		   const std::vector<glm::mat4>& transforms,
-						               const std::vector<Material>& sphereMaterials, 
-						               const std::vector<Material>& modelMaterials) {
-	size_t totalPrimitives = 0;
-	size_t totalTriangles = 0;
-	size_t totalVertices = 0;
-	totalPrimitives += spheres.size();
-	for (const auto& model : models) {
-		totalVertices += model->getVertices().size();
-		totalTriangles += model->getIndices().size() / 3;
-	}
-
-	totalPrimitives += totalTriangles;
-	size_t primitiveBufferSize = roundUp(totalPrimitives, BufferWidth);
-	size_t materialBufferSize = roundUp(sphereMaterials.size() + modelMaterials.size(), BufferWidth);
-	size_t vertexBufferSize = roundUp(totalVertices, BufferWidth);
-	size_t triangleBufferSize = roundUp(totalTriangles, BufferWidth);
-	std::vector<Vertex> vertices(vertexBufferSize);
-	std::vector<Triangle> triangles(totalTriangles);
-	std::vector<Primitive> primitives;
-	std::vector<Material> materials(materialBufferSize);
-	int primitiveCnt = 0;
-	int materialCnt = 0;
-	int vertexCnt = 0;
-	int triangleCnt = 0;
-
-	if (!spheres.empty()) {
-		for (int i = 0; i < spheres.size(); ++i) {
-			primitives.push_back(Primitive(Primitive::Type::Sphere, 
-				primitiveCnt + i, materialCnt + i, const_cast<Sphere*>(&spheres[i])));
+void RayTracing::renderCPUFrame() {
+	{
+		std::lock_guard<std::mutex> lock(_cpuImageMutex);
+		if (_cpuImageUpdated) {
+			_cpuFrame->bind();
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, _windowWidth, _windowHeight, GL_RGB, GL_FLOAT, _cpuImage.data());
+			_cpuImageUpdated = false;
 		}
+	}
 
-		for (const auto& material : sphereMaterials) {
-			materials[materialCnt++] = material;
-		}
+	_drawScreenShader->use();
+	_drawScreenShader->setUniformInt("frame", 0);
 
-		std::vector<Sphere> sphereBuffer(roundUp(spheres.size(), BufferWidth));
-		for (int i = 0; i < spheres.size(); ++i) {
-			sphereBuffer[i] = spheres[i];
-		}
+	_cpuFrame->bind(0);
+	_screenQuad->draw();
+}
 
-		_sphereBuffer.reset(new Texture2D(GL_RGBA32F, BufferWidth, 
-			getBufferHeight(sphereBuffer.size(), sizeof(Sphere), Sphere::getTexDataComponent()), 
-			GL_RGBA, GL_FLOAT, sphereBuffer.data()));
-		_sphereBuffer->bind();
-		_sphereBuffer->setParamterInt(GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		_sphereBuffer->setParamterInt(GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		_sphereBuffer->setParamterInt(GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		_sphereBuffer->setParamterInt(GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		_sphereBuffer->unbind();
-	} else {
-		_sphereBuffer.reset(new Texture2D(GL_RGBA32F, BufferWidth, 
-			getBufferHeight(1, sizeof(Sphere), Sphere::getTexDataComponent()), 
-			GL_RGBA, GL_FLOAT, nullptr));
-	}
-
-	if (!models.empty()) {
-		for (int i = 0; i < models.size(); ++i) {
-			const auto& modelVertices = models[i]->getVertices();
-			const auto& vertIndices = models[i]->getIndices();
-			for (int j = 0, k = 0; j < vertIndices.size(); j += 3, ++k) {
-				triangles[triangleCnt] = Triangle(vertIndices[j] + vertexCnt,
-					vertIndices[j + 1] + vertexCnt,
-					vertIndices[j + 2] + vertexCnt,
-					vertices.data());
-				primitives.push_back(Primitive(Primitive::Type::Triangle,
-					triangleCnt,
-					materialCnt + i,
-					const_cast<Triangle*>(&triangles[triangleCnt])));
-				triangleCnt++;
-			}
+void RayTracing::drawDenoisedFrame() {
+	_denoiseShader->use();
+	_denoiseShader->setUniformFloat("colorSigma", _denoise.colorSigma);
+	_denoiseShader->setUniformFloat("normalSigma", _denoise.normalSigma);
+	_denoiseShader->setUniformFloat("depthSigma", _denoise.depthSigma);
+	_denoiseShader->setUniformFloat("albedoSigma", _denoise.albedoSigma);
+
+	_denoiseShader->setUniformInt("variance", 1);
+	_varianceFrames[_currentWriteBufferID]->bind(1);
+	_denoiseShader->setUniformInt("albedoDepth", 2);
+	_albedoDepthFrames[_currentWriteBufferID]->bind(2);
+	_denoiseShader->setUniformInt("normal", 3);
+	_normalFrames[_currentWriteBufferID]->bind(3);
+
+	// the illumination of the frame, then one pass per iteration, the last one draws to the screen
+	_denoiseShader->setUniformInt("frame", 0);
+	_denoiseShader->setUniformInt("pass", 0);
+	_outFrames[_currentWriteBufferID]->bind(0);
+	_denoiseFramebuffers[0]->bind();
+	_screenQuad->draw();
 
-			if (transforms[i] != glm::mat4(1.0f)) {
-				const auto& transform = transforms[i];
-				auto invTransposeTransform = glm::mat3(glm::transpose(glm::inverse(transform)));
-				for (const auto& vertex : modelVertices) {
-					vertices[vertexCnt++] = {transform * glm::vec4(vertex.position, 1.0f),
-					                    invTransposeTransform * vertex.normal, 
-										vertex.texCoord};
-				}
-			} else {
-				for (const auto& vertex : modelVertices) {
-					vertices[vertexCnt++] = vertex;
-				}
-			}
+	const int iterations = std::max(_denoise.iterations, 1);
+	for (int i = 0; i < iterations; ++i) {
+		const bool lastPass = i + 1 == iterations;
+		_denoiseShader->setUniformInt("pass", lastPass ? 2 : 1);
+		_denoiseShader->setUniformInt("stepWidth", 1 << i);
+		_denoiseFrames[i % 2]->bind(0);
+		if (lastPass) {
+			_denoiseFramebuffers[i % 2]->unbind();
+		} else {
+			_denoiseFramebuffers[(i + 1) % 2]->bind();
 		}
+		_screenQuad->draw();
+	}
+}
+
+void RayTracing::createRenderScene(int index) {
+	SceneDescription desc = createSceneDescription(index, _balls, _ballMaterials,
+		MeshData(_lucy->getVertices(), _lucy->getIndices()));
+
+	_camera->transform.position = desc.cameraPosition;
+	_camera->transform.lookAt(desc.cameraTarget);
+
+	_useBVH = desc.useBVH;
+
+	BVHBuildOptions options;
+	options.method = static_cast<BVHBuildMethod>(_bvhMethodIndex);
+	_scene.reset(new Scene(desc, options, _bvhCache.get()));
 
-		for (const auto& material : modelMaterials) {
-			materials[materialCnt++] = material;
+	createPrimitiveBuffer(*_scene);
+}
+
+void RayTracing::createPrimitiveBuffer(const Scene& scene) {
+	const auto& spheres = scene.spheres;
+	const auto& primitives = scene.primitives;
+	const size_t totalVertices = scene.vertices.size();
+	const size_t totalTriangles = scene.triangles.size();
+
+	if (_useTextureBuffers) {
+		// the largest buffers must fit GL_MAX_TEXTURE_BUFFER_SIZE, 2D textures have no such limit
+		size_t bvhNodes = 2 * std::max(2 * primitives.size(), MinTopLevelCapacity);
+		for (const auto& blas : scene.blas) {
+			bvhNodes += blas->nodes.size();
 		}
 
-		_vertexBuffer.reset(new Texture2D(
-			GL_RGBA32F, BufferWidth, 
-			getBufferHeight(vertexBufferSize, sizeof(Vertex), Sphere::getTexDataComponent()), 
-			GL_RGBA, GL_FLOAT, vertices.data()));
-		_vertexBuffer->bind();
-		_vertexBuffer->setParamterInt(GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		_vertexBuffer->setParamterInt(GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		_vertexBuffer->setParamterInt(GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		_vertexBuffer->setParamterInt(GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		_vertexBuffer->unbind();
-
-		std::vector<glm::ivec3> triangleIndex(triangleBufferSize);
-		int triangleIndexCnt = 0;
-		for (const auto& triangle : triangles) {
-			triangleIndex[triangleIndexCnt++] = { triangle.v[0], triangle.v[1], triangle.v[2] };
+		const size_t maxTexels = std::max({ 2 * totalVertices, totalTriangles, 2 * bvhNodes });
+		if (maxTexels > static_cast<size_t>(TextureBuffer::getMaxTexels())) {
+			std::cout << "data buffers exceed GL_MAX_TEXTURE_BUFFER_SIZE, fall back to 2D textures" << std::endl;
+			_useTextureBuffers = false;
+			initShaders();
 		}
+	}
+
+	// spheres and materials get room for the edits of Scene, see updatePrimitiveBuffer
+	_sphereCapacity = roundUp(spheres.size(), BufferWidth);
+	_sphereBuffer = createDataBuffer(GL_RGBA32F, GL_RGBA, GL_FLOAT, spheres.data(),
+		sizeof(Sphere), sizeof(Sphere) / sizeof(glm::vec4), spheres.size(), _sphereCapacity);
 
-		_indexBuffer.reset(new Texture2D(
-			GL_RGB32I, BufferWidth,
-			getBufferHeight(triangleIndex.size(), sizeof(glm::ivec3), Triangle::getIndexTexDataComponent()),
-			GL_RGB_INTEGER, GL_INT, triangleIndex.data()));
-		_indexBuffer->bind();
-		_indexBuffer->setParamterInt(GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		_indexBuffer->setParamterInt(GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		_indexBuffer->setParamterInt(GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		_indexBuffer->setParamterInt(GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		_indexBuffer->unbind();
+	_vertexBuffer = createDataBuffer(GL_RGBA32F, GL_RGBA, GL_FLOAT, scene.vertices.data(),
+		sizeof(Vertex), sizeof(Vertex) / sizeof(glm::vec4), totalVertices, totalVertices);
+
+	std::vector<glm::ivec3> triangleIndex;
+	triangleIndex.reserve(totalTriangles);
+	for (const auto& triangle : scene.triangles) {
+		triangleIndex.push_back({ triangle.v[0], triangle.v[1], triangle.v[2] });
+	}
+
+	_indexBuffer = createDataBuffer(GL_RGB32I, GL_RGB_INTEGER, GL_INT, triangleIndex.data(),
+		sizeof(glm::ivec3), 1, totalTriangles, totalTriangles);
+
+	std::vector<Material> materials;
+	materials.reserve(scene.materials.size());
+	for (const auto& material : scene.materials) {
+		materials.push_back(toShaderMaterial(material));
+	}
+
+	_materialCapacity = roundUp(materials.size(), BufferWidth);
+	_materialBuffer = createDataBuffer(GL_RGB32F, GL_RGB, GL_FLOAT, materials.data(),
+		sizeof(Material), sizeof(Material) / sizeof(glm::vec3), materials.size(), _materialCapacity);
+
+	// the top level is a flat list without BVH, otherwise the TLAS, the BLAS of the meshes follow it.
+	// The top level gets room to grow, so spheres added later do not move the BLAS
+	_topLevelCapacity = std::max(2 * primitives.size(), MinTopLevelCapacity);
+	std::vector<BVHNode> linearBVH;
+	std::vector<ShaderPrimitive> linearPrimitives;
+	if (!_useBVH) {
+		for (const auto& prim : primitives) {
+			linearPrimitives.push_back({ static_cast<int>(prim.type), prim.shapeIdx, prim.materialIdx });
+		}
+		_raytracingShader->use();
+		_raytracingShader->setUniformInt("nPrimitives", static_cast<int>(primitives.size()));
 	} else {
-		_vertexBuffer.reset(new Texture2D(
-			GL_RGBA32F, BufferWidth, 
-			getBufferHeight(1, sizeof(Vertex), Sphere::getTexDataComponent()), 
-			GL_RGBA, GL_FLOAT, nullptr));
-		_indexBuffer.reset(new Texture2D(
-			GL_RGB32I, BufferWidth,
-			getBufferHeight(1, sizeof(glm::ivec3), Triangle::getIndexTexDataComponent()),
-			GL_RGB_INTEGER, GL_INT, nullptr));
-	}
-
-	if (!materials.empty()) {
-		for (auto& material : materials) {
-			material.type = static_cast<Material::Type>(toFloatLayout(static_cast<int>(material.type)));
+		const BVH& bvh = *scene.bvh;
+
+		std::cout << "BVH Statistics" << std::endl;
+		std::cout << "+ method:     " << BVH::getBuildMethodName(static_cast<BVHBuildMethod>(_bvhMethodIndex)) << std::endl;
+		std::cout << "+ build time: " << scene.bvhBuildTime << " ms" << std::endl;
+		std::cout << "+ nodes:      " << bvh.nodes.size() << std::endl;
+		std::cout << "+ height:     " << bvh.height << " (max " << bvh.maxHeight << ")" << std::endl;
+		std::cout << "+ SAH cost:   " << bvh.sahCost << std::endl;
+		std::cout << "+ BLAS:       " << scene.blas.size() << " (" << scene.cachedBLAS << " cached)" << std::endl;
+		for (size_t i = 0; i < scene.blas.size(); ++i) {
+			std::cout << "  - BLAS " << i << ": " << scene.blas[i]->buildTime << " ms, SAH cost " << scene.blas[i]->sahCost << std::endl;
 		}
 
-		_materialBuffer.reset(new Texture2D(GL_RGB32F, BufferWidth, 
-			getBufferHeight(materials.size(), sizeof(Material), Material::getTexDataComponent()),
-			GL_RGB, GL_FLOAT, materials.data()));
-		_materialBuffer->bind(0);
-		_materialBuffer->setParamterInt(GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		_materialBuffer->setParamterInt(GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		_materialBuffer->setParamterInt(GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		_materialBuffer->setParamterInt(GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		_materialBuffer->unbind();
+		appendBVH(bvh, linearBVH, linearPrimitives);
+
+		// a tree over n primitives has at most 2n - 1 nodes
+		linearBVH.resize(2 * _topLevelCapacity - 1);
+	}
+
+	linearPrimitives.resize(_topLevelCapacity);
+
+	_blasRoots.clear();
+	for (const auto& blas : scene.blas) {
+		_blasRoots.push_back(static_cast<int>(linearBVH.size()));
+		appendBVH(*blas, linearBVH, linearPrimitives);
+	}
+
+	_bvhNodes.clear();
+	_bvhNodes.reserve(linearBVH.size());
+	for (const auto& node : linearBVH) {
+		_bvhNodes.push_back(toShaderBVHNode(node));
+	}
+
+	_bvhBuffer = createDataBuffer(GL_RGBA32F, GL_RGBA, GL_FLOAT, _bvhNodes.data(),
+		sizeof(ShaderBVHNode), sizeof(ShaderBVHNode) / sizeof(glm::vec4), _bvhNodes.size(), _bvhNodes.size());
+
+	_primitiveBuffer = createDataBuffer(GL_RGB32I, GL_RGB_INTEGER, GL_INT, linearPrimitives.data(),
+		sizeof(ShaderPrimitive), 1, linearPrimitives.size(), linearPrimitives.size());
+
+	std::vector<ShaderInstance> instances;
+	instances.reserve(scene.instances.size());
+	for (const auto& instance : scene.instances) {
+		instances.push_back(toShaderInstance(instance));
+	}
+
+	_instanceBuffer = createDataBuffer(GL_RGBA32F, GL_RGBA, GL_FLOAT, instances.data(),
+		sizeof(ShaderInstance), sizeof(ShaderInstance) / sizeof(glm::vec4), instances.size(), instances.size());
+
+	createLightBuffer(scene);
+
+	// the sky stays, but the storage of the data buffers may have changed
+	const std::vector<float>& skyCdf = _environmentMap->getCdf();
+	_skyDistribution = createDataBuffer(GL_R32F, GL_RED, GL_FLOAT, skyCdf.data(),
+		sizeof(float), 1, skyCdf.size(), skyCdf.size());
+
+	std::cout << "Scene Statistics" << std::endl;
+	std::cout << "+ Spheres: " << spheres.size() << " (" << scene.lights.size() << " lights)" << std::endl;
+	std::cout << "+ Models:  "  << scene.meshes << " (" << scene.blas.size() << " distinct)" << std::endl;
+	std::cout << "  + vertices:  " << totalVertices << std::endl;
+	std::cout << "  + triangles: " << totalTriangles << std::endl;
+
+	_scene->clearChanges();
+}
+
+void RayTracing::createLightBuffer(const Scene& scene) {
+	std::vector<glm::ivec2> lights;
+	lights.reserve(scene.lights.size());
+	for (int sphere : scene.lights) {
+		lights.push_back(glm::ivec2(sphere, scene.getSphereMaterial(sphere)));
+	}
+
+	_lightBuffer = createDataBuffer(GL_RG32I, GL_RG_INTEGER, GL_INT, lights.data(),
+		sizeof(glm::ivec2), 1, lights.size(), lights.size());
+}
+
+std::unique_ptr<Texture> RayTracing::createDataBuffer(GLenum internalFormat, GLenum format, GLenum type,
+	const void* data, size_t elementSize, size_t texelsPerElement, size_t count, size_t capacity) const {
+	// a zero sized texture is incomplete, the shader may still bind it
+	capacity = std::max(capacity, std::max(count, static_cast<size_t>(1)));
+
+	std::unique_ptr<Texture> buffer;
+	if (_useTextureBuffers) {
+		buffer.reset(new TextureBuffer(internalFormat, capacity * elementSize));
 	} else {
-		_materialBuffer.reset(new Texture2D(GL_RGB32F, BufferWidth, 
-			getBufferHeight(1, sizeof(Material), Material::getTexDataComponent()),
-			GL_RGB, GL_FLOAT, nullptr));
+		const size_t height = (capacity * texelsPerElement + BufferWidth - 1) / BufferWidth;
+		buffer.reset(new Texture2D(internalFormat, BufferWidth, static_cast<int>(height), format, type));
+	}
+
+	if (count > 0) {
+		updateBufferTexels(*buffer, format, type, data, elementSize, texelsPerElement, 0, count);
+	}
+
+	return buffer;
+}
+
+void RayTracing::updatePrimitiveBuffer(Scene& scene) {
+	const SceneChanges& changes = scene.changes;
+	const size_t primitiveCount = _useBVH ? scene.bvh->orderedPrimitives.size() : scene.primitives.size();
+	const bool fits =
+		primitiveCount <= _topLevelCapacity &&
+		(!_useBVH || scene.bvh->nodes.size() <= 2 * _topLevelCapacity - 1) &&
+		static_cast<size_t>(changes.spheres.end) <= _sphereCapacity &&
+		static_cast<size_t>(changes.materials.end) <= _materialCapacity;
+	if (!fits) {
+		// the top level outgrew the room left for it, the BLAS move
+		createPrimitiveBuffer(scene);
+		return;
+	}
+
+	if (!changes.spheres.empty()) {
+		updateBufferTexels(*_sphereBuffer, GL_RGBA, GL_FLOAT, &scene.spheres[changes.spheres.begin],
+			sizeof(Sphere), sizeof(Sphere) / sizeof(glm::vec4), changes.spheres.begin, changes.spheres.end);
 	}
 
-	if (!primitives.empty()) {
+	if (!changes.materials.empty()) {
+		std::vector<Material> materials;
+		for (int i = changes.materials.begin; i < changes.materials.end; ++i) {
+			materials.push_back(toShaderMaterial(scene.materials[i]));
+		}
+
+		updateBufferTexels(*_materialBuffer, GL_RGB, GL_FLOAT, materials.data(),
+			sizeof(Material), sizeof(Material) / sizeof(glm::vec3), changes.materials.begin, changes.materials.end);
+	}
+
+	if (!changes.instances.empty()) {
+		std::vector<ShaderInstance> instances;
+		for (int i = changes.instances.begin; i < changes.instances.end; ++i) {
+			instances.push_back(toShaderInstance(scene.instances[i]));
+		}
+
+		updateBufferTexels(*_instanceBuffer, GL_RGBA, GL_FLOAT, instances.data(),
+			sizeof(ShaderInstance), sizeof(ShaderInstance) / sizeof(glm::vec4),
+			changes.instances.begin, changes.instances.end);
+	}
+
+	if (changes.tlasRebuilt) {
+		// the top level is rewritten in the room reserved for it, the BLAS stay in place
+		std::vector<BVHNode> linearBVH;
+		std::vector<ShaderPrimitive> linearPrimitives;
 		if (!_useBVH) {
-			std::vector<ShaderPrimitive> orderedPrim(roundUp(primitives.size(), BufferWidth));
-			int primCnt = 0;
-			for (const auto& prim : primitives) {
-				orderedPrim[primCnt++] = { static_cast<int>(prim.type), prim.shapeIdx, prim.materialIdx };
+			for (const auto& prim : scene.primitives) {
+				linearPrimitives.push_back({ static_cast<int>(prim.type), prim.shapeIdx, prim.materialIdx });
 			}
-			_bvhBuffer.reset(new Texture2D(GL_RGB32F, BufferWidth, 
-				getBufferHeight(1, sizeof(BVHNode), BVHNode::getTexDataComponent()), 
-				GL_RGB, GL_FLOAT, nullptr));
-
-			_primitiveBuffer.reset(new Texture2D(GL_RGB32I, BufferWidth, 
-				getBufferHeight(orderedPrim.size(), sizeof(ShaderPrimitive), Primitive::getTexDataComponent()), 
-				GL_RGB_INTEGER, GL_INT, orderedPrim.data()));
-			_primitiveBuffer->bind();
-			_primitiveBuffer->setParamterInt(GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-			_primitiveBuffer->setParamterInt(GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-			_primitiveBuffer->setParamterInt(GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-			_primitiveBuffer->setParamterInt(GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-			_primitiveBuffer->unbind();
 			_raytracingShader->use();
-			_raytracingShader->setUniformInt("nPrimitives", static_cast<int>(primitives.size()));
+			_raytracingShader->setUniformInt("nPrimitives", static_cast<int>(scene.primitives.size()));
+		} else {
+			appendBVH(*scene.bvh, linearBVH, linearPrimitives);
+			updateBVHBuffer(*scene.bvh, 0, static_cast<int>(scene.bvh->nodes.size()));
+		}
 
+		if (!linearPrimitives.empty()) {
+			updateBufferTexels(*_primitiveBuffer, GL_RGB_INTEGER, GL_INT, linearPrimitives.data(),
+				sizeof(ShaderPrimitive), 1, 0, linearPrimitives.size());
+		}
+	} else if (_useBVH) {
+		updateBVHBuffer(*scene.bvh, changes.tlasNodes.begin, changes.tlasNodes.end);
+	}
+
+	if (changes.lightsChanged) {
+		createLightBuffer(scene);
+	}
+
+	scene.clearChanges();
+}
+
+void RayTracing::appendBVH(
+	const BVH& bvh, std::vector<BVHNode>& nodes, std::vector<ShaderPrimitive>& primitives) {
+	const int nodeOffset = static_cast<int>(nodes.size());
+	const int primitiveOffset = static_cast<int>(primitives.size());
+	for (auto node : bvh.nodes) {
+		if (node.isLeaf()) {
+			node.startIndex += primitiveOffset;
 		} else {
-			// build BVH
-			BVH bvh(primitives);
-			auto& linearBVH = bvh.nodes;
-			for (auto& node : linearBVH) {
-				node.type = static_cast<BVHNode::Type>(toFloatLayout(static_cast<int>(node.type)));
-				node.leftChild = toFloatLayout(node.leftChild);
-				node.rightChild = toFloatLayout(node.rightChild);
-			}
+			node.rightChild += nodeOffset;
+		}
+		nodes.push_back(node);
+	}
 
-			std::vector<BVHNode> nodes(roundUp(linearBVH.size(), BufferWidth));
-			int nodeCnt = 0;
-			for (const auto& node : linearBVH) {
-				nodes[nodeCnt++] = node;
-			}
+	for (const auto& prim : bvh.orderedPrimitives) {
+		primitives.push_back({ static_cast<int>(prim.type), prim.shapeIdx, prim.materialIdx });
+	}
+}
 
-			_bvhBuffer.reset(new Texture2D(GL_RGB32F, BufferWidth, 
-				getBufferHeight(nodes.size(), sizeof(BVHNode), BVHNode::getTexDataComponent()), 
-				GL_RGB, GL_FLOAT, nodes.data()));
-			_bvhBuffer->bind();
-			_bvhBuffer->setParamterInt(GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-			_bvhBuffer->setParamterInt(GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-			_bvhBuffer->setParamterInt(GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-			_bvhBuffer->setParamterInt(GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-			_bvhBuffer->unbind();
-
-			std::vector<ShaderPrimitive> orderedPrim(roundUp(bvh.orderedPrimitives.size(), BufferWidth));
-			int primCnt = 0;
-			for (const auto& prim : bvh.orderedPrimitives) {
-				orderedPrim[primCnt++] = { static_cast<int>(prim.type), prim.shapeIdx, prim.materialIdx };
-			}
+void RayTracing::animateBalls() {
+	// spheres added in the editor come after the balls and stay in place
+	if (_scene->spheres.size() < _balls.size()) {
+		return;
+	}
+
+	_animationTime += _deltaTime;
 
-			_primitiveBuffer.reset(new Texture2D(GL_RGB32I, BufferWidth, 
-				getBufferHeight(orderedPrim.size(), sizeof(ShaderPrimitive), Primitive::getTexDataComponent()), 
-				GL_RGB_INTEGER, GL_INT, orderedPrim.data()));
-			_primitiveBuffer->bind();
-			_primitiveBuffer->setParamterInt(GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-			_primitiveBuffer->setParamterInt(GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-			_primitiveBuffer->setParamterInt(GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-			_primitiveBuffer->setParamterInt(GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-			_primitiveBuffer->unbind();
+	// the ground and the three big spheres at the end stay in place
+	for (size_t i = 1; i + 3 < _balls.size(); ++i) {
+		const int handle = static_cast<int>(i);
+		if (!_scene->hasSphere(handle)) {
+			continue;
 		}
+
+		const float phase = 0.7f * static_cast<float>(i);
+		Sphere sphere = _balls[i];
+		sphere.position.y += 0.5f * std::abs(std::sin(4.0f * _animationTime + phase));
+		_scene->setSphere(handle, sphere);
 	}
 
-	std::cout << "Scene Statistics" << std::endl;
-	std::cout << "+ Spheres: " << spheres.size() << std::endl;
-	std::cout << "+ Models:  "  << models.size() << std::endl;
-	std::cout << "  + vertices:  " << totalVertices << std::endl;
-	std::cout << "  + triangles: " << totalTriangles << std::endl;
+	_scene->update();
+	updatePrimitiveBuffer(*_scene);
+
+	_sampleCount = 0;
 }
 
-void RayTracing::createScene1() {
-	_camera->transform.position = glm::vec3(0.0f, 0.0f, 12.0f);
-	_camera->transform.lookAt(glm::vec3(0.0f));
+void RayTracing::editScene() {
+	// the render thread reads the scene, it restarts with the edited one
+	const bool cpuRendering = _rendererIndex == 1;
+	if (cpuRendering) {
+		stopCPURender();
+	}
 
-	_useBVH = false;
+	if (_materialEdited && _scene->hasSphere(_editSphere)) {
+		_scene->setMaterial(_scene->getSphereMaterial(_editSphere), _editMaterial);
+	}
 
-	createPrimitiveBuffer(
-		{
-			Sphere(glm::vec3(0.0f, 0.0f, 0.0f), 1.5f),
-			Sphere(glm::vec3(4.0f, 0.0f, 0.0f), 1.5f),
-			Sphere(glm::vec3(-4.0f, 0.0f, 0.0f), 1.5f)
-		}, 
-		{},
-		{},
-		{
-			Material(Material::Type::Dielectric, 1.5f, 0.0f, glm::vec3(1.0f, 1.0f, 1.0f)),
-			Material(Material::Type::Metal, 1.0f, 0.0f, glm::vec3(0.7f, 0.6f, 0.5f)),
-			Material(Material::Type::Lambertian, 1.0f, 0.0f, glm::vec3(0.8f, 0.4f, 0.2f))
-		},
-		{});
+	if (_removeSphere && _scene->hasSphere(_editSphere)) {
+		_scene->removeSphere(_editSphere);
+	}
+
+	if (_addSphere) {
+		// a small ball in front of the camera
+		const glm::vec3 position = _camera->transform.position + 4.0f * _camera->transform.getFront();
+		_editSphere = _scene->addSphere(Sphere(position, 0.3f),
+			Material(Material::Type::Lambertian, 1.0f, 0.0f, glm::vec3(0.8f, 0.3f, 0.3f)));
+	}
+
+	_materialEdited = false;
+	_addSphere = false;
+	_removeSphere = false;
+
+	_scene->update();
+	updatePrimitiveBuffer(*_scene);
+	_sampleCount = 0;
+
+	if (cpuRendering) {
+		startCPURender();
+	}
 }
 
-void RayTracing::createScene2() {
-	_camera->transform.position = glm::vec3(15.0f, 3.0f, 4.0f);
-	_camera->transform.lookAt(glm::vec3(0.0f));
+void RayTracing::updateBVHBuffer(const BVH& bvh, int dirtyBegin, int dirtyEnd) {
+	if (dirtyBegin >= dirtyEnd) {
+		return;
+	}
 
-	_useBVH = true;
+	// the TLAS is appended first, so its node and primitive indices need no offset
+	for (int i = dirtyBegin; i < dirtyEnd; ++i) {
+		_bvhNodes[i] = toShaderBVHNode(bvh.nodes[i]);
+	}
 
-	createPrimitiveBuffer(
-		_balls, 
-		{},
-		{},
-		_ballMaterials,
-		{});
+	updateBufferTexels(*_bvhBuffer, GL_RGBA, GL_FLOAT, &_bvhNodes[dirtyBegin],
+		sizeof(ShaderBVHNode), sizeof(ShaderBVHNode) / sizeof(glm::vec4), dirtyBegin, dirtyEnd);
 }
 
-void RayTracing::createScene3() {
-	_camera->transform.position = glm::vec3(15.0f, 3.0f, 4.0f);
-	_camera->transform.lookAt(glm::vec3(0.0f));
+void RayTracing::updateBufferTexels(Texture& texture, GLenum format, GLenum type, const void* data,
+	size_t elementSize, size_t texelsPerElement, size_t begin, size_t end) {
+	if (const TextureBuffer* textureBuffer = dynamic_cast<const TextureBuffer*>(&texture)) {
+		// a texture buffer is one flat array, no rows to split the range into
+		textureBuffer->update(begin * elementSize, (end - begin) * elementSize, data);
+		return;
+	}
+
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	const size_t texelSize = elementSize / texelsPerElement;
+	const size_t texelEnd = end * texelsPerElement;
+	size_t texel = begin * texelsPerElement;
+
+	texture.bind();
+	while (texel < texelEnd) {
+		const int x = static_cast<int>(texel % BufferWidth);
+		const int y = static_cast<int>(texel / BufferWidth);
+		const int count = static_cast<int>(std::min(texelEnd - texel, static_cast<size_t>(BufferWidth - x)));
+		if (x == 0 && count == BufferWidth) {
+			// whole rows go in one call
+			const int rows = static_cast<int>((texelEnd - texel) / BufferWidth);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, BufferWidth, rows, format, type, bytes);
+			bytes += rows * BufferWidth * texelSize;
+			texel += rows * BufferWidth;
+		} else {
+			glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, count, 1, format, type, bytes);
+			bytes += count * texelSize;
+			texel += count;
+		}
+	}
+	texture.unbind();
+}
+
+Material RayTracing::toShaderMaterial(const Material& material) {
+	// the shader reads the type from a float texture
+	Material shaderMaterial = material;
+	shaderMaterial.type = static_cast<Material::Type>(toFloatLayout(static_cast<int>(material.type)));
+	return shaderMaterial;
+}
+
+ShaderInstance RayTracing::toShaderInstance(const Instance& instance) const {
+	ShaderInstance shaderInstance;
+	for (int i = 0; i < 3; ++i) {
+		shaderInstance.worldToObject[i] = glm::row(instance.worldToObject, i);
+		shaderInstance.objectToWorld[i] = glm::row(instance.objectToWorld, i);
+	}
+	shaderInstance.info = glm::vec4(static_cast<float>(_blasRoots[instance.meshIdx]),
+		static_cast<float>(instance.materialIdx), 0.0f, 0.0f);
+	return shaderInstance;
+}
+
+bool RayTracing::supportsTextureBuffers() {
+	GLint major = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	if (major >= 4) {
+		return true;
+	}
+
+	GLint nExtensions = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &nExtensions);
+	for (GLint i = 0; i < nExtensions; ++i) {
+		const char* name = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+		if (name != nullptr && std::strcmp(name, "GL_ARB_texture_buffer_object_rgb32") == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
 
-	glm::mat4 scaleT = glm::scale(glm::mat4(1.0f), glm::vec3(0.6f, 0.6f, 0.6f));
-	glm::mat4 rotateT = glm::rotate(glm::mat4(1.0f), glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-
-	_useBVH = true;
-
-	std::vector<glm::mat4> transformations = {
-		rotateT * scaleT,
-		glm::translate(glm::mat4(1.0f), glm::vec3(-4.0f, 0.0f,  2.0f)) * rotateT * scaleT,
-		glm::translate(glm::mat4(1.0f), glm::vec3( 4.0f, 0.0f, -2.0f)) * rotateT * scaleT
-	};
-
-	std::vector<Material> modelMaterials = {
-		Material(Material::Type::Dielectric, 1.5f, 0.0f, glm::vec3(1.0f, 1.0f, 1.0f)),
-		Material(Material::Type::Metal,      1.0f, 0.0f, glm::vec3(0.7f, 0.6f, 0.5f)),
-		Material(Material::Type::Lambertian, 1.0f, 0.0f, glm::vec3(0.8f, 0.4f, 0.2f))
-	};
-
-	createPrimitiveBuffer(
-		_balls, 
-		{ _lucy.get(), _lucy.get(), _lucy.get() },
-		transformations,
-		_ballMaterials,
-		modelMaterials);
+ShaderBVHNode RayTracing::toShaderBVHNode(const BVHNode& node) {
+	ShaderBVHNode shaderNode;
+	shaderNode.v[0] = glm::vec4(node.box.pMin, node.box.pMax.x);
+	shaderNode.v[1] = glm::vec4(node.box.pMax.y, node.box.pMax.z,
+		static_cast<float>(node.startIndex), static_cast<float>(node.nPrimitives));
+	return shaderNode;
 }
 
 int RayTracing::toFloatLayout(int v) {
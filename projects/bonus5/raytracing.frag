@@ -1,18 +1,24 @@
 #version 330 core
 layout (location = 0) out vec4 fragColor;
 layout (location = 1) out uint fragRngState;
+layout (location = 2) out vec4 fragVariance;
+layout (location = 3) out vec4 fragAlbedoDepth;   // mean albedo and depth of the first hits
+layout (location = 4) out vec4 fragNormal;        // mean facing normal of the first hits
 
 in vec2 screenTexCoord;
 
 const int LAMBERTIAN_MATERIAL = 0;
 const int METAL_MATERIAL = 1;
 const int DIELECTRIC_MATERIAL = 2;
+const int EMISSIVE_MATERIAL = 3;    // albedo is the emitted radiance, emitters do not scatter
 
 const int SPHERE_SHAPE = 0;
 const int TRIANGLE_SHAPE = 1;
+const int INSTANCE_SHAPE = 2;
 
 const int BVH_INTERIOR_NODE = 0;
 const int BVH_LEAF_NODE = 1;
+const int BVH_STACK_SIZE = 128;     // nodes left to visit, the same bound as BVH::intersectSubtree
 
 const int DATA_BUFFER_WIDTH = 2048;
 
@@ -20,6 +26,8 @@ const float INFINITY = 10e10f;
 const float FloatOneMinusEpsilon = 0.99999994f;
 const float Pi = 3.14159265358979323846f;
 const float Epsilon = 1e-3f;
+const float MinHitCosine = 1e-4f;   // rays closer to the plane of a triangle miss it, Triangle::MinHitCosine
+const float SkyDepth = 1e4f;    // depth feature of the sky, PixelFeatures::SkyDepth
 
 const int windowWidth = 1200;
 const int maxTraceDepth = 16;
@@ -73,11 +81,18 @@ struct Material {
 };
 
 struct Primitive {
-    int shapeType; // 0: sphere 1 : triangle
+    int shapeType; // 0: sphere 1 : triangle 2: instance
     int shapeIdx;
     int materialIdx;
 };
 
+struct Instance {
+    mat4 worldToObject;
+    mat4 objectToWorld;
+    int blasRoot;    // root node of the mesh BVH in bvh
+    int materialIdx;
+};
+
 struct Interaction {
     Primitive primitive;
     Vertex hitPoint;
@@ -91,20 +106,56 @@ struct BVHNode {
     int secondVal; // rightChild / nPrimitives
 };
 
+// what a camera ray hit first, guides the denoiser, see PixelFeatures
+struct PixelFeatures {
+    vec3 albedo;    // 1 for the sky and lights
+    vec3 normal;    // facing the camera
+    float depth;
+};
+
 uniform sampler2D RTResult;
 uniform usampler2D oldRngState;
 
 uniform uint totalSamples;
+
+// denoiser features, accumulated like RTResult
+uniform sampler2D oldAlbedoDepth;
+uniform sampler2D oldNormal;
+
+// adaptive sampling, mirrors adaptive_sampling.h
+uniform sampler2D oldVariance;  // sample count, mean and m2 of the luminance
+uniform bool adaptiveSampling;
+uniform float varianceThreshold;
+uniform uint minSamples;
+uniform int maxSamplesPerPass;
 uniform int nPrimitives;
+uniform bool useBVH;    // the top level is a BVH, else a flat list of nPrimitives
 
 // Scene Config 
 uniform samplerCube sky;
-uniform sampler2D sphereBuffer;
-uniform sampler2D vertexBuffer;
-uniform isampler2D triangleIndexBuffer;
-uniform sampler2D materialBuffer;
-uniform isampler2D primitiveBuffer;
-uniform sampler2D bvh;
+// data buffers are texture buffers with USE_TEXTURE_BUFFER, else 2D textures DATA_BUFFER_WIDTH wide
+#ifdef USE_TEXTURE_BUFFER
+#define DataBuffer samplerBuffer
+#define IDataBuffer isamplerBuffer
+#else
+#define DataBuffer sampler2D
+#define IDataBuffer isampler2D
+#endif
+
+uniform DataBuffer sphereBuffer;
+uniform DataBuffer vertexBuffer;
+uniform IDataBuffer triangleIndexBuffer;
+uniform DataBuffer materialBuffer;
+uniform IDataBuffer primitiveBuffer;
+uniform DataBuffer bvh;
+uniform DataBuffer instanceBuffer;
+
+// light sampling, mirrors CPURenderer::sampleDirectLight
+uniform bool lightSampling;
+uniform int nLights;
+uniform IDataBuffer lightBuffer;        // sphere and material index of every emissive sphere
+uniform DataBuffer skyDistribution;     // cdf over the sky cells, see EnvironmentMap::getCdf
+uniform int skyDistributionSize;        // cells per face side, 0 for a black sky
 
 uniform Camera camera;
 
@@ -130,14 +181,124 @@ vec3 getHitPoint(inout Ray ray, float t);
 /**
  * Summary: trace the ray in the scene and calculate the color of pixel
  * Parameters:
- *     ray: the ray
+ *     ray     : the ray
+ *     features: receives what the ray hit first
  * Return: the color of pixel
  */
-vec4 trace(inout Ray ray);
+vec4 trace(inout Ray ray, out PixelFeatures features);
 
 vec3 gammaCorrection(vec3 color);
 vec3 inverseGammaCorrection(vec3 color);
-void outputSample(vec4 color);
+
+/**
+ * Summary: start a scattered ray just off the surface, on the side it leaves through
+ * Parameters:
+ *     p  : the hit point
+ *     n  : the surface normal
+ *     dir: direction of the new ray
+ * Return: the new ray
+ */
+Ray spawnRay(vec3 p, vec3 n, vec3 dir);
+
+/**
+ * Summary: blend the samples of this pass into the accumulated result
+ * Parameters:
+ *     color   : sum of the samples of this pass
+ *     nSamples: samples taken in this pass, 0 for a converged pixel
+ *     variance: statistics of the pixel including this pass
+ *     features: sums of the features of the samples of this pass
+ */
+void outputSample(vec3 color, int nSamples, vec4 variance, PixelFeatures features);
+
+// adaptive sampling
+
+/**
+ * Summary: add a sample to the running luminance statistics of the pixel, Welford's update
+ * Parameters:
+ *     variance: sample count, mean and m2
+ *     color   : the sample
+ */
+void addVarianceSample(inout vec4 variance, vec3 color);
+
+/**
+ * Summary: standard error of the mean luminance relative to the mean
+ * Parameters:
+ *     variance: sample count, mean and m2
+ * Return: the relative error, INFINITY with less than 2 samples
+ */
+float getRelativeError(vec4 variance);
+
+/**
+ * Summary: samples the pixel takes in this pass, the error left decides how many
+ * Parameters:
+ *     variance: sample count, mean and m2
+ * Return: 0 when converged, 1 when adaptive sampling is off, else 1 to maxSamplesPerPass
+ */
+int getSampleBudget(vec4 variance);
+
+// light sampling
+
+/**
+ * Summary: probability of picking one of the lights or the sky in sampleDirectLight
+ * Return: 1 / (nLights + 1 with a sky to sample), 0 without light sampling
+ */
+float getLightSelectPdf();
+
+/**
+ * Summary: next event estimation at a diffuse hit, one light or the sky is picked uniformly
+ *          and a shadow ray is sent to a point sampled on it
+ * Parameters:
+ *     ray  : the ray that hit
+ *     isect: the diffuse hit
+ * Return: the light reflected towards the ray, MIS weighted against the bounce
+ */
+vec3 sampleDirectLight(Ray ray, Interaction isect);
+
+/**
+ * Summary: pdf w.r.t. solid angle of sampling a sphere light from p
+ * Parameters:
+ *     sphere: the light
+ *     p     : the point the light is seen from
+ * Return: the pdf of the cone the sphere covers, 0 from inside the sphere
+ */
+float getSphereLightPdf(Sphere sphere, vec3 p);
+
+/**
+ * Summary: sample a direction of the sky, bright and large parts more often
+ * Parameters:
+ *     u  : random number vector
+ *     pdf: receives the pdf of the direction w.r.t. solid angle
+ * Return: the direction
+ */
+vec3 sampleSky(vec2 u, out float pdf);
+
+/**
+ * Summary: pdf w.r.t. solid angle of sampleSky drawing dir
+ */
+float getSkyPdf(vec3 dir);
+
+/**
+ * Summary: cube face of a direction and its coordinates on it, table 8.19 of the OpenGL specification
+ * Parameters:
+ *     dir: the direction
+ *     st : receives the coordinates in [-1, 1]
+ * Return: the face, +x, -x, +y, -y, +z, -z
+ */
+int getSkyFaceCoord(vec3 dir, out vec2 st);
+
+/**
+ * Summary: check whether anything blocks the ray before tMax
+ * Parameters:
+ *     ray : the shadow ray
+ *     tMax: distance to the point being tested
+ * Return: true if the ray is blocked
+ */
+bool occluded(Ray ray, float tMax);
+
+/**
+ * Summary: MIS weight of a sample drawn with pdf fPdf when gPdf could have drawn it too
+ */
+float powerHeuristic(float fPdf, float gPdf);
 
 // intersect
 bool solveQuadraticEquation(float a, float b, float c, out float x1, out float x2);
@@ -151,6 +312,17 @@ bool solveQuadraticEquation(float a, float b, float c, out float x1, out float x
  */
 bool intersect(inout Ray ray, inout Interaction isect);
 
+/**
+ * Summary: find the closest triangle of a mesh, GLSL has no recursion so the BLAS
+ *          traversal is apart from the top level one in intersect
+ * Parameters:
+ *     ray : the ray in object space of the mesh
+ *     root: root node of the mesh bvh in bvh
+ *     isect: record the triangle and the hit point in object space
+ * Return: true if the ray hit the mesh
+ */
+bool intersectBLAS(inout Ray ray, int root, inout Interaction isect);
+
 /**
  * Summary: check whether the ray hit AABB
  * Parameters:
@@ -218,6 +390,15 @@ vec3 cosineWeightedSampleHeimiSphere(vec2 u);
  */
 vec3 uniformSampleSphere(vec2 u);
 
+/**
+ * Summary: uniform sample in the cone around the z axis
+ * Parameters:
+ *     u             : random number vector
+ *     oneMinusCosMax: 1 - cos of the half angle of the cone, kept apart for narrow cones
+ * Return: the sample vector
+ */
+vec3 uniformSampleCone(vec2 u, float oneMinusCosMax);
+
 // material
 /**
  * Summary: approximate the reflectance of dielectric material
@@ -277,9 +458,16 @@ vec3 toLocal(LocalCoord coord, vec3 v);
 vec3 toWorld(LocalCoord coord, vec3 v);
 
 void swap(inout float a, inout float b);
-vec2 getSampleIdx(sampler2D data, int idx);
-void getVec3FromTexture(sampler2D data, vec2 texCoord, out vec3 v);
-void getVec4FromTexture(sampler2D data, vec2 texCoord, out vec4 v);
+
+/**
+ * Summary: fetch a texel of a data buffer
+ * Parameters:
+ *     data: buffer of data
+ *     idx : index of the texel
+ * Return: the texel
+ */
+vec4 fetchBufferTexel(DataBuffer data, int idx);
+ivec4 fetchBufferTexel(IDataBuffer data, int idx);
 
 /**
  * Summary: get material data
@@ -290,7 +478,7 @@ void getVec4FromTexture(sampler2D data, vec2 texCoord, out vec4 v);
  * Return: the material data
  * Usage: getMaterialData(materialBuffer, isect.primitive.materialIdx, isect.material)
  */
-void getMaterialData(sampler2D data, int idx, out Material material);
+void getMaterialData(DataBuffer data, int idx, out Material material);
 
 /**
  * Summary: get sphere data
@@ -301,7 +489,7 @@ void getMaterialData(sampler2D data, int idx, out Material material);
  * Return: the sphere data
  * Usage: getSphereData(sphereBuffer, isect.primitive.shapeIdx, sphere)
  */
-void getSphereData(sampler2D data, int idx, out Sphere sphere);
+void getSphereData(DataBuffer data, int idx, out Sphere sphere);
 
 /**
  * Summary: get the vertex index data of triangle
@@ -312,7 +500,7 @@ void getSphereData(sampler2D data, int idx, out Sphere sphere);
  * Return: the vertex index data of triangle
  * Usage: getTriangleIndexData(triangleIndexBuffer, primitive.shapeIdx, idx)
  */
-void getTriangleIndexData(isampler2D data, int idx, out TriangleIndex triIdx);
+void getTriangleIndexData(IDataBuffer data, int idx, out TriangleIndex triIdx);
 
 /**
  * Summary: get the vertex data of triangle
@@ -323,7 +511,7 @@ void getTriangleIndexData(isampler2D data, int idx, out TriangleIndex triIdx);
  * Return: the vertex data of triangle
  * Usage: getTriangleData(vertexBuffer, triidx, triangle)
  */
-void getTriangleData(sampler2D data, inout TriangleIndex idx, out Triangle triangle);
+void getTriangleData(DataBuffer data, inout TriangleIndex idx, out Triangle triangle);
 
 /**
  * Summary: get primitive data
@@ -334,7 +522,7 @@ void getTriangleData(sampler2D data, inout TriangleIndex idx, out Triangle trian
  * Return: the get primitive data
  * Usage: getPrimitiveData(primitiveBuffer, BVHNode.firstVal, primitive);
  */
-void getPrimitiveData(isampler2D data, int idx, out Primitive primitive);
+void getPrimitiveData(IDataBuffer data, int idx, out Primitive primitive);
 
 /**
  * Summary: get BVHNode data
@@ -345,12 +533,39 @@ void getPrimitiveData(isampler2D data, int idx, out Primitive primitive);
  * Return: the get BVHNode data
  * Usage: getBVHNodeData(bvh, BVHNode.firstVal or BVHNode.secondVal , node)
  */
-void getBVHNodeData(sampler2D data, int idx, out BVHNode node);
+void getBVHNodeData(DataBuffer data, int idx, out BVHNode node);
+
+/**
+ * Summary: get instance data
+ * Parameters:
+ *     data: buffer of data
+ *     idx : index of data
+ *     instance: store the data
+ * Return: the instance data
+ * Usage: getInstanceData(instanceBuffer, primitive.shapeIdx, instance)
+ */
+void getInstanceData(DataBuffer data, int idx, out Instance instance);
 
 void main() {
     rngInit();
-    Ray ray = generateRay(vec2(rngGetRandom1D(), rngGetRandom1D())); 
-    outputSample(trace(ray));
+
+    // the statistics start over with the accumulation
+    vec4 variance = totalSamples == 0u ? vec4(0.0f) : texture(oldVariance, screenTexCoord);
+    int nSamples = getSampleBudget(variance);
+    vec3 color = vec3(0.0f);
+    PixelFeatures features = PixelFeatures(vec3(0.0f), vec3(0.0f), 0.0f);
+    for (int i = 0; i < nSamples; ++i) {
+        Ray ray = generateRay(vec2(rngGetRandom1D(), rngGetRandom1D()));
+        PixelFeatures sampleFeatures;
+        vec3 sampleColor = trace(ray, sampleFeatures).rgb;
+        addVarianceSample(variance, sampleColor);
+        color += sampleColor;
+        features.albedo += sampleFeatures.albedo;
+        features.normal += sampleFeatures.normal;
+        features.depth += sampleFeatures.depth;
+    }
+
+    outputSample(color, nSamples, variance, features);
 }
 
 Ray generateRay(vec2 u) {
@@ -367,9 +582,82 @@ vec3 getHitPoint(inout Ray ray, float t) {
     return ray.o + t * ray.dir;
 }
 
-vec4 trace(inout Ray ray) {
-    // TODO: change the code here to trace the ray through the scene
-    return vec4(texture(sky, ray.dir).rgb, 1.0f);
+vec4 trace(inout Ray ray, out PixelFeatures features) {
+    features = PixelFeatures(vec3(1.0f), -ray.dir, SkyDepth);
+
+    // light reaching a diffuse hit is sampled there and found again by the bounce,
+    // both are weighted by MIS so it counts once, the same as CPURenderer::trace
+    float lightSelectPdf = getLightSelectPdf();
+    vec3 radiance = vec3(0.0f);
+    vec3 throughput = vec3(1.0f);
+    vec3 lastPosition = vec3(0.0f);
+    float bsdfPdf = 0.0f;   // of the last bounce, 0 for camera rays and specular bounces
+    for (int depth = 0; depth < maxTraceDepth; ++depth) {
+        Interaction isect;
+        bool hit = intersect(ray, isect);
+        if (hit && depth == 0) {
+            features.albedo = isect.material.type == EMISSIVE_MATERIAL ? vec3(1.0f) : isect.material.albedo;
+            features.normal = dot(isect.hitPoint.normal, ray.dir) > 0.0f ? -isect.hitPoint.normal : isect.hitPoint.normal;
+            features.depth = length(isect.hitPoint.position - ray.o);
+        }
+
+        if (!hit) {
+            float weight = 1.0f;
+            if (bsdfPdf > 0.0f && lightSelectPdf > 0.0f && skyDistributionSize > 0) {
+                weight = powerHeuristic(bsdfPdf, lightSelectPdf * getSkyPdf(ray.dir));
+            }
+
+            return vec4(radiance + weight * throughput * texture(sky, ray.dir).rgb, 1.0f);
+        }
+
+        if (isect.material.type == EMISSIVE_MATERIAL) {
+            // emitters shine from their front side and absorb what hits them
+            if (dot(ray.dir, isect.hitPoint.normal) < 0.0f) {
+                float weight = 1.0f;
+                if (bsdfPdf > 0.0f && lightSelectPdf > 0.0f && isect.primitive.shapeType == SPHERE_SHAPE) {
+                    Sphere light;
+                    getSphereData(sphereBuffer, isect.primitive.shapeIdx, light);
+                    weight = powerHeuristic(bsdfPdf, lightSelectPdf * getSphereLightPdf(light, lastPosition));
+                }
+
+                radiance += weight * throughput * isect.material.albedo;
+            }
+
+            return vec4(radiance, 1.0f);
+        }
+
+        if (isect.material.type == LAMBERTIAN_MATERIAL && lightSelectPdf > 0.0f) {
+            radiance += throughput * sampleDirectLight(ray, isect);
+        }
+
+        lastPosition = isect.hitPoint.position;
+        bsdfPdf = 0.0f;
+
+        if (isect.material.type == LAMBERTIAN_MATERIAL) {
+            if (!lambertianScatterFunction(ray, isect)) {
+                return vec4(radiance, 1.0f);
+            }
+            bsdfPdf = abs(dot(ray.dir, isect.hitPoint.normal)) / Pi;
+        } else if (isect.material.type == METAL_MATERIAL) {
+            if (!metalScatterFunction(ray, isect)) {
+                return vec4(radiance, 1.0f);
+            }
+        } else {
+            dielectricScatterFunction(ray, isect);
+        }
+
+        throughput *= isect.material.albedo;
+    }
+
+    return vec4(radiance, 1.0f);
+}
+
+Ray spawnRay(vec3 p, vec3 n, vec3 dir) {
+    Ray ray;
+    ray.o = p + (dot(dir, n) > 0.0f ? Epsilon : -Epsilon) * n;
+    ray.dir = dir;
+    ray.tMax = INFINITY;
+    return ray;
 }
 
 vec3 gammaCorrection(vec3 color) {
@@ -380,21 +668,327 @@ vec3 inverseGammaCorrection(vec3 color) {
     return pow(color, vec3(2.2f));
 }
 
-void outputSample(vec4 color) {
+void outputSample(vec3 color, int nSamples, vec4 variance, PixelFeatures features) {
+    // pixels have different sample counts with adaptive sampling, the count is kept in variance
     vec3 rst = texture(RTResult, screenTexCoord).rgb;
-    fragColor = vec4(gammaCorrection(
-        (inverseGammaCorrection(rst) * totalSamples + color.rgb) / (totalSamples + 1u)), 1.0f);
+    float oldSamples = variance.x - float(nSamples);
+    fragColor = nSamples == 0 ? vec4(rst, 1.0f) : vec4(gammaCorrection(
+        (inverseGammaCorrection(rst) * oldSamples + color) / variance.x), 1.0f);
     fragRngState = rngState;
+    fragVariance = variance;
+
+    // the features are means in linear space
+    vec4 albedoDepth = oldSamples > 0.0f ? texture(oldAlbedoDepth, screenTexCoord) : vec4(0.0f);
+    vec4 normal = oldSamples > 0.0f ? texture(oldNormal, screenTexCoord) : vec4(0.0f);
+    fragAlbedoDepth = nSamples == 0 ? albedoDepth :
+        (albedoDepth * oldSamples + vec4(features.albedo, features.depth)) / variance.x;
+    fragNormal = nSamples == 0 ? normal : vec4((normal.xyz * oldSamples + features.normal) / variance.x, 0.0f);
+}
+
+void addVarianceSample(inout vec4 variance, vec3 color) {
+    float x = dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+    variance.x += 1.0f;
+    float delta = x - variance.y;
+    variance.y += delta / variance.x;
+    variance.z += delta * (x - variance.y);
+}
+
+float getRelativeError(vec4 variance) {
+    if (variance.x < 2.0f) {
+        return INFINITY;
+    }
+
+    float sampleVariance = variance.z / (variance.x - 1.0f);
+    return sqrt(sampleVariance / variance.x) / (variance.y + 0.01f);
+}
+
+int getSampleBudget(vec4 variance) {
+    if (!adaptiveSampling || variance.x < float(minSamples)) {
+        return 1;
+    }
+
+    float relativeError = getRelativeError(variance);
+    if (relativeError < varianceThreshold) {
+        return 0;
+    }
+
+    // the error falls with the square root of the samples
+    float ratio = relativeError / varianceThreshold;
+    return max(1, int(min(ratio * ratio, float(maxSamplesPerPass))));
 }
 
 bool intersect(inout Ray ray, inout Interaction isect) {
-    // TODO: perform ray hit the primitive with bvh trasversal
-    return false;
+    // the bvh buffer starts with the top level bvh over spheres and instances,
+    // the bvh of every mesh follows it and an instance stores the index of its root
+    bool hit = false;
+    if (!useBVH) {
+        for (int i = 0; i < nPrimitives; ++i) {
+            Primitive primitive;
+            getPrimitiveData(primitiveBuffer, i, primitive);
+            if (intersectPrimitive(ray, primitive, isect)) {
+                hit = true;
+            }
+        }
+    } else {
+        vec3 invDir = vec3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+        int nodesToVisit[BVH_STACK_SIZE];
+        int toVisitOffset = 0;
+        int currentNodeIndex = 0;
+        while (true) {
+            BVHNode node;
+            getBVHNodeData(bvh, currentNodeIndex, node);
+            if (intersectAABB(ray, node.box, invDir)) {
+                if (node.nodeType == BVH_LEAF_NODE) {
+                    for (int i = 0; i < node.secondVal; ++i) {
+                        Primitive primitive;
+                        getPrimitiveData(primitiveBuffer, node.firstVal + i, primitive);
+                        if (intersectPrimitive(ray, primitive, isect)) {
+                            hit = true;
+                        }
+                    }
+                } else {
+                    nodesToVisit[toVisitOffset++] = node.secondVal;
+                    currentNodeIndex = node.firstVal;
+                    continue;
+                }
+            }
+
+            if (toVisitOffset == 0) {
+                break;
+            }
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+
+    if (hit) {
+        getMaterialData(materialBuffer, isect.primitive.materialIdx, isect.material);
+    }
+
+    return hit;
+}
+
+bool intersectBLAS(inout Ray ray, int root, inout Interaction isect) {
+    bool hit = false;
+    vec3 invDir = vec3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+    int nodesToVisit[BVH_STACK_SIZE];
+    int toVisitOffset = 0;
+    int currentNodeIndex = root;
+    while (true) {
+        BVHNode node;
+        getBVHNodeData(bvh, currentNodeIndex, node);
+        if (intersectAABB(ray, node.box, invDir)) {
+            if (node.nodeType == BVH_LEAF_NODE) {
+                for (int i = 0; i < node.secondVal; ++i) {
+                    Primitive primitive;
+                    getPrimitiveData(primitiveBuffer, node.firstVal + i, primitive);
+                    TriangleIndex triIdx;
+                    getTriangleIndexData(triangleIndexBuffer, primitive.shapeIdx, triIdx);
+                    Triangle triangle;
+                    getTriangleData(vertexBuffer, triIdx, triangle);
+                    if (intersectTriangle(ray, triangle, isect)) {
+                        isect.primitive = primitive;
+                        hit = true;
+                    }
+                }
+            } else {
+                nodesToVisit[toVisitOffset++] = node.secondVal;
+                currentNodeIndex = node.firstVal;
+                continue;
+            }
+        }
+
+        if (toVisitOffset == 0) {
+            break;
+        }
+        currentNodeIndex = nodesToVisit[--toVisitOffset];
+    }
+
+    return hit;
+}
+
+float getLightSelectPdf() {
+    int nChoices = nLights + (skyDistributionSize > 0 ? 1 : 0);
+    return lightSampling && nChoices > 0 ? 1.0f / float(nChoices) : 0.0f;
+}
+
+vec3 sampleDirectLight(Ray ray, Interaction isect) {
+    vec3 n = isect.hitPoint.normal;
+    if (dot(n, ray.dir) > 0.0f) {
+        n = -n;
+    }
+
+    vec3 p = isect.hitPoint.position;
+    int nChoices = nLights + (skyDistributionSize > 0 ? 1 : 0);
+    int choice = min(int(rngGetRandom1D() * float(nChoices)), nChoices - 1);
+    vec2 u = rngGetRandom2D();
+
+    vec3 dir;
+    vec3 emission;
+    float lightPdf = 0.0f;
+    float tMax = INFINITY;
+    if (choice < nLights) {
+        // directions in the cone the sphere covers, seen from p
+        ivec2 light = fetchBufferTexel(lightBuffer, choice).xy;
+        Sphere sphere;
+        getSphereData(sphereBuffer, light.x, sphere);
+        vec3 toCenter = sphere.position - p;
+        float d2 = dot(toCenter, toCenter);
+        float r2 = sphere.radius * sphere.radius;
+        if (d2 <= r2) {
+            return vec3(0.0f);
+        }
+
+        float sin2Max = r2 / d2;
+        float oneMinusCosMax = sin2Max / (1.0f + sqrt(max(0.0f, 1.0f - sin2Max)));
+        dir = normalize(toWorld(createLocalCoord(toCenter), uniformSampleCone(u, oneMinusCosMax)));
+        lightPdf = 1.0f / (2.0f * Pi * oneMinusCosMax);
+
+        // the near side of the sphere, a grazing direction that misses it stops at the tangent
+        float b = dot(dir, toCenter);
+        tMax = b - sqrt(max(0.0f, b * b - (d2 - r2)));
+
+        Material material;
+        getMaterialData(materialBuffer, light.y, material);
+        emission = material.albedo;
+    } else {
+        dir = sampleSky(u, lightPdf);
+        emission = texture(sky, dir).rgb;
+    }
+
+    float cosTheta = dot(n, dir);
+    if (cosTheta <= 0.0f || lightPdf <= 0.0f) {
+        return vec3(0.0f);
+    }
+
+    // stop short of the light, it would block its own shadow ray
+    if (occluded(spawnRay(p, n, dir), tMax * (1.0f - 1e-3f))) {
+        return vec3(0.0f);
+    }
+
+    float selectPdf = 1.0f / float(nChoices);
+    float weight = powerHeuristic(selectPdf * lightPdf, cosTheta / Pi);
+    return isect.material.albedo / Pi * emission * (cosTheta * weight / (selectPdf * lightPdf));
+}
+
+float getSphereLightPdf(Sphere sphere, vec3 p) {
+    vec3 toCenter = sphere.position - p;
+    float d2 = dot(toCenter, toCenter);
+    float r2 = sphere.radius * sphere.radius;
+    if (d2 <= r2) {
+        return 0.0f;
+    }
+
+    float sin2Max = r2 / d2;
+    return 1.0f / (2.0f * Pi * sin2Max / (1.0f + sqrt(max(0.0f, 1.0f - sin2Max))));
+}
+
+vec3 sampleSky(vec2 u, out float pdf) {
+    // the cell by binary search in the cdf, then a uniform point in the cell on the face
+    int nCells = 6 * skyDistributionSize * skyDistributionSize;
+    float total = fetchBufferTexel(skyDistribution, nCells).r;
+    float target = u.x * total;
+    int lo = 0;
+    int hi = nCells;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (fetchBufferTexel(skyDistribution, mid).r <= target) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    float cdf0 = fetchBufferTexel(skyDistribution, lo).r;
+    float cdf1 = fetchBufferTexel(skyDistribution, lo + 1).r;
+    float du = cdf1 > cdf0 ? (target - cdf0) / (cdf1 - cdf0) : 0.5f;
+
+    int face = lo / (skyDistributionSize * skyDistributionSize);
+    int x = lo % skyDistributionSize;
+    int y = lo / skyDistributionSize % skyDistributionSize;
+    vec2 st = 2.0f * (vec2(x, y) + vec2(min(du, FloatOneMinusEpsilon), u.y)) / float(skyDistributionSize) - 1.0f;
+
+    // uniform on the face is not uniform in solid angle, the corners of the cube take less of it
+    float r2 = 1.0f + dot(st, st);
+    float n2 = float(skyDistributionSize * skyDistributionSize);
+    pdf = (cdf1 - cdf0) / total * n2 / 4.0f * r2 * sqrt(r2);
+
+    vec3 dir;
+    if (face == 0) {
+        dir = vec3(1.0f, -st.y, -st.x);
+    } else if (face == 1) {
+        dir = vec3(-1.0f, -st.y, st.x);
+    } else if (face == 2) {
+        dir = vec3(st.x, 1.0f, st.y);
+    } else if (face == 3) {
+        dir = vec3(st.x, -1.0f, -st.y);
+    } else if (face == 4) {
+        dir = vec3(st.x, -st.y, 1.0f);
+    } else {
+        dir = vec3(-st.x, -st.y, -1.0f);
+    }
+
+    return normalize(dir);
+}
+
+float getSkyPdf(vec3 dir) {
+    vec2 st;
+    int face = getSkyFaceCoord(dir, st);
+    ivec2 xy = clamp(ivec2(0.5f * (st + 1.0f) * float(skyDistributionSize)), 0, skyDistributionSize - 1);
+    int cell = (face * skyDistributionSize + xy.y) * skyDistributionSize + xy.x;
+
+    int nCells = 6 * skyDistributionSize * skyDistributionSize;
+    float total = fetchBufferTexel(skyDistribution, nCells).r;
+    float cellPdf = (fetchBufferTexel(skyDistribution, cell + 1).r - fetchBufferTexel(skyDistribution, cell).r) / total;
+    float r2 = 1.0f + dot(st, st);
+    float n2 = float(skyDistributionSize * skyDistributionSize);
+
+    return cellPdf * n2 / 4.0f * r2 * sqrt(r2);
+}
+
+int getSkyFaceCoord(vec3 dir, out vec2 st) {
+    vec3 a = abs(dir);
+    int face;
+    float ma;
+    if (a.x >= a.y && a.x >= a.z) {
+        face = dir.x >= 0.0f ? 0 : 1;
+        st = vec2(dir.x >= 0.0f ? -dir.z : dir.z, -dir.y);
+        ma = a.x;
+    } else if (a.y >= a.z) {
+        face = dir.y >= 0.0f ? 2 : 3;
+        st = vec2(dir.x, dir.y >= 0.0f ? dir.z : -dir.z);
+        ma = a.y;
+    } else {
+        face = dir.z >= 0.0f ? 4 : 5;
+        st = vec2(dir.z >= 0.0f ? dir.x : -dir.x, -dir.y);
+        ma = a.z;
+    }
+
+    st /= ma;
+    return face;
+}
+
+bool occluded(Ray ray, float tMax) {
+    // the closest hit search of intersect answers it too, it only has to stop at tMax
+    Interaction isect;
+    ray.tMax = tMax;
+    return intersect(ray, isect);
+}
+
+float powerHeuristic(float fPdf, float gPdf) {
+    float f2 = fPdf * fPdf;
+    float g2 = gPdf * gPdf;
+    return f2 + g2 > 0.0f ? f2 / (f2 + g2) : 0.0f;
 }
 
 bool intersectAABB(inout Ray ray, inout AABB box, inout vec3 invDir) {
-    // TODO: perform ray hit AABB
-    return false;
+    vec3 t0 = (box.pMin - ray.o) * invDir;
+    vec3 t1 = (box.pMax - ray.o) * invDir;
+    vec3 tNear = min(t0, t1);
+    vec3 tFar = max(t0, t1);
+    float tMin = max(tNear.x, max(tNear.y, tNear.z));
+    float tMax = min(tFar.x, min(tFar.y, tFar.z));
+
+    return tMin < tMax && tMin < ray.tMax && tMax > 0.0f;
 }
 
 bool solveQuadraticEquation(float a, float b, float c, out float x1, out float x2) {
@@ -418,20 +1012,103 @@ bool solveQuadraticEquation(float a, float b, float c, out float x1, out float x
 }
 
 bool intersectPrimitive(inout Ray ray, inout Primitive primitive, inout Interaction isect) {
-    // TODO: perform ray hit the primitive, the type of the primitive can be
-    //      + sphere    (use intersectSphere)
-    //      + triangle  (use intersectTriangle)
-    return false;
+    if (primitive.shapeType == INSTANCE_SHAPE) {
+        // the direction is not normalized, so t is the same in both spaces.
+        // isect.primitive is the triangle hit inside the BLAS
+        Instance instance;
+        getInstanceData(instanceBuffer, primitive.shapeIdx, instance);
+        Ray objectRay;
+        objectRay.o = vec3(instance.worldToObject * vec4(ray.o, 1.0f));
+        objectRay.dir = vec3(instance.worldToObject * vec4(ray.dir, 0.0f));
+        objectRay.tMax = ray.tMax;
+        if (!intersectBLAS(objectRay, instance.blasRoot, isect)) {
+            return false;
+        }
+
+        // normals go to world space by the inverse transpose, i.e. n * worldToObject
+        ray.tMax = objectRay.tMax;
+        isect.hitPoint.position = getHitPoint(ray, ray.tMax);
+        isect.hitPoint.normal = normalize(isect.hitPoint.normal * mat3(instance.worldToObject));
+        isect.primitive.materialIdx = instance.materialIdx;
+        return true;
+    }
+
+    bool hit = false;
+    if (primitive.shapeType == SPHERE_SHAPE) {
+        Sphere sphere;
+        getSphereData(sphereBuffer, primitive.shapeIdx, sphere);
+        hit = intersectSphere(ray, sphere, isect);
+    } else {
+        TriangleIndex triIdx;
+        getTriangleIndexData(triangleIndexBuffer, primitive.shapeIdx, triIdx);
+        Triangle triangle;
+        getTriangleData(vertexBuffer, triIdx, triangle);
+        hit = intersectTriangle(ray, triangle, isect);
+    }
+
+    if (hit) {
+        isect.primitive = primitive;
+    }
+
+    return hit;
 }
 
 bool intersectSphere(inout Ray ray, inout Sphere sphere, inout Interaction isect) {
-    // TODO: perform ray hit the sphere
-    return false;
+    // the nearer root past Epsilon, the same as BVH::hitSphere
+    vec3 oc = ray.o - sphere.position;
+    float a = dot(ray.dir, ray.dir);
+    float b = dot(ray.dir, oc);
+    float c = dot(oc, oc) - sphere.radius * sphere.radius;
+    float discriminant = b * b - a * c;
+    if (discriminant < 0.0f) {
+        return false;
+    }
+
+    float t1 = (-b - sqrt(discriminant)) / a;
+    float t2 = (-b + sqrt(discriminant)) / a;
+    if (Epsilon <= t1 && t1 < ray.tMax) {
+        ray.tMax = t1;
+    } else if (Epsilon <= t2 && t2 < ray.tMax) {
+        ray.tMax = t2;
+    } else {
+        return false;
+    }
+
+    isect.hitPoint.position = getHitPoint(ray, ray.tMax);
+    isect.hitPoint.normal = normalize(isect.hitPoint.position - sphere.position);
+    return true;
 }
 
 bool intersectTriangle(inout Ray ray, inout Triangle mesh, inout Interaction isect) {
-    // TODO: perform ray hit the triangle
-    return false;
+    // Moller-Trumbore, rays grazing the plane miss like in Triangle::intersect
+    vec3 e1 = mesh.v[1].position - mesh.v[0].position;
+    vec3 e2 = mesh.v[2].position - mesh.v[0].position;
+    vec3 pvec = cross(ray.dir, e2);
+    float det = dot(e1, pvec);
+    if (det == 0.0f || abs(det) < MinHitCosine * length(cross(e1, e2))) {
+        return false;
+    }
+
+    float invDet = 1.0f / det;
+    vec3 tvec = ray.o - mesh.v[0].position;
+    float u = dot(tvec, pvec) * invDet;
+    vec3 qvec = cross(tvec, e1);
+    float v = dot(ray.dir, qvec) * invDet;
+    float t = dot(e2, qvec) * invDet;
+    if (u < 0.0f || v < 0.0f || u + v > 1.0f || t < 0.0f || t >= ray.tMax) {
+        return false;
+    }
+
+    ray.tMax = t;
+    isect.hitPoint.position = getHitPoint(ray, t);
+    vec3 normal = (1.0f - u - v) * mesh.v[0].normal + u * mesh.v[1].normal + v * mesh.v[2].normal;
+    if (dot(normal, normal) == 0.0f) {
+        // meshes without vertex normals fall back to the face normal
+        normal = cross(e1, e2);
+    }
+    isect.hitPoint.normal = normalize(normal);
+    isect.hitPoint.texCoord = (1.0f - u - v) * mesh.v[0].texCoord + u * mesh.v[1].texCoord + v * mesh.v[2].texCoord;
+    return true;
 }
 
 // sample 
@@ -451,6 +1128,14 @@ vec3 cosineWeightedSampleHeimiSphere(vec2 u) {
     return vec3(cos(phi) * sinTheta, sin(phi) * sinTheta, cosTheta);
 }
 
+vec3 uniformSampleCone(vec2 u, float oneMinusCosMax) {
+    float cosTheta = 1.0f - u.x * oneMinusCosMax;
+    float sinTheta = sqrt(max(0.0f, 1.0f - cosTheta * cosTheta));
+    float phi = 2.0f * Pi * u.y;
+
+    return vec3(cos(phi) * sinTheta, sin(phi) * sinTheta, cosTheta);
+}
+
 vec3 uniformSampleSphere(vec2 u) {
     float cosTheta = 1 - 2 * u.x;
     float sinTheta = sqrt(max(0.0f, 1 - cosTheta * cosTheta));
@@ -468,18 +1153,49 @@ float fresnelSchlick(float cosTheta, float ior) {
 }
 
 bool lambertianScatterFunction(inout Ray ray, inout Interaction isect) {
-    // TODO: perform ray interact with the lambert material
-    return false;
+    vec3 n = isect.hitPoint.normal;
+    if (dot(n, ray.dir) > 0.0f) {
+        n = -n;
+    }
+
+    vec3 dir = toWorld(createLocalCoord(n), cosineWeightedSampleHeimiSphere(rngGetRandom2D()));
+    ray = spawnRay(isect.hitPoint.position, n, dir);
+    return true;
 }
 
 bool metalScatterFunction(inout Ray ray, inout Interaction isect) {
-    // TODO: perform ray interact with the metallic material
-    return false;
+    vec3 n = isect.hitPoint.normal;
+    if (dot(n, ray.dir) > 0.0f) {
+        n = -n;
+    }
+
+    // fuzzy reflections below the surface are absorbed
+    vec3 dir = reflect(ray.dir, n) + isect.material.fuzz * uniformSampleSphere(rngGetRandom2D());
+    if (dot(dir, n) <= 0.0f) {
+        return false;
+    }
+
+    ray = spawnRay(isect.hitPoint.position, n, normalize(dir));
+    return true;
 }
 
-void dielectricScatterFunction(inout Ray ray, inout Interaction isect) { 
-    // TODO: perform ray interact with the dielectric material
-    return ;
+void dielectricScatterFunction(inout Ray ray, inout Interaction isect) {
+    bool frontFace = dot(ray.dir, isect.hitPoint.normal) < 0.0f;
+    vec3 n = frontFace ? isect.hitPoint.normal : -isect.hitPoint.normal;
+    float eta = frontFace ? 1.0f / isect.material.ior : isect.material.ior;
+
+    float cosTheta = min(dot(-ray.dir, n), 1.0f);
+    float sinTheta = sqrt(max(0.0f, 1.0f - cosTheta * cosTheta));
+
+    // total internal reflection, else reflect or refract by the Fresnel reflectance
+    vec3 dir;
+    if (eta * sinTheta > 1.0f || fresnelSchlick(cosTheta, isect.material.ior) > rngGetRandom1D()) {
+        dir = reflect(ray.dir, n);
+    } else {
+        dir = refract(ray.dir, n, eta);
+    }
+
+    ray = spawnRay(isect.hitPoint.position, n, normalize(dir));
 }
 
 void rngInit() {
@@ -525,6 +1241,15 @@ void swap(inout float a, inout float b) {
     b = tmp;
 }
 
+#ifdef USE_TEXTURE_BUFFER
+vec4 fetchBufferTexel(DataBuffer data, int idx) {
+    return texelFetch(data, idx);
+}
+
+ivec4 fetchBufferTexel(IDataBuffer data, int idx) {
+    return texelFetch(data, idx);
+}
+#else
 vec2 getSampleIdx(isampler2D data, int idx) {
     ivec2 texSize = textureSize(data, 0);
     int x = idx % texSize.x;
@@ -538,66 +1263,90 @@ vec2 getSampleIdx(sampler2D data, int idx) {
     int y = idx / texSize.x;
     return vec2((x + 0.5f) / texSize.x, (y + 0.5f) / texSize.y);
 }
-void getVec3FromTexture(sampler2D data, vec2 texCoord, out vec3 v) {
-    v = texture(data, texCoord).rgb;
+
+vec4 fetchBufferTexel(DataBuffer data, int idx) {
+    return texture(data, getSampleIdx(data, idx));
 }
 
-void getVec4FromTexture(sampler2D data, vec2 texCoord, out vec4 v) {
-    v = texture(data, texCoord);
+ivec4 fetchBufferTexel(IDataBuffer data, int idx) {
+    return texture(data, getSampleIdx(data, idx));
 }
+#endif
 
-void getMaterialData(sampler2D data, int idx, out Material material) {
+void getMaterialData(DataBuffer data, int idx, out Material material) {
     idx *= 2;
     vec3 v;
-    getVec3FromTexture(data, getSampleIdx(data, idx), v);
+    v = fetchBufferTexel(data, idx).rgb;
     material.type = int(v.x);
     material.ior = v.y;
     material.fuzz = v.z;
-    getVec3FromTexture(data, getSampleIdx(data, idx + 1), material.albedo);
+    material.albedo = fetchBufferTexel(data, idx + 1).rgb;
 }
 
-void getSphereData(sampler2D data, int idx, out Sphere sphere) {
+void getSphereData(DataBuffer data, int idx, out Sphere sphere) {
     vec4 v;
-    getVec4FromTexture(data, getSampleIdx(data, idx), v);
+    v = fetchBufferTexel(data, idx);
     sphere.position = v.xyz;
     sphere.radius = v.w;
 }
 
-void getTriangleIndexData(isampler2D data, int idx, out TriangleIndex triIdx) {
-    ivec3 v = texture(data, getSampleIdx(data, idx)).xyz;
+void getTriangleIndexData(IDataBuffer data, int idx, out TriangleIndex triIdx) {
+    ivec3 v = fetchBufferTexel(data, idx).xyz;
     triIdx.v[0] = v.x;
     triIdx.v[1] = v.y;
     triIdx.v[2] = v.z;
 }
 
-void getTriangleData(sampler2D data, inout TriangleIndex idx, out Triangle triangle) {
+void getTriangleData(DataBuffer data, inout TriangleIndex idx, out Triangle triangle) {
     vec4 v[2];
     for (int i = 0; i < 3; ++i) {
         int vid = idx.v[i] * 2;
-        getVec4FromTexture(data, getSampleIdx(data, vid), v[0]);
-        getVec4FromTexture(data, getSampleIdx(data, vid + 1), v[1]);
+        v[0] = fetchBufferTexel(data, vid);
+        v[1] = fetchBufferTexel(data, vid + 1);
         triangle.v[i].position = v[0].xyz;
         triangle.v[i].normal = vec3(v[0].w, v[1].x, v[1].y);
         triangle.v[i].texCoord = v[1].zw;
     }
 }
 
-void getPrimitiveData(isampler2D data, int idx, out Primitive primitive) {
-    ivec3 v = texture(data, getSampleIdx(data, idx)).xyz;
+void getPrimitiveData(IDataBuffer data, int idx, out Primitive primitive) {
+    ivec3 v = fetchBufferTexel(data, idx).xyz;
     primitive.shapeType = v.x;
     primitive.shapeIdx = v.y;
     primitive.materialIdx = v.z;
 }
 
-void getBVHNodeData(sampler2D data, int idx, out BVHNode node) {
-    vec3 v[3];
-    int vid = idx * 3;
-    for (int i = 0; i < 3; ++i) {
-        getVec3FromTexture(data, getSampleIdx(data, vid + i), v[i]);
+void getBVHNodeData(DataBuffer data, int idx, out BVHNode node) {
+    // two texels: pMin, pMax.x | pMax.yz, offset, nPrimitives
+    // the left child of an interior node is the next node, offset is the right child
+    vec4 v[2];
+    int vid = idx * 2;
+    for (int i = 0; i < 2; ++i) {
+        v[i] = fetchBufferTexel(data, vid + i);
+    }
+    node.box.pMin = v[0].xyz;
+    node.box.pMax = vec3(v[0].w, v[1].xy);
+    int nPrimitives = int(v[1].w);
+    if (nPrimitives > 0) {
+        node.nodeType = BVH_LEAF_NODE;
+        node.firstVal = int(v[1].z);
+        node.secondVal = nPrimitives;
+    } else {
+        node.nodeType = BVH_INTERIOR_NODE;
+        node.firstVal = idx + 1;
+        node.secondVal = int(v[1].z);
+    }
+}
+
+void getInstanceData(DataBuffer data, int idx, out Instance instance) {
+    vec4 v[7];
+    int vid = idx * 7;
+    for (int i = 0; i < 7; ++i) {
+        v[i] = fetchBufferTexel(data, vid + i);
     }
-    node.box.pMin = v[0];
-    node.box.pMax = v[1];
-    node.nodeType = int(v[2].x);
-    node.firstVal = int(v[2].y);
-    node.secondVal = int(v[2].z);
+    // rows of the affine matrices, the last row is (0, 0, 0, 1)
+    instance.worldToObject = transpose(mat4(v[0], v[1], v[2], vec4(0.0f, 0.0f, 0.0f, 1.0f)));
+    instance.objectToWorld = transpose(mat4(v[3], v[4], v[5], vec4(0.0f, 0.0f, 0.0f, 1.0f)));
+    instance.blasRoot = int(v[6].x);
+    instance.materialIdx = int(v[6].y);
 }
\ No newline at end of file
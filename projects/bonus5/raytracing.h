@@ -1,19 +1,29 @@
 #pragma once
 
+#include <atomic>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 #include "../base/application.h"
 #include "../base/glsl_program.h"
 #include "../base/model.h"
 #include "../base/texture2d.h"
+#include "../base/texture_buffer.h"
 #include "../base/skybox.h"
 #include "../base/fullscreen_quad.h"
 #include "../base/framebuffer.h"
 #include "../base/camera.h"
 
+#include "adaptive_sampling.h"
 #include "primitive.h"
 #include "bvh.h"
+#include "bvh_cache.h"
+#include "cpu_renderer.h"
+#include "denoiser.h"
+#include "environment_map.h"
+#include "scene.h"
 
 class RayTracing : public Application {
 public:
@@ -27,6 +37,10 @@ private:
 	std::vector<Sphere> _balls;
 	std::vector<Material> _ballMaterials;
 
+	std::unique_ptr<Scene> _scene;
+
+	std::unique_ptr<BVHCache> _bvhCache;
+
 	std::unique_ptr<TextureCubemap> _skybox;
 
 	std::unique_ptr<FullscreenQuad> _screenQuad;
@@ -35,6 +49,7 @@ private:
 
 	std::unique_ptr<GLSLProgram> _raytracingShader;
 	std::unique_ptr<GLSLProgram> _drawScreenShader;
+	std::unique_ptr<GLSLProgram> _denoiseShader;
 
 	std::unique_ptr<Framebuffer> _sampleFramebuffers[2];
 	uint32_t _currentReadBufferID = 0;
@@ -43,44 +58,170 @@ private:
 
 	std::unique_ptr<Texture2D> _outFrames[2];
 	std::unique_ptr<Texture2D> _rngStates[2];
+	std::unique_ptr<Texture2D> _varianceFrames[2];	// sample count, mean and m2 of the luminance
+	std::unique_ptr<Texture2D> _albedoDepthFrames[2];	// mean albedo and depth of the first hits
+	std::unique_ptr<Texture2D> _normalFrames[2];		// mean normal of the first hits
+
+	// illumination and its variance between the passes of denoise.frag
+	std::unique_ptr<Framebuffer> _denoiseFramebuffers[2];
+	std::unique_ptr<Texture2D> _denoiseFrames[2];
+
+	// shared by raytracing.frag and the CPU renderer
+	AdaptiveSamplingOptions _adaptiveSampling;
+	bool _lightSampling = true;
+
+	// denoising only changes what is shown, the accumulation is kept. The CPU render thread
+	// reads the options under _cpuImageMutex
+	DenoiseOptions _denoise;
+
+	// data buffers, TextureBuffer or Texture2D depending on _useTextureBuffers
+	std::unique_ptr<Texture> _vertexBuffer;
+	std::unique_ptr<Texture> _indexBuffer;
 
-	std::unique_ptr<Texture2D> _vertexBuffer;
-	std::unique_ptr<Texture2D> _indexBuffer;
+	std::unique_ptr<Texture> _sphereBuffer;
+	std::unique_ptr<Texture> _primitiveBuffer;
 
-	std::unique_ptr<Texture2D> _sphereBuffer;
-	std::unique_ptr<Texture2D> _primitiveBuffer;
+	std::unique_ptr<Texture> _materialBuffer;
+	std::unique_ptr<Texture> _bvhBuffer;
+	std::unique_ptr<Texture> _instanceBuffer;
+	std::unique_ptr<Texture> _lightBuffer;		// sphere and material of every light
+	std::unique_ptr<Texture> _skyDistribution;	// EnvironmentMap::getCdf
 
-	std::unique_ptr<Texture2D> _materialBuffer;
-	std::unique_ptr<Texture2D> _bvhBuffer;
+	// texture buffers need the RGB32 formats of GL 4.0 or ARB_texture_buffer_object_rgb32,
+	// without them the data buffers fall back to 2D textures BufferWidth texels wide
+	bool _textureBuffersSupported = false;
+	bool _useTextureBuffers = false;
 
 	bool _hasSphere = false;
 	bool _useBVH = false;
 
 	int _renderSceneIndex = 0;
 
+	// index of BVHBuildMethod, used when the scene is rebuilt
+	int _bvhMethodIndex = 0;
+
+	// 0: raytracing.frag, 1: CPURenderer on a background thread
+	int _rendererIndex = 0;
+
+	// edits from the control panel, handleInput applies them through the Scene editing API
+	int _editSphere = 1;
+	Material _editMaterial;
+	bool _materialEdited = false;
+	bool _addSphere = false;
+	bool _removeSphere = false;
+
+	// the balls bounce, the TLAS is refitted every frame instead of rebuilt
+	bool _animateBalls = false;
+	float _animationTime = 0.0f;
+
+	// CPU copy of the bvh buffer, the rows of refitted nodes are uploaded again
+	std::vector<ShaderBVHNode> _bvhNodes;
+
+	// room in the buffers for scene edits, beyond it createPrimitiveBuffer starts over
+	size_t _topLevelCapacity = 0;	// top level primitives, the TLAS may take 2n - 1 nodes
+	size_t _sphereCapacity = 0;
+	size_t _materialCapacity = 0;
+	std::vector<int> _blasRoots;	// root node of every BLAS in the bvh buffer
+
+	// the sky of the CPU renderer, and the distribution both renderers sample it by
+	std::unique_ptr<EnvironmentMap> _environmentMap;
+	std::unique_ptr<CPURenderer> _cpuRenderer;
+	std::unique_ptr<Texture2D> _cpuFrame;
+	std::thread _cpuRenderThread;
+	std::atomic<bool> _cpuRenderStop{ true };
+
+	std::mutex _cpuImageMutex;
+	std::vector<glm::vec3> _cpuImage;
+	bool _cpuImageUpdated = false;
+	uint32_t _cpuSampleCount = 0;
+	double _cpuRaysPerSecond = 0.0;
+	float _cpuConvergedFraction = 0.0f;
+
 	void handleInput() override;
 
 	void renderFrame() override;
 
 	void initShaders();
 
-	void createBalls();
-
 	void createRenderScene(int index);
 
-	void createScene1();
-
-	void createScene2();
-	
-	void createScene3();
-
-	void createPrimitiveBuffer(const std::vector<Sphere>& spheres,
-		const std::vector<Model*> models,
-		const std::vector<glm::mat4>& transforms,
-		const std::vector<Material>& sphereMaterials,
-		const std::vector<Material>& triangleMaterials);
-
-	int getBufferHeight(size_t nObjects, size_t objectSize, size_t texComponent) const;
+	/* the lights of the scene, again whenever Scene::changes has lightsChanged */
+	void createLightBuffer(const Scene& scene);
+
+	void createPrimitiveBuffer(const Scene& scene);
+
+	void startCPURender();
+
+	void stopCPURender();
+
+	void renderCPUFrame();
+
+	/* filter the accumulated GPU frame with denoise.frag and draw it to the screen */
+	void drawDenoisedFrame();
+
+	void animateBalls();
+
+	void editScene();
+
+	/* upload what the scene edits since the last upload changed, see Scene::changes */
+	void updatePrimitiveBuffer(Scene& scene);
+
+	/*
+	*Summary: upload the rows of the bvh buffer holding refitted TLAS nodes
+	*Parameters:
+	*     bvh       : the TLAS, it starts the bvh buffer
+	*     dirtyBegin: first node whose bound changed
+	*     dirtyEnd  : one past the last node whose bound changed
+	*/
+	void updateBVHBuffer(const BVH& bvh, int dirtyBegin, int dirtyEnd);
+
+	/*
+	*Summary: upload elements [begin, end) of a buffer texture, rows of BufferWidth texels
+	*Parameters:
+	*     texture         : the buffer texture
+	*     format          : pixel format of data, e.g. GL_RGBA
+	*     type            : component type of data, e.g. GL_FLOAT
+	*     data            : the elements from begin on
+	*     elementSize     : size of an element in bytes
+	*     texelsPerElement: texels an element takes
+	*     begin           : first element
+	*     end             : one past the last element
+	*/
+	static void updateBufferTexels(Texture& texture, GLenum format, GLenum type, const void* data,
+		size_t elementSize, size_t texelsPerElement, size_t begin, size_t end);
+
+	static ShaderBVHNode toShaderBVHNode(const BVHNode& node);
+
+	static Material toShaderMaterial(const Material& material);
+
+	ShaderInstance toShaderInstance(const Instance& instance) const;
+
+	/*
+	*Summary: append the nodes and ordered primitives of a BVH to the shader buffers
+	*Parameters:
+	*     bvh       : the BVH
+	*     nodes     : node buffer, child indices of the appended nodes are offset to stay valid
+	*     primitives: primitive buffer, leaves of the appended nodes are offset to stay valid
+	*/
+	static void appendBVH(const BVH& bvh, std::vector<BVHNode>& nodes, std::vector<ShaderPrimitive>& primitives);
+
+	/*
+	*Summary: create a data buffer in the storage the shader was built for
+	*Parameters:
+	*     internalFormat  : e.g. GL_RGBA32F
+	*     format          : pixel format of data, e.g. GL_RGBA
+	*     type            : component type of data, e.g. GL_FLOAT
+	*     data            : the elements
+	*     elementSize     : size of an element in bytes
+	*     texelsPerElement: texels an element takes
+	*     count           : number of elements in data
+	*     capacity        : elements the buffer has room for, edits within it upload in place
+	*Return: the buffer
+	*/
+	std::unique_ptr<Texture> createDataBuffer(GLenum internalFormat, GLenum format, GLenum type,
+		const void* data, size_t elementSize, size_t texelsPerElement, size_t count, size_t capacity) const;
+
+	static bool supportsTextureBuffers();
 
 	static int toFloatLayout(int v);
 
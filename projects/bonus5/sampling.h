@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <glm/glm.hpp>
+
+// CPU counterparts of the sampling helpers in raytracing.frag
+
+constexpr float Pi = 3.14159265358979323846f;
+
+struct LocalCoord {
+public:
+    glm::vec3 s;
+    glm::vec3 t;
+    glm::vec3 n;
+};
+
+inline LocalCoord createLocalCoord(const glm::vec3& n) {
+    LocalCoord res;
+    res.n = glm::normalize(n);
+    if (std::abs(res.n.x) > std::abs(res.n.y)) {
+        res.s = glm::normalize(glm::vec3(-res.n.z, 0.0f, res.n.x));
+    } else {
+        res.s = glm::normalize(glm::vec3(0.0f, -res.n.z, res.n.y));
+    }
+    res.t = glm::normalize(glm::cross(res.n, res.s));
+    return res;
+}
+
+inline glm::vec3 toWorld(const LocalCoord& coord, const glm::vec3& v) {
+    return v.x * coord.s + v.y * coord.t + v.z * coord.n;
+}
+
+inline glm::vec3 cosineWeightedSampleHemiSphere(const glm::vec2& u) {
+    float sinTheta = std::sqrt(u.x);
+    float cosTheta = std::sqrt(1.0f - sinTheta * sinTheta);
+    float phi = 2.0f * Pi * u.y;
+
+    return glm::vec3(std::cos(phi) * sinTheta, std::sin(phi) * sinTheta, cosTheta);
+}
+
+inline glm::vec3 uniformSampleSphere(const glm::vec2& u) {
+    float cosTheta = 1.0f - 2.0f * u.x;
+    float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+    float phi = 2.0f * Pi * u.y;
+
+    return glm::vec3(std::cos(phi) * sinTheta, std::sin(phi) * sinTheta, cosTheta);
+}
+
+/*
+*Summary: uniform direction in the cone around the z axis
+*Parameters:
+*     u              : random numbers in [0, 1)
+*     oneMinusCosMax : 1 - cos of the half angle of the cone, kept apart for narrow cones
+*/
+inline glm::vec3 uniformSampleCone(const glm::vec2& u, float oneMinusCosMax) {
+    float cosTheta = 1.0f - u.x * oneMinusCosMax;
+    float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+    float phi = 2.0f * Pi * u.y;
+
+    return glm::vec3(std::cos(phi) * sinTheta, std::sin(phi) * sinTheta, cosTheta);
+}
+
+inline float uniformConePdf(float oneMinusCosMax) {
+    return 1.0f / (2.0f * Pi * oneMinusCosMax);
+}
+
+/* MIS weight of a sample drawn with pdf fPdf when gPdf could have drawn it too */
+inline float powerHeuristic(float fPdf, float gPdf) {
+    float f2 = fPdf * fPdf;
+    float g2 = gPdf * gPdf;
+    return f2 + g2 > 0.0f ? f2 / (f2 + g2) : 0.0f;
+}
+
+inline float fresnelSchlick(float cosTheta, float ior) {
+    float r0 = (1.0f - ior) / (1.0f + ior);
+    r0 = r0 * r0;
+
+    return r0 + (1.0f - r0) * std::pow(1.0f - cosTheta, 5.0f);
+}
+
+inline glm::vec3 gammaCorrection(const glm::vec3& color) {
+    return glm::pow(color, glm::vec3(1.0f / 2.2f));
+}
@@ -0,0 +1,511 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <glm/ext.hpp>
+
+#include "bvh_cache.h"
+#include "random.h"
+#include "scene.h"
+
+Scene::Scene(const SceneDescription& desc, const BVHBuildOptions& options, const BVHCache* cache) {
+    // meshes sharing their arrays, like the three lucys of scene 3, are stored and built once
+    std::vector<int> meshIndices;
+    std::vector<const MeshData*> distinctMeshes;
+    std::map<std::pair<const void*, const void*>, int> meshIds;
+    for (const auto& mesh : desc.meshes) {
+        auto key = std::make_pair(static_cast<const void*>(mesh.vertices), static_cast<const void*>(mesh.indices));
+        auto it = meshIds.find(key);
+        if (it == meshIds.end()) {
+            it = meshIds.insert({ key, static_cast<int>(distinctMeshes.size()) }).first;
+            distinctMeshes.push_back(&mesh);
+        }
+        meshIndices.push_back(it->second);
+    }
+
+    size_t totalVertices = 0;
+    size_t totalTriangles = 0;
+    for (const auto mesh : distinctMeshes) {
+        totalVertices += mesh->vertices->size();
+        totalTriangles += mesh->indices->size() / 3;
+    }
+
+    // primitives keep raw pointers, so the arrays must not grow after this point
+    spheres = desc.spheres;
+    meshes = desc.meshes.size();
+    vertices.resize(totalVertices);
+    triangles.resize(totalTriangles);
+    instances.reserve(desc.meshes.size());
+    primitives.reserve(spheres.size() + desc.meshes.size());
+
+    int materialCnt = 0;
+    if (!spheres.empty()) {
+        for (int i = 0; i < static_cast<int>(spheres.size()); ++i) {
+            primitives.push_back(Primitive(Primitive::Type::Sphere, i, materialCnt + i, &spheres[i]));
+            _sphereMaterials.push_back(materialCnt + i);
+        }
+
+        for (const auto& material : desc.sphereMaterials) {
+            materials.push_back(material);
+            ++materialCnt;
+        }
+    }
+
+    auto buildStart = std::chrono::high_resolution_clock::now();
+
+    int vertexCnt = 0;
+    int triangleCnt = 0;
+    for (const auto mesh : distinctMeshes) {
+        const auto& vertIndices = *mesh->indices;
+        meshTriangleOffsets.push_back(triangleCnt);
+
+        // the material comes from the instance that was hit
+        std::vector<Primitive> meshPrimitives;
+        meshPrimitives.reserve(vertIndices.size() / 3);
+        for (size_t j = 0; j < vertIndices.size(); j += 3) {
+            triangles[triangleCnt] = Triangle(vertIndices[j] + vertexCnt,
+                vertIndices[j + 1] + vertexCnt,
+                vertIndices[j + 2] + vertexCnt,
+                vertices.data());
+            meshPrimitives.push_back(Primitive(Primitive::Type::Triangle,
+                triangleCnt, -1, &triangles[triangleCnt]));
+            triangleCnt++;
+        }
+
+        for (const auto& vertex : *mesh->vertices) {
+            vertices[vertexCnt++] = vertex;
+        }
+
+        // the TLAS over the instances builds in well under a millisecond, only the BLAS are cached
+        std::unique_ptr<BVH> meshBVH;
+        uint64_t key = 0;
+        if (cache != nullptr) {
+            key = BVHCache::getMeshKey(*mesh->vertices, vertIndices, options);
+            meshBVH = cache->load(key, meshPrimitives, options);
+            cachedBLAS += meshBVH != nullptr ? 1 : 0;
+        }
+
+        if (meshBVH == nullptr) {
+            meshBVH.reset(new BVH(meshPrimitives, options));
+            if (cache != nullptr) {
+                cache->save(key, *meshBVH, meshPrimitives);
+            }
+        }
+
+        blas.push_back(std::move(meshBVH));
+    }
+
+    for (int i = 0; i < static_cast<int>(desc.meshes.size()); ++i) {
+        const BVH* meshBVH = blas[meshIndices[i]].get();
+        if (meshBVH->nodes.empty()) {
+            continue;
+        }
+
+        instances.push_back(Instance(meshBVH, meshBVH->nodes[0].box,
+            meshIndices[i], materialCnt + i, desc.transforms[i]));
+        primitives.push_back(Primitive(Primitive::Type::Instance,
+            static_cast<int>(instances.size()) - 1, materialCnt + i, &instances.back()));
+    }
+
+    for (const auto& material : desc.meshMaterials) {
+        materials.push_back(material);
+    }
+
+    bvh.reset(new BVH(primitives, options));
+    auto buildEnd = std::chrono::high_resolution_clock::now();
+    bvhBuildTime = std::chrono::duration<float, std::milli>(buildEnd - buildStart).count();
+
+    findLights();
+}
+
+bool Scene::intersect(const Ray& ray, Interaction& isect) const {
+    if (!bvh->intersect(ray, isect)) {
+        return false;
+    }
+
+    isect.material = materials[isect.primitive.materialIdx];
+    return true;
+}
+
+void Scene::intersect(const Ray* rays, int count, Interaction* isects, bool* hits) const {
+    for (int first = 0; first < count; first += BVH::MaxPacketSize) {
+        const int n = std::min(count - first, static_cast<int>(BVH::MaxPacketSize));
+        bvh->intersectPacket(rays + first, n, isects + first, hits + first);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (hits[i]) {
+            isects[i].material = materials[isects[i].primitive.materialIdx];
+        }
+    }
+}
+
+bool Scene::occluded(const Ray& ray, float tMax) const {
+    return bvh->occluded(ray, tMax);
+}
+
+bool Scene::refit(bool meshesMoved, int* dirtyBegin, int* dirtyEnd) {
+    bool rebuilt = false;
+    if (meshesMoved) {
+        for (auto& meshBVH : blas) {
+            meshBVH->refit();
+            if (meshBVH->isDegraded()) {
+                meshBVH->rebuild();
+                rebuilt = true;
+            }
+        }
+
+        for (auto& instance : instances) {
+            instance.updateBound(instance.blas->nodes[0].box);
+        }
+    }
+
+    bvh->refit(dirtyBegin, dirtyEnd);
+    if (bvh->isDegraded()) {
+        bvh->rebuild();
+        rebuilt = true;
+        if (dirtyBegin != nullptr && dirtyEnd != nullptr) {
+            *dirtyBegin = 0;
+            *dirtyEnd = static_cast<int>(bvh->nodes.size());
+        }
+    }
+
+    return rebuilt;
+}
+
+int Scene::addSphere(const Sphere& sphere, const Material& material) {
+    int handle = 0;
+    if (!_freeSpheres.empty()) {
+        handle = _freeSpheres.back();
+        _freeSpheres.pop_back();
+        spheres[handle] = sphere;
+        materials[_sphereMaterials[handle]] = material;
+    } else {
+        handle = static_cast<int>(spheres.size());
+        const bool grows = spheres.size() == spheres.capacity();
+        spheres.push_back(sphere);
+        if (grows) {
+            relinkSpheres();
+        }
+
+        // appended, the materials of the meshes keep their indices
+        _sphereMaterials.push_back(static_cast<int>(materials.size()));
+        materials.push_back(material);
+    }
+
+    const Primitive prim(Primitive::Type::Sphere, handle, _sphereMaterials[handle], &spheres[handle]);
+    primitives.push_back(prim);
+    bvh->orderedPrimitives.push_back(prim);
+
+    changes.spheres.add(handle);
+    changes.materials.add(_sphereMaterials[handle]);
+    _tlasChanged = true;
+
+    return handle;
+}
+
+void Scene::removeSphere(int sphere) {
+    const int idx = findPrimitive(Primitive::Type::Sphere, sphere);
+    if (idx < 0) {
+        throw std::runtime_error("removeSphere: no sphere " + std::to_string(sphere));
+    }
+
+    primitives.erase(primitives.begin() + idx);
+    auto& ordered = bvh->orderedPrimitives;
+    ordered.erase(std::remove_if(ordered.begin(), ordered.end(), [sphere](const Primitive& prim) {
+        return prim.type == Primitive::Type::Sphere && prim.shapeIdx == sphere;
+    }), ordered.end());
+
+    // the slot stays in the sphere buffer, no primitive refers to it any more
+    _freeSpheres.push_back(sphere);
+    _tlasChanged = true;
+}
+
+bool Scene::hasSphere(int sphere) const {
+    return sphere >= 0 && sphere < static_cast<int>(spheres.size()) &&
+        std::find(_freeSpheres.begin(), _freeSpheres.end(), sphere) == _freeSpheres.end();
+}
+
+void Scene::setSphere(int sphere, const Sphere& value) {
+    if (!hasSphere(sphere)) {
+        throw std::runtime_error("setSphere: no sphere " + std::to_string(sphere));
+    }
+
+    spheres[sphere] = value;
+    changes.spheres.add(sphere);
+    _tlasMoved = true;
+}
+
+int Scene::getSphereMaterial(int sphere) const {
+    if (!hasSphere(sphere)) {
+        throw std::runtime_error("getSphereMaterial: no sphere " + std::to_string(sphere));
+    }
+
+    return _sphereMaterials[sphere];
+}
+
+void Scene::setMaterial(int material, const Material& value) {
+    if (material < 0 || material >= static_cast<int>(materials.size())) {
+        throw std::runtime_error("setMaterial: no material " + std::to_string(material));
+    }
+
+    // hits look the material up by index, the BVHs stay as they are
+    materials[material] = value;
+    changes.materials.add(material);
+}
+
+void Scene::setInstanceTransform(int instance, const glm::mat4& transform) {
+    if (instance < 0 || instance >= static_cast<int>(instances.size())) {
+        throw std::runtime_error("setInstanceTransform: no instance " + std::to_string(instance));
+    }
+
+    Instance& dst = instances[instance];
+    dst = Instance(dst.blas, dst.blas->nodes[0].box, dst.meshIdx, dst.materialIdx, transform);
+    changes.instances.add(instance);
+    _tlasMoved = true;
+}
+
+bool Scene::update() {
+    bool rebuilt = false;
+    if (_tlasChanged) {
+        // the TLAS only holds the spheres and instances, it rebuilds in well under a millisecond
+        bvh->rebuild();
+        rebuilt = true;
+    } else if (_tlasMoved) {
+        int dirtyBegin = 0;
+        int dirtyEnd = 0;
+        rebuilt = refit(false, &dirtyBegin, &dirtyEnd);
+        if (!rebuilt) {
+            changes.tlasNodes.add(dirtyBegin, dirtyEnd);
+        }
+    }
+
+    changes.tlasRebuilt = changes.tlasRebuilt || rebuilt;
+    changes.lightsChanged = findLights() || changes.lightsChanged;
+    _tlasChanged = false;
+    _tlasMoved = false;
+
+    return rebuilt;
+}
+
+void Scene::relinkSpheres() {
+    auto relink = [this](std::vector<Primitive>& prims) {
+        for (auto& prim : prims) {
+            if (prim.type == Primitive::Type::Sphere) {
+                prim.sphere = &spheres[prim.shapeIdx];
+            }
+        }
+    };
+
+    relink(primitives);
+    relink(bvh->orderedPrimitives);
+}
+
+int Scene::findPrimitive(Primitive::Type type, int shapeIdx) const {
+    for (size_t i = 0; i < primitives.size(); ++i) {
+        if (primitives[i].type == type && primitives[i].shapeIdx == shapeIdx) {
+            return static_cast<int>(i);
+        }
+    }
+
+    return -1;
+}
+
+bool Scene::findLights() {
+    std::vector<int> emissive;
+    for (int i = 0; i < static_cast<int>(spheres.size()); ++i) {
+        if (hasSphere(i) && materials[_sphereMaterials[i]].type == Material::Type::Emissive) {
+            emissive.push_back(i);
+        }
+    }
+
+    if (emissive == lights) {
+        return false;
+    }
+
+    lights.swap(emissive);
+    return true;
+}
+
+void createBalls(std::vector<Sphere>& balls, std::vector<Material>& materials) {
+    balls.push_back(Sphere(glm::vec3(0.0f, -1000.0f, 0.0f), 1000.0f));
+    materials.push_back(Material(Material::Type::Lambertian, 1.0f, 0.0f, glm::vec3(0.5f, 0.5f, 0.5f)));
+    for (int a = -12; a < 12; ++a) {
+        for (int b = -12; b < 12; ++b) {
+            // one stream per grid cell, a ball does not depend on the cells generated before it
+            RNG rng = RNG::createStream(static_cast<uint32_t>((a + 12) * 24 + (b + 12)));
+            float chooseMat = randomFloat(rng);
+            float offsetX = randomFloat(rng);
+            float offsetZ = randomFloat(rng);
+            glm::vec3 center(a + 0.9f * offsetX, 0.2f, b + 0.9f * offsetZ);
+
+            if ((glm::length(center - glm::vec3(0.0f, 0.2f, 0.0f)) > 2.0f) &&
+                (glm::length(center - glm::vec3(4.0f, 0.2f, -2.0f)) > 2.0f) &&
+                (glm::length(center - glm::vec3(-4.0f, 0.2f, 2.0f)) > 2.0f) &&
+                (glm::length(center - glm::vec3(4.0f, 0.0f, 5.0f)) > 1.0f)) {
+                Material material;
+                if (chooseMat < 0.8f) {
+                    material.type = Material::Type::Lambertian;
+                    material.ior = 1.0f;
+                    material.fuzz = 0.0f;
+                    glm::vec3 albedo = randomVec3(rng);
+                    material.albedo = albedo * randomVec3(rng);
+                } else if (chooseMat < 0.95f) {
+                    material.type = Material::Type::Metal;
+                    material.ior = 1.0f;
+                    material.fuzz = randomFloat(rng, 0.0f, 0.5f);
+                    material.albedo = randomVec3(rng, 0.5f, 1.0f);
+                } else {
+                    material.type = Material::Type::Dielectric;
+                    material.ior = 1.5f;
+                    material.fuzz = 0.0f;
+                    material.albedo = glm::vec3(1.0f, 1.0f, 1.0f);
+                }
+
+                balls.push_back(Sphere(center, randomFloat(rng, 0.15f, 0.2f)));
+                materials.push_back(material);
+            }
+        }
+    }
+
+    // init three big sphere
+    balls.push_back(Sphere(glm::vec3(4.0f, 1.0f, 5.0f), 1.0f));
+    materials.push_back(Material(Material::Type::Dielectric, 1.5f, 0.0f, glm::vec3(1.0f, 1.0f, 1.0f)));
+
+    balls.push_back(Sphere(glm::vec3(-8.0f, 2.0f, 14.0f), 2.0f));
+    materials.push_back(Material(Material::Type::Lambertian, 1.0f, 0.0f, glm::vec3(0.2f, 0.4f, 0.8f)));
+
+    balls.push_back(Sphere(glm::vec3(3.0f, 3.0f, -8.0f), 2.0f));
+    materials.push_back(Material(Material::Type::Metal, 1.0f, 0.0f, glm::vec3(0.7f, 0.6f, 0.5f)));
+}
+
+SceneDescription createScene1Description() {
+    SceneDescription desc;
+    desc.cameraPosition = glm::vec3(0.0f, 0.0f, 12.0f);
+    desc.useBVH = false;
+
+    desc.spheres = {
+        Sphere(glm::vec3(0.0f, 0.0f, 0.0f), 1.5f),
+        Sphere(glm::vec3(4.0f, 0.0f, 0.0f), 1.5f),
+        Sphere(glm::vec3(-4.0f, 0.0f, 0.0f), 1.5f)
+    };
+
+    desc.sphereMaterials = {
+        Material(Material::Type::Dielectric, 1.5f, 0.0f, glm::vec3(1.0f, 1.0f, 1.0f)),
+        Material(Material::Type::Metal, 1.0f, 0.0f, glm::vec3(0.7f, 0.6f, 0.5f)),
+        Material(Material::Type::Lambertian, 1.0f, 0.0f, glm::vec3(0.8f, 0.4f, 0.2f))
+    };
+
+    return desc;
+}
+
+SceneDescription createScene2Description(
+    const std::vector<Sphere>& balls, const std::vector<Material>& ballMaterials
+) {
+    SceneDescription desc;
+    desc.cameraPosition = glm::vec3(15.0f, 3.0f, 4.0f);
+    desc.useBVH = true;
+
+    desc.spheres = balls;
+    desc.sphereMaterials = ballMaterials;
+
+    return desc;
+}
+
+SceneDescription createScene3Description(
+    const std::vector<Sphere>& balls, const std::vector<Material>& ballMaterials, const MeshData& lucy
+) {
+    SceneDescription desc;
+    desc.cameraPosition = glm::vec3(15.0f, 3.0f, 4.0f);
+    desc.useBVH = true;
+
+    glm::mat4 scaleT = glm::scale(glm::mat4(1.0f), glm::vec3(0.6f, 0.6f, 0.6f));
+    glm::mat4 rotateT = glm::rotate(glm::mat4(1.0f), glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+    desc.spheres = balls;
+    desc.sphereMaterials = ballMaterials;
+
+    desc.meshes = { lucy, lucy, lucy };
+    desc.transforms = {
+        rotateT * scaleT,
+        glm::translate(glm::mat4(1.0f), glm::vec3(-4.0f, 0.0f,  2.0f)) * rotateT * scaleT,
+        glm::translate(glm::mat4(1.0f), glm::vec3( 4.0f, 0.0f, -2.0f)) * rotateT * scaleT
+    };
+
+    desc.meshMaterials = {
+        Material(Material::Type::Dielectric, 1.5f, 0.0f, glm::vec3(1.0f, 1.0f, 1.0f)),
+        Material(Material::Type::Metal,      1.0f, 0.0f, glm::vec3(0.7f, 0.6f, 0.5f)),
+        Material(Material::Type::Lambertian, 1.0f, 0.0f, glm::vec3(0.8f, 0.4f, 0.2f))
+    };
+
+    return desc;
+}
+
+SceneDescription createSmallLightSceneDescription(
+    const std::vector<Sphere>& balls, const std::vector<Material>& ballMaterials
+) {
+    SceneDescription desc = createScene2Description(balls, ballMaterials);
+
+    // the dome blocks the sky, the balls are lit from inside it
+    desc.spheres.push_back(Sphere(glm::vec3(0.0f), 40.0f));
+    desc.sphereMaterials.push_back(Material(Material::Type::Lambertian, 1.0f, 0.0f, glm::vec3(0.6f, 0.6f, 0.6f)));
+
+    desc.spheres.push_back(Sphere(glm::vec3(2.0f, 5.0f, 1.0f), 0.25f));
+    desc.sphereMaterials.push_back(Material(Material::Type::Emissive, 1.0f, 0.0f, glm::vec3(400.0f, 360.0f, 300.0f)));
+
+    return desc;
+}
+
+SceneDescription createInstancingSceneDescription(
+    const std::vector<Sphere>& balls, const std::vector<Material>& ballMaterials, const MeshData& lucy,
+    int nInstances
+) {
+    SceneDescription desc;
+    desc.cameraPosition = glm::vec3(15.0f, 3.0f, 4.0f);
+    desc.useBVH = true;
+
+    desc.spheres = balls;
+    desc.sphereMaterials = ballMaterials;
+
+    glm::mat4 scaleT = glm::scale(glm::mat4(1.0f), glm::vec3(0.3f, 0.3f, 0.3f));
+    const int gridSize = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(nInstances))));
+    for (int i = 0; i < nInstances; ++i) {
+        RNG rng = RNG::createStream(static_cast<uint32_t>(i));
+        float x = 24.0f * ((i % gridSize) + 0.5f) / gridSize - 12.0f;
+        float z = 24.0f * ((i / gridSize) + 0.5f) / gridSize - 12.0f;
+        float angle = randomFloat(rng, 0.0f, 360.0f);
+        glm::mat4 rotateT = glm::rotate(glm::mat4(1.0f), glm::radians(angle), glm::vec3(0.0f, 1.0f, 0.0f));
+
+        Material material;
+        float chooseMat = randomFloat(rng);
+        if (chooseMat < 0.6f) {
+            material = Material(Material::Type::Lambertian, 1.0f, 0.0f, randomVec3(rng, 0.2f, 0.9f));
+        } else if (chooseMat < 0.85f) {
+            material = Material(Material::Type::Metal, 1.0f, randomFloat(rng, 0.0f, 0.3f), randomVec3(rng, 0.5f, 1.0f));
+        } else {
+            material = Material(Material::Type::Dielectric, 1.5f, 0.0f, glm::vec3(1.0f));
+        }
+
+        desc.meshes.push_back(lucy);
+        desc.transforms.push_back(glm::translate(glm::mat4(1.0f), glm::vec3(x, 0.0f, z)) * rotateT * scaleT);
+        desc.meshMaterials.push_back(material);
+    }
+
+    return desc;
+}
+
+SceneDescription createSceneDescription(int index,
+    const std::vector<Sphere>& balls, const std::vector<Material>& ballMaterials, const MeshData& lucy
+) {
+    switch (index) {
+        case 0: return createScene1Description();
+        case 1: return createScene2Description(balls, ballMaterials);
+        case 2: return createScene3Description(balls, ballMaterials, lucy);
+        case 3: return createSmallLightSceneDescription(balls, ballMaterials);
+        default: return createScene3Description(balls, ballMaterials, lucy);
+    }
+}
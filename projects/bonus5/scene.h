@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "../base/vertex.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "material.h"
+#include "primitive.h"
+#include "instance.h"
+#include "bvh.h"
+
+class BVHCache;
+
+/* triangle mesh geometry owned by someone else, e.g. a Model, meshes sharing the arrays are built once */
+struct MeshData {
+public:
+    const std::vector<Vertex>* vertices = nullptr;
+    const std::vector<uint32_t>* indices = nullptr;
+
+public:
+    MeshData() = default;
+
+    MeshData(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices) :
+        vertices(&vertices), indices(&indices) { }
+};
+
+/* everything needed to build a scene, shared by the GPU and CPU renderers */
+struct SceneDescription {
+public:
+    std::vector<Sphere> spheres;
+    std::vector<Material> sphereMaterials;
+
+    std::vector<MeshData> meshes;
+    std::vector<glm::mat4> transforms;
+    std::vector<Material> meshMaterials;
+
+    bool useBVH = false;
+
+    glm::vec3 cameraPosition = glm::vec3(0.0f);
+    glm::vec3 cameraTarget = glm::vec3(0.0f);
+};
+
+/* elements [begin, end) of an array changed, empty if begin >= end */
+struct DirtyRange {
+public:
+    int begin = 0;
+    int end = 0;
+
+public:
+    bool empty() const {
+        return begin >= end;
+    }
+
+    void add(int first, int last) {
+        if (first >= last) {
+            return;
+        }
+
+        begin = empty() ? first : std::min(begin, first);
+        end = empty() ? last : std::max(end, last);
+    }
+
+    void add(int idx) {
+        add(idx, idx + 1);
+    }
+};
+
+/* what the edits since the last Scene::clearChanges touched, the GPU buffers upload only these */
+struct SceneChanges {
+public:
+    DirtyRange spheres;
+    DirtyRange materials;
+    DirtyRange instances;
+    DirtyRange tlasNodes;       // TLAS nodes refitted by Scene::update
+    bool tlasRebuilt = false;   // TLAS nodes and orderedPrimitives are all new, their counts may differ
+    bool lightsChanged = false; // Scene::lights differ, e.g. a sphere became emissive
+
+public:
+    bool empty() const {
+        return spheres.empty() && materials.empty() && instances.empty() && tlasNodes.empty() &&
+            !tlasRebuilt && !lightsChanged;
+    }
+};
+
+/*
+ * geometry of a scene: spheres in world space, every distinct mesh once in
+ * object space with its own BVH (BLAS), instances placing the meshes, and
+ * the top level BVH (TLAS) over the spheres and instances
+ */
+class Scene {
+public:
+    std::vector<Sphere> spheres;
+    std::vector<Vertex> vertices;       // vertices of the distinct meshes
+    std::vector<Triangle> triangles;    // triangles of the distinct meshes
+    std::vector<Material> materials;
+    std::vector<Primitive> primitives;  // spheres and instances
+    std::vector<Instance> instances;
+    size_t meshes = 0;                  // mesh instances in the scene
+
+    // spheres with an emissive material, sampled for direct light. Emissive meshes
+    // are no lights, they are only found by the paths that hit them
+    std::vector<int> lights;
+
+    /* one BVH per distinct mesh, meshTriangleOffsets[i] is the first triangle of mesh i */
+    std::vector<std::unique_ptr<BVH>> blas;
+    std::vector<size_t> meshTriangleOffsets;
+
+    std::unique_ptr<BVH> bvh;           // TLAS
+    float bvhBuildTime = 0.0f;          // ms, BLAS and TLAS
+    int cachedBLAS = 0;                 // BLAS loaded from the cache instead of built
+
+    SceneChanges changes;
+
+public:
+    /*
+    *Summary: build the scene
+    *Parameters:
+    *     desc   : the scene description
+    *     options: build options of the BLAS and TLAS
+    *     cache  : BLAS are loaded from it when present and saved to it after a build, may be nullptr
+    */
+    Scene(const SceneDescription& desc, const BVHBuildOptions& options = BVHBuildOptions(),
+        const BVHCache* cache = nullptr);
+
+    Scene(const Scene& rhs) = delete;
+
+    /*
+    *Summary: find the closest hit of the ray and fetch the material of the hit primitive
+    *Parameters:
+    *     ray  : the ray, tMax is shortened to the hit distance
+    *     isect: record the hit point, primitive and material
+    *Return: true if the ray hit something
+    */
+    bool intersect(const Ray& ray, Interaction& isect) const;
+
+    /*
+    *Summary: closest hits of a batch of coherent rays, e.g. camera rays of neighbouring pixels,
+    *         cut into packets of BVH::MaxPacketSize rays in the given order
+    *Parameters:
+    *     rays  : the rays, tMax of every ray is shortened to its hit distance
+    *     count : number of rays
+    *     isects: record the hit point, primitive and material of every ray
+    *     hits  : receives whether every ray hit something
+    */
+    void intersect(const Ray* rays, int count, Interaction* isects, bool* hits) const;
+
+    /* true if anything blocks the ray before tMax, see BVH::occluded */
+    bool occluded(const Ray& ray, float tMax) const;
+
+    /*
+    *Summary: refit the BVHs after spheres or mesh vertices were moved in place, a BVH whose
+    *         SAH cost degraded past BVHBuildOptions::rebuildThreshold is rebuilt instead
+    *Parameters:
+    *     meshesMoved: vertices changed too, the BLAS and instance bounds are refitted first
+    *     dirtyBegin : first TLAS node whose bound changed
+    *     dirtyEnd   : one past the last TLAS node whose bound changed
+    *Return: true if a BVH was rebuilt, its nodes and orderedPrimitives are then reordered
+    */
+    bool refit(bool meshesMoved = false, int* dirtyBegin = nullptr, int* dirtyEnd = nullptr);
+
+    // editing: sphere handles are indices into spheres and stay valid until the sphere is removed,
+    // instance and material handles are indices into instances and materials. Edits are recorded
+    // in changes, the TLAS follows them in update()
+
+    /*
+    *Summary: add a sphere with its own material, the slot of a removed sphere is reused
+    *Return: handle of the sphere
+    */
+    int addSphere(const Sphere& sphere, const Material& material);
+
+    void removeSphere(int sphere);
+
+    bool hasSphere(int sphere) const;
+
+    void setSphere(int sphere, const Sphere& value);
+
+    /* the material index of the sphere, e.g. to edit it with setMaterial */
+    int getSphereMaterial(int sphere) const;
+
+    void setMaterial(int material, const Material& value);
+
+    void setInstanceTransform(int instance, const glm::mat4& transform);
+
+    /*
+    *Summary: bring the TLAS and the lights up to date with the edits, moved spheres and instances
+    *         refit the TLAS, added or removed ones rebuild it. The BLAS are never touched
+    *Return: true if the TLAS was rebuilt
+    */
+    bool update();
+
+    void clearChanges() {
+        changes = SceneChanges();
+    }
+
+private:
+    std::vector<int> _sphereMaterials;  // material of every sphere slot, kept for reuse after removal
+    std::vector<int> _freeSpheres;      // slots of removed spheres
+    bool _tlasMoved = false;            // bounds of TLAS primitives changed
+    bool _tlasChanged = false;          // TLAS primitives were added or removed
+
+    /* point the primitives at spheres again after the array grew */
+    void relinkSpheres();
+
+    int findPrimitive(Primitive::Type type, int shapeIdx) const;
+
+    /* collect the emissive spheres into lights, return true if they changed */
+    bool findLights();
+};
+
+/*
+*Summary: generate the random balls of scene 2 and scene 3
+*Parameters:
+*     balls    : receives the spheres
+*     materials: receives the material of every sphere
+*/
+void createBalls(std::vector<Sphere>& balls, std::vector<Material>& materials);
+
+SceneDescription createScene1Description();
+
+SceneDescription createScene2Description(
+    const std::vector<Sphere>& balls, const std::vector<Material>& ballMaterials);
+
+SceneDescription createScene3Description(
+    const std::vector<Sphere>& balls, const std::vector<Material>& ballMaterials, const MeshData& lucy);
+
+/* the balls of scene 2 under a closed dome, lit only by a small bright sphere */
+SceneDescription createSmallLightSceneDescription(
+    const std::vector<Sphere>& balls, const std::vector<Material>& ballMaterials);
+
+/*
+*Summary: a grid of lucy instances over the balls of scene 2, used to measure instancing
+*Parameters:
+*     nInstances: number of lucy instances
+*/
+SceneDescription createInstancingSceneDescription(
+    const std::vector<Sphere>& balls, const std::vector<Material>& ballMaterials, const MeshData& lucy,
+    int nInstances);
+
+/*
+*Summary: describe one of the preset scenes
+*Parameters:
+*     index: 0, 1 or 2 for scene 1, 2 or 3, 3 for the small light scene, other values fall back to scene 3
+*Return: the scene description
+*/
+SceneDescription createSceneDescription(int index,
+    const std::vector<Sphere>& balls, const std::vector<Material>& ballMaterials, const MeshData& lucy);
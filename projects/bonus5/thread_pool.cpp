@@ -0,0 +1,168 @@
+#include <algorithm>
+
+#include "thread_pool.h"
+
+static thread_local const ThreadPool* currentPool = nullptr;
+static thread_local int currentWorkerIndex = -1;
+
+ThreadPool::ThreadPool(int nThreads) {
+    if (nThreads <= 0) {
+        nThreads = getHardwareThreadCount();
+    }
+
+    // the thread waiting on a group works too, so one thread less is spawned
+    const int nWorkers = nThreads - 1;
+    for (int i = 0; i < nWorkers + 1; ++i) {
+        _queues.emplace_back(new WorkQueue);
+    }
+
+    for (int i = 0; i < nWorkers; ++i) {
+        _workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(_sleepMutex);
+        _shutdown = true;
+    }
+    _sleepCondition.notify_all();
+
+    for (auto& worker : _workers) {
+        worker.join();
+    }
+}
+
+int ThreadPool::getThreadCount() const {
+    return static_cast<int>(_workers.size()) + 1;
+}
+
+int ThreadPool::getHardwareThreadCount() {
+    return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+void ThreadPool::run(TaskGroup& group, std::function<void()> task) {
+    group.pending.fetch_add(1);
+
+    int queueIndex = getCurrentWorkerIndex();
+    if (queueIndex < 0) {
+        queueIndex = static_cast<int>(_queues.size()) - 1;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_queues[queueIndex]->mutex);
+        _queues[queueIndex]->tasks.push_back({ std::move(task), &group });
+    }
+
+    _queuedTasks.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> lock(_sleepMutex);
+    }
+    _sleepCondition.notify_one();
+}
+
+void ThreadPool::wait(TaskGroup& group) {
+    const int workerIndex = getCurrentWorkerIndex();
+    while (group.pending.load() > 0) {
+        if (!tryRunTask(workerIndex)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void ThreadPool::parallelFor(
+    int begin, int end, int grainSize, const std::function<void(int, int)>& func
+) {
+    const int count = end - begin;
+    if (count <= 0) {
+        return;
+    }
+
+    grainSize = std::max(1, grainSize);
+    if (count <= grainSize || getThreadCount() == 1) {
+        func(begin, end);
+        return;
+    }
+
+    const int nChunks = std::min((count + grainSize - 1) / grainSize, 4 * getThreadCount());
+    const int chunkSize = (count + nChunks - 1) / nChunks;
+
+    TaskGroup group;
+    for (int chunkBegin = begin; chunkBegin < end; chunkBegin += chunkSize) {
+        int chunkEnd = std::min(chunkBegin + chunkSize, end);
+        run(group, [&func, chunkBegin, chunkEnd]() { func(chunkBegin, chunkEnd); });
+    }
+
+    wait(group);
+}
+
+void ThreadPool::workerLoop(int workerIndex) {
+    currentPool = this;
+    currentWorkerIndex = workerIndex;
+
+    while (true) {
+        if (tryRunTask(workerIndex)) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(_sleepMutex);
+        _sleepCondition.wait(lock, [this]() {
+            return _shutdown || _queuedTasks.load() > 0;
+        });
+
+        if (_shutdown && _queuedTasks.load() == 0) {
+            return;
+        }
+    }
+}
+
+bool ThreadPool::tryRunTask(int workerIndex) {
+    Task task;
+    bool found = false;
+
+    // newest own task first for locality, then steal the oldest task of others
+    if (workerIndex >= 0) {
+        found = popTask(workerIndex, true, task);
+    }
+
+    const int nQueues = static_cast<int>(_queues.size());
+    const int victimStart = static_cast<int>(_nextQueue.fetch_add(1) % nQueues);
+    for (int i = 0; i < nQueues && !found; ++i) {
+        int victim = (victimStart + i) % nQueues;
+        if (victim != workerIndex) {
+            found = popTask(victim, false, task);
+        }
+    }
+
+    if (!found) {
+        return false;
+    }
+
+    _queuedTasks.fetch_sub(1);
+    task.func();
+    task.group->pending.fetch_sub(1);
+
+    return true;
+}
+
+bool ThreadPool::popTask(int queueIndex, bool back, Task& task) {
+    WorkQueue& queue = *_queues[queueIndex];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+        return false;
+    }
+
+    if (back) {
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+    } else {
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+    }
+
+    return true;
+}
+
+int ThreadPool::getCurrentWorkerIndex() const {
+    return currentPool == this ? currentWorkerIndex : -1;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* a set of tasks that can be waited on together */
+struct TaskGroup {
+public:
+    std::atomic<int> pending{ 0 };
+};
+
+/*
+ * work-stealing thread pool: every worker owns a deque, pushes and pops its
+ * own tasks at the back and steals from the front of the other deques
+ */
+class ThreadPool {
+public:
+    /* nThreads <= 0 uses all hardware threads */
+    explicit ThreadPool(int nThreads = 0);
+
+    ThreadPool(const ThreadPool& rhs) = delete;
+
+    ~ThreadPool();
+
+    int getThreadCount() const;
+
+    /*
+    *Summary: schedule a task, it runs on a worker or on a thread waiting for its group
+    *Parameters:
+    *     group: the group the task belongs to
+    *     task : the task
+    */
+    void run(TaskGroup& group, std::function<void()> task);
+
+    /*
+    *Summary: block until every task of the group finished, run pending tasks meanwhile
+    *Parameters:
+    *     group: the group to wait on
+    */
+    void wait(TaskGroup& group);
+
+    /*
+    *Summary: split [begin, end) into chunks of at least grainSize and run func on them in parallel
+    *Parameters:
+    *     begin    : first index
+    *     end      : one past the last index
+    *     grainSize: minimum number of indices per chunk
+    *     func     : func(chunkBegin, chunkEnd)
+    */
+    void parallelFor(int begin, int end, int grainSize, const std::function<void(int, int)>& func);
+
+    static int getHardwareThreadCount();
+
+private:
+    struct Task {
+        std::function<void()> func;
+        TaskGroup* group;
+    };
+
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkQueue>> _queues;
+    std::vector<std::thread> _workers;
+
+    std::mutex _sleepMutex;
+    std::condition_variable _sleepCondition;
+    std::atomic<int> _queuedTasks{ 0 };
+    bool _shutdown = false;
+
+    std::atomic<unsigned int> _nextQueue{ 0 };
+
+    void workerLoop(int workerIndex);
+
+    bool tryRunTask(int workerIndex);
+
+    bool popTask(int queueIndex, bool back, Task& task);
+
+    int getCurrentWorkerIndex() const;
+};
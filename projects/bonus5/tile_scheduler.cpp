@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "tile_scheduler.h"
+
+TileScheduler::TileScheduler(ThreadPool& pool, int width, int height, int tileSize, TileOrder order) :
+    _pool(pool) {
+    const int nTilesX = (width + tileSize - 1) / tileSize;
+    const int nTilesY = (height + tileSize - 1) / tileSize;
+
+    for (int tileIdx : getTileOrder(nTilesX, nTilesY, order)) {
+        Tile tile;
+        tile.x0 = (tileIdx % nTilesX) * tileSize;
+        tile.y0 = (tileIdx / nTilesX) * tileSize;
+        tile.x1 = std::min(tile.x0 + tileSize, width);
+        tile.y1 = std::min(tile.y0 + tileSize, height);
+        _tiles.push_back(tile);
+    }
+
+    for (int i = 0; i < _pool.getThreadCount(); ++i) {
+        _queues.emplace_back(new TileQueue);
+    }
+}
+
+bool TileScheduler::run(const std::function<void(const Tile&)>& func, const std::atomic<bool>& cancelled) {
+    // deal contiguous runs of the tile order so each thread starts on a coherent region
+    const int nQueues = static_cast<int>(_queues.size());
+    const int nTiles = getTileCount();
+    for (int i = 0; i < nQueues; ++i) {
+        _queues[i]->begin = static_cast<int>(static_cast<int64_t>(nTiles) * i / nQueues);
+        _queues[i]->end = static_cast<int>(static_cast<int64_t>(nTiles) * (i + 1) / nQueues);
+    }
+
+    std::atomic<bool> completed{ true };
+    auto worker = [&](int queueIndex) {
+        int tileIdx;
+        while (true) {
+            if (cancelled.load(std::memory_order_relaxed)) {
+                completed = false;
+                return;
+            }
+
+            bool found = popTile(queueIndex, true, tileIdx);
+            for (int i = 1; i < nQueues && !found; ++i) {
+                found = popTile((queueIndex + i) % nQueues, false, tileIdx);
+            }
+
+            if (!found) {
+                return;
+            }
+
+            func(_tiles[tileIdx]);
+        }
+    };
+
+    TaskGroup group;
+    for (int i = 1; i < nQueues; ++i) {
+        _pool.run(group, [&worker, i]() { worker(i); });
+    }
+    worker(0);
+    _pool.wait(group);
+
+    return completed.load();
+}
+
+bool TileScheduler::popTile(int queueIndex, bool front, int& tileIdx) {
+    TileQueue& queue = *_queues[queueIndex];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.begin >= queue.end) {
+        return false;
+    }
+
+    tileIdx = front ? queue.begin++ : --queue.end;
+    return true;
+}
+
+std::vector<int> TileScheduler::getTileOrder(int nTilesX, int nTilesY, TileOrder order) {
+    std::vector<int> tileOrder;
+    tileOrder.reserve(static_cast<size_t>(nTilesX) * nTilesY);
+
+    switch (order) {
+    case TileOrder::Scanline:
+        for (int i = 0; i < nTilesX * nTilesY; ++i) {
+            tileOrder.push_back(i);
+        }
+        break;
+    case TileOrder::Spiral: {
+        // sort by the ring around the center, then by the angle inside the ring
+        const float cx = 0.5f * (nTilesX - 1), cy = 0.5f * (nTilesY - 1);
+        std::vector<std::pair<float, int>> keys;
+        for (int i = 0; i < nTilesX * nTilesY; ++i) {
+            const float dx = (i % nTilesX) - cx, dy = (i / nTilesX) - cy;
+            const float ring = std::floor(std::max(std::abs(dx), std::abs(dy)));
+            const float angle = std::atan2(dy, dx) + 3.1415927f;
+            keys.push_back({ ring * 8.0f + angle, i });
+        }
+        std::sort(keys.begin(), keys.end());
+        for (const auto& key : keys) {
+            tileOrder.push_back(key.second);
+        }
+        break;
+    }
+    case TileOrder::Hilbert: {
+        int n = 1;
+        while (n < nTilesX || n < nTilesY) {
+            n <<= 1;
+        }
+
+        for (int d = 0; d < n * n; ++d) {
+            int x, y;
+            hilbertToXY(n, d, x, y);
+            if (x < nTilesX && y < nTilesY) {
+                tileOrder.push_back(y * nTilesX + x);
+            }
+        }
+        break;
+    }
+    }
+
+    return tileOrder;
+}
+
+void TileScheduler::hilbertToXY(int n, int d, int& x, int& y) {
+    x = y = 0;
+    for (int s = 1, t = d; s < n; s *= 2, t /= 4) {
+        const int rx = 1 & (t / 2);
+        const int ry = 1 & (t ^ rx);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+        x += s * rx;
+        y += s * ry;
+    }
+}
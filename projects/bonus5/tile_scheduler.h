@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "thread_pool.h"
+
+enum class TileOrder {
+    Scanline,   // row by row from the bottom left tile
+    Spiral,     // rings around the center tile, the middle of the image converges first
+    Hilbert     // hilbert curve, consecutive tiles are neighbours
+};
+
+struct Tile {
+public:
+    int x0, y0;     // first pixel
+    int x1, y1;     // one past the last pixel
+};
+
+/*
+ * splits the image into tiles and hands them to the threads of a pool:
+ * every thread owns a deque holding a contiguous run of the tile order,
+ * pops its own tiles from the front and steals from the back of the others
+ * once it runs dry, so expensive regions do not leave the other threads idle
+ */
+class TileScheduler {
+public:
+    TileScheduler(ThreadPool& pool, int width, int height, int tileSize, TileOrder order = TileOrder::Hilbert);
+
+    TileScheduler(const TileScheduler& rhs) = delete;
+
+    int getTileCount() const {
+        return static_cast<int>(_tiles.size());
+    }
+
+    /* tiles in the order they are scheduled */
+    const std::vector<Tile>& getTiles() const {
+        return _tiles;
+    }
+
+    /*
+    *Summary: render every tile once, tiles not started yet are skipped when cancelled
+    *Parameters:
+    *     func     : func(tile), called concurrently for different tiles
+    *     cancelled: polled before every tile
+    *Return: false if the run was cancelled before all tiles were rendered
+    */
+    bool run(const std::function<void(const Tile&)>& func, const std::atomic<bool>& cancelled);
+
+    static std::vector<int> getTileOrder(int nTilesX, int nTilesY, TileOrder order);
+
+private:
+    struct TileQueue {
+        std::mutex mutex;
+        int begin = 0;
+        int end = 0;
+    };
+
+    ThreadPool& _pool;
+    std::vector<Tile> _tiles;
+    std::vector<std::unique_ptr<TileQueue>> _queues;
+
+    bool popTile(int queueIndex, bool front, int& tileIdx);
+
+    static void hilbertToXY(int n, int d, int& x, int& y);
+};
@@ -2,11 +2,15 @@
 
 #include <glm/glm.hpp>
 
-#include "../base/model.h"
+#include "../base/vertex.h"
 #include "ray.h"
 #include "aabb.h"
 
 struct Triangle {
+public:
+    // rays closer to the plane of a triangle than this cosine miss it, every triangle test shares the rule
+    static constexpr float MinHitCosine = 1e-4f;
+
 public:
     int v[3];
     Vertex* vertices;
@@ -21,24 +25,24 @@ public:
         v[2] = vi3;
     }
 
-    bool intersect(const Ray& ray) {
-        glm::vec3 o = ray.o;
-        glm::vec3 dir = ray.dir;
-        Vertex v1 = vertices[v[0]];
-        Vertex v2 = vertices[v[1]];
-        Vertex v3 = vertices[v[2]];
-
-        glm::vec3 p1 = v1.position;
-        glm::vec3 p2 = v2.position;
-        glm::vec3 p3 = v3.position;
-        glm::vec3 n1 = v1.normal;
-        glm::vec3 n2 = v2.normal;
-        glm::vec3 n3 = v3.normal;
+    /*
+    *Summary: intersect the ray with the triangle and shorten ray.tMax on a hit
+    *Parameters:
+    *     ray        : the ray
+    *     barycentric: if not null, receives the weights of v[0], v[1], v[2] at the hit point
+    *Return: true if the ray hit the triangle before ray.tMax
+    */
+    bool intersect(const Ray& ray, glm::vec3* barycentric = nullptr) const {
+        const glm::vec3& o = ray.o;
+        const glm::vec3& dir = ray.dir;
+        const glm::vec3& p1 = vertices[v[0]].position;
+        const glm::vec3& p2 = vertices[v[1]].position;
+        const glm::vec3& p3 = vertices[v[2]].position;
 
         glm::vec3 e1 = p2 - p1;
         glm::vec3 e2 = p3 - p1;
         glm::vec3 n = glm::normalize(glm::cross(e1, e2));
-        if (std::abs(glm::dot(n, dir)) < 1e-4f) {
+        if (std::abs(glm::dot(n, dir)) < MinHitCosine) {
             return false;
         }
         
@@ -56,6 +60,9 @@ public:
         
         if (alpha >= 0 && beta >= 0 && gamma >= 0) {
             ray.tMax = tHit;
+            if (barycentric != nullptr) {
+                *barycentric = glm::vec3(alpha, beta, gamma);
+            }
             return true;
         } else {
             return false;
@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define WIDE_BVH_USE_SSE
+#include <xmmintrin.h>
+#endif
+
+#include "wide_bvh.h"
+
+WideBVHNode::WideBVHNode() {
+    for (int i = 0; i < Width; ++i) {
+        setChildBound(i, AABB());
+        child[i] = -1;
+        nPrimitives[i] = 0;
+    }
+}
+
+void WideBVHNode::setChildBound(int i, const AABB& box) {
+    minX[i] = box.pMin.x;
+    minY[i] = box.pMin.y;
+    minZ[i] = box.pMin.z;
+    maxX[i] = box.pMax.x;
+    maxY[i] = box.pMax.y;
+    maxZ[i] = box.pMax.z;
+}
+
+WideBVH::WideBVH(const BVH& bvh, std::vector<const WideBVH*> blas) : _bvh(bvh), _blas(std::move(blas)) {
+    if (!bvh.nodes.empty()) {
+        collapse(bvh, 0);
+    }
+}
+
+int WideBVH::collapse(const BVH& bvh, int idx) {
+    const int nodeIdx = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+
+    std::vector<int> children;
+    if (bvh.nodes[idx].isLeaf()) {
+        children.push_back(idx);
+    } else {
+        children.push_back(idx + 1);
+        children.push_back(bvh.nodes[idx].rightChild);
+    }
+
+    // open the interior child with the largest area until the node is full
+    while (static_cast<int>(children.size()) < WideBVHNode::Width) {
+        int best = -1;
+        float bestArea = -1.0f;
+        for (int i = 0; i < static_cast<int>(children.size()); ++i) {
+            const BVHNode& node = bvh.nodes[children[i]];
+            if (!node.isLeaf() && node.box.surfaceArea() > bestArea) {
+                best = i;
+                bestArea = node.box.surfaceArea();
+            }
+        }
+
+        if (best == -1) {
+            break;
+        }
+
+        const int opened = children[best];
+        children[best] = opened + 1;
+        children.push_back(bvh.nodes[opened].rightChild);
+    }
+
+    for (int i = 0; i < static_cast<int>(children.size()); ++i) {
+        const BVHNode& node = bvh.nodes[children[i]];
+        int child, nPrimitives;
+        if (node.isLeaf()) {
+            child = node.startIndex;
+            nPrimitives = node.nPrimitives;
+        } else {
+            child = collapse(bvh, children[i]);
+            nPrimitives = 0;
+        }
+
+        // nodes may have been reallocated by the recursion
+        nodes[nodeIdx].setChildBound(i, node.box);
+        nodes[nodeIdx].child[i] = child;
+        nodes[nodeIdx].nPrimitives[i] = nPrimitives;
+    }
+
+    return nodeIdx;
+}
+
+int WideBVH::intersectChildren(
+    const WideBVHNode& node, const Ray& ray, const glm::vec3& invDir, float tNear[WideBVHNode::Width]
+) {
+#ifdef WIDE_BVH_USE_SSE
+    const __m128 ox = _mm_set1_ps(ray.o.x);
+    const __m128 oy = _mm_set1_ps(ray.o.y);
+    const __m128 oz = _mm_set1_ps(ray.o.z);
+    const __m128 idx = _mm_set1_ps(invDir.x);
+    const __m128 idy = _mm_set1_ps(invDir.y);
+    const __m128 idz = _mm_set1_ps(invDir.z);
+
+    const __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minX), ox), idx);
+    const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxX), ox), idx);
+    const __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minY), oy), idy);
+    const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxY), oy), idy);
+    const __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minZ), oz), idz);
+    const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxZ), oz), idz);
+
+    __m128 tMin = _mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1));
+    tMin = _mm_max_ps(tMin, _mm_min_ps(tz0, tz1));
+    tMin = _mm_max_ps(tMin, _mm_setzero_ps());
+    __m128 tMax = _mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1));
+    tMax = _mm_min_ps(tMax, _mm_max_ps(tz0, tz1));
+    tMax = _mm_min_ps(tMax, _mm_set1_ps(ray.tMax));
+
+    _mm_storeu_ps(tNear, tMin);
+    return _mm_movemask_ps(_mm_cmple_ps(tMin, tMax));
+#else
+    int mask = 0;
+    for (int i = 0; i < WideBVHNode::Width; ++i) {
+        float tx0 = (node.minX[i] - ray.o.x) * invDir.x;
+        float tx1 = (node.maxX[i] - ray.o.x) * invDir.x;
+        float ty0 = (node.minY[i] - ray.o.y) * invDir.y;
+        float ty1 = (node.maxY[i] - ray.o.y) * invDir.y;
+        float tz0 = (node.minZ[i] - ray.o.z) * invDir.z;
+        float tz1 = (node.maxZ[i] - ray.o.z) * invDir.z;
+
+        float tMin = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)),
+                              std::max(std::min(tz0, tz1), 0.0f));
+        float tMax = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)),
+                              std::min(std::max(tz0, tz1), ray.tMax));
+        tNear[i] = tMin;
+        if (tMin <= tMax) {
+            mask |= 1 << i;
+        }
+    }
+
+    return mask;
+#endif
+}
+
+bool WideBVH::intersect(const Ray& ray, Interaction& isect) const {
+    struct StackEntry {
+        int child;
+        int nPrimitives;
+        float tNear;
+    };
+
+    if (nodes.empty()) {
+        return false;
+    }
+
+    bool hit = false;
+    glm::vec3 invDir = glm::vec3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+
+    StackEntry stack[256];
+    int stackSize = 0;
+    StackEntry current = { 0, 0, 0.0f };
+
+    while (true) {
+        if (current.nPrimitives > 0) {
+            if (intersectLeaf(ray, current.child, current.nPrimitives, isect)) {
+                hit = true;
+            }
+        } else {
+            const WideBVHNode& node = nodes[current.child];
+            float tNear[WideBVHNode::Width];
+            const int mask = intersectChildren(node, ray, invDir, tNear);
+
+            // sort the hit children near to far
+            StackEntry hits[WideBVHNode::Width];
+            int nHits = 0;
+            for (int i = 0; i < WideBVHNode::Width; ++i) {
+                if ((mask & (1 << i)) && node.child[i] != -1) {
+                    StackEntry e = { node.child[i], node.nPrimitives[i], tNear[i] };
+                    int j = nHits++;
+                    while (j > 0 && hits[j - 1].tNear > e.tNear) {
+                        hits[j] = hits[j - 1];
+                        --j;
+                    }
+                    hits[j] = e;
+                }
+            }
+
+            // go on with the nearest child, the others are pushed far to near
+            if (nHits > 0) {
+                for (int i = nHits - 1; i > 0; --i) {
+                    stack[stackSize++] = hits[i];
+                }
+                current = hits[0];
+                continue;
+            }
+        }
+
+        // skip the entries beyond the closest hit found since they were pushed
+        do {
+            if (stackSize == 0) {
+                return hit;
+            }
+            current = stack[--stackSize];
+        } while (current.tNear > ray.tMax);
+    }
+}
+
+bool WideBVH::intersectLeaf(const Ray& ray, int first, int count, Interaction& isect) const {
+    if (_blas.empty()) {
+        return _bvh.intersectLeaf(ray, first, count, isect);
+    }
+
+    bool hit = false;
+    for (int i = 0; i < count; ++i) {
+        const Primitive& primitive = _bvh.orderedPrimitives[first + i];
+        if (primitive.type == Primitive::Type::Instance ?
+            intersectInstance(ray, *primitive.instance, isect) :
+            BVH::intersectPrimitive(ray, primitive, isect)) {
+            hit = true;
+        }
+    }
+
+    return hit;
+}
+
+bool WideBVH::intersectInstance(const Ray& ray, const Instance& instance, Interaction& isect) const {
+    // the direction is not normalized, so t is the same in both spaces
+    glm::vec3 o = glm::vec3(instance.worldToObject * glm::vec4(ray.o, 1.0f));
+    glm::vec3 dir = glm::vec3(instance.worldToObject * glm::vec4(ray.dir, 0.0f));
+    Ray objectRay(o, dir, ray.tMax);
+    if (!_blas[instance.meshIdx]->intersect(objectRay, isect)) {
+        return false;
+    }
+
+    ray.tMax = objectRay.tMax;
+    isect.hitPoint.position = ray(ray.tMax);
+    isect.hitPoint.normal = glm::normalize(instance.normalToWorld * isect.hitPoint.normal);
+    isect.primitive.materialIdx = instance.materialIdx;
+    return true;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+
+#include "bvh.h"
+
+struct alignas(16) WideBVHNode {
+public:
+    static constexpr int Width = 4;
+public:
+    // bounds of the children in SoA layout
+    float minX[Width], minY[Width], minZ[Width];
+    float maxX[Width], maxY[Width], maxZ[Width];
+    // node index of interior children, first primitive of leaf children, -1 for empty slots
+    int child[Width];
+    // number of primitives of leaf children, 0 for interior children
+    int nPrimitives[Width];
+
+public:
+    WideBVHNode();
+
+    void setChildBound(int i, const AABB& box);
+};
+
+/*
+ * 4-wide BVH collapsed from a binary BVH, traversed with SIMD slab tests.
+ * it shares orderedPrimitives and the leaf tests with the binary BVH it was built from.
+ */
+class WideBVH {
+public:
+    std::vector<WideBVHNode> nodes;
+
+public:
+    /*
+    *Summary: collapse a built BVH, which must outlive the wide one
+    *Parameters:
+    *     bvh : the binary BVH, e.g. Scene::bvh or one of Scene::blas
+    *     blas: wide trees of the meshes indexed by Instance::meshIdx, instances are traced
+    *           through their binary BLAS if it is empty
+    */
+    explicit WideBVH(const BVH& bvh, std::vector<const WideBVH*> blas = {});
+
+    bool intersect(const Ray& ray, Interaction& isect) const;
+
+private:
+    const BVH& _bvh;
+
+    std::vector<const WideBVH*> _blas;
+
+    /*
+    *Summary: collapse the binary subtree into wide nodes
+    *Parameters:
+    *     bvh: the binary BVH
+    *     idx: index of the binary node
+    *Return: index of the wide node in nodes array
+    */
+    int collapse(const BVH& bvh, int idx);
+
+    /* closest hit among the primitives of a leaf, instances go through the wide BLAS if there are any */
+    bool intersectLeaf(const Ray& ray, int first, int count, Interaction& isect) const;
+
+    /* the same as BVH::intersectInstance with the wide tree of the mesh */
+    bool intersectInstance(const Ray& ray, const Instance& instance, Interaction& isect) const;
+
+    /*
+    *Summary: slab test of the ray against the children of a node
+    *Parameters:
+    *     node  : the wide node
+    *     ray   : the ray
+    *     invDir: vec3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z)
+    *     tNear : entry distance of every child
+    *Return: bit i is set if child i is hit
+    */
+    static int intersectChildren(
+        const WideBVHNode& node, const Ray& ray, const glm::vec3& invDir, float tNear[WideBVHNode::Width]);
+};
@@ -0,0 +1,664 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "../base/camera.h"
+#include "../base/model.h"
+#include "../bonus5/bvh.h"
+#include "../bonus5/environment_map.h"
+#include "../bonus5/random.h"
+#include "../bonus5/sampling.h"
+#include "../bonus5/scene.h"
+#include "../bonus5/wide_bvh.h"
+
+// traces fixed ray sets through the scenes of bonus5 on one thread and prints
+// build and traversal figures as JSON, to compare builds of the BVH code
+
+const std::string lucyRelPath = "obj/lucy.obj";
+
+const std::vector<std::string> skyboxTextureRelPaths = {
+	"texture/skyboxrt/right.jpg",
+	"texture/skyboxrt/left.jpg",
+	"texture/skyboxrt/top.jpg",
+	"texture/skyboxrt/bottom.jpg",
+	"texture/skyboxrt/front.jpg",
+	"texture/skyboxrt/back.jpg",
+};
+
+const char* const sceneNames[] = { "scene1", "scene2", "scene3", "instancing", "small_light" };
+
+constexpr int TileSize = 16;
+constexpr float RayOffset = 1e-4f;
+constexpr int TriangleCheckRays = 100000;     // per BLAS
+
+struct BenchmarkOptions {
+	std::string assetRootDir = "../../media/";
+	std::string output;
+	std::vector<int> scenes = { 1, 2, 3 };
+	int instances = 128;
+	int width = 640;
+	int height = 360;
+	int runs = 3;
+	int threads = 0;
+	BVHBuildMethod bvhMethod = BVHBuildMethod::SAH;
+};
+
+/* one kind of ray traced through a scene */
+struct RayBenchmark {
+	uint64_t rays = 0;
+	uint64_t hits = 0;
+	double seconds = 0.0;           // best run, single rays
+	double packetSeconds = 0.0;     // best run, Scene::intersect in packets, 0 if not measured
+	double wideSeconds = 0.0;       // best run, single rays through the 4-wide trees, 0 if not measured
+	double closestHitSeconds = 0.0; // best run, shadow rays traced by Scene::intersect, 0 if not measured
+	TraversalStatistics traversal;
+};
+
+void printUsage(const char* program) {
+	std::cout << "usage: " << program << " [options]\n"
+		<< "  --scenes <list>      comma separated scenes as in bonus5_cli, 4 is a grid of lucy instances,\n"
+		<< "                       5 is lit by a small light (default 1,2,3)\n"
+		<< "  --instances <n>      lucy instances of scene 4 (default 128)\n"
+		<< "  --width <pixels>     camera rays per row (default 640)\n"
+		<< "  --height <pixels>    camera rays per column (default 360)\n"
+		<< "  --runs <n>           every ray set is traced n times, the fastest run is reported (default 3)\n"
+		<< "  --threads <n>        BVH build threads, 0 uses all cores (default 0), rays are traced on one thread\n"
+		<< "  --bvh <method>       sah, lbvh, hlbvh or sbvh (default sah)\n"
+		<< "  --output <file>      write the JSON to file instead of stdout\n"
+		<< "  --assets <dir>       media directory (default ../../media/)\n";
+}
+
+std::vector<int> parseSceneList(const std::string& value) {
+	std::vector<int> scenes;
+	std::stringstream ss(value);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		const int scene = std::stoi(item);
+		if (scene < 1 || scene > 5) {
+			throw std::runtime_error("scene must be 1, 2, 3, 4 or 5");
+		}
+		scenes.push_back(scene);
+	}
+
+	if (scenes.empty()) {
+		throw std::runtime_error("no scene given");
+	}
+
+	return scenes;
+}
+
+BenchmarkOptions getOptions(int argc, char* argv[]) {
+	BenchmarkOptions options;
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h") {
+			printUsage(argv[0]);
+			std::exit(EXIT_SUCCESS);
+		}
+
+		if (i + 1 >= argc) {
+			throw std::runtime_error("missing value of " + arg);
+		}
+
+		const std::string value = argv[++i];
+		if (arg == "--scenes") {
+			options.scenes = parseSceneList(value);
+		} else if (arg == "--instances") {
+			options.instances = std::stoi(value);
+		} else if (arg == "--width") {
+			options.width = std::stoi(value);
+		} else if (arg == "--height") {
+			options.height = std::stoi(value);
+		} else if (arg == "--runs") {
+			options.runs = std::stoi(value);
+		} else if (arg == "--threads") {
+			options.threads = std::stoi(value);
+		} else if (arg == "--bvh") {
+			if (value == "sah") {
+				options.bvhMethod = BVHBuildMethod::SAH;
+			} else if (value == "lbvh") {
+				options.bvhMethod = BVHBuildMethod::LBVH;
+			} else if (value == "hlbvh") {
+				options.bvhMethod = BVHBuildMethod::HLBVH;
+			} else if (value == "sbvh") {
+				options.bvhMethod = BVHBuildMethod::SBVH;
+			} else {
+				throw std::runtime_error("unknown bvh build method " + value);
+			}
+		} else if (arg == "--output") {
+			options.output = value;
+		} else if (arg == "--assets") {
+			options.assetRootDir = value;
+			if (!options.assetRootDir.empty() && options.assetRootDir.back() != '/') {
+				options.assetRootDir += '/';
+			}
+		} else {
+			throw std::runtime_error("unknown option " + arg);
+		}
+	}
+
+	if (options.width <= 0 || options.height <= 0 || options.runs <= 0) {
+		throw std::runtime_error("width, height and runs must be positive");
+	}
+
+	return options;
+}
+
+double getSeconds(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/* a ray leaving the surface on the side of dir, the same offset as the CPU renderer */
+Ray spawnRay(const glm::vec3& p, const glm::vec3& n, glm::vec3 dir) {
+	glm::vec3 offset = glm::dot(dir, n) > 0.0f ? RayOffset * n : -RayOffset * n;
+	return Ray(p + offset, dir);
+}
+
+/* the normal of the hit on the side the ray came from */
+glm::vec3 getFacingNormal(const Ray& ray, const Interaction& isect) {
+	const glm::vec3& n = isect.hitPoint.normal;
+	return glm::dot(n, ray.dir) > 0.0f ? -n : n;
+}
+
+/*
+*Summary: camera rays through the pixel centers, tile by tile like the CPU renderer traces them,
+*         so neighbouring rays form the same packets
+*/
+std::vector<Ray> generateCameraRays(const Camera& camera, int width, int height) {
+	glm::mat4 cameraToScreen = camera.getProjectionMatrix();
+	glm::mat4 screenToRaster = glm::scale(glm::mat4(1.0f),
+		glm::vec3(float(width) / 2.0f, float(height) / 2.0f, 1.0f)) *
+		glm::translate(glm::mat4(1.0f), glm::vec3(1.0f, 1.0f, 0.0f));
+	glm::mat4 cameraToWorld = glm::inverse(camera.getViewMatrix());
+	glm::mat4 rasterToCamera = glm::inverse(cameraToScreen) * glm::inverse(screenToRaster);
+	glm::vec3 o = glm::vec3(cameraToWorld * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+
+	std::vector<Ray> rays;
+	rays.reserve(static_cast<size_t>(width) * height);
+	for (int ty = 0; ty < height; ty += TileSize) {
+		for (int tx = 0; tx < width; tx += TileSize) {
+			for (int y = ty; y < std::min(ty + TileSize, height); ++y) {
+				for (int x = tx; x < std::min(tx + TileSize, width); ++x) {
+					glm::vec3 localRayDir = glm::vec3(rasterToCamera * glm::vec4(x + 0.5f, y + 0.5f, 0.0f, 1.0f));
+					glm::vec3 dir = glm::normalize(glm::vec3(cameraToWorld * glm::vec4(localRayDir, 0.0f)));
+					rays.push_back(Ray(o, dir));
+				}
+			}
+		}
+	}
+
+	return rays;
+}
+
+/* a cosine weighted bounce from every hit, as a Lambertian surface scatters */
+std::vector<Ray> generateDiffuseRays(const std::vector<Ray>& rays,
+	const std::vector<Interaction>& isects, const std::vector<bool>& hits) {
+	std::vector<Ray> bounces;
+	for (size_t i = 0; i < rays.size(); ++i) {
+		if (!hits[i]) {
+			continue;
+		}
+
+		RNG rng = RNG::createStream(static_cast<uint32_t>(i), 0u, 1u);
+		const glm::vec3 n = getFacingNormal(rays[i], isects[i]);
+		glm::vec3 dir = toWorld(createLocalCoord(n), cosineWeightedSampleHemiSphere(rng.get2D()));
+		bounces.push_back(spawnRay(isects[i].hitPoint.position, n, dir));
+	}
+
+	return bounces;
+}
+
+/*
+*Summary: a shadow ray from every hit to a point on one of the lights or a direction of the sky,
+*         picked and sampled the way CPURenderer::sampleDirectLight does
+*Parameters:
+*     tMax: receives the distance to the light of every shadow ray
+*/
+std::vector<Ray> generateShadowRays(const Scene& scene, const EnvironmentMap& sky, const std::vector<Ray>& rays,
+	const std::vector<Interaction>& isects, const std::vector<bool>& hits, std::vector<float>& tMax) {
+	const int nLights = static_cast<int>(scene.lights.size());
+	const int nChoices = nLights + (sky.hasDistribution() ? 1 : 0);
+	std::vector<Ray> shadowRays;
+	tMax.clear();
+	if (nChoices == 0) {
+		return shadowRays;
+	}
+
+	for (size_t i = 0; i < rays.size(); ++i) {
+		if (!hits[i]) {
+			continue;
+		}
+
+		RNG rng = RNG::createStream(static_cast<uint32_t>(i), 0u, 2u);
+		const int choice = std::min(static_cast<int>(rng.getFloat() * nChoices), nChoices - 1);
+		const glm::vec2 u = rng.get2D();
+		const glm::vec3& p = isects[i].hitPoint.position;
+		const glm::vec3 n = getFacingNormal(rays[i], isects[i]);
+
+		glm::vec3 dir;
+		float distance = std::numeric_limits<float>::max();
+		if (choice < nLights) {
+			const Sphere& light = scene.spheres[scene.lights[choice]];
+			const glm::vec3 toCenter = light.position - p;
+			const float d2 = glm::dot(toCenter, toCenter);
+			const float r2 = light.radius * light.radius;
+			if (d2 <= r2) {
+				continue;
+			}
+
+			const float sin2Max = r2 / d2;
+			const float oneMinusCosMax = sin2Max / (1.0f + std::sqrt(std::max(0.0f, 1.0f - sin2Max)));
+			dir = glm::normalize(toWorld(createLocalCoord(toCenter), uniformSampleCone(u, oneMinusCosMax)));
+			const float b = glm::dot(dir, toCenter);
+			distance = (b - std::sqrt(std::max(0.0f, b * b - (d2 - r2)))) * (1.0f - 1e-3f);
+		} else {
+			float pdf;
+			dir = sky.sample(u, &pdf);
+		}
+
+		// samples below the surface are dropped by the renderer before tracing
+		if (glm::dot(n, dir) <= 0.0f) {
+			continue;
+		}
+
+		shadowRays.push_back(spawnRay(p, n, dir));
+		tMax.push_back(distance);
+	}
+
+	return shadowRays;
+}
+
+/* the fastest of runs calls of trace, which traces the rays once */
+template <typename TraceFunc>
+double timeBestRun(int runs, TraceFunc trace) {
+	double best = std::numeric_limits<double>::max();
+	for (int run = 0; run < runs; ++run) {
+		const auto start = std::chrono::steady_clock::now();
+		trace();
+		best = std::min(best, getSeconds(start));
+	}
+
+	return best;
+}
+
+/*
+*Summary: trace closest hit rays one by one, in packets and one by one through the wide trees
+*Parameters:
+*     wide    : the 4-wide trees of the scene, see WideBVH
+*     packets : the rays are coherent and in packet order, time Scene::intersect in packets too
+*     isects  : receives the hits of the single ray run
+*     hits    : receives whether every ray hit something
+*/
+RayBenchmark benchmarkClosestHit(const Scene& scene, const WideBVH& wide, const std::vector<Ray>& rays,
+	bool packets, int runs, std::vector<Interaction>& isects, std::vector<bool>& hits) {
+	RayBenchmark result;
+	result.rays = rays.size();
+	isects.assign(rays.size(), Interaction());
+	hits.assign(rays.size(), false);
+	if (rays.empty()) {
+		return result;
+	}
+
+	result.seconds = timeBestRun(runs, [&]() {
+		for (size_t i = 0; i < rays.size(); ++i) {
+			Ray ray = rays[i];
+			isects[i] = Interaction();
+			hits[i] = scene.intersect(ray, isects[i]);
+		}
+	});
+
+	if (packets) {
+		std::vector<Ray> packetRays;
+		std::vector<Interaction> packetIsects(rays.size());
+		std::unique_ptr<bool[]> packetHits(new bool[rays.size()]);
+		result.packetSeconds = timeBestRun(runs, [&]() {
+			// tMax is shortened by the hits, every run starts from fresh rays
+			packetRays = rays;
+			scene.intersect(packetRays.data(), static_cast<int>(packetRays.size()),
+				packetIsects.data(), packetHits.get());
+		});
+	}
+
+	// the same per ray work as Scene::intersect, only the trees differ
+	std::vector<Interaction> wideIsects(rays.size());
+	result.wideSeconds = timeBestRun(runs, [&]() {
+		for (size_t i = 0; i < rays.size(); ++i) {
+			Ray ray = rays[i];
+			wideIsects[i] = Interaction();
+			if (wide.intersect(ray, wideIsects[i])) {
+				wideIsects[i].material = scene.materials[wideIsects[i].primitive.materialIdx];
+			}
+		}
+	});
+
+	for (size_t i = 0; i < rays.size(); ++i) {
+		Ray ray = rays[i];
+		Interaction isect;
+		scene.bvh->intersect(ray, isect, result.traversal);
+		result.hits += hits[i] ? 1 : 0;
+	}
+
+	return result;
+}
+
+/*
+*Summary: trace shadow rays with the any-hit Scene::occluded, then with the closest hit
+*         Scene::intersect up to the same tMax, which must agree on every ray
+*/
+RayBenchmark benchmarkShadow(const Scene& scene, const std::vector<Ray>& rays, const std::vector<float>& tMax, int runs) {
+	RayBenchmark result;
+	result.rays = rays.size();
+	if (rays.empty()) {
+		return result;
+	}
+
+	std::vector<bool> occluded(rays.size());
+	result.seconds = timeBestRun(runs, [&]() {
+		for (size_t i = 0; i < rays.size(); ++i) {
+			occluded[i] = scene.occluded(rays[i], tMax[i]);
+		}
+	});
+
+	std::vector<bool> hits(rays.size());
+	result.closestHitSeconds = timeBestRun(runs, [&]() {
+		for (size_t i = 0; i < rays.size(); ++i) {
+			Ray ray = rays[i];
+			ray.tMax = tMax[i];
+			Interaction isect;
+			hits[i] = scene.intersect(ray, isect);
+		}
+	});
+
+	uint64_t mismatches = 0;
+	for (size_t i = 0; i < rays.size(); ++i) {
+		result.hits += occluded[i] ? 1 : 0;
+		mismatches += occluded[i] != hits[i] ? 1 : 0;
+	}
+
+	if (mismatches > 0) {
+		throw std::runtime_error("occluded and intersect disagree on " + std::to_string(mismatches) +
+			" of " + std::to_string(rays.size()) + " shadow rays");
+	}
+
+	for (size_t i = 0; i < rays.size(); ++i) {
+		scene.bvh->occluded(rays[i], tMax[i], result.traversal);
+	}
+
+	return result;
+}
+
+/*
+*Summary: compare the 4-wide triangle test of a BLAS with Triangle::intersect on random rays aimed
+*         at random triangles, some outside the edges and some grazing the plane. The two tests
+*         round differently: their errors grow with the coordinates over the triangle size and
+*         with the inverse cosine of the ray, so hits are compared within that bound, and rays
+*         within it of an edge or of the grazing limit may hit in one test only
+*Return: number of rays the tests disagree on, in hit, t, or the barycentric weights
+*/
+uint64_t checkTriangleTest(const BVH& blas, int nRays) {
+	const int nTriangles = static_cast<int>(blas.orderedPrimitives.size());
+	const float roundoff = 64.0f * std::numeric_limits<float>::epsilon();
+	uint64_t mismatches = 0;
+	for (int i = 0; i < nRays; ++i) {
+		RNG rng = RNG::createStream(static_cast<uint32_t>(i), 0u, 3u);
+		const int idx = std::min(static_cast<int>(rng.getFloat() * nTriangles), nTriangles - 1);
+		const Triangle& triangle = *blas.orderedPrimitives[idx].triangle;
+		const glm::vec3& p1 = triangle.vertices[triangle.v[0]].position;
+		const glm::vec3& p2 = triangle.vertices[triangle.v[1]].position;
+		const glm::vec3& p3 = triangle.vertices[triangle.v[2]].position;
+		const glm::vec3 normal = glm::cross(p2 - p1, p3 - p1);
+		if (glm::length(normal) == 0.0f) {
+			continue;
+		}
+
+		// weights in [-0.2, 1.2] put about half the targets outside the triangle
+		const glm::vec2 w = rng.get2D() * 1.4f - 0.2f;
+		const glm::vec3 target = p1 + w.x * (p2 - p1) + w.y * (p3 - p1);
+		const LocalCoord frame = createLocalCoord(normal);
+		glm::vec3 dir;
+		if (i % 4 == 0) {
+			// a quarter of the rays around the grazing limit
+			const float cosine = rng.getFloat() * 4.0f * Triangle::MinHitCosine;
+			const float phi = rng.getFloat() * 2.0f * Pi;
+			const float sine = std::sqrt(1.0f - cosine * cosine);
+			dir = toWorld(frame, glm::vec3(sine * std::cos(phi), sine * std::sin(phi), cosine));
+		} else {
+			dir = uniformSampleSphere(rng.get2D());
+		}
+		const float size = glm::length(p2 - p1) + glm::length(p3 - p1);
+		const Ray ray(target - (0.1f + rng.getFloat()) * size * dir, dir);
+
+		const float cosine = std::abs(glm::dot(frame.n, dir));
+		const float tolerance = roundoff * (glm::length(p1) + glm::length(ray.o)) / size / std::max(cosine, 1e-6f);
+
+		Ray soaRay = ray;
+		glm::vec2 uv;
+		const bool soaHit = blas.findTriangleHit(soaRay, idx, 1, false, &uv) >= 0;
+		Ray scalarRay = ray;
+		glm::vec3 barycentric;
+		const bool scalarHit = triangle.intersect(scalarRay, &barycentric);
+
+		// both tests miss rays grazing the plane, wherever they point. The cosine of the 4-wide
+		// test comes from the edges, it is less exact on thin triangles
+		const float limitBand = roundoff * glm::length(p2 - p1) * glm::length(p3 - p1) / glm::length(normal);
+		if (cosine < Triangle::MinHitCosine - limitBand) {
+			mismatches += soaHit || scalarHit ? 1 : 0;
+		} else if (soaHit && scalarHit) {
+			if (std::abs(soaRay.tMax - scalarRay.tMax) > tolerance * size ||
+				std::abs(uv.x - barycentric.y) > tolerance || std::abs(uv.y - barycentric.z) > tolerance) {
+				++mismatches;
+			}
+		} else if (soaHit != scalarHit && cosine > Triangle::MinHitCosine + limitBand) {
+			const glm::vec3 weights = soaHit ? glm::vec3(1.0f - uv.x - uv.y, uv.x, uv.y) : barycentric;
+			if (std::min(std::min(weights.x, weights.y), weights.z) > tolerance) {
+				++mismatches;
+			}
+		}
+	}
+
+	return mismatches;
+}
+
+double getMraysPerSecond(uint64_t rays, double seconds) {
+	return seconds > 0.0 ? rays / seconds * 1e-6 : 0.0;
+}
+
+void writeBVH(std::ostream& out, const BVH& bvh, const std::string& indent) {
+	out << indent << "\"build_ms\": " << bvh.buildTime << ",\n"
+		<< indent << "\"nodes\": " << bvh.nodes.size() << ",\n"
+		<< indent << "\"references\": " << bvh.orderedPrimitives.size() << ",\n"
+		<< indent << "\"height\": " << bvh.height << ",\n"
+		<< indent << "\"sah_cost\": " << bvh.sahCost << "\n";
+}
+
+void writeRays(std::ostream& out, const char* name, const RayBenchmark& result, const char* hitName, bool last) {
+	const std::string indent = "        ";
+	out << "      \"" << name << "\": {\n"
+		<< indent << "\"rays\": " << result.rays << ",\n"
+		<< indent << "\"" << hitName << "\": "
+		<< (result.rays > 0 ? static_cast<double>(result.hits) / result.rays : 0.0) << ",\n"
+		<< indent << "\"seconds\": " << result.seconds << ",\n"
+		<< indent << "\"mrays_per_second\": " << getMraysPerSecond(result.rays, result.seconds) << ",\n";
+	if (result.packetSeconds > 0.0) {
+		out << indent << "\"packet_seconds\": " << result.packetSeconds << ",\n"
+			<< indent << "\"packet_mrays_per_second\": " << getMraysPerSecond(result.rays, result.packetSeconds) << ",\n";
+	}
+	if (result.wideSeconds > 0.0) {
+		out << indent << "\"wide_seconds\": " << result.wideSeconds << ",\n"
+			<< indent << "\"wide_mrays_per_second\": " << getMraysPerSecond(result.rays, result.wideSeconds) << ",\n";
+	}
+	if (result.closestHitSeconds > 0.0) {
+		out << indent << "\"closest_hit_seconds\": " << result.closestHitSeconds << ",\n"
+			<< indent << "\"closest_hit_mrays_per_second\": " << getMraysPerSecond(result.rays, result.closestHitSeconds) << ",\n"
+			<< indent << "\"any_hit_speedup\": " << result.closestHitSeconds / result.seconds << ",\n";
+	}
+	out << indent << "\"nodes_per_ray\": " << result.traversal.getNodesPerRay() << ",\n"
+		<< indent << "\"primitives_per_ray\": " << result.traversal.getPrimitivesPerRay() << ",\n"
+		<< indent << "\"instances_per_ray\": " << result.traversal.getInstancesPerRay() << "\n"
+		<< "      }" << (last ? "\n" : ",\n");
+}
+
+void benchmarkScene(std::ostream& out, int sceneIdx, const BenchmarkOptions& options, const EnvironmentMap& sky,
+	const std::vector<Sphere>& balls, const std::vector<Material>& ballMaterials, const MeshData& lucy) {
+	SceneDescription desc = sceneIdx == 4 ?
+		createInstancingSceneDescription(balls, ballMaterials, lucy, options.instances) :
+		createSceneDescription(sceneIdx == 5 ? 3 : sceneIdx - 1, balls, ballMaterials, lucy);
+	BVHBuildOptions bvhOptions;
+	bvhOptions.method = options.bvhMethod;
+	bvhOptions.nThreads = options.threads;
+
+	const auto buildStart = std::chrono::steady_clock::now();
+	Scene scene(desc, bvhOptions);
+	const double sceneSeconds = getSeconds(buildStart);
+
+	// collapse every BLAS, then the TLAS whose instances enter them
+	const auto wideStart = std::chrono::steady_clock::now();
+	std::vector<std::unique_ptr<WideBVH>> wideBlas;
+	std::vector<const WideBVH*> wideBlasPtrs;
+	size_t wideNodes = 0;
+	for (const auto& meshBVH : scene.blas) {
+		wideBlas.emplace_back(new WideBVH(*meshBVH));
+		wideBlasPtrs.push_back(wideBlas.back().get());
+		wideNodes += wideBlas.back()->nodes.size();
+	}
+	const WideBVH wideTlas(*scene.bvh, wideBlasPtrs);
+	wideNodes += wideTlas.nodes.size();
+	const double wideSeconds = getSeconds(wideStart);
+
+	PerspectiveCamera camera(glm::radians(60.0f),
+		static_cast<float>(options.width) / options.height, 0.1f, 1000.0f);
+	camera.transform.position = desc.cameraPosition;
+	camera.transform.lookAt(desc.cameraTarget);
+
+	std::vector<Interaction> isects;
+	std::vector<bool> hits;
+	const std::vector<Ray> cameraRays = generateCameraRays(camera, options.width, options.height);
+	const RayBenchmark primary = benchmarkClosestHit(scene, wideTlas, cameraRays, true, options.runs, isects, hits);
+
+	std::vector<float> shadowTMax;
+	const std::vector<Ray> diffuseRays = generateDiffuseRays(cameraRays, isects, hits);
+	const std::vector<Ray> shadowRays = generateShadowRays(scene, sky, cameraRays, isects, hits, shadowTMax);
+
+	std::vector<Interaction> bounceIsects;
+	std::vector<bool> bounceHits;
+	const RayBenchmark diffuse = benchmarkClosestHit(scene, wideTlas, diffuseRays, false, options.runs, bounceIsects, bounceHits);
+	const RayBenchmark shadow = benchmarkShadow(scene, shadowRays, shadowTMax, options.runs);
+
+	size_t blasNodes = 0;
+	uint64_t checkRays = 0;
+	uint64_t checkMismatches = 0;
+	for (const auto& meshBVH : scene.blas) {
+		blasNodes += meshBVH->nodes.size();
+		if (meshBVH->hasTriangleData() && !meshBVH->orderedPrimitives.empty()) {
+			checkRays += TriangleCheckRays;
+			checkMismatches += checkTriangleTest(*meshBVH, TriangleCheckRays);
+		}
+	}
+
+	if (checkMismatches > 0) {
+		throw std::runtime_error(std::string(sceneNames[sceneIdx - 1]) + ": the 4-wide triangle test and Triangle::intersect disagree on " +
+			std::to_string(checkMismatches) + " of " + std::to_string(checkRays) + " rays");
+	}
+
+	out << "    {\n"
+		<< "      \"scene\": " << sceneIdx << ",\n"
+		<< "      \"name\": \"" << sceneNames[sceneIdx - 1] << "\",\n"
+		<< "      \"primitives\": " << scene.primitives.size() << ",\n"
+		<< "      \"triangles\": " << scene.triangles.size() << ",\n"
+		<< "      \"instances\": " << scene.instances.size() << ",\n"
+		<< "      \"lights\": " << scene.lights.size() << ",\n"
+		<< "      \"triangle_check_rays\": " << checkRays << ",\n"
+		<< "      \"build\": {\n"
+		<< "        \"scene_ms\": " << sceneSeconds * 1e3 << ",\n"
+		<< "        \"bvh_ms\": " << scene.bvhBuildTime << ",\n"
+		<< "        \"nodes\": " << scene.bvh->nodes.size() + blasNodes << ",\n"
+		<< "        \"wide_ms\": " << wideSeconds * 1e3 << ",\n"
+		<< "        \"wide_nodes\": " << wideNodes << ",\n"
+		<< "        \"tlas\": {\n";
+	writeBVH(out, *scene.bvh, "          ");
+	out << "        },\n"
+		<< "        \"blas\": [";
+	for (size_t i = 0; i < scene.blas.size(); ++i) {
+		out << (i == 0 ? "\n" : ",\n") << "          {\n";
+		writeBVH(out, *scene.blas[i], "            ");
+		out << "          }";
+	}
+	out << (scene.blas.empty() ? "]\n" : "\n        ]\n")
+		<< "      },\n";
+	writeRays(out, "primary", primary, "hit_fraction", false);
+	writeRays(out, "diffuse", diffuse, "hit_fraction", false);
+	writeRays(out, "shadow", shadow, "occluded_fraction", true);
+	out << "    }";
+}
+
+void benchmark(const BenchmarkOptions& options) {
+	std::vector<std::string> skyboxTexturePaths;
+	for (const auto& relPath : skyboxTextureRelPaths) {
+		skyboxTexturePaths.push_back(options.assetRootDir + relPath);
+	}
+	EnvironmentMap sky(skyboxTexturePaths);
+
+	std::vector<Sphere> balls;
+	std::vector<Material> ballMaterials;
+	createBalls(balls, ballMaterials);
+
+	std::vector<Vertex> lucyVertices;
+	std::vector<uint32_t> lucyIndices;
+	for (int sceneIdx : options.scenes) {
+		if ((sceneIdx == 3 || sceneIdx == 4) && lucyIndices.empty()) {
+			Model::loadObj(options.assetRootDir + lucyRelPath, lucyVertices, lucyIndices);
+		}
+	}
+	const MeshData lucy(lucyVertices, lucyIndices);
+
+	// the whole document is built first, a failed run leaves no partial JSON behind
+	std::stringstream out;
+	out << "{\n"
+		<< "  \"bvh\": \"" << BVH::getBuildMethodName(options.bvhMethod) << "\",\n"
+		<< "  \"width\": " << options.width << ",\n"
+		<< "  \"height\": " << options.height << ",\n"
+		<< "  \"runs\": " << options.runs << ",\n"
+		<< "  \"scenes\": [\n";
+	for (size_t i = 0; i < options.scenes.size(); ++i) {
+		benchmarkScene(out, options.scenes[i], options, sky, balls, ballMaterials, lucy);
+		out << (i + 1 < options.scenes.size() ? ",\n" : "\n");
+	}
+	out << "  ]\n"
+		<< "}\n";
+
+	if (options.output.empty()) {
+		std::cout << out.str();
+	} else {
+		std::ofstream file(options.output);
+		if (!file) {
+			throw std::runtime_error("open " + options.output + " failure");
+		}
+		file << out.str();
+	}
+}
+
+int main(int argc, char* argv[]) {
+	try {
+		benchmark(getOptions(argc, argv));
+	} catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	} catch (...) {
+		std::cerr << "Unknown Error" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,342 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "../base/camera.h"
+#include "../base/model.h"
+#include "../bonus5/bvh_cache.h"
+#include "../bonus5/cpu_renderer.h"
+#include "../bonus5/environment_map.h"
+#include "../bonus5/image_writer.h"
+#include "../bonus5/scene.h"
+
+const std::string lucyRelPath = "obj/lucy.obj";
+
+const std::vector<std::string> skyboxTextureRelPaths = {
+	"texture/skyboxrt/right.jpg",
+	"texture/skyboxrt/left.jpg",
+	"texture/skyboxrt/top.jpg",
+	"texture/skyboxrt/bottom.jpg",
+	"texture/skyboxrt/front.jpg",
+	"texture/skyboxrt/back.jpg",
+};
+
+struct RenderOptions {
+	std::string assetRootDir = "../../media/";
+	std::string output = "bonus5.png";
+	int scene = 3;
+	int instances = 128;
+	int width = 640;
+	int height = 360;
+	int samples = 64;
+	int saveInterval = 16;
+	int threads = 0;
+	TileOrder tileOrder = TileOrder::Hilbert;
+	BVHBuildMethod bvhMethod = BVHBuildMethod::SAH;
+	std::string cacheDir;
+	float adaptiveThreshold = 0.0f;
+	bool lightSampling = true;
+	bool denoise = false;
+	std::string checkpoint;
+};
+
+void printUsage(const char* program) {
+	std::cout << "usage: " << program << " [options]\n"
+		<< "  --scene <1-5>        scene to render, 4 is a grid of lucy instances, 5 is lit by a small light (default 3)\n"
+		<< "  --instances <n>      lucy instances of scene 4 (default 128)\n"
+		<< "  --width <pixels>     image width (default 640)\n"
+		<< "  --height <pixels>    image height (default 360)\n"
+		<< "  --spp <n>            samples per pixel (default 64)\n"
+		<< "  --save-every <n>     write the image every n samples, 0 only at the end (default 16)\n"
+		<< "  --threads <n>        render threads, 0 uses all cores (default 0)\n"
+		<< "  --tile-order <order> scanline, spiral or hilbert (default hilbert)\n"
+		<< "  --bvh <method>       sah, lbvh, hlbvh or sbvh (default sah)\n"
+		<< "  --cache <dir>        load mesh BVHs and parsed obj files from dir and save new ones to it\n"
+		<< "                       (default off, parsed obj files are then cached next to them)\n"
+		<< "  --adaptive <error>   skip pixels whose relative error is below error, spp counts passes then (default off)\n"
+		<< "  --lights <on|off>    sample lights and the sky at diffuse hits, weighted by MIS (default on)\n"
+		<< "  --denoise <on|off>   filter the written images guided by the first hits, for low spp (default off)\n"
+		<< "  --checkpoint <file>  resume from file if it matches the render, save to it with every image (default off)\n"
+		<< "  --output <file>      output image, png or pfm, a pfm is written a tile at a time (default bonus5.png)\n"
+		<< "  --assets <dir>       media directory (default ../../media/)\n";
+}
+
+RenderOptions getOptions(int argc, char* argv[]) {
+	RenderOptions options;
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h") {
+			printUsage(argv[0]);
+			std::exit(EXIT_SUCCESS);
+		}
+
+		if (i + 1 >= argc) {
+			throw std::runtime_error("missing value of " + arg);
+		}
+
+		const std::string value = argv[++i];
+		if (arg == "--scene") {
+			options.scene = std::stoi(value);
+		} else if (arg == "--instances") {
+			options.instances = std::stoi(value);
+		} else if (arg == "--width") {
+			options.width = std::stoi(value);
+		} else if (arg == "--height") {
+			options.height = std::stoi(value);
+		} else if (arg == "--spp") {
+			options.samples = std::stoi(value);
+		} else if (arg == "--save-every") {
+			options.saveInterval = std::stoi(value);
+		} else if (arg == "--threads") {
+			options.threads = std::stoi(value);
+		} else if (arg == "--tile-order") {
+			if (value == "scanline") {
+				options.tileOrder = TileOrder::Scanline;
+			} else if (value == "spiral") {
+				options.tileOrder = TileOrder::Spiral;
+			} else if (value == "hilbert") {
+				options.tileOrder = TileOrder::Hilbert;
+			} else {
+				throw std::runtime_error("unknown tile order " + value);
+			}
+		} else if (arg == "--bvh") {
+			if (value == "sah") {
+				options.bvhMethod = BVHBuildMethod::SAH;
+			} else if (value == "lbvh") {
+				options.bvhMethod = BVHBuildMethod::LBVH;
+			} else if (value == "hlbvh") {
+				options.bvhMethod = BVHBuildMethod::HLBVH;
+			} else if (value == "sbvh") {
+				options.bvhMethod = BVHBuildMethod::SBVH;
+			} else {
+				throw std::runtime_error("unknown bvh build method " + value);
+			}
+		} else if (arg == "--cache") {
+			options.cacheDir = value;
+		} else if (arg == "--adaptive") {
+			options.adaptiveThreshold = std::stof(value);
+		} else if (arg == "--lights") {
+			if (value == "on") {
+				options.lightSampling = true;
+			} else if (value == "off") {
+				options.lightSampling = false;
+			} else {
+				throw std::runtime_error("--lights must be on or off");
+			}
+		} else if (arg == "--denoise") {
+			if (value == "on") {
+				options.denoise = true;
+			} else if (value == "off") {
+				options.denoise = false;
+			} else {
+				throw std::runtime_error("--denoise must be on or off");
+			}
+		} else if (arg == "--checkpoint") {
+			options.checkpoint = value;
+		} else if (arg == "--output") {
+			options.output = value;
+		} else if (arg == "--assets") {
+			options.assetRootDir = value;
+			if (!options.assetRootDir.empty() && options.assetRootDir.back() != '/') {
+				options.assetRootDir += '/';
+			}
+		} else {
+			throw std::runtime_error("unknown option " + arg);
+		}
+	}
+
+	if (options.scene < 1 || options.scene > 5) {
+		throw std::runtime_error("scene must be 1, 2, 3, 4 or 5");
+	}
+
+	if (options.width <= 0 || options.height <= 0 || options.samples <= 0) {
+		throw std::runtime_error("width, height and spp must be positive");
+	}
+
+	if (options.adaptiveThreshold < 0.0f) {
+		throw std::runtime_error("adaptive error must not be negative");
+	}
+
+	return options;
+}
+
+bool isPfm(const std::string& filepath) {
+	return filepath.size() >= 4 && filepath.compare(filepath.size() - 4, 4, ".pfm") == 0;
+}
+
+/* the options that change the image a checkpoint accumulates, the camera follows from the scene */
+uint64_t getCheckpointKey(const RenderOptions& options) {
+	const int32_t values[] = { options.scene, options.scene == 4 ? options.instances : 0 };
+	return BVHCache::hash(values, sizeof(values), 0);
+}
+
+void render(const RenderOptions& options) {
+	std::vector<std::string> skyboxTexturePaths;
+	for (const auto& relPath : skyboxTextureRelPaths) {
+		skyboxTexturePaths.push_back(options.assetRootDir + relPath);
+	}
+	EnvironmentMap sky(skyboxTexturePaths);
+
+	std::vector<Sphere> balls;
+	std::vector<Material> ballMaterials;
+	createBalls(balls, ballMaterials);
+
+	std::vector<Vertex> lucyVertices;
+	std::vector<uint32_t> lucyIndices;
+	if (options.scene == 3 || options.scene == 4) {
+		if (!options.cacheDir.empty()) {
+			Model::setMeshCacheDirectory(options.cacheDir);
+		}
+		Model::loadObj(options.assetRootDir + lucyRelPath, lucyVertices, lucyIndices);
+	}
+
+	const MeshData lucy(lucyVertices, lucyIndices);
+	SceneDescription desc = options.scene == 4 ?
+		createInstancingSceneDescription(balls, ballMaterials, lucy, options.instances) :
+		createSceneDescription(options.scene == 5 ? 3 : options.scene - 1, balls, ballMaterials, lucy);
+	BVHBuildOptions bvhOptions;
+	bvhOptions.method = options.bvhMethod;
+	std::unique_ptr<BVHCache> cache;
+	if (!options.cacheDir.empty()) {
+		cache.reset(new BVHCache(options.cacheDir));
+	}
+	Scene scene(desc, bvhOptions, cache.get());
+
+	std::cout << "Scene Statistics" << std::endl;
+	std::cout << "+ primitives: " << scene.primitives.size() << std::endl;
+	std::cout << "+ instances:  " << scene.instances.size() << " of " << scene.blas.size() << " meshes" << std::endl;
+	std::cout << "+ triangles:  " << scene.triangles.size() << std::endl;
+	std::cout << "+ lights:     " << scene.lights.size() << " spheres" << std::endl;
+	std::cout << "+ BVH build:  " << scene.bvhBuildTime << " ms (" << BVH::getBuildMethodName(options.bvhMethod) << ", "
+		<< scene.cachedBLAS << " of " << scene.blas.size() << " BLAS cached)" << std::endl;
+	std::cout << "+ TLAS:       " << scene.bvh->buildTime << " ms, SAH cost " << scene.bvh->sahCost << std::endl;
+	for (size_t i = 0; i < scene.blas.size(); ++i) {
+		std::cout << "+ BLAS " << i << ":     " << scene.blas[i]->buildTime << " ms, SAH cost " << scene.blas[i]->sahCost
+			<< ", " << scene.blas[i]->orderedPrimitives.size() << " references" << std::endl;
+	}
+
+	PerspectiveCamera camera(glm::radians(60.0f),
+		static_cast<float>(options.width) / options.height, 0.1f, 1000.0f);
+	camera.transform.position = desc.cameraPosition;
+	camera.transform.lookAt(desc.cameraTarget);
+
+	CPURenderer renderer(options.width, options.height, options.threads, options.tileOrder);
+	renderer.setScene(&scene, &sky);
+	renderer.setCamera(camera);
+
+	AdaptiveSamplingOptions adaptiveOptions;
+	adaptiveOptions.enabled = options.adaptiveThreshold > 0.0f;
+	adaptiveOptions.threshold = options.adaptiveThreshold;
+	renderer.setAdaptiveSampling(adaptiveOptions);
+	renderer.setLightSampling(options.lightSampling);
+
+	const uint64_t checkpointKey = getCheckpointKey(options);
+	if (!options.checkpoint.empty()) {
+		if (renderer.loadCheckpoint(options.checkpoint, checkpointKey)) {
+			std::cout << "resumed from " << options.checkpoint << " at sample " << renderer.getSampleCount() << std::endl;
+		} else {
+			std::cout << "no checkpoint of this render in " << options.checkpoint << ", starting at sample 0" << std::endl;
+		}
+	}
+
+	// tiles go straight from the accumulation to the file, only the ones that changed are written again
+	std::unique_ptr<TiledImageWriter> pfmWriter;
+	if (isPfm(options.output)) {
+		pfmWriter.reset(new TiledImageWriter(options.output, options.width, options.height, CPURenderer::TileSize));
+	}
+
+	DenoiseOptions denoiseOptions;
+	denoiseOptions.enabled = options.denoise;
+	std::vector<glm::vec3> image;
+	double denoiseSeconds = 0.0;
+
+	auto writeOutput = [&]() {
+		std::string written;
+		if (options.denoise) {
+			const auto start = std::chrono::steady_clock::now();
+			renderer.getDenoisedImage(image, denoiseOptions);
+			denoiseSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (pfmWriter) {
+				pfmWriter->writeImage(image);
+				pfmWriter->flush();
+			} else {
+				renderer.writeImage(options.output, image);
+			}
+		} else if (pfmWriter) {
+			written = " (" + std::to_string(renderer.writeTiles(*pfmWriter)) + " tiles)";
+		} else {
+			renderer.writeImage(options.output);
+		}
+
+		if (!options.checkpoint.empty()) {
+			renderer.saveCheckpoint(options.checkpoint, checkpointKey);
+		}
+
+		const RenderStatistics& stats = renderer.getStatistics();
+		std::cout << "samples: " << renderer.getSampleCount() << "/" << options.samples
+			<< "  " << stats.getRaysPerSecond() * 1e-6 << " Mrays/s"
+			<< "  " << stats.getSamplesPerSecond() * 1e-6 << " Msamples/s"
+			<< "  -> " << options.output << written << std::endl;
+	};
+
+	// every pixel converged, more passes would not trace a ray
+	auto isConverged = [&]() {
+		return adaptiveOptions.enabled && renderer.getConvergedFraction() == 1.0f;
+	};
+
+	// a checkpoint may already hold every sample
+	const int firstSample = static_cast<int>(renderer.getSampleCount());
+	if (firstSample >= options.samples || isConverged()) {
+		writeOutput();
+	} else {
+		for (int i = firstSample; i < options.samples; ++i) {
+			renderer.renderSample();
+
+			const bool converged = isConverged();
+			const bool lastSample = i + 1 == options.samples || converged;
+			if (lastSample || (options.saveInterval > 0 && (i + 1) % options.saveInterval == 0)) {
+				writeOutput();
+			}
+
+			if (converged) {
+				break;
+			}
+		}
+	}
+
+	const RenderStatistics& stats = renderer.getStatistics();
+	std::cout << "Render Statistics" << std::endl;
+	std::cout << "+ time:      " << stats.seconds << " s" << std::endl;
+	std::cout << "+ rays:      " << stats.rays << std::endl;
+	std::cout << "+ rays/s:    " << stats.getRaysPerSecond() << std::endl;
+	std::cout << "+ samples/s: " << stats.getSamplesPerSecond() << std::endl;
+	if (options.denoise) {
+		std::cout << "+ denoise:   " << denoiseSeconds * 1e3 << " ms, " << denoiseOptions.iterations << " passes" << std::endl;
+	}
+	if (adaptiveOptions.enabled) {
+		std::cout << "+ samples:   " << stats.samples << ", "
+			<< static_cast<double>(stats.samples) / (options.width * options.height) << " per pixel" << std::endl;
+		std::cout << "+ converged: " << renderer.getConvergedFraction() * 100.0f << "% of the pixels" << std::endl;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	try {
+		render(getOptions(argc, argv));
+	} catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	} catch (...) {
+		std::cerr << "Unknown Error" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -232,7 +232,7 @@ void InstancedRendering::renderFrame() {
 		// 	_asternoidInstancedShader->setUniformMat4("model", _modelMatrices[i]);
   //       }
 		glBindVertexArray(_asternoid->getVao());
-		glDrawElementsInstanced(GL_TRIANGLES, static_cast<unsigned int>(3*_asternoid->getFaceCount()), GL_UNSIGNED_INT, 0, _amount);
+		glDrawElementsInstanced(GL_TRIANGLES, static_cast<unsigned int>(3*_asternoid->getFaceCount()), _asternoid->getIndexType(), 0, _amount);
 		glBindVertexArray(0);
 		// ---------------------------------------------------------
 		break;